@@ -2,8 +2,27 @@
 #define BACKUP_RESTORE_ALL_H_
 
 #include "backup_restore/backup.hpp"
+#include "backup_restore/backup_journal.hpp"
+#include "backup_restore/change_journal.hpp"
+#include "backup_restore/chunk_cache.hpp"
 #include "backup_restore/chunker.hpp"
+#include "backup_restore/directory_scanner.hpp"
+#include "backup_restore/file_digest_index.hpp"
+#include "backup_restore/file_filter.hpp"
+#include "backup_restore/file_state_cache.hpp"
+#include "backup_restore/journal.hpp"
+#include "backup_restore/manifest.hpp"
+#include "backup_restore/mapped_file.hpp"
+#include "backup_restore/metadata.hpp"
+#include "backup_restore/path_index.hpp"
+#include "backup_restore/prefetcher.hpp"
 #include "backup_restore/progress.hpp"
+#include "backup_restore/record_codec.hpp"
 #include "backup_restore/restore.hpp"
+#include "backup_restore/restore_journal.hpp"
+#include "backup_restore/restore_session.hpp"
+#include "backup_restore/snapshot.hpp"
+#include "backup_restore/snapshot_spool.hpp"
+#include "backup_restore/tree.hpp"
 
 #endif  // BACKUP_RESTORE_ALL_H_
\ No newline at end of file
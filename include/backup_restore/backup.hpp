@@ -5,55 +5,45 @@
 
 #include <chrono>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "backup_journal.hpp"
+#include "change_journal.hpp"
 #include "chunker.hpp"
+#include "directory_scanner.hpp"
+#include "file_digest_index.hpp"
+#include "file_filter.hpp"
+#include "file_state_cache.hpp"
+#include "manifest.hpp"
+#include "metadata.hpp"
+#include "path_index.hpp"
 #include "progress.hpp"
+#include "snapshot.hpp"
+#include "snapshot_spool.hpp"
+#include "tree.hpp"
 
 namespace fs = std::filesystem;
 
-enum class BackupType { FULL, INCREMENTAL, DIFFERENTIAL };
-
-struct FileMetadata {
-  std::string original_filename;
-  std::vector<std::string> chunk_hashes;
-  uint64_t total_size;
-  fs::file_time_type mtime;
-  bool is_symlink = false;
-  std::string symlink_target;
-  std::string permissions;  // File permissions in octal format (e.g., "0644")
-  std::string sha256_checksum;  // SHA256 hash of the entire file
-};
-
-struct BackupMetadata {
-  BackupType type;
-  std::chrono::system_clock::time_point timestamp;
-  std::string original_path;
-  std::string previous_backup;
-  std::string remarks;
-  std::map<std::string, FileMetadata> files;
-  BackupMetadata() {};
-  BackupMetadata(BackupType type_,
-                 std::chrono::system_clock::time_point timestamp_,
-                 std::string previous_backup_,
-                 std::map<std::string, FileMetadata> files_)
-      : type(type_),
-        timestamp(timestamp_),
-        previous_backup(previous_backup_),
-        files(files_) {};
-};
-
 struct BackupDetails {
   std::string type;
   std::string timestamp;
   std::string name;
   std::string remarks;
+  std::string previous_backup;
+  uint64_t file_count = 0;
+  uint64_t total_size = 0;
+  uint64_t new_bytes = 0;
   BackupDetails(const std::string& type, const std::string& timestamp,
                 const std::string& name, const std::string& remarks)
       : type(type), timestamp(timestamp), name(name), remarks(remarks) {}
+  explicit BackupDetails(const ManifestEntry& entry);
 };
 
 class Backup {
@@ -64,26 +54,66 @@ class Backup {
   ~Backup();
   void BackupDirectory();
 
+  // Stop with a checkpoint once the budget is used up, zero means unlimited
+  void SetTimeBudget(std::chrono::seconds budget);
+  // False if the last BackupDirectory() stopped early and will resume
+  bool IsComplete() const { return complete_; }
+  // Back up only the paths the journal lists when it covers the base
+  // snapshot, rather than scanning the source
+  void SetChangeJournal(ChangeJournal* change_journal);
+  // Leave out what the filter settings of a schedule exclude, see
+  // FileFilter. The .resilioz-ignore files of the source apply regardless.
+  void SetFilter(const nlohmann::json& settings);
+
   // Utility functions
   std::vector<std::string> ListBackups();
   void DisplayAllBackupDetails();
-  void CompareBackups(const std::string& backup1, const std::string& backup2);
+  // Print what changed between two backups, as JSON for scripts if asked
+  void CompareBackups(const std::string& backup1, const std::string& backup2,
+                      bool as_json = false);
   std::vector<BackupDetails> GetAllBackupDetails();
+  // Read only the repository catalog, without preparing a backup
+  static std::vector<BackupDetails> ListBackupDetails(Repository* repo);
 
  protected:
-  void BackupFile(const fs::path& file_path);
-  bool CheckFileToSkip(const fs::path& file_path);
-  FileMetadata CheckFileMetadata(const fs::path& file_path);
-  void ProcessChunk(const Chunk& chunk, FileMetadata& file_metadata,
-                    ProgressBar& progress);
-  void SaveMetadata();
+  void BackupFile(const ScannedFile& file);
+  // Record a backed up file in the snapshot and the journal
+  void RecordFile(const std::string& file_path,
+                  const FileMetadata& file_metadata);
+  // The file as of the base snapshot or the interrupted run, if any
+  std::optional<FileMetadata> FindPrevious(const std::string& file_path);
+  bool IsJournaled(const std::string& file_path) const;
+  // Drop files of the base snapshot or the interrupted run that a complete
+  // scan of the source, or of one directory below it, did not see. Returns
+  // how many.
+  size_t RemoveDeletedFiles(SnapshotSpool& scanned,
+                            const std::string& directory_key = "");
+  // Back up the paths a change journal listed, scanning directories that
+  // appeared and dropping what is gone. False if visit asked to stop.
+  bool BackupChangedPaths(const fs::path& changed_paths,
+                          const std::function<bool(const ScannedFile&)>& visit,
+                          size_t& deleted_files);
+  FileMetadata CheckFileMetadata(const ScannedFile& file);
+  // Put a file with more hard links in the group of its inode, so later
+  // links reuse what it read
+  void RememberLink(const ScannedFile& file, FileMetadata& file_metadata);
+  // Returns the name of the saved snapshot
+  std::string SaveMetadata();
   std::string GenerateChunkFilename(const std::string& hash);
   Chunk CompressChunk(const Chunk& original_chunk);
   void SaveChunk(const Chunk& chunk);
-  BackupMetadata LoadPreviousMetadata(const std::string& backup_name);
+  // Journal the start of the run, unless it continues an interrupted one
+  void BeginJournal();
+  void Checkpoint();
+  // Checkpoint once enough time or data passed since the last one
+  void CheckpointIfDue();
+  // Save the snapshot of a finished run and drop its journal. Returns the
+  // name of the snapshot.
+  std::string CompleteBackup();
+  void LoadPreviousSnapshot(const std::string& backup_name);
   std::string GetLatestBackup();
   std::string GetLatestFullBackup();
-  bool CheckFileForChanges(const fs::path& file_path,
+  bool CheckFileForChanges(const ScannedFile& file,
                            const FileMetadata& previous_metadata);
 
   fs::path input_path_;
@@ -92,10 +122,39 @@ class Backup {
   Chunker chunker_;
   BackupType backup_type_;
   BackupMetadata metadata_;
+  Manifest manifest_;
+  TreeStore trees_;
+  // Directory nodes for the snapshot, reusing unchanged ones of the base
+  TreeBuilder tree_builder_;
+  // Base snapshot, as a tree or for older snapshots as a file list
+  std::optional<TreeRef> base_root_;
+  FileTable base_files_;
+  // Files added, changed or deleted since the base, spilled to disk in runs
+  SnapshotSpool changes_;
+  PathIndex history_;
+  // Inodes read by the last backup of the source, trusted by incremental
+  // and differential backups
+  FileStateCache file_states_;
+  // Chunks of every file content in the repository, by whole-file digest
+  FileDigestIndex digests_;
+  // Files of this backup with more hard links, by device and inode
+  std::map<std::pair<uint64_t, uint64_t>, FileMetadata> linked_files_;
+  BackupJournal journal_;
+  ChangeJournal* change_journal_ = nullptr;
+  std::unique_ptr<FileFilter> filter_;
+  bool resumed_ = false;
+  bool complete_ = false;
+  std::chrono::seconds time_budget_{0};
+  std::chrono::steady_clock::time_point last_checkpoint_;
+  uint64_t uncheckpointed_bytes_ = 0;
 
  private:
-  std::string CalculateFileSHA256(const fs::path& file_path);
+  // Holes hash as zeros without reading them
+  std::string CalculateFileSHA256(const fs::path& file_path,
+                                  const std::vector<FileExtent>& holes = {});
   std::string GetFilePermissions(const fs::path& file_path);
+  // Octal string like "0644"
+  static std::string FormatPermissions(uint32_t mode);
 };
 
 #endif  // BACKUP_HPP_
@@ -0,0 +1,58 @@
+#ifndef BACKUP_JOURNAL_HPP_
+#define BACKUP_JOURNAL_HPP_
+
+#include <repositories/all.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "metadata.hpp"
+
+namespace fs = std::filesystem;
+
+// Write-ahead progress log of a running backup, kept in the app data
+// directory per repository and source path. Records are buffered and only
+// appended by Commit(), after the repository has made the matching uploads
+// durable, so a restarted backup can trust everything it reads back.
+class BackupJournal {
+ public:
+  BackupJournal(Repository* repo, const fs::path& input_path);
+
+  // Read the journal of an interrupted backup, returns false if there is none
+  bool Load();
+
+  // Start a new journal for this snapshot, dropping any previous one
+  void Begin(const BackupMetadata& metadata);
+
+  // Chunk uploaded with this many stored bytes
+  void RecordChunk(const std::string& hash, uint64_t size);
+  void RecordFile(const std::string& file_path,
+                  const FileMetadata& file_metadata);
+  bool HasChunk(const std::string& hash) const;
+  // Stored bytes of every chunk uploaded for this snapshot so far
+  uint64_t GetChunkBytes() const { return chunk_bytes_; }
+
+  // Durably append every record made since the last commit
+  void Commit();
+  size_t GetPendingCount() const { return pending_.size(); }
+
+  // Forget the journal once its snapshot has been saved
+  void Remove();
+
+  // Header and completed files of a loaded journal
+  const BackupMetadata& GetMetadata() const { return metadata_; }
+
+ private:
+  fs::path journal_path_;
+  BackupMetadata metadata_;
+  std::unordered_set<std::string> chunks_;
+  uint64_t chunk_bytes_ = 0;
+  std::vector<std::string> pending_;  // Serialized records not yet committed
+};
+
+#endif  // BACKUP_JOURNAL_HPP_
@@ -0,0 +1,94 @@
+#ifndef CHANGE_JOURNAL_HPP_
+#define CHANGE_JOURNAL_HPP_
+
+#include <repositories/all.h>
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Kernel notifications of changes below a directory tree
+class ChangeWatch {
+ public:
+  virtual ~ChangeWatch() = default;
+
+  // Descriptor that polls readable while events are queued
+  virtual int fd() const = 0;
+  // Add the paths the queued events name, false if events were lost
+  virtual bool Read(std::vector<std::string>& paths) = 0;
+};
+
+// Paths changed below a backup source since recent snapshots of it, kept
+// while the scheduler runs. A watcher thread takes them from fanotify on
+// the whole file system where the process may use it, else from inotify on
+// every directory of the source, and appends them to a journal file instead
+// of holding them in memory. A backup cuts the journal as it starts and
+// reads only the paths listed, provided its base snapshot was cut from the
+// same journal. Lost events, a failed watch or a restart of the scheduler
+// leave no snapshot the journal vouches for, and the next backup scans the
+// whole source.
+class ChangeJournal {
+ public:
+  // Journals of a source are told apart by name, one for each schedule
+  ChangeJournal(Repository* repo, const fs::path& source,
+                const std::string& name);
+  ~ChangeJournal();
+
+  ChangeJournal(const ChangeJournal&) = delete;
+  ChangeJournal& operator=(const ChangeJournal&) = delete;
+
+  // Drop what an earlier run recorded and start watching in the background
+  void Start();
+
+  // Set the paths changed so far aside for a starting backup. Returns the
+  // file listing them if they cover every change since the base snapshot,
+  // nullopt if the source has to be scanned.
+  std::optional<fs::path> Cut(const std::string& base_backup);
+  // The backup that cut the journal was saved, changes since it are those
+  // recorded after the cut
+  void Commit(const std::string& backup_name);
+  // The backup failed or stopped early, its paths go back to the journal
+  void Abort();
+
+  // Visit the paths of a cut journal, repeats included
+  static void ReadPaths(const fs::path& path,
+                        const std::function<void(const std::string&)>& visitor);
+
+ private:
+  void WatchLoop();
+  void OpenLog(bool truncate);
+  // Move the paths set aside back into the journal
+  void RestorePending();
+
+  std::string source_;
+  fs::path log_path_;
+  fs::path pending_path_;
+
+  std::mutex mutex_;
+  std::ofstream log_;
+  bool watching_ = false;
+  uint64_t losses_ = 0;
+  // Snapshots whose changes since are all in the journal
+  std::set<std::string> bases_;
+  // State when the paths set aside were cut
+  bool cut_ = false;
+  bool cut_watching_ = false;
+  uint64_t cut_losses_ = 0;
+
+  std::atomic<bool> stopping_{false};
+  std::unique_ptr<ChangeWatch> watch_;
+  std::thread watcher_;
+};
+
+#endif  // CHANGE_JOURNAL_HPP_
@@ -0,0 +1,55 @@
+#ifndef CHUNK_CACHE_HPP_
+#define CHUNK_CACHE_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Size-bounded, least recently used cache of compressed chunks that
+// survives across sessions. Chunks are stored under their content digest
+// and verified against it on every read.
+class ChunkCache {
+ public:
+  ChunkCache(const fs::path& cache_dir, uint64_t max_bytes);
+
+  // Cache under the app data path, limited by the `chunk_cache_limit_mb`
+  // setting
+  static fs::path GetDefaultPath();
+  static uint64_t GetConfiguredLimit();
+
+  // Stored chunk data, or nothing if missing or corrupt
+  std::optional<std::vector<uint8_t>> Get(const std::string& hash);
+  // Store a chunk, logging instead of failing if it cannot be written
+  void Put(const std::string& hash, const std::vector<uint8_t>& data);
+
+  static std::string CalculateDigest(const std::vector<uint8_t>& data);
+
+ private:
+  struct Entry {
+    std::string hash;
+    uint64_t size;
+  };
+
+  fs::path GetChunkPath(const std::string& hash) const;
+  void LoadIndex();
+  void Touch(const std::string& hash);
+  void Forget(const std::string& hash);
+  void Evict();
+
+  fs::path cache_dir_;
+  uint64_t max_bytes_;
+  uint64_t total_bytes_ = 0;
+
+  std::mutex mutex_;
+  std::list<Entry> lru_;  // Most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
+
+#endif  // CHUNK_CACHE_HPP_
@@ -3,9 +3,12 @@
 
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
 #include <functional>
 #include <vector>
 
+#include "metadata.hpp"
+
 namespace fs = std::filesystem;
 
 struct Chunk {
@@ -22,11 +25,32 @@ class Chunker {
   void CombineChunks(const std::vector<Chunk>& chunks,
                      const fs::path& output_path);
 
-  // New streaming methods
+  // Holes of a file by SEEK_DATA and SEEK_HOLE, none where the file
+  // system can't tell them
+  static std::vector<FileExtent> FindHoles(const fs::path& file_path);
+
+  // A chunk of one repeated byte, as zeroed or preallocated regions give, is
+  // a fill. Its hash spells out the byte and the length behind a prefix no
+  // digest has in practice, so it is restored without a stored object.
+  static bool IsFillHash(const std::string& hash);
+  // The chunk a fill hash stands for, with its data set
+  static Chunk MakeFillChunk(const std::string& hash);
+
+  // New streaming methods. Holes of the file are skipped without reading
+  // them, the chunks hold the data between them.
   void StreamSplitFile(const fs::path& file_path,
-                       std::function<void(const Chunk&)> chunk_callback);
-  void StreamCombineChunks(std::function<Chunk()> chunk_provider,
-                           const fs::path& output_path, size_t original_size);
+                       std::function<void(const Chunk&)> chunk_callback,
+                       const std::vector<FileExtent>& holes = {});
+  // Write chunks from the provider into output_path. A non-zero
+  // start_offset keeps that many bytes of an existing file and appends after
+  // them; chunk_written is told the file size after every chunk. Both count
+  // chunk bytes only, the holes and zero fills are seeked over and left
+  // unallocated.
+  void StreamCombineChunks(
+      std::function<Chunk()> chunk_provider, const fs::path& output_path,
+      size_t original_size, size_t start_offset = 0,
+      std::function<void(std::ofstream&, size_t)> chunk_written = nullptr,
+      const std::vector<FileExtent>& holes = {});
 
  private:
   size_t average_chunk_size_;
@@ -0,0 +1,88 @@
+#ifndef DIRECTORY_SCANNER_HPP_
+#define DIRECTORY_SCANNER_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_filter.hpp"
+
+namespace fs = std::filesystem;
+
+// A regular file or symlink found by a scan, with the attributes of the
+// entry itself as returned by its one statx call
+struct ScannedFile {
+  std::string path;
+  bool is_symlink = false;
+  uint64_t size = 0;
+  uint64_t allocated = 0;  // Bytes of storage, less than size if sparse
+  fs::file_time_type mtime;
+  fs::file_time_type ctime;
+  uint32_t mode = 0;  // Permission bits
+  uint32_t links = 1;  // Hard links to the inode
+  uint64_t device = 0;
+  uint64_t inode = 0;
+};
+
+// Walks a directory tree on worker threads. A worker lists a directory with
+// getdents64, hands subdirectories back to the other workers by their entry
+// type and stats every other entry once with statx relative to the open
+// directory. Files are queued for the caller up to a limit, so the walk
+// stays only a little ahead of the backup. Symlinks are reported and not
+// followed, the order of files is unspecified. With a filter, directories
+// it leaves out are never queued and files it leaves out are not reported.
+class DirectoryScanner {
+ public:
+  explicit DirectoryScanner(const fs::path& root,
+                            const FileFilter* filter = nullptr,
+                            size_t worker_count = 4,
+                            size_t queue_limit = 4096);
+  ~DirectoryScanner();
+
+  DirectoryScanner(const DirectoryScanner&) = delete;
+  DirectoryScanner& operator=(const DirectoryScanner&) = delete;
+
+  // Wait for the next file, false once the walk is done. Rethrows the
+  // first error of a worker.
+  bool Next(ScannedFile& file);
+
+  // Attributes of one path as a scan would report them, nullopt unless it
+  // is a regular file or symlink
+  static std::optional<ScannedFile> Stat(const fs::path& path);
+
+ private:
+  // A directory to list and the filter rules that apply inside it
+  struct PendingDirectory {
+    std::string path;
+    FileFilter::Scope scope;
+  };
+
+  void WorkerLoop();
+  void ScanDirectory(const PendingDirectory& directory);
+  bool IsDone() const { return directories_.empty() && busy_workers_ == 0; }
+
+  const FileFilter* filter_;
+  size_t queue_limit_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;   // Directory queued or walk over
+  std::condition_variable ready_cv_;  // File queued or walk over
+  std::condition_variable space_cv_;  // Room in the file queue
+  // Taken from the back, depth first
+  std::vector<PendingDirectory> directories_;
+  size_t busy_workers_ = 0;
+  std::deque<ScannedFile> files_;
+  bool stopping_ = false;
+  std::exception_ptr error_;
+
+  std::vector<std::thread> workers_;
+};
+
+#endif  // DIRECTORY_SCANNER_HPP_
@@ -0,0 +1,83 @@
+#ifndef FILE_DIGEST_INDEX_HPP_
+#define FILE_DIGEST_INDEX_HPP_
+
+#include <repositories/all.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "manifest.hpp"
+#include "mapped_file.hpp"
+#include "metadata.hpp"
+
+namespace fs = std::filesystem;
+
+// Repository-wide index from whole-file SHA-256 digests to the chunks that
+// hold such a file, so a copy of content already stored anywhere is backed
+// up in one lookup instead of being chunked and compressed again. Every
+// snapshot adds one immutable segment under digests/ with the files it
+// chunked. The client merges the segments of listed snapshots into a local
+// table sorted by digest and maps it for binary search. A snapshot without
+// a segment, such as one from before the index, is covered with no files.
+// One whose segment cannot be read is left out of the table and read again
+// on the next load.
+class FileDigestIndex {
+ public:
+  FileDigestIndex(Repository* repo, const fs::path& cache_dir);
+  ~FileDigestIndex();
+
+  FileDigestIndex(const FileDigestIndex&) = delete;
+  FileDigestIndex& operator=(const FileDigestIndex&) = delete;
+
+  // Merge the segments of snapshots not yet in the local table and map it.
+  // The table is rebuilt if it covers a snapshot that is no longer listed.
+  void Load(Manifest& manifest);
+
+  // Chunks and holes of a stored file with this digest and size, if any
+  std::optional<FileMetadata> Find(const std::string& sha256_checksum,
+                                   uint64_t total_size) const;
+
+  // Remember a file the current backup chunked
+  void Add(const FileMetadata& file_metadata);
+  // Publish the files added as the segment of a new snapshot, empty if
+  // there are none, before the snapshot is listed
+  void AddSnapshot(const std::string& backup_name);
+
+ private:
+  // Records by raw digest, ordered as in the table
+  using Batch = std::map<std::string, std::vector<uint8_t>>;
+
+  fs::path GetSegmentPath(const std::string& backup_name) const;
+  // Records of a snapshot's segment by raw digest, none if the repository
+  // has no segment for it. Throws if it cannot be read.
+  std::vector<std::pair<std::string, FileMetadata>> ReadSegment(
+      const std::string& backup_name);
+  // Rewrite the table with the batch merged in, covering the given snapshots
+  void Merge(const Batch& batch, const std::vector<std::string>& covered);
+  void RemoveSegments(const std::vector<std::string>& names);
+  std::vector<std::string> ReadCoveredSnapshots();
+  void Map();
+
+  Repository* repo_;
+  fs::path cache_dir_;
+  fs::path index_path_;
+
+  // Merged table
+  std::unique_ptr<MappedFile> mapped_;
+  const uint8_t* entries_ = nullptr;
+  uint64_t count_ = 0;
+  const uint8_t* records_ = nullptr;
+  size_t records_size_ = 0;
+
+  // Files of the current backup by hex digest
+  std::unordered_map<std::string, FileMetadata> added_;
+};
+
+#endif  // FILE_DIGEST_INDEX_HPP_
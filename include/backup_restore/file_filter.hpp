@@ -0,0 +1,75 @@
+#ifndef FILE_FILTER_HPP_
+#define FILE_FILTER_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct ScannedFile;
+// Compiled rules of a directory and those it inherits
+struct FilterScope;
+
+// Decides which paths below a backup source are left out. Rules come from
+// the filter settings of a schedule and from .resilioz-ignore files in the
+// source, both written as gitignore patterns: a leading '!' includes again,
+// a trailing '/' matches directories only, a pattern with a '/' is anchored
+// to its directory and '**' spans directories. The patterns of an ignore
+// file apply below its directory and take precedence over those above it.
+// Every set of patterns is compiled once, with plain names and extensions
+// hashed when none of them includes again. A directory left out is not
+// scanned at all, so nothing below it can be included again. Size bounds
+// and the age limit apply to regular files only.
+class FileFilter {
+ public:
+  using Scope = std::shared_ptr<const FilterScope>;
+
+  static constexpr const char* IGNORE_FILE_NAME = ".resilioz-ignore";
+
+  // Settings are optional: "exclude" and "include" pattern lists, where an
+  // include is an exclude negated and placed last, "min_size" and
+  // "max_size" in bytes and "max_age_days" for the modification time
+  explicit FileFilter(const fs::path& root,
+                      const nlohmann::json& settings = nlohmann::json());
+  ~FileFilter();
+
+  FileFilter(const FileFilter&) = delete;
+  FileFilter& operator=(const FileFilter&) = delete;
+
+  // Rules inside a directory whose parent has the given scope, read from
+  // its ignore file if it has one. The directory's own scope is returned
+  // as it is.
+  Scope Enter(const Scope& parent, const std::string& directory) const;
+  // Rules inside a directory at or below the root, null if it or one above
+  // it is left out. Safe to call from several threads.
+  Scope FindScope(const std::string& directory) const;
+
+  // Whether the patterns leave out a path inside the scope's directory
+  bool ExcludesPath(const Scope& scope, const std::string& path,
+                    bool is_directory) const;
+  // Whether the size bounds and age limit keep a file
+  bool IsWithinLimits(const ScannedFile& file) const;
+
+ private:
+  Scope FindScopeLocked(const std::string& directory) const;
+
+  std::string root_;
+  Scope root_scope_;
+  uint64_t min_size_ = 0;
+  uint64_t max_size_ = 0;  // Zero means unlimited
+  bool has_max_age_ = false;
+  fs::file_time_type oldest_mtime_;
+
+  mutable std::mutex mutex_;
+  // Directories looked up below the root, null for those left out
+  mutable std::unordered_map<std::string, Scope> scopes_;
+};
+
+#endif  // FILE_FILTER_HPP_
@@ -0,0 +1,86 @@
+#ifndef FILE_STATE_CACHE_HPP_
+#define FILE_STATE_CACHE_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "directory_scanner.hpp"
+#include "manifest.hpp"
+#include "mapped_file.hpp"
+#include "metadata.hpp"
+
+namespace fs = std::filesystem;
+
+// A file as the last backup of its source read it
+struct FileState {
+  std::string path;
+  fs::file_time_type ctime;
+  FileMetadata file;
+
+  // Whether the inode was not written since, by its size and times
+  bool Matches(const ScannedFile& scanned) const;
+};
+
+// Client-side record of the regular files the last backup of a source saw,
+// by device and inode, with their size, mtime and ctime to the nanosecond
+// and the chunks they held. An inode whose attributes all still match was
+// not written since, so its chunks are reused without reading it. A moved
+// or renamed inode is matched without its ctime, which the rename updated,
+// and reused the same way. Files changed shortly before a backup
+// started are left out, as a write in the same clock tick would go
+// unnoticed. The records are sorted and mapped for binary search, and only
+// trusted while the backup that wrote them is in the manifest.
+class FileStateCache {
+ public:
+  // Records are written next to the others under cache_dir, the work_dir
+  // holds those of the current backup until it is published
+  FileStateCache(const fs::path& cache_dir, const fs::path& source,
+                 const fs::path& work_dir);
+  ~FileStateCache();
+
+  FileStateCache(const FileStateCache&) = delete;
+  FileStateCache& operator=(const FileStateCache&) = delete;
+
+  // Map the records of the last backup of the source, if still listed
+  void Load(Manifest& manifest);
+
+  // What the inode of a scanned regular file held when last read, if it
+  // was. The file changed since unless the state still matches it.
+  std::optional<FileState> Find(const ScannedFile& file) const;
+
+  // Remember a file of the current backup and the chunks it holds
+  void Record(const ScannedFile& file, const FileMetadata& file_metadata);
+  // Replace the loaded records with the recorded ones, once the backup
+  // holding their chunks is published
+  void Commit(const std::string& backup_name);
+
+ private:
+  struct IndexEntry {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;  // Of the record in the record area
+  };
+
+  fs::path path_;
+  fs::path records_path_;
+  fs::file_time_type trusted_before_;
+
+  // Loaded records
+  std::unique_ptr<MappedFile> mapped_;
+  const uint8_t* index_ = nullptr;
+  uint64_t count_ = 0;
+  const uint8_t* records_ = nullptr;
+  size_t records_size_ = 0;
+
+  // Records of the current backup, in scan order until committed
+  std::ofstream recorded_;
+  std::vector<IndexEntry> recorded_index_;
+  uint64_t recorded_size_ = 0;
+};
+
+#endif  // FILE_STATE_CACHE_HPP_
@@ -0,0 +1,24 @@
+#ifndef JOURNAL_HPP_
+#define JOURNAL_HPP_
+
+#include <repositories/all.h>
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Helpers shared by the backup and restore progress journals
+namespace Journal {
+
+// Journal file in the app data directory, unique per repository and identity
+fs::path GetPath(const std::string& kind, Repository* repo,
+                 const std::string& identity);
+
+// Write data and fsync it before returning
+void WriteDurably(const fs::path& path, const std::string& data,
+                  bool truncate);
+
+}  // namespace Journal
+
+#endif  // JOURNAL_HPP_
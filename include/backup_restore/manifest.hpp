@@ -0,0 +1,85 @@
+#ifndef MANIFEST_HPP_
+#define MANIFEST_HPP_
+
+#include <repositories/all.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+
+namespace fs = std::filesystem;
+
+// One compact record per snapshot, enough to list and pick backups without
+// fetching their full metadata
+struct ManifestEntry {
+  std::string name;
+  BackupType type = BackupType::FULL;
+  std::chrono::system_clock::time_point timestamp;
+  std::string previous_backup;
+  std::string remarks;
+  uint64_t file_count = 0;
+  uint64_t total_size = 0;     // Logical bytes of all files in the snapshot
+  uint64_t new_bytes = 0;      // Stored bytes of chunks uploaded for it
+  uint64_t metadata_size = 0;  // Bytes of the encrypted metadata object
+  std::string metadata_digest;  // SHA-256 of the encrypted metadata object
+};
+
+// The catalog object of a repository. It is an append-only sequence of
+// separately encrypted blocks of entries: a new snapshot appends one block
+// and leaves the rest untouched, and the writer folds the blocks into one
+// once there are many, keeping a load to a few key derivations.
+class Manifest {
+ public:
+  // Metadata objects are cached per repository under the app data path and
+  // survive across sessions
+  explicit Manifest(Repository* repo);
+
+  // Fetch the catalog; repositories written before it existed are indexed
+  // once from their JSON manifest or snapshot metadata and converted
+  void Load();
+
+  // Record a newly uploaded snapshot by appending it to the catalog, the
+  // local metadata file is kept in the cache. Clients of one machine take
+  // turns through a lock in the cache. The repository has no lock of its
+  // own, so clients on different machines adding at the same moment may
+  // lose one of the records.
+  void Add(const ManifestEntry& entry, const fs::path& metadata_file);
+
+  // Entries ordered newest first
+  std::vector<ManifestEntry> GetEntries() const;
+  std::optional<ManifestEntry> Find(const std::string& backup_name) const;
+
+  // Return the cached metadata of a snapshot, downloading it only when it is
+  // missing or does not match the manifest
+  fs::path FetchMetadata(const std::string& backup_name);
+
+  static std::string CalculateDigest(const fs::path& file_path);
+
+  // Per-repository cache directory, shared with other immutable objects
+  const fs::path& GetCacheDir() const { return cache_dir_; }
+
+ private:
+  bool Download(const std::string& name, const fs::path& local_path);
+  void ReadCatalog(const fs::path& catalog_path);
+  bool ReadLegacyManifest();
+  void Rebuild();
+  // Write every entry as a single block, replacing the catalog
+  void Save();
+  void Append(const ManifestEntry& entry);
+  void Publish(const std::vector<uint8_t>& catalog);
+  void PruneCache();
+  bool IsCacheValid(const ManifestEntry& entry,
+                    const fs::path& cached_path) const;
+
+  Repository* repo_;
+  fs::path cache_dir_;
+  std::vector<ManifestEntry> entries_;
+  size_t block_count_ = 0;  // Blocks in the loaded catalog
+};
+
+#endif  // MANIFEST_HPP_
@@ -0,0 +1,188 @@
+#ifndef METADATA_HPP_
+#define METADATA_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+enum class BackupType { FULL, INCREMENTAL, DIFFERENTIAL };
+
+// A byte range of a file
+struct FileExtent {
+  uint64_t offset = 0;
+  uint64_t length = 0;
+
+  bool operator==(const FileExtent& other) const {
+    return offset == other.offset && length == other.length;
+  }
+  bool operator!=(const FileExtent& other) const { return !(*this == other); }
+};
+
+struct FileMetadata {
+  std::string original_filename;
+  std::vector<std::string> chunk_hashes;
+  uint64_t total_size;
+  fs::file_time_type mtime;
+  bool is_symlink = false;
+  std::string symlink_target;
+  std::string permissions;  // File permissions in octal format (e.g., "0644")
+  std::string sha256_checksum;  // SHA256 hash of the entire file
+  // Holes of a sparse file in offset order. They read as zeros and are
+  // left out of the chunks, which hold only the data between them.
+  std::vector<FileExtent> holes;
+  // Files of the snapshot sharing an inode through hard links name the
+  // first of them found, which restore writes and links the others to
+  std::string link_group;
+};
+
+// Files of a snapshot in path order, packed for snapshots of millions of
+// files: directory paths are interned, names and digests live in shared
+// arenas and permissions are kept as mode bits. Entries are decoded into
+// FileMetadata when accessed, so iterators hand out values rather than
+// references into the table and are invalidated by any insertion.
+class FileTable {
+ public:
+  using value_type = std::pair<std::string, FileMetadata>;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = FileTable::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    const_iterator() = default;
+
+    reference operator*() const;
+    pointer operator->() const { return &**this; }
+    const_iterator& operator++();
+    bool operator==(const const_iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return index_ != other.index_;
+    }
+
+    // Path of the entry without decoding the rest of it
+    std::string GetPath() const;
+
+   private:
+    friend class FileTable;
+    const_iterator(const FileTable* table, size_t index);
+
+    const FileTable* table_ = nullptr;
+    size_t index_ = 0;
+    mutable std::optional<value_type> value_;
+  };
+  using iterator = const_iterator;
+
+  FileTable() = default;
+  FileTable(const FileTable& other);
+  FileTable& operator=(const FileTable& other);
+  FileTable(FileTable&&) = default;
+  FileTable& operator=(FileTable&&) = default;
+
+  // Iteration sorts entries added since the last pass first
+  const_iterator begin() const;
+  const_iterator end() const;
+  const_iterator find(const std::string& file_path) const;
+  // First entry whose path is not less than file_path
+  const_iterator lower_bound(const std::string& file_path) const;
+
+  size_t size() const { return live_count_; }
+  bool empty() const { return live_count_ == 0; }
+
+  void insert_or_assign(const std::string& file_path,
+                        const FileMetadata& file_metadata);
+  const_iterator erase(const_iterator it);
+  void clear();
+
+  // Hash every path so find takes constant time, for tables read many times
+  // without changing. Adding a file drops the index again.
+  void IndexPaths() const;
+
+ private:
+  struct Entry {
+    uint64_t total_size = 0;
+    int64_t mtime = 0;          // Nanoseconds since the file clock epoch
+    uint64_t name_offset = 0;   // In names_
+    uint32_t first_digest = 0;  // In digests_: checksum if any, then chunks
+    uint32_t directory = 0;     // In directories_
+    uint32_t name_size = 0;
+    uint32_t chunk_count = 0;
+    uint32_t mode = 0;          // Permission bits and entry flags
+    uint32_t extra = 0;         // In extras_, for rarer fields
+  };
+
+  // Fields too rare to give every entry room for
+  struct Extra {
+    std::string symlink_target;
+    std::string original_filename;
+    std::vector<FileExtent> holes;
+    std::string link_group;
+  };
+
+  std::string_view GetName(const Entry& entry) const;
+  std::string GetPath(const Entry& entry) const;
+  int Compare(const Entry& entry, std::string_view file_path) const;
+  size_t FindSorted(std::string_view file_path) const;
+  size_t FindIndexed(std::string_view file_path) const;
+  size_t SkipDeleted(size_t index) const;
+  uint32_t InternDirectory(std::string_view directory);
+  void Encode(Entry& entry, const FileMetadata& file_metadata);
+  FileMetadata Decode(const Entry& entry) const;
+  void RebuildDirectoryIndex();
+  // Sort the tail into the table and drop erased entries and stale data
+  void Merge() const;
+
+  // Entries before sorted_count_ are in path order, later ones were added
+  // since and are found through tail_index_. Merging is logically const.
+  mutable std::vector<Entry> entries_;
+  mutable size_t sorted_count_ = 0;
+  mutable std::unordered_map<std::string, uint32_t> tail_index_;
+  mutable std::string names_;
+  mutable std::vector<uint8_t> digests_;
+  mutable std::vector<Extra> extras_;
+  // Open addressing table of entry index + 1 by path hash, 0 is free
+  mutable std::vector<uint32_t> path_index_;
+  std::deque<std::string> directories_;
+  std::unordered_map<std::string_view, uint32_t> directory_ids_;
+  size_t live_count_ = 0;
+};
+
+struct BackupMetadata {
+  BackupType type;
+  std::chrono::system_clock::time_point timestamp;
+  std::string original_path;
+  std::string previous_backup;
+  std::string remarks;
+  FileTable files;
+  BackupMetadata() {};
+  BackupMetadata(BackupType type_,
+                 std::chrono::system_clock::time_point timestamp_,
+                 std::string previous_backup_,
+                 FileTable files_)
+      : type(type_),
+        timestamp(timestamp_),
+        previous_backup(previous_backup_),
+        files(files_) {};
+};
+
+// JSON form shared by snapshot metadata and the backup journal
+nlohmann::json FileMetadataToJson(const FileMetadata& file_metadata);
+FileMetadata FileMetadataFromJson(const nlohmann::json& file_json);
+
+#endif  // METADATA_HPP_
@@ -0,0 +1,69 @@
+#ifndef PATH_INDEX_HPP_
+#define PATH_INDEX_HPP_
+
+#include <repositories/all.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "manifest.hpp"
+#include "snapshot_spool.hpp"
+#include "tree.hpp"
+
+namespace fs = std::filesystem;
+
+// A file as held by one snapshot
+struct FileVersion {
+  std::string path;
+  std::string backup_name;
+  uint64_t size = 0;
+  fs::file_time_type mtime;
+  std::string sha256_checksum;  // Empty for symlinks
+};
+
+// Repository-wide index from paths to the snapshots holding them. Every
+// snapshot adds one immutable segment under history/ listing, sorted by
+// path, the files it added, changed or deleted against its base, or all of
+// them for a full backup. A segment is split into separately compressed
+// and encrypted blocks behind an encrypted directory of their first paths,
+// so a lookup only opens the blocks that can hold what it asks for.
+class PathIndex {
+ public:
+  PathIndex(Repository* repo, const fs::path& cache_dir);
+
+  // Publish the segment of a new snapshot, complete when changes hold every
+  // file of it rather than the difference to its base
+  void AddSnapshot(const std::string& backup_name, bool complete,
+                   SnapshotSpool& changes);
+
+  // Every snapshot holding a file that matches the pattern, by path and then
+  // snapshot name. The pattern is a path, a directory ending in '/' or a
+  // glob whose wildcards also match across directories. Snapshots from
+  // before the index are indexed from their metadata on first use.
+  std::vector<FileVersion> Find(Manifest& manifest, TreeStore* trees,
+                                const std::string& pattern);
+
+ private:
+  // Files of one segment that match a query, nullopt marking deletions
+  struct Segment {
+    bool complete = false;
+    std::map<std::string, std::optional<FileVersion>> files;
+  };
+
+  fs::path GetCachePath(const std::string& backup_name) const;
+  bool FetchSegment(const std::string& backup_name);
+  void BuildSegment(Manifest& manifest, TreeStore* trees,
+                    const std::string& backup_name);
+  Segment ReadSegment(const std::string& backup_name,
+                      const std::string& pattern);
+
+  Repository* repo_;
+  fs::path cache_dir_;
+};
+
+#endif  // PATH_INDEX_HPP_
@@ -0,0 +1,69 @@
+#ifndef PREFETCHER_HPP_
+#define PREFETCHER_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunker.hpp"
+
+// Loads chunks ahead of the restore writer on worker threads. Chunks are
+// scheduled in restore order as the files ahead come up and at most
+// `window` chunks are kept in flight or ready, so throughput is bound by
+// bandwidth instead of latency.
+class ChunkPrefetcher {
+ public:
+  using ChunkLoader = std::function<Chunk(const std::string& hash)>;
+
+  explicit ChunkPrefetcher(ChunkLoader loader, size_t worker_count = 4,
+                           size_t window = 16);
+  ~ChunkPrefetcher();
+
+  ChunkPrefetcher(const ChunkPrefetcher&) = delete;
+  ChunkPrefetcher& operator=(const ChunkPrefetcher&) = delete;
+
+  // Append the chunk hashes from `first` on in the order they will be
+  // requested. Returns the sequence number following the last one.
+  uint64_t Schedule(const std::vector<std::string>& hashes, size_t first = 0);
+
+  // Take the next scheduled chunk if it has this hash, waiting for its
+  // download if needed. Any other chunk is loaded directly.
+  Chunk Get(const std::string& hash);
+
+  // Drop the scheduled chunks before a sequence number Schedule returned,
+  // such as those of a file abandoned part way
+  void SkipTo(uint64_t seq);
+  // Drop every scheduled chunk
+  void Clear();
+
+ private:
+  struct Slot {
+    std::string hash;
+    bool started = false;
+    bool done = false;
+    Chunk chunk;
+    std::exception_ptr error;
+  };
+
+  void WorkerLoop();
+  void PopFront();
+
+  ChunkLoader loader_;
+  size_t window_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable ready_cv_;
+  std::deque<Slot> slots_;  // Front is the next chunk to be requested
+  uint64_t front_seq_ = 0;  // Sequence number of slots_.front()
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+
+#endif  // PREFETCHER_HPP_
@@ -0,0 +1,54 @@
+#ifndef RECORD_CODEC_HPP_
+#define RECORD_CODEC_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+
+// Field encodings shared by snapshot streams and tree nodes: varints,
+// zigzag integers, length-prefixed strings and raw SHA-256 digests
+namespace RecordCodec {
+
+static const size_t DIGEST_SIZE = 32;
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value);
+void PutSigned(std::vector<uint8_t>& out, int64_t value);
+void PutString(std::vector<uint8_t>& out, const std::string& value);
+// Hex digest stored as its raw bytes, throws on malformed input
+void PutDigest(std::vector<uint8_t>& out, const std::string& hex);
+
+// Every field of a file except its path
+void PutFileMetadata(std::vector<uint8_t>& out,
+                     const FileMetadata& file_metadata);
+
+// Bounds-checked reads from a record payload
+class Decoder {
+ public:
+  Decoder(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+  explicit Decoder(const std::vector<uint8_t>& payload)
+      : Decoder(payload.data(), payload.size()) {}
+
+  uint8_t GetByte();
+  uint64_t GetVarint();
+  int64_t GetSigned();
+  std::string GetString();
+  std::string GetDigest();
+  FileMetadata GetFileMetadata();
+
+  bool AtEnd() const { return pos_ == size_; }
+  // Bytes consumed so far
+  size_t GetOffset() const { return pos_; }
+
+ private:
+  void Require(uint64_t count);
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_ = 0;
+};
+
+}  // namespace RecordCodec
+
+#endif  // RECORD_CODEC_HPP_
@@ -3,16 +3,27 @@
 
 #include <chrono>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <nlohmann/json.hpp>
+#include <memory>
 #include <optional>
+#include <set>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "backup.hpp"
+#include "chunk_cache.hpp"
 #include "chunker.hpp"
+#include "manifest.hpp"
+#include "path_index.hpp"
+#include "prefetcher.hpp"
 #include "progress.hpp"
+#include "restore_journal.hpp"
+#include "restore_session.hpp"
+#include "tree.hpp"
 
 namespace fs = std::filesystem;
 
@@ -35,8 +46,11 @@ class Restore {
                    const std::string backup_name_);
   void VerifyFile(const fs::path& file_path, const fs::path output_path_,
                   const std::string backup_name_);
-  // Restore all files from backup
-  void RestoreAll(const fs::path output_path_, const std::string backup_name_);
+  // Restore all files from backup, resume continues an interrupted restore
+  void RestoreAll(const fs::path output_path_, const std::string backup_name_,
+                  bool resume = false);
+  // Whether an interrupted restore of this backup into output_path exists
+  bool CanResume(const fs::path& output_path, const std::string& backup_name);
 
   // Verify Backup Integrity
   void VerifyBackup(const std::string backup_name_);
@@ -44,24 +58,77 @@ class Restore {
   // List available backups
   std::vector<std::string> ListBackups();
 
-  // Compare two backups
-  void CompareBackups(const std::string& backup1, const std::string& backup2);
+  // Compare two backups, as JSON for scripts if asked
+  void CompareBackups(const std::string& backup1, const std::string& backup2,
+                      bool as_json = false);
+
+  // Every backup holding a file that matches a path, directory or glob
+  std::vector<FileVersion> FindFileHistory(const std::string& pattern);
 
  protected:
-  // Load metadata from backup
+  // Chunks of a file queued in the prefetcher ahead of it
+  struct PrefetchPlan {
+    size_t chunks = 0;
+    uint64_t end = 0;  // Prefetcher sequence number after its last chunk
+    // Where an interrupted restore left the file, if it can continue there
+    std::optional<RestoreProgress> resume_from;
+  };
+  using PlannedVisitor = std::function<void(
+      const std::string&, const FileMetadata&, const PrefetchPlan&)>;
+
+  // Open a session on the backup, kept until another backup is loaded
   void LoadMetadata(const std::string backup_name_);
+  // Visit the files of the open session in order, with the chunks of a
+  // bounded window of the files after the visited one queued for download.
+  // Files in skipped_files are visited with nothing queued.
+  void ForEachPlanned(const fs::path& output_path, bool verifying,
+                      const std::set<std::string>& skipped_files,
+                      const PlannedVisitor& visitor);
+  // Restore or verify one file of the open session, planned by
+  // ForEachPlanned or on its own if no plan is given
+  void RestoreEntry(const std::string& file_path,
+                    const FileMetadata& file_metadata,
+                    const fs::path& output_path,
+                    const PrefetchPlan* plan = nullptr);
+  void VerifyEntry(const std::string& file_path,
+                   const FileMetadata& file_metadata,
+                   const fs::path& output_path,
+                   const PrefetchPlan* plan = nullptr);
   bool CheckFileIntegrity(const fs::path& file_path,
                           const std::string& expected_checksum);
   std::pair<std::string, int> ReportResults();
   std::pair<std::string, int> ReportVerifyResults();
+
+  // Track progress of a full restore so an interrupted one can resume
+  void OpenJournal(const fs::path& output_path, const std::string& backup_name,
+                   bool resume);
+  void CloseJournal();
+  void Checkpoint();
+  bool IsCheckpointDue() const;
+  bool IsAlreadyRestored(const std::string& file_path,
+                         const FileMetadata& file_metadata,
+                         const fs::path& output_file);
+
   Repository* repo_;
-  std::optional<BackupMetadata*> metadata_ = nullptr;
   fs::path temp_dir_;
+  Manifest manifest_;
+  TreeStore trees_;
+  PathIndex history_;
+  std::unique_ptr<RestoreSession> session_;
   std::vector<std::string>
       integrity_failures_;  // Track files that failed integrity check
   std::vector<std::string> failed_files_;  // Track files that failed to restore
   std::vector<std::string> successful_files_;  // Track files that succeeded
 
+  // Progress journal of the running full restore, null otherwise
+  std::unique_ptr<RestoreJournal> journal_;
+  bool resuming_ = false;
+  std::chrono::steady_clock::time_point last_checkpoint_;
+  uint64_t uncheckpointed_bytes_ = 0;
+  // Restored files the journal records but the next checkpoint has yet to
+  // sync
+  std::set<fs::path> unsynced_files_;
+
  private:
   // Load a chunk from disk
   Chunk LoadChunk(const std::string& hash);
@@ -70,12 +137,21 @@ class Restore {
   Chunk DecompressChunk(const Chunk& compressed_chunk);
 
   // Helper methods for file restore
-  std::optional<std::pair<std::string, FileMetadata>> FindFileMetadata(
-      const std::string& filename);
+  fs::path GetOutputPath(const std::string& filename,
+                         const fs::path& original_path,
+                         const fs::path& output_path_) const;
   fs::path PrepareOutputPath(const std::string& filename,
                              const fs::path& original_path,
                              const fs::path output_path_);
   Chunk GetNextChunk(const FileMetadata& file_metadata, ProgressBar& progress);
+  // Decide where the restore of a file starts and queue the chunks it will
+  // read. With group_digests, files to be linked to an earlier file of their
+  // hard link group queue nothing.
+  PrefetchPlan PlanRestore(
+      const std::string& file_path, const FileMetadata& file_metadata,
+      const fs::path& output_file,
+      std::unordered_map<std::string, std::string>* group_digests);
+  PrefetchPlan PlanVerify(const FileMetadata& file_metadata);
 
   Chunker chunker_;
 
@@ -87,6 +163,17 @@ class Restore {
   size_t current_chunk_ = 0;
   size_t processed_bytes_ = 0;
   std::string current_file_hash_;  // Track which file we're processing
+
+  // Compressed chunks kept across sessions
+  ChunkCache chunk_cache_;
+
+  // Downloads and decompresses upcoming chunks in the background
+  std::unique_ptr<ChunkPrefetcher> prefetcher_;
+
+  // First file restored of each hard link group of the snapshot, with its
+  // digest
+  std::unordered_map<std::string, std::pair<fs::path, std::string>>
+      linked_outputs_;
 };
 
 #endif  // RESTORE_HPP_
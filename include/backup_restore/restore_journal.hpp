@@ -0,0 +1,61 @@
+#ifndef RESTORE_JOURNAL_HPP_
+#define RESTORE_JOURNAL_HPP_
+
+#include <repositories/all.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Chunks of a file already written to the restore target
+struct RestoreProgress {
+  size_t chunks = 0;
+  uint64_t bytes = 0;
+};
+
+// Progress log of a restore of one backup into one destination. Records are
+// buffered and only appended by Commit(), after the restored data has been
+// synced, so a resumed restore can trust everything it reads back.
+class RestoreJournal {
+ public:
+  RestoreJournal(Repository* repo, const std::string& backup_name,
+                 const fs::path& output_path);
+
+  // Read the journal of an interrupted restore, returns false if there is none
+  bool Load();
+  bool Exists() const { return fs::exists(journal_path_); }
+
+  // Start a new journal, dropping any previous one
+  void Begin();
+
+  // File restored and verified against this digest
+  void RecordFile(const std::string& file_path, const std::string& sha256);
+  // Leading chunks of a large file written so far
+  void RecordProgress(const std::string& file_path,
+                      const RestoreProgress& progress);
+
+  std::optional<std::string> GetFinishedDigest(
+      const std::string& file_path) const;
+  std::optional<RestoreProgress> GetProgress(
+      const std::string& file_path) const;
+
+  // Durably append every record made since the last commit
+  void Commit();
+  size_t GetPendingCount() const { return pending_.size(); }
+
+  // Forget the journal once the restore has completed
+  void Remove();
+
+ private:
+  fs::path journal_path_;
+  std::map<std::string, std::string> finished_;
+  std::map<std::string, RestoreProgress> progress_;
+  std::vector<std::string> pending_;  // Serialized records not yet committed
+};
+
+#endif  // RESTORE_JOURNAL_HPP_
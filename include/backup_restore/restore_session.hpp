@@ -0,0 +1,44 @@
+#ifndef RESTORE_SESSION_HPP_
+#define RESTORE_SESSION_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+#include "manifest.hpp"
+#include "metadata.hpp"
+#include "tree.hpp"
+
+// A snapshot opened for restore or verification. Tree snapshots are read
+// node by node as they are used, so looking up one file decrypts only the
+// directories on its path. Older snapshots are decoded once and their
+// paths hashed.
+class RestoreSession {
+ public:
+  RestoreSession(Manifest& manifest, TreeStore* trees,
+                 const std::string& backup_name, const std::string& password);
+
+  const std::string& GetBackupName() const { return backup_name_; }
+  uint64_t GetFileCount() const;
+
+  // Nothing when the snapshot has no such file
+  std::optional<FileMetadata> Find(const std::string& file_path);
+
+  // Visit the files below a directory key, the whole snapshot by default,
+  // one directory at a time. Directory nodes on the way are collected when
+  // asked for, parents before their files.
+  void ForEachFile(
+      const std::function<void(const std::string&, const FileMetadata&)>&
+          visitor,
+      const std::string& directory_key = "",
+      TreeDirectories* directories = nullptr);
+
+ private:
+  std::string backup_name_;
+  TreeStore* trees_;
+  std::optional<TreeRef> root_;
+  FileTable files_;  // Older snapshots only
+};
+
+#endif  // RESTORE_SESSION_HPP_
@@ -0,0 +1,127 @@
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include <zstd.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+#include "tree.hpp"
+#include "utils/encryption_util.h"
+
+namespace fs = std::filesystem;
+
+// On-disk encoding of snapshot metadata. BINARY is a versioned stream of
+// length-prefixed records with raw digests, zstd-compressed and then
+// encrypted; it either lists the files or refers to the root of a tree of
+// directory nodes. JSON is the original format, still read for older
+// snapshots and written only when selected for debugging.
+enum class SnapshotFormat { BINARY, JSON };
+
+// Encodes one snapshot record by record without holding it in memory
+class SnapshotWriter {
+ public:
+  SnapshotWriter(const fs::path& path, const std::string& password,
+                 SnapshotFormat format = SnapshotFormat::BINARY);
+  ~SnapshotWriter();
+
+  // Format chosen by the "snapshot_format" setting, binary by default
+  static SnapshotFormat GetConfiguredFormat();
+
+  // Must come first, files are taken from the arguments of WriteFile()
+  void WriteHeader(const BackupMetadata& metadata);
+  void WriteFile(const std::string& file_path,
+                 const FileMetadata& file_metadata);
+  // Binary only, in place of WriteFile() calls
+  void WriteRoot(const TreeRef& root);
+  // Flush and close the file, the snapshot is incomplete without this
+  void Finish();
+
+ private:
+  void Compress(ZSTD_EndDirective mode);
+  void Emit(const uint8_t* data, size_t size);
+
+  std::ofstream file_;
+  SnapshotFormat format_;
+  std::string password_;
+  std::unique_ptr<EncryptionUtil::MetadataEncryptor> encryptor_;
+  ZSTD_CCtx* cctx_ = nullptr;
+  std::vector<uint8_t> pending_;  // Encoded records not yet compressed
+  uint64_t file_count_ = 0;
+  bool finished_ = false;
+  nlohmann::json legacy_json_;  // Whole snapshot in JSON format
+};
+
+// Decodes a snapshot in either format, handing out files one at a time
+class SnapshotReader {
+ public:
+  // Snapshots referring to a tree read their files through trees
+  SnapshotReader(const fs::path& path, const std::string& password,
+                 TreeStore* trees = nullptr);
+  ~SnapshotReader();
+
+  // Snapshot fields other than the files
+  const BackupMetadata& GetHeader() const { return header_; }
+  bool IsLegacy() const { return legacy_; }
+  // Tree root with the file count and size of the whole snapshot, if any
+  const std::optional<TreeRef>& GetRoot() const { return root_; }
+
+  // Visit every file, throws if the snapshot is truncated. Directories of a
+  // tree snapshot are collected when asked for.
+  void ReadFiles(
+      const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+      TreeDirectories* directories = nullptr);
+
+ private:
+  bool Fill(size_t size);
+  bool Pump();
+  bool ReadMore();
+  bool ReadRecord(uint8_t& tag, std::vector<uint8_t>& payload);
+
+  std::ifstream file_;
+  EncryptionUtil::MetadataDecryptor decryptor_;
+  ZSTD_DCtx* dctx_ = nullptr;
+  std::vector<uint8_t> compressed_;  // Decrypted, still compressed bytes
+  size_t compressed_offset_ = 0;
+  bool flush_pending_ = false;  // Decompressor may hold more output
+  bool input_done_ = false;
+  std::vector<uint8_t> buffer_;  // Decompressed record bytes
+  size_t offset_ = 0;
+  bool legacy_ = false;
+  nlohmann::json legacy_json_;
+  BackupMetadata header_;
+  TreeStore* trees_;
+  std::optional<TreeRef> root_;
+};
+
+// Decode a whole snapshot into memory
+BackupMetadata ReadSnapshot(const fs::path& path, const std::string& password,
+                            TreeStore* trees = nullptr,
+                            TreeDirectories* directories = nullptr);
+
+// Count file and byte changes between two snapshots by joining their files
+// in path order. Tree snapshots skip every subtree the two have in common,
+// others are sorted through spools on disk, so memory stays bounded.
+SnapshotDiff CompareSnapshots(const fs::path& before, const fs::path& after,
+                              const std::string& password, TreeStore* trees);
+
+// Byte count with a binary unit, like "1.5 MB"
+std::string FormatBytes(uint64_t bytes);
+
+// Comparison of two named snapshots for people and for scripts
+std::string FormatSnapshotDiff(const std::string& before,
+                               const std::string& after,
+                               const SnapshotDiff& diff);
+nlohmann::json SnapshotDiffToJson(const std::string& before,
+                                  const std::string& after,
+                                  const SnapshotDiff& diff);
+
+#endif  // SNAPSHOT_HPP_
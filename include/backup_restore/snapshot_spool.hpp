@@ -0,0 +1,85 @@
+#ifndef SNAPSHOT_SPOOL_HPP_
+#define SNAPSHOT_SPOOL_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+
+namespace fs = std::filesystem;
+
+// File records of a snapshot being written, kept in memory only up to a
+// byte budget. A full buffer is sorted by path and spilled to a run file
+// under dir, and the runs are merged back in path order when the snapshot
+// is built, so memory does not grow with the number of files.
+class SnapshotSpool {
+ public:
+  explicit SnapshotSpool(const fs::path& dir,
+                         uint64_t max_buffer_bytes = 32ULL * 1024 * 1024);
+  ~SnapshotSpool();
+
+  SnapshotSpool(const SnapshotSpool&) = delete;
+  SnapshotSpool& operator=(const SnapshotSpool&) = delete;
+
+  // A file was added or changed, the last record of a path wins
+  void Add(const std::string& file_path, const FileMetadata& file_metadata);
+  // A file was deleted
+  void Remove(const std::string& file_path);
+
+  bool IsEmpty() const { return runs_.empty() && buffer_.empty(); }
+
+  // Visit every recorded path once in path order with its last record,
+  // nullptr for deleted files
+  void Merge(const std::function<void(const std::string&,
+                                      const FileMetadata*)>& visitor);
+
+  // Hands out the records Merge() visits one at a time, so two spools can
+  // be walked side by side. Nothing may be added while it is open.
+  class Reader {
+   public:
+    explicit Reader(SnapshotSpool& spool);
+    ~Reader();
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    bool Valid() const { return valid_; }
+    const std::string& GetPath() const { return path_; }
+    // nullptr for deleted files
+    const FileMetadata* GetFile() const {
+      return removed_ ? nullptr : &file_;
+    }
+    void Next();
+
+   private:
+    struct Runs;
+
+    std::unique_ptr<Runs> runs_;
+    bool valid_ = false;
+    std::string path_;
+    bool removed_ = false;
+    FileMetadata file_;
+  };
+
+ private:
+  struct Record {
+    std::string path;
+    bool removed = false;
+    std::vector<uint8_t> file;  // Encoded file, unless removed
+  };
+
+  void Push(Record record);
+  void Spill();
+
+  fs::path dir_;
+  uint64_t max_buffer_bytes_;
+  uint64_t buffer_bytes_ = 0;
+  std::vector<Record> buffer_;  // In insertion order
+  std::vector<fs::path> runs_;  // Oldest first
+};
+
+#endif  // SNAPSHOT_SPOOL_HPP_
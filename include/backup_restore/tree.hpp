@@ -0,0 +1,173 @@
+#ifndef TREE_HPP_
+#define TREE_HPP_
+
+#include <repositories/all.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "metadata.hpp"
+#include "snapshot_spool.hpp"
+
+namespace fs = std::filesystem;
+
+// A directory node by content address, with totals of the subtree below it
+// so unchanged subtrees can be counted without reading them
+struct TreeRef {
+  std::string hash;
+  uint64_t file_count = 0;
+  uint64_t total_size = 0;
+};
+
+// Nodes of a snapshot by directory key: the directory path with a trailing
+// '/', the root being ""
+using TreeDirectories = std::map<std::string, TreeRef>;
+
+// Files are changed when their content is, told by their chunk digests.
+// Chunk lengths are not kept, so the bytes of a changed file are split
+// between changed and shared at the average chunk size of the file.
+struct SnapshotDiff {
+  size_t changed_files = 0;
+  size_t unchanged_files = 0;
+  size_t added_files = 0;
+  size_t deleted_files = 0;
+
+  uint64_t added_bytes = 0;
+  uint64_t deleted_bytes = 0;
+  uint64_t changed_bytes = 0;  // Content of changed files new to them
+  uint64_t shared_bytes = 0;   // Content the newer snapshot kept
+
+  SnapshotDiff& operator+=(const SnapshotDiff& other);
+};
+
+// Count a path held by both snapshots
+void CompareFiles(const FileMetadata& before, const FileMetadata& after,
+                  SnapshotDiff& diff);
+
+// One decoded entry of a directory node
+struct TreeEntry {
+  std::string name;
+  bool is_directory = false;
+  TreeRef subtree;    // Directories only
+  FileMetadata file;  // Files only
+};
+
+// Content-addressed directory nodes under trees/ in the repository. A node
+// is named by the SHA-256 of its encoding and stored compressed and
+// encrypted like snapshot metadata, so a directory that did not change
+// between snapshots is stored once. Nodes are immutable and kept in the
+// local cache after their first use.
+class TreeStore {
+ public:
+  TreeStore(Repository* repo, const fs::path& cache_dir);
+  ~TreeStore();
+
+  // Store an encoded node and return its hash, nodes this store uploaded
+  // before are not uploaded again
+  std::string Put(const std::vector<uint8_t>& node);
+  // Make nodes stored since the last call durable, must happen before a
+  // snapshot referencing them is published
+  void Flush();
+
+  std::vector<TreeEntry> Get(const std::string& hash);
+
+  // Visit every file below root one directory at a time, or only those
+  // below a directory key, optionally collecting the node of each directory
+  // on the way
+  void ReadFiles(
+      const TreeRef& root,
+      const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+      TreeDirectories* directories = nullptr,
+      const std::string& directory_key = "");
+
+  // The file at file_path below root, reading only the nodes on its way
+  std::optional<FileMetadata> FindFile(const TreeRef& root,
+                                       const std::string& file_path);
+
+  // Compare two snapshots, descending only into subtrees whose hashes
+  // differ. The top levels are opened until there are enough differing
+  // subtrees to compare them on worker threads.
+  SnapshotDiff Diff(const TreeRef& before, const TreeRef& after);
+
+  // Whether file_path lies in a subtree that passed an earlier verification
+  bool IsVerified(const TreeDirectories& directories,
+                  const std::string& file_path);
+  // Remember every subtree of a snapshot that verified cleanly
+  void MarkVerified(const TreeDirectories& directories);
+
+  static std::string GetDirectoryKey(const std::string& file_path);
+  static std::string GetParentKey(const std::string& directory_key);
+
+ private:
+  fs::path GetCachePath(const std::string& hash) const;
+  std::shared_ptr<const std::vector<TreeEntry>> GetDecoded(
+      const std::string& hash);
+  void ReadDirectory(
+      const TreeRef& ref, const std::string& key,
+      const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+      TreeDirectories* directories);
+  // Differing subdirectories go to deeper when given, else are descended
+  void DiffDirectory(const TreeRef& before, const TreeRef& after,
+                     SnapshotDiff& diff,
+                     std::vector<std::pair<TreeRef, TreeRef>>* deeper);
+  void LoadVerified();
+
+  Repository* repo_;
+  fs::path cache_dir_;
+  fs::path staging_dir_;
+  std::map<std::string, fs::path> pending_;  // Uploaded, not yet flushed
+  std::set<std::string> stored_;             // Uploaded and flushed
+  std::set<std::string> verified_;
+  bool verified_loaded_ = false;
+
+  // Recently decoded nodes, most recently used first
+  using DecodedNode =
+      std::pair<std::string, std::shared_ptr<const std::vector<TreeEntry>>>;
+  std::list<DecodedNode> decoded_;
+  std::unordered_map<std::string, std::list<DecodedNode>::iterator>
+      decoded_index_;
+};
+
+// Applies the file changes of a snapshot to the directory nodes of its base.
+// Changes arrive in path order, so only the directories on the way to the
+// current change are open; subtrees without changes are referenced as they
+// are instead of being read or encoded again.
+class TreeBuilder {
+ public:
+  explicit TreeBuilder(TreeStore* store) : store_(store) {}
+
+  // The base is empty for a full snapshot
+  TreeRef Build(const std::optional<TreeRef>& base, SnapshotSpool& changes);
+
+ private:
+  struct PendingEntry {
+    bool is_directory = false;
+    TreeRef subtree;            // Directories only
+    std::vector<uint8_t> file;  // Encoded file, files only
+    uint64_t total_size = 0;
+  };
+
+  // A directory on the path to the current change, its node not yet written
+  struct OpenDirectory {
+    std::string key;
+    std::map<std::string, PendingEntry> entries;  // By name
+  };
+
+  std::map<std::string, PendingEntry> ReadEntries(const TreeRef& ref);
+  TreeRef WriteDirectory(const OpenDirectory& directory);
+  void CloseDirectory(std::vector<OpenDirectory>& open);
+
+  TreeStore* store_;
+};
+
+#endif  // TREE_HPP_
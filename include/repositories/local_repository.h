@@ -1,7 +1,9 @@
 #ifndef LOCAL_REPOSITORY_H_
 #define LOCAL_REPOSITORY_H_
 
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <vector>
 
 #include "repository.h"
 
@@ -10,7 +12,7 @@ class LocalRepository : public Repository {
   LocalRepository();
   LocalRepository(const std::string& path, const std::string& name,
                   const std::string& password, const std::string& created_at);
-  ~LocalRepository() override {}
+  ~LocalRepository() override;
 
   bool Exists() const override;
   void Initialize() override;
@@ -31,10 +33,29 @@ class LocalRepository : public Repository {
   bool DownloadDirectory(const std::string& local_dir,
                          const std::string& local_path) const override;
 
+  void Flush() const override;
+
  private:
+  // An upload written to an unnamed (O_TMPFILE) or temporary file that is
+  // published under its final name on the next group commit
+  struct StagedFile {
+    int fd = -1;             // Open O_TMPFILE descriptor, -1 if named
+    std::string temp_path;   // Named temporary file, empty for O_TMPFILE
+    std::string final_path;
+  };
+
   bool LocalDirectoryExists() const;
   void CreateLocalDirectory() const;
   void RemoveLocalDirectory() const;
+
+  void StageFile(const std::string& source_file,
+                 const std::string& final_path) const;
+  void CommitStagedFiles() const;
+
+  mutable std::mutex staging_mutex_;
+  mutable std::vector<StagedFile> staged_files_;
+  mutable size_t staged_bytes_ = 0;
+  mutable size_t staged_counter_ = 0;
 };
 
 #endif  // LOCAL_REPOSITORY_H_
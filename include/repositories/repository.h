@@ -23,6 +23,8 @@ class Repository {
   std::string GetPassword() const;
 
   std::string GetHashedPassword() const;
+  // Local cache of what the client has read from this repository
+  std::string GetCachePath() const;
   std::string GetRepositoryInfoString() const;
 
   static std::string GetRepositoryInfoString(const std::string &name,
@@ -44,12 +46,21 @@ class Repository {
                           const std::string &destination_path) const = 0;
   virtual bool UploadDirectory(const std::string &source_dir,
                                const std::string &destination_path) const = 0;
+  // False if the repository has no such file, throws on other failures
   virtual bool DownloadFile(const std::string &source_file,
                             const std::string &destination_path) const = 0;
   virtual bool DownloadDirectory(const std::string &source_dir,
                                  const std::string &destination_path) const = 0;
 
+  // Makes every previously uploaded file durable and visible. Backends that
+  // batch their writes override this; the rest write through immediately.
+  virtual void Flush() const {}
+
  protected:
+  // The cache describes a repository that is gone once it is deleted or
+  // created anew at the same location
+  void RemoveCache() const;
+
   std::string name_;
   std::string path_;
   std::string password_;
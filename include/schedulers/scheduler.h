@@ -5,14 +5,19 @@
 #include <netinet/in.h>
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <string>
 #include "repositories/all.h"
+#include "backup_restore/change_journal.hpp"
 #include <atomic>
 
 class Scheduler {
  public:
-  Scheduler();
+  // With track_changes, incremental schedules keep a change journal of
+  // their source and back up only the paths in it
+  explicit Scheduler(bool track_changes = false);
   void Run();
   void RequestShutdown();
   
@@ -20,6 +25,12 @@ class Scheduler {
   libcron::Cron<> cron;
   std::map<std::string, std::string> schedules;
   std::map<std::string, Repository*> repo_data;
+  // Shared with the scheduled backups using them, so removing a schedule
+  // leaves a running backup its journal
+  std::map<std::string, std::shared_ptr<ChangeJournal>> change_journals;
+  // Guards change_journals between the request and cron threads
+  std::mutex change_journals_mutex;
+  bool track_changes;
   sockaddr_in address;
   int conn_id = 1;
   std::atomic<bool> running{true};
@@ -27,6 +38,7 @@ class Scheduler {
   std::string AddSchedule(nlohmann::json reqBody);
   std::string ViewSchedules();
   std::string RemoveSchedule(nlohmann::json reqBody);
+  std::string UpdateThrottle(nlohmann::json reqBody);
 
   // Utility functions
   std::string GenerateScheduleName(std::string schedule_id);
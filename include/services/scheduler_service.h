@@ -30,6 +30,7 @@ class SchedulerService : public Service {
         void AddSchedule();
         void RemoveSchedule();
         void ViewSchedules();
+        void ThrottleTransfers();
         
         SchedulerRequestManager *request_mgr;
         RepositoryService *repo_service;
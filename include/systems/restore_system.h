@@ -15,6 +15,7 @@ class RestoreSystem : public System {
  private:
   void RestoreFromBackup();
   void VerifyBackup();
+  void SearchFileHistory();
 
   RepositoryService* repo_service_;
   Repository* repository_;
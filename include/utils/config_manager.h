@@ -0,0 +1,34 @@
+#ifndef CONFIG_MANAGER_H_
+#define CONFIG_MANAGER_H_
+
+#include <nlohmann/json.hpp>
+#include <string>
+
+// Application wide settings kept in the app data directory
+class ConfigManager {
+ public:
+  ConfigManager();
+  bool Load();
+  bool Save();
+
+  template <typename T>
+  T Get(const std::string& key, const T& fallback) const {
+    auto it = config_.find(key);
+    if (it == config_.end()) return fallback;
+    try {
+      return it->get<T>();
+    } catch (const nlohmann::json::exception&) {
+      return fallback;
+    }
+  }
+
+  void Set(const std::string& key, const nlohmann::json& value);
+
+ private:
+  nlohmann::json config_;
+  std::string config_file_;
+
+  void EnsureConfigFileExists();
+};
+
+#endif  // CONFIG_MANAGER_H_
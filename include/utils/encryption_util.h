@@ -1,6 +1,8 @@
 #ifndef ENCRYPTION_UTIL_H
 #define ENCRYPTION_UTIL_H
 
+#include <openssl/evp.h>
+
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -12,6 +14,43 @@ namespace EncryptionUtil {
     bool IsEncrypted(const std::vector<uint8_t>& data);
     bool IsEncrypted(const std::string& data);
 
+    // Incremental EncryptMetadata for data too large to hold at once,
+    // producing the same container. Errors are thrown.
+    class MetadataEncryptor {
+        public:
+            explicit MetadataEncryptor(const std::string& password);
+            ~MetadataEncryptor();
+            MetadataEncryptor(const MetadataEncryptor&) = delete;
+            MetadataEncryptor& operator=(const MetadataEncryptor&) = delete;
+
+            std::vector<uint8_t> Update(const uint8_t* data, size_t size);
+            std::vector<uint8_t> Final();
+
+        private:
+            EVP_CIPHER_CTX* ctx_ = nullptr;  // Null when the password is empty
+            std::vector<uint8_t> header_;    // Magic, salt and IV not yet emitted
+    };
+
+    // Incremental DecryptMetadata, passing unencrypted data through as is
+    class MetadataDecryptor {
+        public:
+            explicit MetadataDecryptor(const std::string& password);
+            ~MetadataDecryptor();
+            MetadataDecryptor(const MetadataDecryptor&) = delete;
+            MetadataDecryptor& operator=(const MetadataDecryptor&) = delete;
+
+            std::vector<uint8_t> Update(const uint8_t* data, size_t size);
+            std::vector<uint8_t> Final();
+
+        private:
+            std::vector<uint8_t> Decrypt(const uint8_t* data, size_t size);
+
+            std::string password_;
+            EVP_CIPHER_CTX* ctx_ = nullptr;
+            bool passthrough_ = false;
+            std::vector<uint8_t> header_;  // Input held until the header is complete
+    };
+
 } // namespace MetadataEncryption
 
 #endif // ENCRYPTION_UTIL_H 
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef RATE_LIMITER_H_
+#define RATE_LIMITER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+// Limits applied between two local times of day, "HH:MM" in the config.
+// A window whose end is before its start wraps past midnight.
+struct ThrottleProfile {
+  int start_minute = 0;
+  int end_minute = 0;
+  uint64_t bytes_per_second = 0;  // 0 means unlimited
+  uint64_t ops_per_second = 0;
+  uint64_t read_bytes_per_second = 0;
+};
+
+// Process wide token buckets shared by every repository transfer and source
+// read. An operation is one file transfer or source file open. Bytes moved
+// to or from the repository and bytes read from the source are charged to
+// separate buckets, so a file is not charged twice and content the
+// repository already has costs no transfer bandwidth.
+class RateLimiter {
+ public:
+  static RateLimiter& Instance();
+
+  // Block until the caller may continue after using these resources
+  void AcquireBytes(uint64_t bytes);
+  void AcquireReadBytes(uint64_t bytes);
+  void AcquireOp();
+
+  // Limits used outside of every profile window
+  void SetLimits(uint64_t bytes_per_second, uint64_t ops_per_second,
+                 uint64_t read_bytes_per_second = 0);
+  void SetProfiles(const std::vector<ThrottleProfile>& profiles);
+
+  // Settings in the same layout as the `throttle` config key
+  void Configure(const nlohmann::json& settings);
+  nlohmann::json GetSettings();
+
+ private:
+  struct Bucket {
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last_refill =
+        std::chrono::steady_clock::now();
+  };
+
+  RateLimiter();
+  // The bucket is refilled at the rate `limit` selects
+  void Acquire(Bucket& bucket, uint64_t amount,
+               uint64_t ThrottleProfile::*limit);
+  // Limits of the active profile, or the default ones outside every window
+  ThrottleProfile GetCurrentLimits();
+
+  std::mutex mutex_;
+  ThrottleProfile limits_;  // Default limits, the window is unused
+  std::vector<ThrottleProfile> profiles_;
+  Bucket byte_bucket_;
+  Bucket read_bucket_;
+  Bucket op_bucket_;
+};
+
+#endif  // RATE_LIMITER_H_
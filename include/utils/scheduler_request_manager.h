@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <netinet/in.h>
+#include <nlohmann/json.hpp>
 #include "schedulers/schedule.h"
 #include "backup_restore/backup.hpp"
 #include "repositories/repository.h"
@@ -21,8 +22,12 @@ class SchedulerRequestManager{
             std::string destination_created_at,
             RepositoryType destination_type,
             std::string remarks,
-            BackupType type);
+            BackupType type,
+            int time_budget_minutes = 0,
+            const nlohmann::json& filters = nlohmann::json::object());
         bool SendDeleteRequest(std::string schedule_id);
+        // Apply throttle settings at runtime, an empty object only queries
+        nlohmann::json SendThrottleRequest(const nlohmann::json& settings);
     
     private:
         std::string SendRequest(const char *message);
@@ -1,9 +1,11 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include "utils/config_manager.h"
 #include "utils/error_util.h"
 #include "utils/logger.h"
 #include "utils/prompter.h"
+#include "utils/rate_limiter.h"
 #include "utils/repodata_manager.h"
 #include "utils/setup.h"
 #include "utils/time_util.h"
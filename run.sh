@@ -19,6 +19,9 @@ BUILD_PATH="./build/scheduler"
 ## IMPORTANT - Change this is you want logs to go to sys.log, currenly scheduler logs are a seperate file
 LOG_FILE="/var/log/scheduler.log" 
 
+## Set to "--track-changes" to have incremental schedules back up only the paths the kernel reported changed
+SCHEDULER_ARGS=""
+
 echo "[INFO ] Checking if $SERVICE_NAME is already running..."
 if systemctl is-active --quiet "$SERVICE_NAME"; then
   echo "[INFO ] $SERVICE_NAME is already running. Skipping binary copy."
@@ -45,7 +48,7 @@ Wants=network-online.target
 
 [Service]
 Type=simple
-ExecStart=$EXEC_PATH
+ExecStart=$EXEC_PATH $SCHEDULER_ARGS
 StandardOutput=append:$LOG_FILE
 StandardError=inherit
 Restart=on-failure
@@ -16,41 +16,66 @@
 #include "backup_restore/progress.hpp"
 #include "utils/error_util.h"
 #include "utils/logger.h"
+#include "utils/rate_limiter.h"
 #include "utils/user_io.h"
 #include "utils/encryption_util.h"
 
 namespace fs = std::filesystem;
 
+// Make finished work durable in the journal at least this often
+static const auto CHECKPOINT_INTERVAL = std::chrono::seconds(60);
+static const uint64_t CHECKPOINT_BYTES = 256ULL * 1024 * 1024;
+
 Backup::Backup(Repository* repo, const fs::path& input_path, BackupType type,
                const std::string& remarks, size_t average_chunk_size)
     : input_path_(input_path),
       repo_(repo),
       chunker_(average_chunk_size),
       temp_dir_(fs::temp_directory_path() / ("backup_temp_" + repo->GetName())),
-      backup_type_(type) {
+      backup_type_(type),
+      manifest_(repo),
+      trees_(repo, manifest_.GetCacheDir()),
+      tree_builder_(&trees_),
+      changes_(temp_dir_ / "spool"),
+      history_(repo, manifest_.GetCacheDir()),
+      file_states_(manifest_.GetCacheDir(), input_path, temp_dir_),
+      digests_(repo, manifest_.GetCacheDir()),
+      journal_(repo, input_path) {
   if (!fs::exists(input_path_)) {
     ErrorUtil::ThrowError("Input path does not exist: " + input_path_.string());
   }
+  filter_ = std::make_unique<FileFilter>(input_path_);
 
   // Create necessary directories
 
   fs::create_directories(temp_dir_);
   fs::create_directories(temp_dir_ / "backup");
   fs::create_directories(temp_dir_ / "chunks");
-  const fs::path prev_meta_path = temp_dir_ / "backup";
-  auto fetched_metadata =
-      repo_->DownloadDirectory("backup/", prev_meta_path.string());
-  if (!fetched_metadata) ErrorUtil::ThrowError("Failed to load metadata");
+  manifest_.Load();
+  digests_.Load(manifest_);
 
   // Initialize metadata
   metadata_.type = type;
   metadata_.timestamp = std::chrono::system_clock::now();
   metadata_.remarks = remarks;
 
+  // Pick up an interrupted backup of the same source and type
+  if (journal_.Load()) {
+    const BackupMetadata& journaled = journal_.GetMetadata();
+    if (journaled.type == type &&
+        (type == BackupType::FULL || manifest_.Find(journaled.previous_backup))) {
+      resumed_ = true;
+      metadata_.timestamp = journaled.timestamp;
+      metadata_.remarks = journaled.remarks;
+    }
+  }
+
   // For incremental/differential backups, load previous metadata
   if (type != BackupType::FULL) {
     std::string previous_backup;
-    if (type == BackupType::INCREMENTAL) {
+    if (resumed_) {
+      previous_backup = journal_.GetMetadata().previous_backup;
+    } else if (type == BackupType::INCREMENTAL) {
       previous_backup = GetLatestBackup();
     } else {  // DIFFERENTIAL
       previous_backup = GetLatestFullBackup();
@@ -66,9 +91,15 @@ Backup::Backup(Repository* repo, const fs::path& input_path, BackupType type,
     }
 
     metadata_.previous_backup = previous_backup;
+    LoadPreviousSnapshot(previous_backup);
+    // Full backups read every file again
+    file_states_.Load(manifest_);
+  }
 
-    BackupMetadata prev_metadata = LoadPreviousMetadata(previous_backup);
-    metadata_.files = prev_metadata.files;
+  if (resumed_) {
+    for (const auto& [file_path, file_metadata] : journal_.GetMetadata().files) {
+      changes_.Add(file_path, file_metadata);
+    }
   }
 }
 
@@ -78,92 +109,322 @@ Backup::~Backup() {
   }
 }
 
-void Backup::BackupFile(const fs::path& file_path) {
-  if (CheckFileToSkip(file_path)) {
+void Backup::BackupFile(const ScannedFile& file) {
+  // Another link to an inode this backup already read
+  if (!file.is_symlink && file.links > 1) {
+    auto linked = linked_files_.find({file.device, file.inode});
+    if (linked != linked_files_.end() &&
+        linked->second.total_size == file.size &&
+        linked->second.mtime == file.mtime) {
+      FileMetadata file_metadata = linked->second;
+      file_metadata.original_filename =
+          fs::path(file.path).filename().string();
+      Logger::TerminalLog("Linking " + file.path +
+                          " to an earlier link of its inode");
+      RecordFile(file.path, file_metadata);
+      return;
+    }
+  }
+
+  // The inode still holds what an earlier backup read, maybe at another path
+  auto state = file_states_.Find(file);
+  if (state && state->Matches(file)) {
+    FileMetadata file_metadata = state->file;
+    file_metadata.original_filename = fs::path(file.path).filename().string();
+    file_metadata.permissions = FormatPermissions(file.mode);
+    Logger::TerminalLog("Reusing chunks of unchanged file: " + file.path +
+                        (state->path != file.path ? " (was " + state->path + ")"
+                                                  : ""));
+    RememberLink(file, file_metadata);
+    RecordFile(file.path, file_metadata);
+    file_states_.Record(file, file_metadata);
     return;
   }
 
-  auto file_metadata = CheckFileMetadata(file_path);
+  auto file_metadata = CheckFileMetadata(file);
 
   // For symlinks, we don't need to chunk content, just store the metadata
   if (file_metadata.is_symlink) {
-    Logger::TerminalLog("Backing up symlink: " + file_path.string() + " -> " +
+    Logger::TerminalLog("Backing up symlink: " + file.path + " -> " +
                         file_metadata.symlink_target);
-    metadata_.files[file_path.string()] = file_metadata;
+    RecordFile(file.path, file_metadata);
+    return;
+  }
+
+  // The same content is stored already, maybe under another name
+  if (auto stored = digests_.Find(file_metadata.sha256_checksum,
+                                  file_metadata.total_size)) {
+    file_metadata.chunk_hashes = stored->chunk_hashes;
+    file_metadata.holes = stored->holes;
+    Logger::TerminalLog("Reusing chunks of identical file: " + file.path);
+    RememberLink(file, file_metadata);
+    RecordFile(file.path, file_metadata);
+    file_states_.Record(file, file_metadata);
     return;
   }
 
   ProgressBar progress(file_metadata.total_size, 0,
-                       "Backup of " + file_path.string());
+                       "Backup of " + file.path);
 
+  // Holes count as processed, they are never read
   size_t processed_bytes = 0;
   size_t processed_chunks = 0;
+  for (const auto& hole : file_metadata.holes) {
+    processed_bytes += hole.length;
+  }
 
   // Use streaming chunking
-  chunker_.StreamSplitFile(file_path, [&](const Chunk& chunk) {
-    // Compress the chunk before saving
-    Chunk compressed_chunk = CompressChunk(chunk);
-    file_metadata.chunk_hashes.push_back(compressed_chunk.hash);
-    SaveChunk(compressed_chunk);
+  chunker_.StreamSplitFile(file.path, [&](const Chunk& chunk) {
+    if (Chunker::IsFillHash(chunk.hash)) {
+      // Nothing to store, the hash describes the fill
+      file_metadata.chunk_hashes.push_back(chunk.hash);
+    } else {
+      // Compress the chunk before saving
+      Chunk compressed_chunk = CompressChunk(chunk);
+      file_metadata.chunk_hashes.push_back(compressed_chunk.hash);
+      SaveChunk(compressed_chunk);
+    }
 
     // Update progress
     processed_bytes += chunk.size;
     processed_chunks++;
     progress.Update(processed_bytes, processed_chunks);
-  });
+  }, file_metadata.holes);
 
   progress.Complete();
 
-  metadata_.files[file_path.string()] = file_metadata;
+  RememberLink(file, file_metadata);
+  RecordFile(file.path, file_metadata);
+  file_states_.Record(file, file_metadata);
+  digests_.Add(file_metadata);
+  uncheckpointed_bytes_ += file_metadata.total_size;
+}
+
+void Backup::RecordFile(const std::string& file_path,
+                        const FileMetadata& file_metadata) {
+  changes_.Add(file_path, file_metadata);
+  journal_.RecordFile(file_path, file_metadata);
+}
+
+std::optional<FileMetadata> Backup::FindPrevious(const std::string& file_path) {
+  const FileTable& journaled = journal_.GetMetadata().files;
+  if (resumed_) {
+    auto it = journaled.find(file_path);
+    if (it != journaled.end()) return it->second;
+  }
+  if (base_root_) {
+    return trees_.FindFile(*base_root_, file_path);
+  }
+  auto it = base_files_.find(file_path);
+  if (it != base_files_.end()) return it->second;
+  return std::nullopt;
+}
+
+bool Backup::IsJournaled(const std::string& file_path) const {
+  const FileTable& journaled = journal_.GetMetadata().files;
+  return resumed_ && journaled.find(file_path) != journaled.end();
 }
 
-bool Backup::CheckFileToSkip(const fs::path& file_path) {
-  if (backup_type_ != BackupType::FULL) {
-    auto it = metadata_.files.find(file_path.string());
-    if (it != metadata_.files.end() &&
-        !CheckFileForChanges(file_path, it->second)) {
-      Logger::TerminalLog("Skipping unchanged file: " + file_path.string());
-      return true;
+size_t Backup::RemoveDeletedFiles(SnapshotSpool& scanned,
+                                  const std::string& directory_key) {
+  // Every file the base or the interrupted run holds, sorted like the scan
+  // so the two are compared in one pass. Only the paths matter.
+  SnapshotSpool known(temp_dir_ / "known");
+  auto is_below = [&directory_key](const std::string& file_path) {
+    return file_path.compare(0, directory_key.size(), directory_key) == 0;
+  };
+  if (base_root_) {
+    trees_.ReadFiles(
+        *base_root_,
+        [&known](const std::string& file_path, FileMetadata&&) {
+          known.Add(file_path, FileMetadata{});
+        },
+        nullptr, directory_key);
+  } else {
+    for (auto it = base_files_.lower_bound(directory_key);
+         it != base_files_.end() && is_below(it.GetPath()); ++it) {
+      known.Add(it.GetPath(), FileMetadata{});
+    }
+  }
+  if (resumed_) {
+    const FileTable& journaled = journal_.GetMetadata().files;
+    for (auto it = journaled.lower_bound(directory_key);
+         it != journaled.end() && is_below(it.GetPath()); ++it) {
+      known.Add(it.GetPath(), FileMetadata{});
     }
   }
-  return false;
+
+  size_t deleted_files = 0;
+  SnapshotSpool::Reader known_it(known);
+  SnapshotSpool::Reader scanned_it(scanned);
+  for (; known_it.Valid(); known_it.Next()) {
+    while (scanned_it.Valid() && scanned_it.GetPath() < known_it.GetPath()) {
+      scanned_it.Next();
+    }
+    if (!scanned_it.Valid() || scanned_it.GetPath() != known_it.GetPath()) {
+      deleted_files++;
+      changes_.Remove(known_it.GetPath());
+    }
+  }
+  return deleted_files;
 }
 
-FileMetadata Backup::CheckFileMetadata(const fs::path& file_path) {
-  FileMetadata metadata;
-  metadata.original_filename = file_path.filename().string();
+bool Backup::BackupChangedPaths(
+    const fs::path& changed_paths,
+    const std::function<bool(const ScannedFile&)>& visit,
+    size_t& deleted_files) {
+  // In path order and once each, however often a path changed
+  SnapshotSpool changed(temp_dir_ / "changed");
+  ChangeJournal::ReadPaths(changed_paths, [&changed](const std::string& path) {
+    // An edited ignore file may change what its whole directory holds
+    fs::path changed_path(path);
+    if (changed_path.filename() == FileFilter::IGNORE_FILE_NAME) {
+      changed.Add(changed_path.parent_path().string(), FileMetadata{});
+    } else {
+      changed.Add(path, FileMetadata{});
+    }
+  });
+
+  // Directories scanned or dropped as a whole, paths below them are done
+  std::set<std::string> covered_directories;
+  for (SnapshotSpool::Reader it(changed); it.Valid(); it.Next()) {
+    const std::string& path = it.GetPath();
+    bool covered = false;
+    for (std::string key = TreeStore::GetDirectoryKey(path);
+         !key.empty() && !covered; key = TreeStore::GetParentKey(key)) {
+      covered = covered_directories.count(key) > 0;
+    }
+    if (covered) continue;
+
+    std::string directory_key = path.back() == '/' ? path : path + "/";
+    covered_directories.insert(directory_key);
+    std::error_code ec;
+    fs::file_status status = fs::symlink_status(path, ec);
+    bool is_directory = fs::is_directory(status);
+    // What the filter leaves out is handled as if it were gone
+    auto scope = filter_->FindScope(fs::path(path).parent_path().string());
+    bool excluded = !scope || filter_->ExcludesPath(scope, path, is_directory);
+    if (is_directory && !excluded) {
+      // Created, moved here or replaced, nothing tells what it holds
+      if (FindPrevious(path)) {
+        deleted_files++;
+        changes_.Remove(path);
+      }
+      SnapshotSpool scanned(temp_dir_ / "scanned");
+      DirectoryScanner scanner(path, filter_.get());
+      ScannedFile file;
+      while (scanner.Next(file)) {
+        scanned.Add(file.path, FileMetadata{});
+        if (!visit(file)) return false;
+      }
+      deleted_files += RemoveDeletedFiles(scanned, directory_key);
+      continue;
+    }
 
-  // Get file permissions
-  metadata.permissions = GetFilePermissions(file_path);
+    // Whatever a directory of the base held here is gone
+    SnapshotSpool none(temp_dir_ / "removed");
+    deleted_files += RemoveDeletedFiles(none, directory_key);
+
+    std::optional<ScannedFile> file;
+    if (!excluded) file = DirectoryScanner::Stat(path);
+    if (file && filter_->IsWithinLimits(*file)) {
+      if (!visit(*file)) return false;
+    } else if (FindPrevious(path)) {
+      deleted_files++;
+      changes_.Remove(path);
+    }
+  }
+  return true;
+}
+
+FileMetadata Backup::CheckFileMetadata(const ScannedFile& file) {
+  FileMetadata metadata;
+  metadata.original_filename = fs::path(file.path).filename().string();
 
   // Check if it's a symlink
-  if (fs::is_symlink(file_path)) {
+  if (file.is_symlink) {
+    // Symlinks keep the permissions and time of their target
+    metadata.permissions = GetFilePermissions(file.path);
     metadata.is_symlink = true;
-    metadata.symlink_target = fs::read_symlink(file_path).string();
+    metadata.symlink_target = fs::read_symlink(file.path).string();
     // For symlinks, we don't need to chunk the content, just store the target
     metadata.total_size = 0;
-    metadata.mtime = fs::last_write_time(file_path);
+    metadata.mtime = fs::last_write_time(file.path);
     metadata.sha256_checksum = ""; // Symlinks don't have content checksum
   } else {
+    metadata.permissions = FormatPermissions(file.mode);
     metadata.is_symlink = false;
-    metadata.total_size = fs::file_size(file_path);
-    metadata.mtime = fs::last_write_time(file_path);
+    metadata.total_size = file.size;
+    metadata.mtime = file.mtime;
+    // Only a file with fewer bytes allocated than its size can have holes
+    if (file.allocated < file.size) {
+      metadata.holes = Chunker::FindHoles(file.path);
+    }
     // Calculate SHA256 checksum for regular files
-    metadata.sha256_checksum = CalculateFileSHA256(file_path);
+    metadata.sha256_checksum = CalculateFileSHA256(file.path, metadata.holes);
   }
 
   return metadata;
 }
 
-void Backup::ProcessChunk(const Chunk& chunk, FileMetadata& file_metadata,
-                          ProgressBar& progress) {
-  // Compress the chunk before saving
-  Chunk compressed_chunk = CompressChunk(chunk);
-  file_metadata.chunk_hashes.push_back(compressed_chunk.hash);
-  SaveChunk(compressed_chunk);
+void Backup::RememberLink(const ScannedFile& file,
+                          FileMetadata& file_metadata) {
+  // Groups of an earlier snapshot may name a path that is gone
+  file_metadata.link_group.clear();
+  if (file.is_symlink || file.links < 2) return;
+  // Named after this backup too, so a group carried over unchanged from an
+  // earlier snapshot never merges with one formed now
+  file_metadata.link_group =
+      std::to_string(metadata_.timestamp.time_since_epoch().count()) + ":" +
+      file.path;
+  linked_files_[{file.device, file.inode}] = file_metadata;
+}
+
+void Backup::SetTimeBudget(std::chrono::seconds budget) {
+  time_budget_ = budget;
+}
+
+void Backup::SetChangeJournal(ChangeJournal* change_journal) {
+  change_journal_ = change_journal;
+}
+
+void Backup::SetFilter(const nlohmann::json& settings) {
+  filter_ = std::make_unique<FileFilter>(input_path_, settings);
+}
+
+void Backup::Checkpoint() {
+  // Journal records must never point at chunks the repository could lose
+  repo_->Flush();
+  journal_.Commit();
+  last_checkpoint_ = std::chrono::steady_clock::now();
+  uncheckpointed_bytes_ = 0;
+}
+
+void Backup::BeginJournal() {
+  if (resumed_) {
+    Logger::TerminalLog("Resuming interrupted backup, " +
+                        std::to_string(journal_.GetMetadata().files.size()) +
+                        " files already done");
+  } else {
+    journal_.Begin(metadata_);
+  }
+  last_checkpoint_ = std::chrono::steady_clock::now();
+}
+
+void Backup::CheckpointIfDue() {
+  if (std::chrono::steady_clock::now() - last_checkpoint_ >=
+          CHECKPOINT_INTERVAL ||
+      uncheckpointed_bytes_ >= CHECKPOINT_BYTES) {
+    Checkpoint();
+  }
+}
 
-  // Update progress
-  progress.Update(chunk.size, file_metadata.chunk_hashes.size());
+std::string Backup::CompleteBackup() {
+  std::string backup_name = SaveMetadata();
+  if (change_journal_) change_journal_->Commit(backup_name);
+  journal_.Remove();
+  complete_ = true;
+  return backup_name;
 }
 
 void Backup::BackupDirectory() {
@@ -171,39 +432,88 @@ void Backup::BackupDirectory() {
   size_t unchanged_files = 0;
   size_t added_files = 0;
   size_t deleted_files = 0;
+  size_t resumed_files = 0;
+  bool out_of_time = false;
+  complete_ = false;
+
+  BeginJournal();
+  auto started = last_checkpoint_;
+
+  // Paths changed since the base snapshot, if the change journal has them
+  std::optional<fs::path> changed_paths;
+  if (change_journal_) {
+    // Older snapshots without a tree are scanned in full
+    bool has_base = backup_type_ != BackupType::FULL && base_root_;
+    changed_paths =
+        change_journal_->Cut(has_base ? metadata_.previous_backup : "");
+    if (changed_paths) {
+      Logger::TerminalLog("Backing up the paths changed since " +
+                          metadata_.previous_backup);
+    } else if (backup_type_ != BackupType::FULL) {
+      Logger::TerminalLog("Change journal does not cover " +
+                          metadata_.previous_backup +
+                          ", scanning the whole source");
+    }
+  }
 
-  // Track files in current backup
-  std::set<std::string> current_files;
+  // Back up a file unless it is unchanged, false once out of time
+  auto visit = [&](const ScannedFile& file) {
+    auto previous = FindPrevious(file.path);
+    if (!previous) {
+      added_files++;
+      BackupFile(file);
+    } else if (CheckFileForChanges(file, *previous)) {
+      changed_files++;
+      BackupFile(file);
+    } else if (IsJournaled(file.path)) {
+      resumed_files++;
+      file_states_.Record(file, *previous);
+    } else {
+      unchanged_files++;
+      file_states_.Record(file, *previous);
+    }
 
-  // First, check for deleted files
+    CheckpointIfDue();
+    return time_budget_.count() == 0 ||
+           std::chrono::steady_clock::now() - started < time_budget_;
+  };
 
-  for (auto it = metadata_.files.begin(); it != metadata_.files.end();) {
-    if (!fs::exists(it->first)) {
-      deleted_files++;
-      it = metadata_.files.erase(it);  // erase returns the next valid iterator
+  try {
+    if (changed_paths) {
+      out_of_time = !BackupChangedPaths(*changed_paths, visit, deleted_files);
     } else {
-      ++it;
+      // Paths seen by the scan, deleted files are those it did not see
+      SnapshotSpool scanned(temp_dir_ / "scanned");
+      DirectoryScanner scanner(input_path_, filter_.get());
+      ScannedFile file;
+      while (scanner.Next(file)) {
+        scanned.Add(file.path, FileMetadata{});
+        if (!visit(file)) {
+          out_of_time = true;
+          break;
+        }
+      }
+      // Only a finished scan tells which files are gone
+      if (!out_of_time) deleted_files = RemoveDeletedFiles(scanned);
+    }
+  } catch (...) {
+    if (change_journal_) change_journal_->Abort();
+    // Keep what was uploaded so the next run can resume from here
+    try {
+      Checkpoint();
+    } catch (const std::exception& e) {
+      ErrorUtil::LogException(e, "Could not checkpoint backup progress");
     }
+    throw;
   }
 
-  // Then process existing files
-  for (const auto& entry : fs::recursive_directory_iterator(input_path_)) {
-    // Handle both regular files and symlinks (both file and directory symlinks)
-    if (entry.is_regular_file() || fs::is_symlink(entry.path())) {
-      std::string file_path = entry.path().string();
-      current_files.insert(file_path);
-
-      auto it = metadata_.files.find(file_path);
-      if (it == metadata_.files.end()) {
-        added_files++;
-        BackupFile(entry.path());
-      } else if (CheckFileForChanges(entry.path(), it->second)) {
-        changed_files++;
-        BackupFile(entry.path());
-      } else {
-        unchanged_files++;
-      }
-    }
+  if (out_of_time) {
+    if (change_journal_) change_journal_->Abort();
+    Checkpoint();
+    Logger::TerminalLog(
+        "Backup time budget used up, the next run will resume this backup",
+        LogLevel::WARNING);
+    return;
   }
 
   std::ostringstream summary;
@@ -211,61 +521,71 @@ void Backup::BackupDirectory() {
           << "\n - Changed files: " << changed_files
           << "\n - Unchanged files: " << unchanged_files
           << "\n - Added files: " << added_files
-          << "\n - Deleted files: " << deleted_files << std::endl;
+          << "\n - Deleted files: " << deleted_files;
+  if (resumed_files > 0) {
+    summary << "\n - Resumed files: " << resumed_files;
+  }
+  summary << std::endl;
   Logger::TerminalLog(summary.str());
 
-  SaveMetadata();
+  CompleteBackup();
 }
 
-void Backup::SaveMetadata() {
+std::string Backup::SaveMetadata() {
   // Generate backup name from timestamp
   auto time = std::chrono::system_clock::to_time_t(metadata_.timestamp);
   std::stringstream ss;
   ss << std::put_time(std::localtime(&time), "%Y%m%d_%H%M%S");
   std::string backup_name = ss.str();
 
-  // Convert metadata to JSON
-  nlohmann::json metadata_json;
-  metadata_json["type"] = static_cast<int>(metadata_.type);
-  metadata_json["timestamp"] =
-      std::chrono::system_clock::to_time_t(metadata_.timestamp);
-  metadata_json["previous_backup"] = metadata_.previous_backup;
-  metadata_json["remarks"] = metadata_.remarks;
-
-  nlohmann::json files_json;
-  for (const auto& [file_path, file_metadata] : metadata_.files) {
-    nlohmann::json file_json;
-    file_json["original_filename"] = file_metadata.original_filename;
-    file_json["chunk_hashes"] = file_metadata.chunk_hashes;
-    file_json["total_size"] = file_metadata.total_size;
-    file_json["is_symlink"] = file_metadata.is_symlink;
-    file_json["permissions"] = file_metadata.permissions;
-    file_json["sha256_checksum"] = file_metadata.sha256_checksum;
-    if (file_metadata.is_symlink) {
-      file_json["symlink_target"] = file_metadata.symlink_target;
-    }
-
-    // Convert file times to seconds since epoch
-    auto mtime_seconds = std::chrono::duration_cast<std::chrono::seconds>(
-                             file_metadata.mtime.time_since_epoch())
-                             .count();
-
-    file_json["mtime"] = mtime_seconds;
-    files_json[file_path] = file_json;
+  fs::path local_meta_path = temp_dir_ / "backup" / backup_name;
+  SnapshotFormat format = SnapshotWriter::GetConfiguredFormat();
+  SnapshotWriter writer(local_meta_path, repo_->GetPassword(), format);
+  writer.WriteHeader(metadata_);
+  // Only directories that changed since the base snapshot are encoded,
+  // unchanged nodes are already in the repository
+  TreeRef root = tree_builder_.Build(base_root_, changes_);
+  if (format == SnapshotFormat::BINARY) {
+    writer.WriteRoot(root);
+  } else {
+    trees_.ReadFiles(root, [&writer](const std::string& file_path,
+                                     FileMetadata&& file_metadata) {
+      writer.WriteFile(file_path, file_metadata);
+    });
+  }
+  writer.Finish();
+  history_.AddSnapshot(backup_name, backup_type_ == BackupType::FULL,
+                       changes_);
+  // Without its segment the next backups only miss the files it added
+  try {
+    digests_.AddSnapshot(backup_name);
+  } catch (const std::exception& e) {
+    ErrorUtil::LogException(e, "Could not publish file digests of " +
+                                   backup_name);
   }
-  metadata_json["files"] = files_json;
 
-  // Encrypt metadata using repository password
-  std::string json_string = metadata_json.dump(4);
-  std::vector<uint8_t> encrypted_data = EncryptionUtil::EncryptMetadata(json_string, repo_->GetPassword());
-  
-  // Save metadata
-  fs::path local_meta_path = temp_dir_ / "backup" / backup_name;
-  std::ofstream metadata_file(local_meta_path, std::ios::binary);
-  metadata_file.write(reinterpret_cast<const char*>(encrypted_data.data()), encrypted_data.size());
-  metadata_file.close();
+  // Chunks and tree nodes must be durable before the snapshot that
+  // references them
+  trees_.Flush();
 
   repo_->UploadFile(local_meta_path.string(), "backup/");
+  repo_->Flush();
+
+  ManifestEntry entry;
+  entry.name = backup_name;
+  entry.type = metadata_.type;
+  entry.timestamp = metadata_.timestamp;
+  entry.previous_backup = metadata_.previous_backup;
+  entry.remarks = metadata_.remarks;
+  entry.file_count = root.file_count;
+  entry.total_size = root.total_size;
+  entry.new_bytes = journal_.GetChunkBytes();
+  entry.metadata_size = fs::file_size(local_meta_path);
+  entry.metadata_digest = Manifest::CalculateDigest(local_meta_path);
+  manifest_.Add(entry, local_meta_path);
+
+  file_states_.Commit(backup_name);
+  return backup_name;
 }
 
 std::string Backup::GenerateChunkFilename(const std::string& hash) {
@@ -320,119 +640,58 @@ Chunk Backup::CompressChunk(const Chunk& original_chunk) {
 }
 
 void Backup::SaveChunk(const Chunk& chunk) {
+  // Already uploaded by this backup or by the run it resumes
+  if (journal_.HasChunk(chunk.hash)) {
+    return;
+  }
+
   fs::path chunk_path =
       temp_dir_ / "chunks" / GenerateChunkFilename(chunk.hash);
 
-  if (!fs::exists(chunk_path)) {
-    std::ofstream chunk_file(chunk_path, std::ios::binary);
-    if (!chunk_file) {
-      ErrorUtil::ThrowError("Could not create chunk file: " +
-                            chunk_path.string());
-    }
-    chunk_file.write(reinterpret_cast<const char*>(chunk.data.data()),
-                     chunk.data.size());
-    chunk_file.close();
-    const fs::path repo_target = "chunks/" + chunk.hash.substr(0, 2) + "/";
-    repo_->UploadFile(chunk_path.string(), repo_target.string());
+  std::ofstream chunk_file(chunk_path, std::ios::binary);
+  if (!chunk_file) {
+    ErrorUtil::ThrowError("Could not create chunk file: " +
+                          chunk_path.string());
   }
+  chunk_file.write(reinterpret_cast<const char*>(chunk.data.data()),
+                   chunk.data.size());
+  chunk_file.close();
+  const fs::path repo_target = "chunks/" + chunk.hash.substr(0, 2) + "/";
+  repo_->UploadFile(chunk_path.string(), repo_target.string());
+  journal_.RecordChunk(chunk.hash, chunk.data.size());
+  fs::remove(chunk_path);
 }
 
-BackupMetadata Backup::LoadPreviousMetadata(const std::string& backup_name) {
-  fs::path metadata_path = temp_dir_ / "backup" / backup_name;
-  if (!fs::exists(metadata_path)) {
+void Backup::LoadPreviousSnapshot(const std::string& backup_name) {
+  if (!manifest_.Find(backup_name)) {
     ErrorUtil::ThrowError("Previous backup metadata not found: " +
-                          metadata_path.string());
-  }
-
-  std::ifstream metadata_file(metadata_path, std::ios::binary);
-  if (!metadata_file) {
-    ErrorUtil::ThrowError("Could not open metadata file: " + metadata_path.string());
-  }
-
-  // Read encrypted data
-  std::vector<uint8_t> encrypted_data(
-    (std::istreambuf_iterator<char>(metadata_file)),
-    std::istreambuf_iterator<char>()
-  );
-  metadata_file.close();
-
-  // Decrypt metadata using repository password
-  std::string json_string = EncryptionUtil::DecryptMetadata(encrypted_data, repo_->GetPassword());
-  if (json_string.empty()) {
-    ErrorUtil::ThrowError("Failed to decrypt metadata: " + backup_name);
-  }
-
-  nlohmann::json metadata_json = nlohmann::json::parse(json_string);
-
-  BackupMetadata metadata;
-  metadata.type = static_cast<BackupType>(metadata_json["type"].get<int>());
-  metadata.timestamp = std::chrono::system_clock::from_time_t(
-      metadata_json["timestamp"].get<time_t>());
-  metadata.previous_backup =
-      metadata_json["previous_backup"].get<std::string>();
-  metadata.remarks = metadata_json.value("remarks", "");
-
-  for (const auto& [file_path, file_json] : metadata_json["files"].items()) {
-    FileMetadata file_metadata;
-    file_metadata.original_filename = file_json["original_filename"];
-    file_metadata.chunk_hashes =
-        file_json["chunk_hashes"].get<std::vector<std::string>>();
-    file_metadata.total_size = file_json["total_size"];
-    file_metadata.mtime = fs::file_time_type(
-        std::chrono::duration_cast<fs::file_time_type::duration>(
-            std::chrono::seconds(file_json["mtime"].get<time_t>())));
-
-    // Load symlink information (with backward compatibility)
-    file_metadata.is_symlink = file_json.value("is_symlink", false);
-    if (file_metadata.is_symlink) {
-      file_metadata.symlink_target = file_json["symlink_target"];
-    }
-
-    // Load new fields with backward compatibility
-    file_metadata.permissions = file_json.value("permissions", "");
-    file_metadata.sha256_checksum = file_json.value("sha256_checksum", "");
-
-    metadata.files[file_path] = file_metadata;
+                          backup_name);
+  }
+  fs::path metadata_path = manifest_.FetchMetadata(backup_name);
+  SnapshotReader reader(metadata_path, repo_->GetPassword(), &trees_);
+  if (reader.GetRoot()) {
+    // Files are looked up in the tree as the walk reaches them
+    base_root_ = reader.GetRoot();
+    return;
   }
 
-  return metadata;
+  // Older snapshots list their files, which all go into the new tree
+  reader.ReadFiles(
+      [this](const std::string& file_path, FileMetadata&& file_metadata) {
+        changes_.Add(file_path, file_metadata);
+        base_files_.insert_or_assign(file_path, std::move(file_metadata));
+      });
 }
 
 std::string Backup::GetLatestBackup() {
   auto backups = ListBackups();
-  Logger::TerminalLog("Getting latest backup from " + temp_dir_.string());
   return backups.empty() ? "" : backups[0];
 }
 
 std::string Backup::GetLatestFullBackup() {
-  auto backups = ListBackups();
-  for (auto it = backups.begin(); it != backups.end(); ++it) {
-    fs::path metadata_path = temp_dir_ / "backup" / *it;
-    std::ifstream metadata_file(metadata_path, std::ios::binary);
-    if (!metadata_file) {
-      continue;
-    }
-
-    // Read encrypted data
-    std::vector<uint8_t> encrypted_data(
-      (std::istreambuf_iterator<char>(metadata_file)),
-      std::istreambuf_iterator<char>()
-    );
-    metadata_file.close();
-
-    // Decrypt metadata using repository password
-    std::string json_string = EncryptionUtil::DecryptMetadata(encrypted_data, repo_->GetPassword());
-    if (json_string.empty()) {
-      continue; // Skip corrupted metadata
-    }
-
-    try {
-      nlohmann::json metadata_json = nlohmann::json::parse(json_string);
-      if (static_cast<BackupType>(metadata_json["type"].get<int>()) == BackupType::FULL) {
-        return *it;
-      }
-    } catch (...) {
-      continue; // Skip invalid JSON
+  for (const auto& entry : manifest_.GetEntries()) {
+    if (entry.type == BackupType::FULL) {
+      return entry.name;
     }
   }
   return "";
@@ -440,70 +699,52 @@ std::string Backup::GetLatestFullBackup() {
 
 std::vector<std::string> Backup::ListBackups() {
   std::vector<std::string> backups;
-  for (const auto& entry : fs::directory_iterator(temp_dir_ / "backup")) {
-    if (entry.is_regular_file()) {
-      backups.push_back(entry.path().filename().string());
-    }
+  // Manifest entries are already in descending order
+  for (const auto& entry : manifest_.GetEntries()) {
+    backups.push_back(entry.name);
   }
-
-  // Return backups in descending order
-  std::sort(backups.rbegin(), backups.rend());
-
   return backups;
 }
 
+BackupDetails::BackupDetails(const ManifestEntry& entry)
+    : name(entry.name),
+      remarks(entry.remarks),
+      previous_backup(entry.previous_backup),
+      file_count(entry.file_count),
+      total_size(entry.total_size),
+      new_bytes(entry.new_bytes) {
+  auto time = std::chrono::system_clock::to_time_t(entry.timestamp);
+  std::stringstream timestamp_str;
+  timestamp_str << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S");
+  timestamp = timestamp_str.str();
+
+  switch (entry.type) {
+    case BackupType::FULL:
+      type = "FULL";
+      break;
+    case BackupType::INCREMENTAL:
+      type = "INCREMENTAL";
+      break;
+    case BackupType::DIFFERENTIAL:
+      type = "DIFFERENTIAL";
+      break;
+  }
+}
+
 std::vector<BackupDetails> Backup::GetAllBackupDetails() {
   std::vector<BackupDetails> backupDetails;
-  const auto backups = ListBackups();
-  for (const auto& backup : backups) {
-    fs::path metadata_path = temp_dir_ / "backup" / backup;
-    std::ifstream metadata_file(metadata_path, std::ios::binary);
-    if (!metadata_file) {
-      continue;
-    }
-
-    // Read encrypted data
-    std::vector<uint8_t> encrypted_data(
-      (std::istreambuf_iterator<char>(metadata_file)),
-      std::istreambuf_iterator<char>()
-    );
-    metadata_file.close();
-
-    // Decrypt metadata using repository password
-    std::string json_string = EncryptionUtil::DecryptMetadata(encrypted_data, repo_->GetPassword());
-    if (json_string.empty()) {
-      continue; // Skip corrupted metadata
-    }
-
-    try {
-      nlohmann::json metadata_json = nlohmann::json::parse(json_string);
-
-      auto type = static_cast<BackupType>(metadata_json["type"].get<int>());
-      auto timestamp = std::chrono::system_clock::from_time_t(
-          metadata_json["timestamp"].get<time_t>());
-      auto time = std::chrono::system_clock::to_time_t(timestamp);
-      std::stringstream timestamp_str;
-      timestamp_str << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S");
-
-      std::string type_str;
-      switch (type) {
-        case BackupType::FULL:
-          type_str = "FULL";
-          break;
-        case BackupType::INCREMENTAL:
-          type_str = "INCREMENTAL";
-          break;
-        case BackupType::DIFFERENTIAL:
-          type_str = "DIFFERENTIAL";
-          break;
-      }
+  for (const auto& entry : manifest_.GetEntries()) {
+    backupDetails.emplace_back(entry);
+  }
+  return backupDetails;
+}
 
-      std::string remarks = metadata_json.value("remarks", "");
-      BackupDetails details(type_str, timestamp_str.str(), backup, remarks);
-      backupDetails.push_back(details);
-    } catch (...) {
-      continue; // Skip invalid JSON
-    }
+std::vector<BackupDetails> Backup::ListBackupDetails(Repository* repo) {
+  Manifest manifest(repo);
+  manifest.Load();
+  std::vector<BackupDetails> backupDetails;
+  for (const auto& entry : manifest.GetEntries()) {
+    backupDetails.emplace_back(entry);
   }
   return backupDetails;
 }
@@ -518,104 +759,87 @@ void Backup::DisplayAllBackupDetails() {
 
   UserIO::DisplayMinTitle("Backup List");
   std::cout << std::setw(20) << "Name" << " | " << std::setw(10) << "Type"
-            << " | " << std::setw(20) << "Time" << " | " << std::setw(30)
-            << "Remarks" << " | \n";
-  std::cout << std::string(90, '-') << std::endl;
+            << " | " << std::setw(20) << "Time" << " | " << std::setw(8)
+            << "Files" << " | " << std::setw(9) << "Size" << " | "
+            << std::setw(9) << "New" << " | " << std::setw(20) << "Remarks"
+            << " | \n";
+  std::cout << std::string(120, '-') << std::endl;
 
   for (const auto& backup : backupDetails) {
     std::string remarks = backup.remarks;
-    if (remarks.length() > 27) {
-      remarks = remarks.substr(0, 24) + "...";
+    if (remarks.length() > 20) {
+      remarks = remarks.substr(0, 17) + "...";
     }
 
     std::cout << std::setw(20) << backup.name << " | " << std::setw(10)
               << backup.type << " | " << std::setw(20) << backup.timestamp
-              << " | " << std::setw(30) << remarks << " | \n";
+              << " | " << std::setw(8) << backup.file_count << " | "
+              << std::setw(9) << FormatBytes(backup.total_size) << " | "
+              << std::setw(9) << FormatBytes(backup.new_bytes) << " | "
+              << std::setw(20) << remarks << " | \n";
   }
-  std::cout << std::string(90, '-') << "\n\n";
+  std::cout << std::string(120, '-') << "\n\n";
 }
 
 void Backup::CompareBackups(const std::string& backup1,
-                            const std::string& backup2) {
-  BackupMetadata metadata1 = LoadPreviousMetadata(backup1);
-  BackupMetadata metadata2 = LoadPreviousMetadata(backup2);
-
-  size_t changed_files = 0;
-  size_t unchanged_files = 0;
-  size_t added_files = 0;
-  size_t deleted_files = 0;
-
-  // Compare files
-  for (const auto& [file_path, file_metadata2] : metadata2.files) {
-    auto it = metadata1.files.find(file_path);
-    if (it == metadata1.files.end()) {
-      added_files++;
-    } else if (file_metadata2.total_size != it->second.total_size ||
-               file_metadata2.mtime != it->second.mtime) {
-      changed_files++;
-    } else {
-      unchanged_files++;
-    }
+                            const std::string& backup2, bool as_json) {
+  if (!manifest_.Find(backup1) || !manifest_.Find(backup2)) {
+    ErrorUtil::ThrowError("One or both backup metadata files not found");
   }
+  SnapshotDiff diff = CompareSnapshots(manifest_.FetchMetadata(backup1),
+                                       manifest_.FetchMetadata(backup2),
+                                       repo_->GetPassword(), &trees_);
 
-  // Count deleted files
-  for (const auto& [file_path, _] : metadata1.files) {
-    if (metadata2.files.find(file_path) == metadata2.files.end()) {
-      deleted_files++;
-    }
+  if (as_json) {
+    Logger::TerminalLog(SnapshotDiffToJson(backup1, backup2, diff).dump(2));
+  } else {
+    Logger::TerminalLog(FormatSnapshotDiff(backup1, backup2, diff));
   }
+}
 
-  std::ostringstream comparison;
-  comparison << "Backup Comparison (" << backup1 << " vs " << backup2 << "):"
-             << "\n - Changed files: " << changed_files
-             << "\n - Unchanged files: " << unchanged_files
-             << "\n - Added files: " << added_files
-             << "\n - Deleted files: " << deleted_files << std::endl;
-  Logger::TerminalLog(comparison.str());
+// Older snapshots and journals only kept whole seconds
+static bool IsSameTime(fs::file_time_type current,
+                       fs::file_time_type previous) {
+  if (previous.time_since_epoch() % std::chrono::seconds(1) ==
+      fs::file_time_type::duration::zero()) {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               current.time_since_epoch()) ==
+           std::chrono::duration_cast<std::chrono::seconds>(
+               previous.time_since_epoch());
+  }
+  return current == previous;
 }
 
-bool Backup::CheckFileForChanges(const fs::path& file_path,
+bool Backup::CheckFileForChanges(const ScannedFile& file,
                                  const FileMetadata& previous_metadata) {
   // Check if it's a symlink
-  if (fs::is_symlink(file_path)) {
-    std::string current_target = fs::read_symlink(file_path).string();
-    auto mtime = fs::last_write_time(file_path);
-    std::string current_permissions = GetFilePermissions(file_path);
-
-    // Convert both times to seconds for comparison
-    auto current_mtime_seconds =
-        std::chrono::duration_cast<std::chrono::seconds>(
-            mtime.time_since_epoch())
-            .count();
-    auto previous_mtime_seconds =
-        std::chrono::duration_cast<std::chrono::seconds>(
-            previous_metadata.mtime.time_since_epoch())
-            .count();
+  if (file.is_symlink) {
+    std::string current_target = fs::read_symlink(file.path).string();
+    auto mtime = fs::last_write_time(file.path);
 
     // For symlinks, check if target or modification time changed
     return current_target != previous_metadata.symlink_target ||
-           current_mtime_seconds != previous_mtime_seconds;
+           !IsSameTime(mtime, previous_metadata.mtime);
   }
 
-  // Regular file check
-  // auto file_status = fs::status(file_path);
-  auto mtime = fs::last_write_time(file_path);
-  auto size = fs::file_size(file_path);
+  // Linked or unlinked since, its link group has to be formed again
+  if (previous_metadata.link_group.empty() == (file.links > 1)) return true;
 
-  // Convert both times to seconds for comparison
-  auto current_mtime_seconds =
-      std::chrono::duration_cast<std::chrono::seconds>(mtime.time_since_epoch())
-          .count();
-  auto previous_mtime_seconds =
-      std::chrono::duration_cast<std::chrono::seconds>(
-          previous_metadata.mtime.time_since_epoch())
-          .count();
+  // An inode read by an earlier backup is trusted over the times of the
+  // snapshot, which miss rewrites that keep the size and the mtime
+  if (auto state = file_states_.Find(file)) {
+    return !state->Matches(file) ||
+           state->file.chunk_hashes != previous_metadata.chunk_hashes ||
+           state->file.holes != previous_metadata.holes;
+  }
 
-  return size != previous_metadata.total_size ||
-         current_mtime_seconds != previous_mtime_seconds;
+  // Regular file check, with the attributes of the scan
+  return file.size != previous_metadata.total_size ||
+         !IsSameTime(file.mtime, previous_metadata.mtime);
 }
 
-std::string Backup::CalculateFileSHA256(const fs::path& file_path) {
+std::string Backup::CalculateFileSHA256(const fs::path& file_path,
+                                        const std::vector<FileExtent>& holes) {
   std::ifstream file(file_path, std::ios::binary);
   if (!file) {
     ErrorUtil::ThrowError("Could not open file for SHA256 calculation: " + file_path.string());
@@ -625,10 +849,31 @@ std::string Backup::CalculateFileSHA256(const fs::path& file_path) {
   SHA256_Init(&sha256);
 
   char buffer[4096];
+  uint64_t position = 0;
+  for (const auto& hole : holes) {
+    // Data up to the hole, then its zeros without reading them
+    while (file && position < hole.offset) {
+      file.read(buffer, std::min<uint64_t>(sizeof(buffer),
+                                           hole.offset - position));
+      SHA256_Update(&sha256, buffer, file.gcount());
+      RateLimiter::Instance().AcquireReadBytes(file.gcount());
+      position += file.gcount();
+    }
+    static const char ZEROS[4096] = {};
+    for (uint64_t left = hole.length; left > 0;) {
+      uint64_t length = std::min<uint64_t>(sizeof(ZEROS), left);
+      SHA256_Update(&sha256, ZEROS, length);
+      left -= length;
+    }
+    position += hole.length;
+    file.seekg(position);
+  }
   while (file.read(buffer, sizeof(buffer))) {
     SHA256_Update(&sha256, buffer, file.gcount());
+    RateLimiter::Instance().AcquireReadBytes(file.gcount());
   }
   SHA256_Update(&sha256, buffer, file.gcount()); // Read remaining bytes
+  RateLimiter::Instance().AcquireReadBytes(file.gcount());
 
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256_Final(hash, &sha256);
@@ -650,31 +895,13 @@ std::string Backup::GetFilePermissions(const fs::path& file_path) {
     ErrorUtil::ThrowError("Could not get file permissions: " + file_path.string());
   }
 
-  // Convert permissions to octal format
-  std::string perms_str;
-  perms_str += (perms & fs::perms::owner_read) != fs::perms::none ? "r" : "-";
-  perms_str += (perms & fs::perms::owner_write) != fs::perms::none ? "w" : "-";
-  perms_str += (perms & fs::perms::owner_exec) != fs::perms::none ? "x" : "-";
-  perms_str += (perms & fs::perms::group_read) != fs::perms::none ? "r" : "-";
-  perms_str += (perms & fs::perms::group_write) != fs::perms::none ? "w" : "-";
-  perms_str += (perms & fs::perms::group_exec) != fs::perms::none ? "x" : "-";
-  perms_str += (perms & fs::perms::others_read) != fs::perms::none ? "r" : "-";
-  perms_str += (perms & fs::perms::others_write) != fs::perms::none ? "w" : "-";
-  perms_str += (perms & fs::perms::others_exec) != fs::perms::none ? "x" : "-";
+  // Permission bits have their POSIX values
+  return FormatPermissions(static_cast<uint32_t>(perms & fs::perms::all));
+}
 
+std::string Backup::FormatPermissions(uint32_t mode) {
   // Convert to octal
-  int octal = 0;
-  if (perms_str[0] == 'r') octal |= 0400;
-  if (perms_str[1] == 'w') octal |= 0200;
-  if (perms_str[2] == 'x') octal |= 0100;
-  if (perms_str[3] == 'r') octal |= 0040;
-  if (perms_str[4] == 'w') octal |= 0020;
-  if (perms_str[5] == 'x') octal |= 0010;
-  if (perms_str[6] == 'r') octal |= 0004;
-  if (perms_str[7] == 'w') octal |= 0002;
-  if (perms_str[8] == 'x') octal |= 0001;
-
   std::stringstream ss;
-  ss << std::oct << std::setw(4) << std::setfill('0') << octal;
+  ss << std::oct << std::setw(4) << std::setfill('0') << (mode & 0777);
   return ss.str();
 }
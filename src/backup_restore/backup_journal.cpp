@@ -0,0 +1,123 @@
+#include "backup_restore/backup_journal.hpp"
+
+#include <fstream>
+
+#include "backup_restore/journal.hpp"
+#include "utils/logger.h"
+
+BackupJournal::BackupJournal(Repository* repo, const fs::path& input_path)
+    : journal_path_(Journal::GetPath(
+          "backup", repo,
+          fs::absolute(input_path).lexically_normal().string())) {}
+
+bool BackupJournal::Load() {
+  std::ifstream journal_file(journal_path_);
+  if (!journal_file) return false;
+
+  metadata_ = BackupMetadata();
+  chunks_.clear();
+  chunk_bytes_ = 0;
+  pending_.clear();
+
+  std::string line;
+  bool has_header = false;
+  while (std::getline(journal_file, line)) {
+    nlohmann::json record;
+    try {
+      record = nlohmann::json::parse(line);
+    } catch (const nlohmann::json::exception&) {
+      // Torn write of the last record before a crash
+      break;
+    }
+
+    std::string kind = record.value("kind", "");
+    if (kind == "begin") {
+      metadata_.type = static_cast<BackupType>(record["type"].get<int>());
+      metadata_.timestamp = std::chrono::system_clock::from_time_t(
+          record["timestamp"].get<time_t>());
+      metadata_.previous_backup = record.value("previous_backup", "");
+      metadata_.remarks = record.value("remarks", "");
+      has_header = true;
+    } else if (!has_header) {
+      break;
+    } else if (kind == "chunk") {
+      chunks_.insert(record["hash"].get<std::string>());
+      // Journals written before sizes were recorded count nothing
+      chunk_bytes_ += record.value("size", uint64_t(0));
+    } else if (kind == "file") {
+      metadata_.files.insert_or_assign(record["path"].get<std::string>(),
+                                       FileMetadataFromJson(record["metadata"]));
+    }
+  }
+
+  if (!has_header) {
+    Logger::SystemLog("Ignoring unreadable backup journal: " +
+                          journal_path_.string(),
+                      LogLevel::WARNING);
+    return false;
+  }
+  return true;
+}
+
+void BackupJournal::Begin(const BackupMetadata& metadata) {
+  metadata_ = BackupMetadata();
+  metadata_.type = metadata.type;
+  metadata_.timestamp = metadata.timestamp;
+  metadata_.previous_backup = metadata.previous_backup;
+  metadata_.remarks = metadata.remarks;
+  chunks_.clear();
+  chunk_bytes_ = 0;
+  pending_.clear();
+
+  nlohmann::json header;
+  header["kind"] = "begin";
+  header["type"] = static_cast<int>(metadata.type);
+  header["timestamp"] = std::chrono::system_clock::to_time_t(metadata.timestamp);
+  header["previous_backup"] = metadata.previous_backup;
+  header["remarks"] = metadata.remarks;
+
+  Journal::WriteDurably(journal_path_, header.dump() + "\n", true);
+}
+
+void BackupJournal::RecordChunk(const std::string& hash, uint64_t size) {
+  if (!chunks_.insert(hash).second) return;
+  chunk_bytes_ += size;
+  nlohmann::json record;
+  record["kind"] = "chunk";
+  record["hash"] = hash;
+  record["size"] = size;
+  pending_.push_back(record.dump());
+}
+
+void BackupJournal::RecordFile(const std::string& file_path,
+                               const FileMetadata& file_metadata) {
+  nlohmann::json record;
+  record["kind"] = "file";
+  record["path"] = file_path;
+  record["metadata"] = FileMetadataToJson(file_metadata);
+  pending_.push_back(record.dump());
+}
+
+bool BackupJournal::HasChunk(const std::string& hash) const {
+  return chunks_.count(hash) > 0;
+}
+
+void BackupJournal::Commit() {
+  if (pending_.empty()) return;
+
+  std::string data;
+  for (const auto& record : pending_) {
+    data += record;
+    data += '\n';
+  }
+  Journal::WriteDurably(journal_path_, data, false);
+  pending_.clear();
+}
+
+void BackupJournal::Remove() {
+  std::error_code ec;
+  fs::remove(journal_path_, ec);
+  chunks_.clear();
+  chunk_bytes_ = 0;
+  pending_.clear();
+}
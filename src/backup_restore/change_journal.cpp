@@ -0,0 +1,497 @@
+#include "backup_restore/change_journal.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <nlohmann/json.hpp>
+
+#include "backup_restore/journal.hpp"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+// How long the watcher waits for events before checking for a stop
+static const int POLL_TIMEOUT_MS = 1000;
+static const size_t EVENT_BUFFER_SIZE = 256 * 1024;
+
+static const uint64_t FANOTIFY_EVENTS = FAN_CREATE | FAN_DELETE |
+                                        FAN_MOVED_FROM | FAN_MOVED_TO |
+                                        FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+static const uint32_t INOTIFY_EVENTS =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW |
+    IN_EXCL_UNLINK;
+
+// Path of an entry the way a scan of the directory names it
+static std::string JoinPath(const std::string& directory,
+                            const std::string& name) {
+  if (!directory.empty() && directory.back() == '/') return directory + name;
+  return directory + "/" + name;
+}
+
+static bool IsBelow(const std::string& path, const std::string& root) {
+  if (path == root) return true;
+  std::string prefix = JoinPath(root, "");
+  return path.compare(0, prefix.size(), prefix) == 0;
+}
+
+namespace {
+
+// Closes a descriptor when it goes out of scope
+class Descriptor {
+ public:
+  explicit Descriptor(int fd = -1) : fd_(fd) {}
+  ~Descriptor() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  Descriptor(const Descriptor&) = delete;
+  Descriptor& operator=(const Descriptor&) = delete;
+
+  int get() const { return fd_; }
+
+ private:
+  int fd_;
+};
+
+// Directory entry events of the file system holding the source, reported
+// with a handle of the directory that is resolved to its path. Needs the
+// administrator and read-search capabilities, but no watch per directory.
+class FanotifyWatch : public ChangeWatch {
+ public:
+  explicit FanotifyWatch(const std::string& source)
+      : source_(source), buffer_(EVENT_BUFFER_SIZE) {
+    root_ = fs::canonical(source_).string();
+    mount_fd_ = open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount_fd_ < 0) {
+      ErrorUtil::ThrowError("Could not open " + root_ + ": " +
+                            std::strerror(errno));
+    }
+
+    fd_ = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                            FAN_REPORT_DFID_NAME,
+                        O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+      std::string error = std::strerror(errno);
+      close(mount_fd_);
+      ErrorUtil::ThrowError("fanotify_init failed: " + error);
+    }
+    std::string error;
+    if (fanotify_mark(fd_, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                      FANOTIFY_EVENTS, AT_FDCWD, root_.c_str()) != 0) {
+      error = "fanotify_mark failed: " + std::string(std::strerror(errno));
+    } else if (!CanResolve()) {
+      error = "directory handles cannot be opened";
+    }
+    if (!error.empty()) {
+      close(fd_);
+      close(mount_fd_);
+      ErrorUtil::ThrowError(error);
+    }
+  }
+
+  ~FanotifyWatch() override {
+    close(fd_);
+    close(mount_fd_);
+  }
+
+  int fd() const override { return fd_; }
+
+  bool Read(std::vector<std::string>& paths) override {
+    ssize_t length = read(fd_, buffer_.data(), buffer_.size());
+    if (length < 0) {
+      if (errno == EAGAIN || errno == EINTR) return true;
+      ErrorUtil::ThrowError("Could not read fanotify events: " +
+                            std::string(std::strerror(errno)));
+    }
+
+    bool complete = true;
+    auto* event = reinterpret_cast<struct fanotify_event_metadata*>(
+        buffer_.data());
+    for (; FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length)) {
+      if (event->vers != FANOTIFY_METADATA_VERSION) {
+        ErrorUtil::ThrowError("Unsupported fanotify event version");
+      }
+      if (event->mask & FAN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      // Changes to a directory itself do not change what a backup holds
+      if ((event->mask & FAN_ONDIR) &&
+          !(event->mask &
+            (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO))) {
+        continue;
+      }
+
+      auto* info = reinterpret_cast<struct fanotify_event_info_fid*>(
+          reinterpret_cast<char*>(event) + event->metadata_len);
+      if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) continue;
+      auto* handle = reinterpret_cast<struct file_handle*>(info->handle);
+      std::string name(
+          reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes));
+
+      std::string directory;
+      // A directory that is gone took its entries along, and its own
+      // removal is reported by its parent
+      if (!Resolve(handle, directory)) continue;
+      std::string path = name == "." ? directory : JoinPath(directory, name);
+      if (!IsBelow(path, root_)) continue;
+      paths.push_back(ToSourcePath(path));
+    }
+    return complete;
+  }
+
+ private:
+  // Paths are reported below the source as it was given, not its real path
+  std::string ToSourcePath(const std::string& path) const {
+    if (path == root_) return source_;
+    return JoinPath(source_, path.substr(JoinPath(root_, "").size()));
+  }
+
+  bool Resolve(struct file_handle* handle, std::string& path) const {
+    Descriptor directory(
+        open_by_handle_at(mount_fd_, handle, O_PATH | O_CLOEXEC));
+    if (directory.get() < 0) return false;
+
+    char target[PATH_MAX];
+    std::string link = "/proc/self/fd/" + std::to_string(directory.get());
+    ssize_t length = readlink(link.c_str(), target, sizeof(target));
+    if (length < 0 || length == sizeof(target)) return false;
+    path.assign(target, length);
+    static const std::string DELETED = " (deleted)";
+    return path.size() < DELETED.size() ||
+           path.compare(path.size() - DELETED.size(), DELETED.size(),
+                        DELETED) != 0;
+  }
+
+  // Handles are only of use with the capability to open them again
+  bool CanResolve() const {
+    std::vector<char> storage(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    auto* handle = reinterpret_cast<struct file_handle*>(storage.data());
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mount_id;
+    if (name_to_handle_at(AT_FDCWD, root_.c_str(), handle, &mount_id, 0) != 0) {
+      return false;
+    }
+    std::string path;
+    return Resolve(handle, path) && path == root_;
+  }
+
+  std::string source_;
+  std::string root_;  // Real path of the source
+  int mount_fd_ = -1;
+  int fd_ = -1;
+  std::vector<char> buffer_;
+};
+
+// A watch on every directory of the source, added for new directories as
+// they appear. Needs no privileges, but one watch per directory within the
+// fs.inotify.max_user_watches limit.
+class InotifyWatch : public ChangeWatch {
+ public:
+  explicit InotifyWatch(const std::string& source)
+      : source_(source), buffer_(EVENT_BUFFER_SIZE) {
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+      ErrorUtil::ThrowError("inotify_init1 failed: " +
+                            std::string(std::strerror(errno)));
+    }
+    try {
+      if (!AddTree(source_)) {
+        ErrorUtil::ThrowError("Could not watch " + source_);
+      }
+    } catch (...) {
+      close(fd_);
+      throw;
+    }
+  }
+
+  ~InotifyWatch() override { close(fd_); }
+
+  int fd() const override { return fd_; }
+
+  bool Read(std::vector<std::string>& paths) override {
+    ssize_t length = read(fd_, buffer_.data(), buffer_.size());
+    if (length < 0) {
+      if (errno == EAGAIN || errno == EINTR) return true;
+      ErrorUtil::ThrowError("Could not read inotify events: " +
+                            std::string(std::strerror(errno)));
+    }
+
+    bool complete = true;
+    for (ssize_t offset = 0; offset < length;) {
+      const auto* event =
+          reinterpret_cast<const struct inotify_event*>(buffer_.data() + offset);
+      offset += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      auto directory = directories_.find(event->wd);
+      if (directory == directories_.end()) continue;
+      if (event->mask & IN_IGNORED) {
+        directories_.erase(directory);
+        continue;
+      }
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // Other directories are reported by their parents
+        if (directory->second == source_) complete = false;
+        continue;
+      }
+
+      bool is_directory = event->mask & IN_ISDIR;
+      if (is_directory && !(event->mask & (IN_CREATE | IN_DELETE |
+                                           IN_MOVED_FROM | IN_MOVED_TO))) {
+        continue;
+      }
+      std::string path = JoinPath(directory->second, event->name);
+      if (is_directory && (event->mask & IN_MOVED_FROM)) {
+        RemoveTree(path);
+      }
+      if (is_directory && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        // Entries made before the watch are found by the backup scanning
+        // the new directory
+        if (!AddTree(path)) complete = false;
+      }
+      paths.push_back(path);
+    }
+    return complete;
+  }
+
+ private:
+  // False once the watch limit is reached
+  bool AddTree(const std::string& root) {
+    std::vector<std::string> pending = {root};
+    while (!pending.empty()) {
+      std::string directory = std::move(pending.back());
+      pending.pop_back();
+
+      int wd = inotify_add_watch(fd_, directory.c_str(), INOTIFY_EVENTS);
+      if (wd < 0) {
+        // Removed or replaced meanwhile, its parent reports that
+        if (errno == ENOENT || errno == ENOTDIR) continue;
+        if (errno == ENOSPC) {
+          Logger::SystemLog("Out of inotify watches for " + source_ +
+                                ", raise fs.inotify.max_user_watches",
+                            LogLevel::WARNING);
+          return false;
+        }
+        ErrorUtil::ThrowError("Could not watch " + directory + ": " +
+                              std::strerror(errno));
+      }
+      directories_[wd] = directory;
+
+      std::error_code ec;
+      for (fs::directory_iterator it(directory, ec), end; !ec && it != end;
+           it.increment(ec)) {
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+          pending.push_back(
+              JoinPath(directory, it->path().filename().string()));
+        }
+      }
+    }
+    return true;
+  }
+
+  // Watches of a moved directory still carry its old path
+  void RemoveTree(const std::string& root) {
+    for (auto it = directories_.begin(); it != directories_.end();) {
+      if (IsBelow(it->second, root)) {
+        inotify_rm_watch(fd_, it->first);
+        it = directories_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::string source_;
+  int fd_ = -1;
+  std::map<int, std::string> directories_;
+  std::vector<char> buffer_;
+};
+
+}  // namespace
+
+ChangeJournal::ChangeJournal(Repository* repo, const fs::path& source,
+                             const std::string& name)
+    : source_(source.string()),
+      log_path_(Journal::GetPath(
+          "changes", repo,
+          fs::absolute(source).lexically_normal().string() + "\n" + name)),
+      pending_path_(log_path_.string() + ".pending") {}
+
+ChangeJournal::~ChangeJournal() {
+  stopping_ = true;
+  if (watcher_.joinable()) watcher_.join();
+  log_.close();
+  std::error_code ec;
+  fs::remove(log_path_, ec);
+  fs::remove(pending_path_, ec);
+}
+
+void ChangeJournal::Start() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Changes made while nothing watched were not recorded
+    fs::create_directories(log_path_.parent_path());
+    std::error_code ec;
+    fs::remove(pending_path_, ec);
+    OpenLog(true);
+  }
+  watcher_ = std::thread(&ChangeJournal::WatchLoop, this);
+}
+
+void ChangeJournal::OpenLog(bool truncate) {
+  log_.close();
+  log_.clear();
+  log_.open(log_path_, truncate ? std::ios::trunc : std::ios::app);
+  if (!log_) {
+    ErrorUtil::ThrowError("Could not open change journal: " +
+                          log_path_.string());
+  }
+}
+
+void ChangeJournal::WatchLoop() {
+  // Watching every directory of a large tree takes a while, changes are
+  // trusted from the moment it is in place
+  try {
+    try {
+      watch_ = std::make_unique<FanotifyWatch>(source_);
+    } catch (const std::exception& e) {
+      Logger::SystemLog("Watching " + source_ + " with inotify, " + e.what(),
+                        LogLevel::INFO);
+      watch_ = std::make_unique<InotifyWatch>(source_);
+    }
+  } catch (const std::exception& e) {
+    ErrorUtil::LogException(e, "Not tracking changes of " + source_);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    watching_ = true;
+  }
+  Logger::SystemLog("Tracking changes of " + source_, LogLevel::INFO);
+
+  std::vector<std::string> paths;
+  while (!stopping_) {
+    struct pollfd descriptor = {watch_->fd(), POLLIN, 0};
+    int ready = poll(&descriptor, 1, POLL_TIMEOUT_MS);
+    if (ready < 0 && errno != EINTR) {
+      Logger::SystemLog("Could not poll changes of " + source_ + ": " +
+                            std::strerror(errno),
+                        LogLevel::ERROR);
+      break;
+    }
+    if (ready <= 0) continue;
+
+    paths.clear();
+    bool complete = false;
+    try {
+      complete = watch_->Read(paths);
+    } catch (const std::exception& e) {
+      ErrorUtil::LogException(e, "Change journal of " + source_);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& path : paths) {
+      log_ << nlohmann::json(path).dump() << '\n';
+    }
+    log_.flush();
+    if (!complete || !log_) {
+      // Nothing short of a scan finds what the lost events named
+      Logger::SystemLog("Change events of " + source_ +
+                            " were lost, its next backup scans it",
+                        LogLevel::WARNING);
+      losses_++;
+      bases_.clear();
+      try {
+        OpenLog(true);
+      } catch (const std::exception& e) {
+        ErrorUtil::LogException(e, "Change journal of " + source_);
+        break;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  watching_ = false;
+  bases_.clear();
+}
+
+std::optional<fs::path> ChangeJournal::Cut(const std::string& base_backup) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  log_.close();
+  if (fs::exists(pending_path_)) {
+    // Left by a backup that neither committed nor aborted
+    std::ofstream pending(pending_path_, std::ios::app);
+    std::ifstream log(log_path_);
+    pending << log.rdbuf();
+  } else {
+    fs::rename(log_path_, pending_path_);
+  }
+  OpenLog(true);
+
+  cut_ = true;
+  cut_watching_ = watching_;
+  cut_losses_ = losses_;
+  if (!watching_ || bases_.count(base_backup) == 0) return std::nullopt;
+  return pending_path_;
+}
+
+void ChangeJournal::Commit(const std::string& backup_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!cut_) return;
+  cut_ = false;
+
+  // Some changes since the cut are missing
+  std::error_code ec;
+  fs::remove(pending_path_, ec);
+  if (!cut_watching_ || losses_ != cut_losses_) return;
+  bases_ = {backup_name};
+}
+
+void ChangeJournal::Abort() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!cut_) return;
+  cut_ = false;
+  RestorePending();
+}
+
+void ChangeJournal::RestorePending() {
+  {
+    std::ifstream pending(pending_path_);
+    if (pending.peek() != std::ifstream::traits_type::eof()) {
+      log_ << pending.rdbuf();
+    }
+    log_.flush();
+  }
+  std::error_code ec;
+  fs::remove(pending_path_, ec);
+}
+
+void ChangeJournal::ReadPaths(
+    const fs::path& path,
+    const std::function<void(const std::string&)>& visitor) {
+  std::ifstream file(path);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not read change journal: " + path.string());
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::string changed;
+    try {
+      changed = nlohmann::json::parse(line).get<std::string>();
+    } catch (const nlohmann::json::exception&) {
+      ErrorUtil::ThrowError("Damaged change journal: " + path.string());
+    }
+    visitor(changed);
+  }
+}
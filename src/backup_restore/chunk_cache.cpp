@@ -0,0 +1,210 @@
+#include "backup_restore/chunk_cache.hpp"
+
+#include <openssl/sha.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include "utils/config_manager.h"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+#include "utils/setup.h"
+
+static const uint64_t DEFAULT_CHUNK_CACHE_LIMIT_MB = 2048;
+
+ChunkCache::ChunkCache(const fs::path& cache_dir, uint64_t max_bytes)
+    : cache_dir_(cache_dir), max_bytes_(max_bytes) {
+  if (max_bytes_ == 0) return;  // Caching disabled
+  fs::create_directories(cache_dir_);
+  LoadIndex();
+}
+
+fs::path ChunkCache::GetDefaultPath() {
+  return fs::path(Setup::GetAppDataPath()) / "cache" / "chunks";
+}
+
+uint64_t ChunkCache::GetConfiguredLimit() {
+  try {
+    ConfigManager config;
+    return config.Get<uint64_t>("chunk_cache_limit_mb",
+                                DEFAULT_CHUNK_CACHE_LIMIT_MB) *
+           1024 * 1024;
+  } catch (const std::exception& e) {
+    ErrorUtil::LogException(e, "Using default chunk cache limit");
+    return DEFAULT_CHUNK_CACHE_LIMIT_MB * 1024 * 1024;
+  }
+}
+
+std::string ChunkCache::CalculateDigest(const std::vector<uint8_t>& data) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(data.data(), data.size(), hash);
+
+  std::stringstream ss;
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << static_cast<int>(hash[i]);
+  }
+  return ss.str();
+}
+
+std::optional<std::vector<uint8_t>> ChunkCache::Get(const std::string& hash) {
+  if (max_bytes_ == 0) return std::nullopt;
+
+  fs::path chunk_path = GetChunkPath(hash);
+  std::ifstream chunk_file(chunk_path, std::ios::binary);
+  if (!chunk_file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Forget(hash);
+    return std::nullopt;
+  }
+
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(chunk_file)),
+                            std::istreambuf_iterator<char>());
+  chunk_file.close();
+
+  bool intact = CalculateDigest(data) == hash;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!intact) {
+    Logger::SystemLog("Dropping corrupt cached chunk: " + hash,
+                      LogLevel::WARNING);
+    std::error_code ec;
+    fs::remove(chunk_path, ec);
+    Forget(hash);
+    return std::nullopt;
+  }
+
+  if (!index_.count(hash)) {
+    // Added by another session since the index was loaded
+    lru_.push_front({hash, data.size()});
+    index_[hash] = lru_.begin();
+    total_bytes_ += data.size();
+  }
+  Touch(hash);
+  Evict();
+  return data;
+}
+
+void ChunkCache::Put(const std::string& hash,
+                     const std::vector<uint8_t>& data) {
+  if (max_bytes_ == 0 || data.size() > max_bytes_) return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.count(hash)) {
+      Touch(hash);
+      return;
+    }
+  }
+
+  fs::path chunk_path = GetChunkPath(hash);
+  std::stringstream temp_name;
+  temp_name << hash << ".part." << getpid() << "." << std::this_thread::get_id();
+  fs::path temp_path = chunk_path.parent_path() / temp_name.str();
+
+  // Caching is best effort, a chunk that cannot be written is only skipped
+  std::error_code ec;
+  fs::create_directories(chunk_path.parent_path(), ec);
+  std::ofstream chunk_file(temp_path, std::ios::binary | std::ios::trunc);
+  chunk_file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  chunk_file.close();
+  if (!chunk_file) {
+    fs::remove(temp_path, ec);
+    Logger::SystemLog("Could not write cached chunk: " + temp_path.string(),
+                      LogLevel::WARNING);
+    return;
+  }
+  fs::rename(temp_path, chunk_path, ec);
+  if (ec) {
+    Logger::SystemLog("Could not add cached chunk " + chunk_path.string() +
+                          ": " + ec.message(),
+                      LogLevel::WARNING);
+    fs::remove(temp_path, ec);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!index_.count(hash)) {
+    lru_.push_front({hash, data.size()});
+    index_[hash] = lru_.begin();
+    total_bytes_ += data.size();
+  }
+  Evict();
+}
+
+fs::path ChunkCache::GetChunkPath(const std::string& hash) const {
+  // Use first two hex digits as subdirectory, same as the repository
+  return cache_dir_ / hash.substr(0, 2) / (hash + ".chunk");
+}
+
+void ChunkCache::LoadIndex() {
+  struct Found {
+    std::string hash;
+    uint64_t size;
+    fs::file_time_type last_used;
+  };
+  std::vector<Found> found;
+  std::error_code ec;
+  auto stale_before = fs::file_time_type::clock::now() - std::chrono::hours(1);
+
+  for (const auto& file : fs::recursive_directory_iterator(cache_dir_, ec)) {
+    if (!file.is_regular_file(ec)) continue;
+
+    std::string name = file.path().filename().string();
+    if (name.find(".part.") != std::string::npos) {
+      // Leftover of an interrupted write
+      if (file.last_write_time(ec) < stale_before) fs::remove(file.path(), ec);
+      continue;
+    }
+    if (file.path().extension() != ".chunk") continue;
+
+    found.push_back({file.path().stem().string(), file.file_size(ec),
+                     file.last_write_time(ec)});
+  }
+
+  std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+    return a.last_used > b.last_used;
+  });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& chunk : found) {
+    lru_.push_back({chunk.hash, chunk.size});
+    index_[chunk.hash] = std::prev(lru_.end());
+    total_bytes_ += chunk.size;
+  }
+  Evict();
+}
+
+void ChunkCache::Touch(const std::string& hash) {
+  auto it = index_.find(hash);
+  if (it == index_.end()) return;
+  lru_.splice(lru_.begin(), lru_, it->second);
+
+  // Modification time carries the recency over to the next session
+  std::error_code ec;
+  fs::last_write_time(GetChunkPath(hash), fs::file_time_type::clock::now(),
+                      ec);
+}
+
+void ChunkCache::Forget(const std::string& hash) {
+  auto it = index_.find(hash);
+  if (it == index_.end()) return;
+  total_bytes_ -= it->second->size;
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+void ChunkCache::Evict() {
+  std::error_code ec;
+  while (total_bytes_ > max_bytes_ && !lru_.empty()) {
+    const Entry& victim = lru_.back();
+    fs::remove(GetChunkPath(victim.hash), ec);
+    total_bytes_ -= victim.size;
+    index_.erase(victim.hash);
+    lru_.pop_back();
+  }
+}
@@ -1,17 +1,32 @@
 #include "backup_restore/chunker.hpp"
 
+#include <fcntl.h>
 #include <openssl/sha.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <random>
 #include <sstream>
 
 #include "utils/error_util.h"
+#include "utils/rate_limiter.h"
 
 namespace fs = std::filesystem;
 
+// Fill hashes are this many zero digits, then the byte and the length
+static const size_t FILL_PREFIX_SIZE = 46;
+// Bound on the length of a fill, well above the largest chunk the content
+// defined splitting makes, so a corrupt hash can't ask for a huge buffer
+static const uint64_t MAX_FILL_SIZE = 64ULL * 1024 * 1024;
+
 // Gear hash table - precomputed random values for FastCDC
 static const uint64_t GEAR_TABLE[256] = {
     0xcab06edf, 0xb2718138, 0x3c224673, 0x3b9cf4f3, 0x99309a2f, 0x4cae6426,
@@ -58,6 +73,39 @@ static const uint64_t GEAR_TABLE[256] = {
     0xde089e30, 0xbf167903, 0x551a3200, 0xa330b700, 0x917e3ebf, 0x5a794e62,
     0xe44d3356, 0x9fcd9417, 0x30eb9b8b, 0x6e33ef51};
 
+// Whether every byte equals the first, 64 bytes per step with SSE2
+static bool IsSingleByte(const uint8_t* data, size_t size) {
+  if (size == 0) return false;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i pattern = _mm_set1_epi8(static_cast<char>(data[0]));
+  for (; i + 64 <= size; i += 64) {
+    const __m128i* block = reinterpret_cast<const __m128i*>(data + i);
+    __m128i differences = _mm_or_si128(
+        _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(block), pattern),
+                     _mm_xor_si128(_mm_loadu_si128(block + 1), pattern)),
+        _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(block + 2), pattern),
+                     _mm_xor_si128(_mm_loadu_si128(block + 3), pattern)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(differences,
+                                         _mm_setzero_si128())) != 0xffff) {
+      return false;
+    }
+  }
+#endif
+  for (; i < size; i++) {
+    if (data[i] != data[0]) return false;
+  }
+  return true;
+}
+
+static std::string MakeFillHash(uint8_t value, uint64_t size) {
+  char suffix[19];
+  std::snprintf(suffix, sizeof(suffix), "%02x%016llx",
+                static_cast<unsigned>(value),
+                static_cast<unsigned long long>(size));
+  return std::string(FILL_PREFIX_SIZE, '0') + suffix;
+}
+
 Chunker::Chunker(size_t average_size) : average_chunk_size_(average_size) {
   // Initialize gear table if needed (shown abbreviated above)
 }
@@ -213,23 +261,111 @@ size_t Chunker::FindChunkBoundaryWithFastCDC(const std::vector<uint8_t>& data,
   return end;
 }
 
+bool Chunker::IsFillHash(const std::string& hash) {
+  return hash.size() == FILL_PREFIX_SIZE + 18 &&
+         hash.find_first_not_of('0') >= FILL_PREFIX_SIZE;
+}
+
+Chunk Chunker::MakeFillChunk(const std::string& hash) {
+  if (!IsFillHash(hash)) {
+    ErrorUtil::ThrowError("Not a fill chunk: " + hash);
+  }
+  Chunk chunk;
+  chunk.hash = hash;
+  uint8_t value = std::stoul(hash.substr(FILL_PREFIX_SIZE, 2), nullptr, 16);
+  uint64_t size = std::stoull(hash.substr(FILL_PREFIX_SIZE + 2), nullptr, 16);
+  if (size == 0 || size > MAX_FILL_SIZE) {
+    ErrorUtil::ThrowError("Invalid fill chunk length: " + hash);
+  }
+  chunk.size = size;
+  chunk.data.assign(chunk.size, value);
+  return chunk;
+}
+
+std::vector<FileExtent> Chunker::FindHoles(const fs::path& file_path) {
+  int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ErrorUtil::ThrowError("Could not open file: " + file_path.string() + ": " +
+                          std::strerror(errno));
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+
+  std::vector<FileExtent> holes;
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+      // No data past the offset, the rest of the file is a hole
+      if (errno != ENXIO) {
+        holes.clear();
+        break;
+      }
+      data = size;
+    }
+    if (data > offset) {
+      holes.push_back({static_cast<uint64_t>(offset),
+                       static_cast<uint64_t>(data - offset)});
+    }
+    if (data >= size) break;
+    offset = lseek(fd, data, SEEK_HOLE);
+    if (offset < 0) {
+      holes.clear();
+      break;
+    }
+  }
+  close(fd);
+  return holes;
+}
+
 void Chunker::StreamSplitFile(
     const fs::path& file_path,
-    std::function<void(const Chunk&)> chunk_callback) {
+    std::function<void(const Chunk&)> chunk_callback,
+    const std::vector<FileExtent>& holes) {
+  RateLimiter::Instance().AcquireOp();
   std::ifstream file(file_path, std::ios::binary);
   if (!file) {
     ErrorUtil::ThrowError("Could not open file: " + file_path.string());
   }
 
-  // Get file size
+  // Get the size of the data outside the holes
   file.seekg(0, std::ios::end);
   size_t file_size = file.tellg();
   file.seekg(0, std::ios::beg);
+  for (const auto& hole : holes) {
+    file_size -= std::min<uint64_t>(hole.length, file_size);
+  }
+
+  // Read the data after the file position, seeking over holes
+  uint64_t position = 0;
+  size_t next_hole = 0;
+  auto read_data = [&](uint8_t* out, size_t count) {
+    size_t total = 0;
+    while (total < count && file) {
+      while (next_hole < holes.size() &&
+             holes[next_hole].offset <= position) {
+        position = std::max(position,
+                            holes[next_hole].offset + holes[next_hole].length);
+        next_hole++;
+        file.seekg(position);
+      }
+      size_t length = count - total;
+      if (next_hole < holes.size()) {
+        length = std::min<uint64_t>(length,
+                                    holes[next_hole].offset - position);
+      }
+      file.read(reinterpret_cast<char*>(out + total), length);
+      size_t bytes_read = file.gcount();
+      total += bytes_read;
+      position += bytes_read;
+    }
+    return total;
+  };
 
   // If file is smaller than minimum chunk size, process it as a single chunk
   if (file_size <= average_chunk_size_ / 2) {
     std::vector<uint8_t> data(file_size);
-    file.read(reinterpret_cast<char*>(data.data()), file_size);
+    data.resize(read_data(data.data(), file_size));
+    RateLimiter::Instance().AcquireReadBytes(data.size());
     ProcessChunk(data, chunk_callback);
     return;
   }
@@ -242,10 +378,10 @@ void Chunker::StreamSplitFile(
   size_t total_bytes_processed = 0;
 
   while (file) {
-    file.read(reinterpret_cast<char*>(buffer.data()), buffer_size);
-    size_t bytes_read = file.gcount();
+    size_t bytes_read = read_data(buffer.data(), buffer_size);
 
     if (bytes_read == 0) break;
+    RateLimiter::Instance().AcquireReadBytes(bytes_read);
 
     size_t pos = 0;
     while (pos < bytes_read) {
@@ -280,17 +416,41 @@ void Chunker::StreamSplitFile(
   }
 }
 
-void Chunker::StreamCombineChunks(std::function<Chunk()> chunk_provider,
-                                  const fs::path& output_path,
-                                  size_t original_size) {
+void Chunker::StreamCombineChunks(
+    std::function<Chunk()> chunk_provider, const fs::path& output_path,
+    size_t original_size, size_t start_offset,
+    std::function<void(std::ofstream&, size_t)> chunk_written,
+    const std::vector<FileExtent>& holes) {
   try{
-      std::ofstream file(output_path, std::ios::binary);
+      // Chunks hold the bytes outside the holes, in file order
+      size_t data_size = original_size;
+      for (const auto& hole : holes) {
+        data_size -= std::min<uint64_t>(hole.length, data_size);
+      }
+      uint64_t position = start_offset;
+      size_t next_hole = 0;
+      while (next_hole < holes.size() && holes[next_hole].offset < position) {
+        position += holes[next_hole].length;
+        next_hole++;
+      }
+
+      std::ofstream file;
+      if (start_offset > 0) {
+        // Continue a partially restored file after its verified prefix
+        fs::resize_file(output_path, position);
+        file.open(output_path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(position);
+      } else {
+        file.open(output_path, std::ios::binary);
+      }
       if (!file) {
         ErrorUtil::ThrowError("Could not create output file: " +
                               output_path.string());
       }
 
-        size_t total_bytes_written = 0;
+        size_t total_bytes_written = start_offset;
+        // Seeking past the end leaves the file short until resized
+        bool extended = !holes.empty();
 
         while (true) {
           Chunk chunk = chunk_provider();
@@ -298,17 +458,46 @@ void Chunker::StreamCombineChunks(std::function<Chunk()> chunk_provider,
 
           // Calculate how many bytes we can write
           size_t bytes_to_write =
-              std::min(chunk.size, original_size - total_bytes_written);
-
-          if (bytes_to_write > 0) {
-            file.write(reinterpret_cast<const char*>(chunk.data.data()),
-                      bytes_to_write);
-            total_bytes_written += bytes_to_write;
+              std::min(chunk.size, data_size - total_bytes_written);
+
+          // Seek over the holes the chunk spans, which stay unallocated, and
+          // over the whole of a zero fill
+          bool zero_fill = IsFillHash(chunk.hash) && chunk.data[0] == 0;
+          if (zero_fill) extended = true;
+          size_t chunk_offset = 0;
+          while (chunk_offset < bytes_to_write) {
+            if (next_hole < holes.size() &&
+                holes[next_hole].offset <= position) {
+              position += holes[next_hole].length;
+              next_hole++;
+              file.seekp(position);
+              continue;
+            }
+            size_t length = bytes_to_write - chunk_offset;
+            if (next_hole < holes.size()) {
+              length = std::min<uint64_t>(length,
+                                          holes[next_hole].offset - position);
+            }
+            if (zero_fill) {
+              file.seekp(position + length);
+            } else {
+              file.write(reinterpret_cast<const char*>(chunk.data.data() +
+                                                       chunk_offset),
+                         length);
+            }
+            chunk_offset += length;
+            position += length;
           }
+          total_bytes_written += bytes_to_write;
+          if (chunk_written) chunk_written(file, total_bytes_written);
         }
 
         // Ensure the file is exactly the original size
         file.close();
+        if (extended) {
+          // A hole or zero fill at the end is left by extending the file
+          fs::resize_file(output_path, original_size);
+        }
 
   }
   catch (const std::exception& e) {
@@ -324,6 +513,14 @@ void Chunker::ProcessChunk(const std::vector<uint8_t>& chunk_data,
   chunk.data = chunk_data;
   chunk.size = chunk_data.size();
 
+  // A fill needs no digest, its hash describes it
+  if (chunk.size <= MAX_FILL_SIZE &&
+      IsSingleByte(chunk.data.data(), chunk.size)) {
+    chunk.hash = MakeFillHash(chunk.data[0], chunk.size);
+    chunk_callback(chunk);
+    return;
+  }
+
   // Calculate SHA-256 hash of the chunk
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256_CTX sha256;
@@ -0,0 +1,270 @@
+#include "backup_restore/directory_scanner.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <utility>
+
+#include "utils/error_util.h"
+
+// Directory entries read per getdents64 call
+static const size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+static const unsigned int STATX_FIELDS = STATX_TYPE | STATX_MODE |
+                                         STATX_NLINK | STATX_INO |
+                                         STATX_SIZE | STATX_BLOCKS |
+                                         STATX_MTIME | STATX_CTIME;
+
+namespace {
+
+// Record layout returned by the getdents64 system call
+struct LinuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Closes a directory descriptor when the scan of it ends
+class DirectoryHandle {
+ public:
+  explicit DirectoryHandle(const std::string& path)
+      : fd_(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+    if (fd_ < 0) {
+      ErrorUtil::ThrowError("Could not open directory: " + path + ": " +
+                            std::strerror(errno));
+    }
+  }
+  ~DirectoryHandle() { close(fd_); }
+
+  DirectoryHandle(const DirectoryHandle&) = delete;
+  DirectoryHandle& operator=(const DirectoryHandle&) = delete;
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_;
+};
+
+}  // namespace
+
+// The file clock counts from its own epoch, which lies a whole number of
+// seconds away from the Unix epoch in the standard libraries
+static std::chrono::seconds GetFileClockOffset() {
+  static const std::chrono::seconds offset =
+      std::chrono::round<std::chrono::seconds>(
+          fs::file_time_type::clock::now().time_since_epoch() -
+          std::chrono::system_clock::now().time_since_epoch());
+  return offset;
+}
+
+static fs::file_time_type ToFileTime(const struct statx_timestamp& time) {
+  return fs::file_time_type(
+      std::chrono::duration_cast<fs::file_time_type::duration>(
+          std::chrono::seconds(time.tv_sec) +
+          std::chrono::nanoseconds(time.tv_nsec) + GetFileClockOffset()));
+}
+
+static ScannedFile ToScannedFile(std::string path, const struct statx& stx) {
+  ScannedFile file;
+  file.path = std::move(path);
+  file.is_symlink = S_ISLNK(stx.stx_mode);
+  file.size = stx.stx_size;
+  // Blocks are counted in 512 byte units whatever the block size
+  file.allocated = stx.stx_blocks * 512;
+  file.mtime = ToFileTime(stx.stx_mtime);
+  file.ctime = ToFileTime(stx.stx_ctime);
+  file.mode = stx.stx_mode & 0777;
+  file.links = stx.stx_nlink;
+  file.device = static_cast<uint64_t>(stx.stx_dev_major) << 32 |
+                stx.stx_dev_minor;
+  file.inode = stx.stx_ino;
+  return file;
+}
+
+DirectoryScanner::DirectoryScanner(const fs::path& root,
+                                   const FileFilter* filter,
+                                   size_t worker_count, size_t queue_limit)
+    : filter_(filter), queue_limit_(std::max<size_t>(queue_limit, 1)) {
+  FileFilter::Scope scope;
+  if (filter_) scope = filter_->FindScope(root.string());
+  // Nothing to scan inside a directory the filter leaves out
+  if (!filter_ || scope) directories_.push_back({root.string(), scope});
+  for (size_t i = 0; i < std::max<size_t>(worker_count, 1); ++i) {
+    workers_.emplace_back(&DirectoryScanner::WorkerLoop, this);
+  }
+}
+
+DirectoryScanner::~DirectoryScanner() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  space_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool DirectoryScanner::Next(ScannedFile& file) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ready_cv_.wait(lock, [this] {
+    return !files_.empty() || error_ || IsDone();
+  });
+  if (error_) std::rethrow_exception(error_);
+  if (files_.empty()) return false;
+
+  file = std::move(files_.front());
+  files_.pop_front();
+  lock.unlock();
+  space_cv_.notify_one();
+  return true;
+}
+
+std::optional<ScannedFile> DirectoryScanner::Stat(const fs::path& path) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_FIELDS,
+            &stx) != 0) {
+    if (errno == ENOENT || errno == ENOTDIR) return std::nullopt;
+    ErrorUtil::ThrowError("Could not stat file: " + path.string() + ": " +
+                          std::strerror(errno));
+  }
+  if (!S_ISREG(stx.stx_mode) && !S_ISLNK(stx.stx_mode)) return std::nullopt;
+  return ToScannedFile(path.string(), stx);
+}
+
+void DirectoryScanner::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] {
+      return stopping_ || !directories_.empty() || busy_workers_ == 0;
+    });
+    if (stopping_ || directories_.empty()) break;
+
+    PendingDirectory directory = std::move(directories_.back());
+    directories_.pop_back();
+    busy_workers_++;
+    lock.unlock();
+
+    std::exception_ptr error;
+    try {
+      ScanDirectory(directory);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    busy_workers_--;
+    if (error && !error_) {
+      error_ = error;
+      stopping_ = true;
+    }
+    if (stopping_ || IsDone()) {
+      work_cv_.notify_all();
+      ready_cv_.notify_all();
+      space_cv_.notify_all();
+    }
+  }
+}
+
+void DirectoryScanner::ScanDirectory(const PendingDirectory& directory) {
+  DirectoryHandle handle(directory.path);
+  std::string prefix = directory.path;
+  if (prefix.empty() || prefix.back() != '/') prefix += '/';
+
+  // Names and entry types, kept until the ignore file of the directory has
+  // been read if it has one
+  std::vector<std::pair<std::string, unsigned char>> entries;
+  bool has_ignore_file = false;
+  std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+  while (true) {
+    long length =
+        syscall(SYS_getdents64, handle.fd(), buffer.data(), buffer.size());
+    if (length < 0) {
+      ErrorUtil::ThrowError("Could not read directory: " + directory.path +
+                            ": " + std::strerror(errno));
+    }
+    if (length == 0) break;
+
+    for (long offset = 0; offset < length;) {
+      const auto* entry =
+          reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+      offset += entry->d_reclen;
+
+      const char* name = entry->d_name;
+      if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+        continue;
+      }
+      if (std::strcmp(name, FileFilter::IGNORE_FILE_NAME) == 0) {
+        has_ignore_file = true;
+      }
+      entries.emplace_back(name, entry->d_type);
+    }
+  }
+
+  FileFilter::Scope scope = directory.scope;
+  if (filter_ && has_ignore_file) {
+    scope = filter_->Enter(scope, directory.path);
+  }
+  auto excluded = [&](const std::string& path, bool is_directory) {
+    return filter_ && filter_->ExcludesPath(scope, path, is_directory);
+  };
+
+  std::vector<PendingDirectory> subdirectories;
+  std::vector<ScannedFile> files;
+  for (const auto& [name, type] : entries) {
+    std::string path = prefix + name;
+    if (type == DT_DIR) {
+      if (!excluded(path, true)) subdirectories.push_back({path, scope});
+      continue;
+    }
+    // Only file systems without entry types need a stat to tell them
+    if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+      continue;
+    }
+    // Left out by name before it costs a stat
+    if (type != DT_UNKNOWN && excluded(path, false)) continue;
+
+    struct statx stx;
+    if (statx(handle.fd(), name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_FIELDS,
+              &stx) != 0) {
+      // Removed since it was listed
+      if (errno == ENOENT) continue;
+      ErrorUtil::ThrowError("Could not stat file: " + path + ": " +
+                            std::strerror(errno));
+    }
+    if (S_ISDIR(stx.stx_mode)) {
+      if (!excluded(path, true)) subdirectories.push_back({path, scope});
+    } else if (S_ISREG(stx.stx_mode) || S_ISLNK(stx.stx_mode)) {
+      if (type == DT_UNKNOWN && excluded(path, false)) continue;
+      ScannedFile file = ToScannedFile(std::move(path), stx);
+      if (filter_ && !filter_->IsWithinLimits(file)) continue;
+      files.push_back(std::move(file));
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Subdirectories first, so idle workers start on them while the files of
+  // this one wait for room in the queue
+  for (auto& subdirectory : subdirectories) {
+    directories_.push_back(std::move(subdirectory));
+  }
+  work_cv_.notify_all();
+
+  for (auto& file : files) {
+    space_cv_.wait(lock, [this] {
+      return stopping_ || files_.size() < queue_limit_;
+    });
+    if (stopping_) return;
+    files_.push_back(std::move(file));
+    ready_cv_.notify_one();
+  }
+}
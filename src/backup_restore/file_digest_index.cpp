@@ -0,0 +1,450 @@
+#include "backup_restore/file_digest_index.hpp"
+
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+
+#include "backup_restore/record_codec.hpp"
+#include "utils/encryption_util.h"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+// Start of a segment and of the local table, each followed by its version
+static const std::string SEGMENT_MAGIC = "RZFDSG";
+static const std::string INDEX_MAGIC = "RZFDIX";
+static const uint8_t FORMAT_VERSION = 1;
+
+static const size_t ENTRY_SIZE = RecordCodec::DIGEST_SIZE + 8;
+static const uint64_t MAX_SEGMENT_SIZE = 1ULL << 32;
+// Bytes of segment records held before they are merged into the table
+static const size_t MAX_BATCH_SIZE = 64 * 1024 * 1024;
+
+static void PutFixed(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+static uint64_t GetFixed(const uint8_t* data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+static std::string ToRawDigest(const std::string& hex) {
+  std::vector<uint8_t> raw;
+  RecordCodec::PutDigest(raw, hex);
+  return std::string(raw.begin(), raw.end());
+}
+
+// Only what it takes to reuse the chunks of a file
+static FileMetadata GetContent(const FileMetadata& file_metadata) {
+  FileMetadata content;
+  content.total_size = file_metadata.total_size;
+  content.chunk_hashes = file_metadata.chunk_hashes;
+  content.holes = file_metadata.holes;
+  return content;
+}
+
+static std::vector<uint8_t> SealSegment(const std::vector<uint8_t>& plain,
+                                        const std::string& password) {
+  std::vector<uint8_t> compressed(ZSTD_compressBound(plain.size()));
+  size_t compressed_size =
+      ZSTD_compress(compressed.data(), compressed.size(), plain.data(),
+                    plain.size(), ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError(compressed_size)) {
+    ErrorUtil::ThrowError("Failed to compress digest segment: " +
+                          std::string(ZSTD_getErrorName(compressed_size)));
+  }
+
+  EncryptionUtil::MetadataEncryptor encryptor(password);
+  std::vector<uint8_t> sealed =
+      encryptor.Update(compressed.data(), compressed_size);
+  std::vector<uint8_t> tail = encryptor.Final();
+  sealed.insert(sealed.end(), tail.begin(), tail.end());
+  return sealed;
+}
+
+static std::vector<uint8_t> OpenSegment(const std::vector<uint8_t>& sealed,
+                                        const std::string& password) {
+  EncryptionUtil::MetadataDecryptor decryptor(password);
+  std::vector<uint8_t> compressed =
+      decryptor.Update(sealed.data(), sealed.size());
+  std::vector<uint8_t> tail = decryptor.Final();
+  compressed.insert(compressed.end(), tail.begin(), tail.end());
+
+  unsigned long long size =
+      ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN ||
+      size > MAX_SEGMENT_SIZE) {
+    ErrorUtil::ThrowError("Corrupt digest segment");
+  }
+  std::vector<uint8_t> plain(size);
+  size_t result = ZSTD_decompress(plain.data(), plain.size(),
+                                  compressed.data(), compressed.size());
+  if (ZSTD_isError(result) || result != size) {
+    ErrorUtil::ThrowError("Failed to decompress digest segment");
+  }
+  return plain;
+}
+
+FileDigestIndex::FileDigestIndex(Repository* repo, const fs::path& cache_dir)
+    : repo_(repo),
+      cache_dir_(cache_dir / "digests"),
+      index_path_(cache_dir_ / "index") {
+  fs::create_directories(cache_dir_);
+}
+
+FileDigestIndex::~FileDigestIndex() = default;
+
+fs::path FileDigestIndex::GetSegmentPath(
+    const std::string& backup_name) const {
+  return cache_dir_ / (backup_name + ".idx");
+}
+
+void FileDigestIndex::Load(Manifest& manifest) {
+  mapped_.reset();
+  count_ = 0;
+
+  std::vector<std::string> listed;
+  std::set<std::string> listed_names;
+  for (const auto& entry : manifest.GetEntries()) {
+    listed.push_back(entry.name);
+    listed_names.insert(entry.name);
+  }
+
+  std::vector<std::string> covered = ReadCoveredSnapshots();
+  std::set<std::string> covered_names(covered.begin(), covered.end());
+  // Chunks of a snapshot that is gone may be gone too
+  bool stale = std::any_of(
+      covered.begin(), covered.end(),
+      [&](const std::string& name) { return !listed_names.count(name); });
+  if (stale) {
+    Logger::SystemLog("Rebuilding file digest index " + index_path_.string(),
+                      LogLevel::WARNING);
+    fs::remove(index_path_);
+    covered.clear();
+    covered_names.clear();
+  }
+
+  std::vector<std::string> missing;
+  for (const auto& name : listed) {
+    if (!covered_names.count(name)) missing.push_back(name);
+  }
+  Map();
+  if (missing.empty()) return;
+
+  // Segments are merged into the table a batch at a time, so memory is
+  // bounded by the batch and not by the table
+  Batch batch;
+  size_t batch_size = 0;
+  std::vector<std::string> merged;
+  for (const auto& name : missing) {
+    try {
+      for (const auto& [digest, content] : ReadSegment(name)) {
+        if (batch.count(digest)) continue;
+        std::vector<uint8_t> record;
+        RecordCodec::PutFileMetadata(record, content);
+        batch_size += digest.size() + record.size();
+        batch.emplace(digest, std::move(record));
+      }
+    } catch (const std::exception& e) {
+      // Left uncovered, so the next load tries it again
+      ErrorUtil::LogExceptionSystem(e,
+                                    "Skipping file digests of backup " + name);
+      continue;
+    }
+    covered.push_back(name);
+    merged.push_back(name);
+
+    if (batch_size >= MAX_BATCH_SIZE) {
+      Merge(batch, covered);
+      RemoveSegments(merged);
+      batch.clear();
+      batch_size = 0;
+      merged.clear();
+    }
+  }
+  if (!merged.empty()) {
+    Merge(batch, covered);
+    RemoveSegments(merged);
+  }
+}
+
+void FileDigestIndex::Merge(const Batch& batch,
+                            const std::vector<std::string>& covered) {
+  // Visits the records of the table and the batch in digest order, the
+  // table's copy of a content is older and wins
+  auto walk = [&](const auto& visit) {
+    auto added = batch.begin();
+    for (uint64_t i = 0; i <= count_; i++) {
+      const uint8_t* entry = i < count_ ? entries_ + i * ENTRY_SIZE : nullptr;
+      for (; added != batch.end(); ++added) {
+        if (entry && std::memcmp(added->first.data(), entry,
+                                 RecordCodec::DIGEST_SIZE) >= 0) {
+          break;
+        }
+        visit(reinterpret_cast<const uint8_t*>(added->first.data()),
+              added->second.data(), added->second.size());
+      }
+      if (!entry) break;
+
+      uint64_t offset = GetFixed(entry + RecordCodec::DIGEST_SIZE, 8);
+      if (offset >= records_size_) continue;
+      RecordCodec::Decoder decoder(records_ + offset, records_size_ - offset);
+      decoder.GetFileMetadata();
+      if (added != batch.end() &&
+          std::memcmp(added->first.data(), entry, RecordCodec::DIGEST_SIZE) ==
+              0) {
+        ++added;
+      }
+      visit(entry, records_ + offset, decoder.GetOffset());
+    }
+  };
+
+  uint64_t count = 0;
+  walk([&](const uint8_t*, const uint8_t*, size_t) { count++; });
+
+  std::vector<uint8_t> header(INDEX_MAGIC.begin(), INDEX_MAGIC.end());
+  header.push_back(FORMAT_VERSION);
+  PutFixed(header, covered.size(), 4);
+  for (const auto& name : covered) {
+    PutFixed(header, name.size(), 4);
+    header.insert(header.end(), name.begin(), name.end());
+  }
+  PutFixed(header, count, 8);
+
+  fs::path temp_path =
+      index_path_.string() + ".part." + std::to_string(getpid());
+  {
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(header.data()), header.size());
+    uint64_t offset = 0;
+    walk([&](const uint8_t* digest, const uint8_t*, size_t size) {
+      std::vector<uint8_t> entry(digest, digest + RecordCodec::DIGEST_SIZE);
+      PutFixed(entry, offset, 8);
+      out.write(reinterpret_cast<const char*>(entry.data()), entry.size());
+      offset += size;
+    });
+    walk([&](const uint8_t*, const uint8_t* record, size_t size) {
+      out.write(reinterpret_cast<const char*>(record), size);
+    });
+    out.close();
+    if (!out) {
+      fs::remove(temp_path);
+      ErrorUtil::ThrowError("Could not write file digest index: " +
+                            temp_path.string());
+    }
+  }
+  fs::rename(temp_path, index_path_);
+  Map();
+}
+
+void FileDigestIndex::RemoveSegments(const std::vector<std::string>& names) {
+  for (const auto& name : names) {
+    std::error_code ec;
+    fs::remove(GetSegmentPath(name), ec);
+  }
+}
+
+std::vector<std::string> FileDigestIndex::ReadCoveredSnapshots() {
+  std::vector<std::string> covered;
+  if (!fs::exists(index_path_)) return covered;
+
+  std::ifstream file(index_path_, std::ios::binary);
+  std::vector<char> header(INDEX_MAGIC.size() + 1 + 4);
+  if (!file.read(header.data(), header.size()) ||
+      !std::equal(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), header.begin()) ||
+      static_cast<uint8_t>(header[INDEX_MAGIC.size()]) != FORMAT_VERSION) {
+    // Treated as covering nothing, it is replaced on the next merge
+    return covered;
+  }
+  uint64_t count = GetFixed(
+      reinterpret_cast<const uint8_t*>(header.data()) + INDEX_MAGIC.size() + 1,
+      4);
+  for (uint64_t i = 0; i < count; i++) {
+    uint8_t size[4];
+    if (!file.read(reinterpret_cast<char*>(size), sizeof(size))) break;
+    std::string name(GetFixed(size, 4), '\0');
+    if (!file.read(name.data(), name.size())) break;
+    covered.push_back(std::move(name));
+  }
+  return covered;
+}
+
+void FileDigestIndex::Map() {
+  mapped_.reset();
+  count_ = 0;
+  if (!fs::exists(index_path_)) return;
+
+  try {
+    auto mapped = std::make_unique<MappedFile>(index_path_);
+    const uint8_t* data = mapped->data();
+    size_t size = mapped->size();
+    size_t offset = INDEX_MAGIC.size() + 1;
+    if (size < offset + 4 ||
+        !std::equal(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), data) ||
+        data[INDEX_MAGIC.size()] != FORMAT_VERSION) {
+      ErrorUtil::ThrowError("bad marker");
+    }
+    uint64_t covered_count = GetFixed(data + offset, 4);
+    offset += 4;
+    for (uint64_t i = 0; i < covered_count; i++) {
+      if (size - offset < 4) ErrorUtil::ThrowError("truncated");
+      uint64_t name_size = GetFixed(data + offset, 4);
+      offset += 4;
+      if (size - offset < name_size) ErrorUtil::ThrowError("truncated");
+      offset += name_size;
+    }
+    if (size - offset < 8) ErrorUtil::ThrowError("truncated");
+    uint64_t count = GetFixed(data + offset, 8);
+    offset += 8;
+    if ((size - offset) / ENTRY_SIZE < count) {
+      ErrorUtil::ThrowError("truncated");
+    }
+
+    entries_ = data + offset;
+    count_ = count;
+    records_ = entries_ + count * ENTRY_SIZE;
+    records_size_ = data + size - records_;
+    mapped_ = std::move(mapped);
+  } catch (const std::exception& e) {
+    Logger::SystemLog("Dropping damaged file digest index " +
+                          index_path_.string() + ": " + e.what(),
+                      LogLevel::WARNING);
+    count_ = 0;
+    std::error_code ec;
+    fs::remove(index_path_, ec);
+  }
+}
+
+std::optional<FileMetadata> FileDigestIndex::Find(
+    const std::string& sha256_checksum, uint64_t total_size) const {
+  if (sha256_checksum.empty()) return std::nullopt;
+
+  auto added = added_.find(sha256_checksum);
+  if (added != added_.end()) {
+    if (added->second.total_size != total_size) return std::nullopt;
+    return added->second;
+  }
+
+  // Entries are sorted by raw digest
+  std::string digest = ToRawDigest(sha256_checksum);
+  uint64_t low = 0;
+  uint64_t high = count_;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    const uint8_t* entry = entries_ + middle * ENTRY_SIZE;
+    int order = std::memcmp(entry, digest.data(), RecordCodec::DIGEST_SIZE);
+    if (order < 0) {
+      low = middle + 1;
+    } else if (order > 0) {
+      high = middle;
+    } else {
+      uint64_t offset = GetFixed(entry + RecordCodec::DIGEST_SIZE, 8);
+      if (offset >= records_size_) return std::nullopt;
+      RecordCodec::Decoder decoder(records_ + offset, records_size_ - offset);
+      FileMetadata content = decoder.GetFileMetadata();
+      if (content.total_size != total_size) return std::nullopt;
+      content.sha256_checksum = sha256_checksum;
+      return content;
+    }
+  }
+  return std::nullopt;
+}
+
+void FileDigestIndex::Add(const FileMetadata& file_metadata) {
+  if (file_metadata.is_symlink || file_metadata.sha256_checksum.empty()) {
+    return;
+  }
+  FileMetadata content = GetContent(file_metadata);
+  content.sha256_checksum = file_metadata.sha256_checksum;
+  added_.emplace(file_metadata.sha256_checksum, std::move(content));
+}
+
+void FileDigestIndex::AddSnapshot(const std::string& backup_name) {
+  std::vector<uint8_t> plain(SEGMENT_MAGIC.begin(), SEGMENT_MAGIC.end());
+  plain.push_back(FORMAT_VERSION);
+  RecordCodec::PutVarint(plain, added_.size());
+  for (const auto& [sha256_checksum, content] : added_) {
+    RecordCodec::PutDigest(plain, sha256_checksum);
+    RecordCodec::PutFileMetadata(plain, GetContent(content));
+  }
+  std::vector<uint8_t> sealed = SealSegment(plain, repo_->GetPassword());
+
+  // Kept in the cache so the next merge need not download it
+  fs::path segment_path = GetSegmentPath(backup_name);
+  fs::path temp_path =
+      segment_path.string() + ".part." + std::to_string(getpid());
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(sealed.data()), sealed.size());
+  file.close();
+  if (!file) {
+    fs::remove(temp_path);
+    ErrorUtil::ThrowError("Could not write file: " + temp_path.string());
+  }
+  fs::rename(temp_path, segment_path);
+
+  if (!repo_->UploadFile(segment_path.string(), "digests/")) {
+    ErrorUtil::ThrowError("Failed to upload file digests of " + backup_name);
+  }
+  added_.clear();
+}
+
+std::vector<std::pair<std::string, FileMetadata>> FileDigestIndex::ReadSegment(
+    const std::string& backup_name) {
+  std::vector<std::pair<std::string, FileMetadata>> records;
+  fs::path segment_path = GetSegmentPath(backup_name);
+  if (!fs::exists(segment_path)) {
+    fs::path download_path =
+        segment_path.string() + ".part." + std::to_string(getpid());
+    bool fetched = false;
+    try {
+      fetched = repo_->DownloadFile("digests/" + backup_name + ".idx",
+                                    download_path.string());
+    } catch (const std::exception&) {
+      std::error_code ec;
+      fs::remove(download_path, ec);
+      throw;
+    }
+    if (!fetched) {
+      // Snapshots from before the index, or whose segment failed to publish,
+      // add nothing
+      std::error_code ec;
+      fs::remove(download_path, ec);
+      Logger::SystemLog("No file digests for backup " + backup_name);
+      return records;
+    }
+    if (!fs::exists(download_path)) {
+      ErrorUtil::ThrowError("Failed to download file digests of " +
+                            backup_name);
+    }
+    fs::rename(download_path, segment_path);
+  }
+
+  std::ifstream file(segment_path, std::ios::binary);
+  std::vector<uint8_t> sealed((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+  std::vector<uint8_t> plain = OpenSegment(sealed, repo_->GetPassword());
+  if (plain.size() < SEGMENT_MAGIC.size() + 1 ||
+      !std::equal(SEGMENT_MAGIC.begin(), SEGMENT_MAGIC.end(), plain.begin()) ||
+      plain[SEGMENT_MAGIC.size()] != FORMAT_VERSION) {
+    ErrorUtil::ThrowError("Corrupt digest segment of " + backup_name);
+  }
+
+  RecordCodec::Decoder decoder(plain.data() + SEGMENT_MAGIC.size() + 1,
+                               plain.size() - SEGMENT_MAGIC.size() - 1);
+  uint64_t count = decoder.GetVarint();
+  for (uint64_t i = 0; i < count; i++) {
+    std::string digest = ToRawDigest(decoder.GetDigest());
+    records.emplace_back(std::move(digest), decoder.GetFileMetadata());
+  }
+  return records;
+}
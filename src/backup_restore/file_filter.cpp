@@ -0,0 +1,389 @@
+#include "backup_restore/file_filter.hpp"
+
+#include <fstream>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+
+#include "backup_restore/directory_scanner.hpp"
+#include "utils/error_util.h"
+
+namespace {
+
+enum class Verdict { NONE, EXCLUDE, INCLUDE };
+
+// One gitignore pattern, matched as a literal or suffix where it can be
+struct FilterRule {
+  enum class Kind { LITERAL, SUFFIX, GLOB };
+
+  Kind kind = Kind::GLOB;
+  std::string pattern;  // For a suffix, the part after the leading '*'
+  bool negated = false;
+  bool directory_only = false;
+  // Matched against the path relative to the directory of the rule rather
+  // than against the last name
+  bool anchored = false;
+};
+
+}  // namespace
+
+// Patterns of one set in their order. Without negated patterns every match
+// excludes, so plain names and extensions are found by hash and the order
+// only matters among the remaining globs.
+class FilterRuleSet {
+ public:
+  explicit FilterRuleSet(std::vector<FilterRule> rules);
+
+  bool IsEmpty() const { return rules_.empty(); }
+  Verdict Match(std::string_view relative, std::string_view name,
+                bool is_directory) const;
+
+ private:
+  std::vector<FilterRule> rules_;
+  bool has_negations_ = false;
+  // Hashed patterns of a set without negations
+  std::unordered_set<std::string> names_;
+  std::unordered_set<std::string> directory_names_;
+  std::unordered_set<std::string> extensions_;
+  std::vector<size_t> others_;  // Indexes of the remaining rules
+};
+
+struct FilterScope {
+  std::shared_ptr<const FilterScope> parent;
+  std::string prefix;  // Directory of the rules, with a trailing '/'
+  FilterRuleSet rules;
+};
+
+static bool HasWildcard(std::string_view pattern) {
+  return pattern.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+// Match a bracket expression at pattern[p] against one character, moving p
+// past it. False with p unchanged if the bracket is never closed.
+static bool MatchClass(std::string_view pattern, size_t& p, char c,
+                       bool& matched) {
+  size_t i = p + 1;
+  bool negated = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+  if (negated) i++;
+  matched = false;
+  bool first = true;
+  for (; i < pattern.size() && (first || pattern[i] != ']'); i++) {
+    first = false;
+    char low = pattern[i];
+    if (low == '\\' && i + 1 < pattern.size()) low = pattern[++i];
+    char high = low;
+    if (i + 2 < pattern.size() && pattern[i + 1] == '-' &&
+        pattern[i + 2] != ']') {
+      high = pattern[i + 2];
+      i += 2;
+    }
+    if (low <= c && c <= high) matched = true;
+  }
+  if (i >= pattern.size()) return false;
+  p = i + 1;
+  matched = matched != negated && c != '/';
+  return true;
+}
+
+// Glob match of a whole path, where '*' and '?' stay within one name and
+// '**' spans any number of them
+static bool MatchGlob(std::string_view pattern, std::string_view text) {
+  size_t p = 0;
+  size_t t = 0;
+  while (p < pattern.size()) {
+    char c = pattern[p];
+    if (c == '*') {
+      bool any_depth = p + 1 < pattern.size() && pattern[p + 1] == '*';
+      p += any_depth ? 2 : 1;
+      // "**/" matches no directory or any number of whole ones
+      if (any_depth && p < pattern.size() && pattern[p] == '/') {
+        std::string_view rest = pattern.substr(p + 1);
+        while (true) {
+          if (MatchGlob(rest, text.substr(t))) return true;
+          size_t slash = text.find('/', t);
+          if (slash == std::string_view::npos) return false;
+          t = slash + 1;
+        }
+      }
+      std::string_view rest = pattern.substr(p);
+      for (;; t++) {
+        if (MatchGlob(rest, text.substr(t))) return true;
+        if (t == text.size() || (!any_depth && text[t] == '/')) return false;
+      }
+    }
+    if (t == text.size()) return false;
+
+    if (c == '?') {
+      if (text[t] == '/') return false;
+    } else if (c == '[') {
+      bool matched;
+      if (MatchClass(pattern, p, text[t], matched)) {
+        if (!matched) return false;
+        t++;
+        continue;
+      }
+      if (text[t] != c) return false;
+    } else {
+      if (c == '\\' && p + 1 < pattern.size()) c = pattern[++p];
+      if (text[t] != c) return false;
+    }
+    p++;
+    t++;
+  }
+  return t == text.size();
+}
+
+static bool MatchRule(const FilterRule& rule, std::string_view relative,
+                      std::string_view name, bool is_directory) {
+  if (rule.directory_only && !is_directory) return false;
+  std::string_view text = rule.anchored ? relative : name;
+  switch (rule.kind) {
+    case FilterRule::Kind::LITERAL:
+      return text == rule.pattern;
+    case FilterRule::Kind::SUFFIX:
+      return text.size() >= rule.pattern.size() &&
+             text.substr(text.size() - rule.pattern.size()) == rule.pattern;
+    case FilterRule::Kind::GLOB:
+      return MatchGlob(rule.pattern, text);
+  }
+  return false;
+}
+
+// Compile one line of an ignore file, false for blanks and comments
+static bool ParseRule(std::string line, FilterRule& rule) {
+  if (!line.empty() && line.back() == '\r') line.pop_back();
+  // Trailing spaces count only when escaped
+  while (!line.empty() && line.back() == ' ' &&
+         (line.size() < 2 || line[line.size() - 2] != '\\')) {
+    line.pop_back();
+  }
+  if (line.empty() || line[0] == '#') return false;
+
+  rule = FilterRule{};
+  if (line[0] == '!') {
+    rule.negated = true;
+    line.erase(0, 1);
+  } else if (line[0] == '\\' && line.size() > 1 &&
+             (line[1] == '!' || line[1] == '#')) {
+    line.erase(0, 1);
+  }
+  if (!line.empty() && line.back() == '/') {
+    rule.directory_only = true;
+    line.pop_back();
+  }
+  rule.anchored = line.find('/') != std::string::npos;
+  if (!line.empty() && line[0] == '/') line.erase(0, 1);
+  if (line.empty()) return false;
+
+  if (!HasWildcard(line)) {
+    rule.kind = FilterRule::Kind::LITERAL;
+  } else if (!rule.anchored && line[0] == '*' &&
+             !HasWildcard(std::string_view(line).substr(1))) {
+    rule.kind = FilterRule::Kind::SUFFIX;
+    line.erase(0, 1);
+  }
+  rule.pattern = std::move(line);
+  return true;
+}
+
+static std::vector<FilterRule> ReadIgnoreFile(const fs::path& path) {
+  std::vector<FilterRule> rules;
+  std::ifstream file(path);
+  std::string line;
+  FilterRule rule;
+  while (std::getline(file, line)) {
+    if (ParseRule(line, rule)) rules.push_back(std::move(rule));
+  }
+  return rules;
+}
+
+FilterRuleSet::FilterRuleSet(std::vector<FilterRule> rules)
+    : rules_(std::move(rules)) {
+  for (const auto& rule : rules_) {
+    has_negations_ = has_negations_ || rule.negated;
+  }
+  if (has_negations_) return;
+
+  for (size_t i = 0; i < rules_.size(); i++) {
+    const FilterRule& rule = rules_[i];
+    bool hashable = !rule.anchored && !rule.directory_only;
+    if (!rule.anchored && rule.kind == FilterRule::Kind::LITERAL) {
+      (rule.directory_only ? directory_names_ : names_).insert(rule.pattern);
+    } else if (hashable && rule.kind == FilterRule::Kind::SUFFIX &&
+               rule.pattern.size() > 1 && rule.pattern[0] == '.' &&
+               rule.pattern.find('.', 1) == std::string::npos) {
+      extensions_.insert(rule.pattern);
+    } else {
+      others_.push_back(i);
+    }
+  }
+}
+
+Verdict FilterRuleSet::Match(std::string_view relative, std::string_view name,
+                             bool is_directory) const {
+  if (has_negations_) {
+    // The last matching pattern decides
+    for (auto it = rules_.rbegin(); it != rules_.rend(); ++it) {
+      if (MatchRule(*it, relative, name, is_directory)) {
+        return it->negated ? Verdict::INCLUDE : Verdict::EXCLUDE;
+      }
+    }
+    return Verdict::NONE;
+  }
+
+  if (!names_.empty() && names_.count(std::string(name)) > 0) {
+    return Verdict::EXCLUDE;
+  }
+  if (is_directory && !directory_names_.empty() &&
+      directory_names_.count(std::string(name)) > 0) {
+    return Verdict::EXCLUDE;
+  }
+  size_t dot = name.rfind('.');
+  if (!extensions_.empty() && dot != std::string_view::npos &&
+      extensions_.count(std::string(name.substr(dot))) > 0) {
+    return Verdict::EXCLUDE;
+  }
+  for (size_t i : others_) {
+    if (MatchRule(rules_[i], relative, name, is_directory)) {
+      return Verdict::EXCLUDE;
+    }
+  }
+  return Verdict::NONE;
+}
+
+static std::vector<std::string> GetPatterns(const nlohmann::json& settings,
+                                            const std::string& key) {
+  std::vector<std::string> patterns;
+  if (!settings.contains(key)) return patterns;
+  const auto& list = settings[key];
+  if (!list.is_array()) {
+    ErrorUtil::ThrowError("Filter setting " + key + " must be a list");
+  }
+  for (const auto& pattern : list) {
+    if (!pattern.is_string()) {
+      ErrorUtil::ThrowError("Filter setting " + key + " must hold patterns");
+    }
+    patterns.push_back(pattern.get<std::string>());
+  }
+  return patterns;
+}
+
+static uint64_t GetLimit(const nlohmann::json& settings,
+                         const std::string& key) {
+  if (!settings.contains(key)) return 0;
+  const auto& limit = settings[key];
+  if (!limit.is_number_integer() ||
+      (!limit.is_number_unsigned() && limit.get<int64_t>() < 0)) {
+    ErrorUtil::ThrowError("Filter setting " + key +
+                          " must be a whole number, not negative");
+  }
+  return limit.get<uint64_t>();
+}
+
+FileFilter::FileFilter(const fs::path& root, const nlohmann::json& settings)
+    : root_(root.string()) {
+  if (!settings.is_null() && !settings.is_object()) {
+    ErrorUtil::ThrowError("Filter settings must be an object");
+  }
+  while (root_.size() > 1 && root_.back() == '/') root_.pop_back();
+
+  std::vector<FilterRule> rules;
+  if (settings.is_object()) {
+    FilterRule rule;
+    for (const auto& pattern : GetPatterns(settings, "exclude")) {
+      if (ParseRule(pattern, rule)) rules.push_back(std::move(rule));
+    }
+    for (const auto& pattern : GetPatterns(settings, "include")) {
+      if (ParseRule("!" + pattern, rule)) rules.push_back(std::move(rule));
+    }
+    min_size_ = GetLimit(settings, "min_size");
+    max_size_ = GetLimit(settings, "max_size");
+    if (uint64_t days = GetLimit(settings, "max_age_days")) {
+      has_max_age_ = true;
+      oldest_mtime_ = fs::file_time_type::clock::now() -
+                      std::chrono::hours(24) * static_cast<int64_t>(days);
+    }
+  }
+  // The ignore file of the root comes after the settings and wins over them
+  for (auto& rule : ReadIgnoreFile(fs::path(root_) / IGNORE_FILE_NAME)) {
+    rules.push_back(std::move(rule));
+  }
+
+  std::string prefix = root_;
+  if (prefix.back() != '/') prefix += '/';
+  root_scope_ = std::make_shared<const FilterScope>(
+      FilterScope{nullptr, prefix, FilterRuleSet(std::move(rules))});
+}
+
+FileFilter::~FileFilter() = default;
+
+FileFilter::Scope FileFilter::Enter(const Scope& parent,
+                                    const std::string& directory) const {
+  std::string prefix = directory;
+  while (prefix.size() > 1 && prefix.back() == '/') prefix.pop_back();
+  if (prefix.back() != '/') prefix += '/';
+  // The directory's own scope, such as the root's, has its rules already
+  if (parent && parent->prefix == prefix) return parent;
+
+  std::vector<FilterRule> rules =
+      ReadIgnoreFile(fs::path(directory) / IGNORE_FILE_NAME);
+  if (rules.empty()) return parent;
+
+  return std::make_shared<const FilterScope>(
+      FilterScope{parent, prefix, FilterRuleSet(std::move(rules))});
+}
+
+FileFilter::Scope FileFilter::FindScope(const std::string& directory) const {
+  std::string key = directory;
+  while (key.size() > 1 && key.back() == '/') key.pop_back();
+  std::lock_guard<std::mutex> lock(mutex_);
+  return FindScopeLocked(key);
+}
+
+FileFilter::Scope FileFilter::FindScopeLocked(
+    const std::string& directory) const {
+  // The root, or a path not below it
+  const std::string& prefix = root_scope_->prefix;
+  if (directory.size() <= prefix.size() ||
+      directory.compare(0, prefix.size(), prefix) != 0) {
+    return root_scope_;
+  }
+  auto it = scopes_.find(directory);
+  if (it != scopes_.end()) return it->second;
+
+  Scope parent = FindScopeLocked(directory.substr(0, directory.rfind('/')));
+  Scope scope;
+  if (parent && !ExcludesPath(parent, directory, true)) {
+    scope = Enter(parent, directory);
+  }
+  scopes_[directory] = scope;
+  return scope;
+}
+
+bool FileFilter::ExcludesPath(const Scope& scope, const std::string& path,
+                              bool is_directory) const {
+  std::string_view name = path;
+  size_t slash = name.rfind('/');
+  if (slash != std::string_view::npos) name.remove_prefix(slash + 1);
+
+  // Deeper rules first, the first that matches decides
+  for (const FilterScope* current = scope.get(); current;
+       current = current->parent.get()) {
+    if (current->rules.IsEmpty() ||
+        path.compare(0, current->prefix.size(), current->prefix) != 0) {
+      continue;
+    }
+    std::string_view relative = std::string_view(path).substr(
+        current->prefix.size());
+    Verdict verdict = current->rules.Match(relative, name, is_directory);
+    if (verdict != Verdict::NONE) return verdict == Verdict::EXCLUDE;
+  }
+  return false;
+}
+
+bool FileFilter::IsWithinLimits(const ScannedFile& file) const {
+  if (file.is_symlink) return true;
+  if (file.size < min_size_) return false;
+  if (max_size_ > 0 && file.size > max_size_) return false;
+  return !has_max_age_ || file.mtime >= oldest_mtime_;
+}
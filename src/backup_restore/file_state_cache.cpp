@@ -0,0 +1,235 @@
+#include "backup_restore/file_state_cache.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "backup_restore/chunk_cache.hpp"
+#include "backup_restore/record_codec.hpp"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+// Start of the file, followed by the format version
+static const std::string STATE_MAGIC = "RZSTAT";
+static const uint8_t STATE_VERSION = 1;
+
+static const size_t INDEX_ENTRY_SIZE = 24;
+// Timestamps of some file systems are this coarse, a file changed within
+// it of the backup start may change again without its times moving
+static const auto RACY_WINDOW = std::chrono::seconds(2);
+
+static void PutFixed(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+static uint64_t GetFixed(const uint8_t* data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+static int64_t ToNanoseconds(fs::file_time_type time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+bool FileState::Matches(const ScannedFile& scanned) const {
+  if (file.total_size != scanned.size ||
+      ToNanoseconds(file.mtime) != ToNanoseconds(scanned.mtime)) {
+    return false;
+  }
+  // Renaming a file moves its ctime, at another path size and mtime decide
+  return path != scanned.path ||
+         ToNanoseconds(ctime) == ToNanoseconds(scanned.ctime);
+}
+
+FileStateCache::FileStateCache(const fs::path& cache_dir,
+                               const fs::path& source,
+                               const fs::path& work_dir)
+    : records_path_(work_dir / "file_states"),
+      trusted_before_(fs::file_time_type::clock::now() - RACY_WINDOW) {
+  std::string source_path = source.string();
+  path_ = cache_dir / "file_states" /
+          ChunkCache::CalculateDigest(
+              std::vector<uint8_t>(source_path.begin(), source_path.end()));
+}
+
+FileStateCache::~FileStateCache() {
+  recorded_.close();
+  std::error_code ec;
+  fs::remove(records_path_, ec);
+}
+
+void FileStateCache::Load(Manifest& manifest) {
+  mapped_.reset();
+  count_ = 0;
+  if (!fs::exists(path_)) return;
+
+  try {
+    auto mapped = std::make_unique<MappedFile>(path_);
+    const uint8_t* data = mapped->data();
+    size_t size = mapped->size();
+    size_t offset = STATE_MAGIC.size() + 1;
+    if (size < offset + 4 ||
+        !std::equal(STATE_MAGIC.begin(), STATE_MAGIC.end(), data) ||
+        data[STATE_MAGIC.size()] != STATE_VERSION) {
+      ErrorUtil::ThrowError("bad marker");
+    }
+    uint64_t name_size = GetFixed(data + offset, 4);
+    offset += 4;
+    if (size - offset < name_size + 8) ErrorUtil::ThrowError("truncated");
+    std::string backup_name(reinterpret_cast<const char*>(data + offset),
+                            name_size);
+    offset += name_size;
+    uint64_t count = GetFixed(data + offset, 8);
+    offset += 8;
+    if ((size - offset) / INDEX_ENTRY_SIZE < count) {
+      ErrorUtil::ThrowError("truncated");
+    }
+
+    // Chunks of a backup that is gone may be gone too
+    if (!manifest.Find(backup_name)) {
+      fs::remove(path_);
+      return;
+    }
+
+    index_ = data + offset;
+    count_ = count;
+    records_ = index_ + count * INDEX_ENTRY_SIZE;
+    records_size_ = data + size - records_;
+    mapped_ = std::move(mapped);
+  } catch (const std::exception& e) {
+    Logger::SystemLog("Dropping damaged file state cache " + path_.string() +
+                          ": " + e.what(),
+                      LogLevel::WARNING);
+    count_ = 0;
+    std::error_code ec;
+    fs::remove(path_, ec);
+  }
+}
+
+std::optional<FileState> FileStateCache::Find(const ScannedFile& file) const {
+  if (file.is_symlink) return std::nullopt;
+
+  // Entries are sorted by device and inode
+  uint64_t low = 0;
+  uint64_t high = count_;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    const uint8_t* entry = index_ + middle * INDEX_ENTRY_SIZE;
+    uint64_t device = GetFixed(entry, 8);
+    uint64_t inode = GetFixed(entry + 8, 8);
+    if (device < file.device || (device == file.device && inode < file.inode)) {
+      low = middle + 1;
+    } else if (device == file.device && inode == file.inode) {
+      uint64_t offset = GetFixed(entry + 16, 8);
+      if (offset >= records_size_) return std::nullopt;
+
+      RecordCodec::Decoder decoder(records_ + offset, records_size_ - offset);
+      FileState state;
+      state.path = decoder.GetString();
+      state.ctime = fs::file_time_type(
+          std::chrono::duration_cast<fs::file_time_type::duration>(
+              std::chrono::nanoseconds(decoder.GetSigned())));
+      state.file = decoder.GetFileMetadata();
+      return state;
+    } else {
+      high = middle;
+    }
+  }
+  return std::nullopt;
+}
+
+void FileStateCache::Record(const ScannedFile& file,
+                            const FileMetadata& file_metadata) {
+  if (file.is_symlink || file.ctime >= trusted_before_ ||
+      file.mtime >= trusted_before_) {
+    return;
+  }
+
+  if (!recorded_.is_open()) {
+    fs::create_directories(records_path_.parent_path());
+    recorded_.open(records_path_, std::ios::binary | std::ios::trunc);
+    if (!recorded_) {
+      ErrorUtil::ThrowError("Could not create file state records: " +
+                            records_path_.string());
+    }
+  }
+
+  // Times as scanned, snapshots of older versions may have dropped the
+  // nanoseconds
+  FileMetadata state = file_metadata;
+  state.mtime = file.mtime;
+
+  std::vector<uint8_t> record;
+  RecordCodec::PutString(record, file.path);
+  RecordCodec::PutSigned(record, ToNanoseconds(file.ctime));
+  RecordCodec::PutFileMetadata(record, state);
+  recorded_.write(reinterpret_cast<const char*>(record.data()), record.size());
+  recorded_index_.push_back({file.device, file.inode, recorded_size_});
+  recorded_size_ += record.size();
+}
+
+void FileStateCache::Commit(const std::string& backup_name) {
+  if (recorded_.is_open()) {
+    recorded_.close();
+    if (!recorded_) {
+      ErrorUtil::ThrowError("Could not write file state records: " +
+                            records_path_.string());
+    }
+  }
+
+  std::stable_sort(recorded_index_.begin(), recorded_index_.end(),
+                   [](const IndexEntry& a, const IndexEntry& b) {
+                     return a.device != b.device ? a.device < b.device
+                                                 : a.inode < b.inode;
+                   });
+  // Hard links share an inode and its content, one record does for all
+  recorded_index_.erase(
+      std::unique(recorded_index_.begin(), recorded_index_.end(),
+                  [](const IndexEntry& a, const IndexEntry& b) {
+                    return a.device == b.device && a.inode == b.inode;
+                  }),
+      recorded_index_.end());
+
+  std::vector<uint8_t> header(STATE_MAGIC.begin(), STATE_MAGIC.end());
+  header.push_back(STATE_VERSION);
+  PutFixed(header, backup_name.size(), 4);
+  header.insert(header.end(), backup_name.begin(), backup_name.end());
+  PutFixed(header, recorded_index_.size(), 8);
+  for (const auto& entry : recorded_index_) {
+    PutFixed(header, entry.device, 8);
+    PutFixed(header, entry.inode, 8);
+    PutFixed(header, entry.offset, 8);
+  }
+
+  // The old records stay mapped until the new ones are in place
+  fs::create_directories(path_.parent_path());
+  fs::path temp_path = path_.string() + ".part." + std::to_string(getpid());
+  {
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(header.data()), header.size());
+    if (recorded_size_ > 0) {
+      std::ifstream records(records_path_, std::ios::binary);
+      out << records.rdbuf();
+    }
+    out.close();
+    if (!out) {
+      fs::remove(temp_path);
+      ErrorUtil::ThrowError("Could not write file state cache: " +
+                            temp_path.string());
+    }
+  }
+  fs::rename(temp_path, path_);
+
+  recorded_index_.clear();
+  recorded_size_ = 0;
+  std::error_code ec;
+  fs::remove(records_path_, ec);
+}
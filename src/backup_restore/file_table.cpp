@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "backup_restore/metadata.hpp"
+#include "backup_restore/record_codec.hpp"
+#include "utils/error_util.h"
+
+static const uint32_t MODE_PERMISSIONS = 07777;
+static const uint32_t FLAG_HAS_PERMISSIONS = 1 << 16;
+static const uint32_t FLAG_HAS_CHECKSUM = 1 << 17;
+static const uint32_t FLAG_SYMLINK = 1 << 18;
+static const uint32_t FLAG_RENAMED = 1 << 19;  // Name differs from the path
+static const uint32_t FLAG_DELETED = 1 << 20;
+static const uint32_t FLAG_SPARSE = 1 << 21;
+static const uint32_t FLAG_LINKED = 1 << 22;
+
+// Entries added out of order are merged once the unsorted tail grows past
+// this share of the table, keeping the total merge work linear
+static const size_t MIN_TAIL_SIZE = 4096;
+static const size_t TAIL_SHARE = 8;
+
+// Compare the concatenations a1 + a2 and b1 + b2 without building them
+static int CompareJoined(std::string_view a1, std::string_view a2,
+                         std::string_view b1, std::string_view b2) {
+  while (true) {
+    if (a1.empty()) std::swap(a1, a2);
+    if (b1.empty()) std::swap(b1, b2);
+    if (a1.empty() || b1.empty()) {
+      return a1.empty() ? (b1.empty() ? 0 : -1) : 1;
+    }
+    size_t n = std::min(a1.size(), b1.size());
+    int result = a1.substr(0, n).compare(b1.substr(0, n));
+    if (result != 0) return result;
+    a1.remove_prefix(n);
+    b1.remove_prefix(n);
+  }
+}
+
+// FNV-1a over the concatenation a + b
+static uint64_t HashJoined(std::string_view a, std::string_view b) {
+  uint64_t hash = 14695981039346656037ull;
+  for (std::string_view part : {a, b}) {
+    for (unsigned char c : part) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+  }
+  return hash;
+}
+
+static size_t SplitDirectory(std::string_view file_path) {
+  size_t slash = file_path.rfind('/');
+  return slash == std::string_view::npos ? 0 : slash + 1;
+}
+
+FileTable::const_iterator::const_iterator(const FileTable* table, size_t index)
+    : table_(table), index_(index) {}
+
+FileTable::const_iterator::reference FileTable::const_iterator::operator*()
+    const {
+  if (!value_) {
+    const Entry& entry = table_->entries_[index_];
+    value_.emplace(table_->GetPath(entry), table_->Decode(entry));
+  }
+  return *value_;
+}
+
+FileTable::const_iterator& FileTable::const_iterator::operator++() {
+  index_ = table_->SkipDeleted(index_ + 1);
+  value_.reset();
+  return *this;
+}
+
+std::string FileTable::const_iterator::GetPath() const {
+  return value_ ? value_->first : table_->GetPath(table_->entries_[index_]);
+}
+
+FileTable::FileTable(const FileTable& other)
+    : entries_(other.entries_),
+      sorted_count_(other.sorted_count_),
+      tail_index_(other.tail_index_),
+      names_(other.names_),
+      digests_(other.digests_),
+      extras_(other.extras_),
+      path_index_(other.path_index_),
+      directories_(other.directories_),
+      live_count_(other.live_count_) {
+  RebuildDirectoryIndex();
+}
+
+FileTable& FileTable::operator=(const FileTable& other) {
+  if (this != &other) {
+    FileTable copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+void FileTable::RebuildDirectoryIndex() {
+  // Keys view the strings of this table's own directories_
+  directory_ids_.clear();
+  for (size_t i = 0; i < directories_.size(); i++) {
+    directory_ids_.emplace(directories_[i], static_cast<uint32_t>(i));
+  }
+}
+
+FileTable::const_iterator FileTable::begin() const {
+  Merge();
+  return const_iterator(this, SkipDeleted(0));
+}
+
+FileTable::const_iterator FileTable::end() const {
+  return const_iterator(this, entries_.size());
+}
+
+FileTable::const_iterator FileTable::find(const std::string& file_path) const {
+  if (!path_index_.empty()) {
+    size_t index = FindIndexed(file_path);
+    return index == entries_.size() || (entries_[index].mode & FLAG_DELETED)
+               ? end()
+               : const_iterator(this, index);
+  }
+
+  size_t index = FindSorted(file_path);
+  if (index < sorted_count_ && Compare(entries_[index], file_path) == 0) {
+    return entries_[index].mode & FLAG_DELETED ? end()
+                                               : const_iterator(this, index);
+  }
+  auto it = tail_index_.find(file_path);
+  return it == tail_index_.end() ? end() : const_iterator(this, it->second);
+}
+
+FileTable::const_iterator FileTable::lower_bound(
+    const std::string& file_path) const {
+  Merge();
+  return const_iterator(this, SkipDeleted(FindSorted(file_path)));
+}
+
+void FileTable::insert_or_assign(const std::string& file_path,
+                                 const FileMetadata& file_metadata) {
+  size_t index = FindSorted(file_path);
+  if (index < sorted_count_ && Compare(entries_[index], file_path) == 0) {
+    Entry& entry = entries_[index];
+    if (entry.mode & FLAG_DELETED) live_count_++;
+    Encode(entry, file_metadata);
+    return;
+  }
+  auto tail = tail_index_.find(file_path);
+  if (tail != tail_index_.end()) {
+    Encode(entries_[tail->second], file_metadata);
+    return;
+  }
+
+  Entry entry;
+  size_t split = SplitDirectory(file_path);
+  entry.directory =
+      InternDirectory(std::string_view(file_path).substr(0, split));
+  entry.name_offset = names_.size();
+  entry.name_size = file_path.size() - split;
+  names_.append(file_path, split, std::string::npos);
+  Encode(entry, file_metadata);
+  live_count_++;
+  path_index_.clear();
+
+  // Files read in path order extend the sorted part directly
+  bool in_order = tail_index_.empty() && sorted_count_ == entries_.size() &&
+                  (sorted_count_ == 0 ||
+                   Compare(entries_[sorted_count_ - 1], file_path) < 0);
+  entries_.push_back(entry);
+  if (in_order) {
+    sorted_count_++;
+    return;
+  }
+
+  tail_index_.emplace(file_path, static_cast<uint32_t>(entries_.size() - 1));
+  if (tail_index_.size() >
+      std::max(MIN_TAIL_SIZE, sorted_count_ / TAIL_SHARE)) {
+    Merge();
+  }
+}
+
+FileTable::const_iterator FileTable::erase(const_iterator it) {
+  Entry& entry = entries_[it.index_];
+  entry.mode |= FLAG_DELETED;
+  live_count_--;
+  if (it.index_ >= sorted_count_) {
+    tail_index_.erase(GetPath(entry));
+  }
+  return const_iterator(this, SkipDeleted(it.index_ + 1));
+}
+
+void FileTable::clear() {
+  *this = FileTable();
+}
+
+void FileTable::IndexPaths() const {
+  Merge();
+  if (!path_index_.empty()) return;
+
+  // At most half full keeps probe sequences short
+  size_t slots = 16;
+  while (slots < entries_.size() * 2) slots *= 2;
+  path_index_.assign(slots, 0);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const Entry& entry = entries_[i];
+    size_t slot =
+        HashJoined(directories_[entry.directory], GetName(entry)) & (slots - 1);
+    while (path_index_[slot] != 0) slot = (slot + 1) & (slots - 1);
+    path_index_[slot] = static_cast<uint32_t>(i + 1);
+  }
+}
+
+std::string_view FileTable::GetName(const Entry& entry) const {
+  return std::string_view(names_).substr(entry.name_offset, entry.name_size);
+}
+
+std::string FileTable::GetPath(const Entry& entry) const {
+  std::string file_path = directories_[entry.directory];
+  file_path.append(GetName(entry));
+  return file_path;
+}
+
+int FileTable::Compare(const Entry& entry, std::string_view file_path) const {
+  return CompareJoined(directories_[entry.directory], GetName(entry),
+                       file_path, std::string_view());
+}
+
+size_t FileTable::FindSorted(std::string_view file_path) const {
+  size_t low = 0;
+  size_t high = sorted_count_;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (Compare(entries_[middle], file_path) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+size_t FileTable::FindIndexed(std::string_view file_path) const {
+  size_t mask = path_index_.size() - 1;
+  for (size_t slot = HashJoined(file_path, std::string_view()) & mask;
+       path_index_[slot] != 0; slot = (slot + 1) & mask) {
+    size_t index = path_index_[slot] - 1;
+    if (Compare(entries_[index], file_path) == 0) return index;
+  }
+  return entries_.size();
+}
+
+size_t FileTable::SkipDeleted(size_t index) const {
+  while (index < entries_.size() && (entries_[index].mode & FLAG_DELETED)) {
+    index++;
+  }
+  return index;
+}
+
+uint32_t FileTable::InternDirectory(std::string_view directory) {
+  auto it = directory_ids_.find(directory);
+  if (it != directory_ids_.end()) return it->second;
+
+  directories_.emplace_back(directory);
+  uint32_t id = static_cast<uint32_t>(directories_.size() - 1);
+  directory_ids_.emplace(directories_.back(), id);
+  return id;
+}
+
+void FileTable::Encode(Entry& entry, const FileMetadata& file_metadata) {
+  entry.total_size = file_metadata.total_size;
+  entry.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    file_metadata.mtime.time_since_epoch())
+                    .count();
+  entry.mode = 0;
+  if (!file_metadata.permissions.empty()) {
+    entry.mode |= FLAG_HAS_PERMISSIONS |
+                  (std::stoul(file_metadata.permissions, nullptr, 8) &
+                   MODE_PERMISSIONS);
+  }
+
+  // Earlier digests of a reassigned entry stay behind until the next merge
+  entry.first_digest = digests_.size() / RecordCodec::DIGEST_SIZE;
+  if (!file_metadata.sha256_checksum.empty()) {
+    entry.mode |= FLAG_HAS_CHECKSUM;
+    RecordCodec::PutDigest(digests_, file_metadata.sha256_checksum);
+  }
+  entry.chunk_count = file_metadata.chunk_hashes.size();
+  for (const auto& hash : file_metadata.chunk_hashes) {
+    RecordCodec::PutDigest(digests_, hash);
+  }
+
+  if (file_metadata.is_symlink) entry.mode |= FLAG_SYMLINK;
+  if (file_metadata.original_filename != GetName(entry)) {
+    entry.mode |= FLAG_RENAMED;
+  }
+  if (!file_metadata.holes.empty()) entry.mode |= FLAG_SPARSE;
+  if (!file_metadata.link_group.empty()) entry.mode |= FLAG_LINKED;
+  if (entry.mode &
+      (FLAG_SYMLINK | FLAG_RENAMED | FLAG_SPARSE | FLAG_LINKED)) {
+    if (entry.extra == 0) {
+      extras_.emplace_back();
+      entry.extra = extras_.size();
+    }
+    Extra& extra = extras_[entry.extra - 1];
+    extra.symlink_target = file_metadata.symlink_target;
+    extra.original_filename = file_metadata.original_filename;
+    extra.holes = file_metadata.holes;
+    extra.link_group = file_metadata.link_group;
+  }
+}
+
+FileMetadata FileTable::Decode(const Entry& entry) const {
+  FileMetadata file_metadata;
+  file_metadata.total_size = entry.total_size;
+  file_metadata.mtime = fs::file_time_type(
+      std::chrono::duration_cast<fs::file_time_type::duration>(
+          std::chrono::nanoseconds(entry.mtime)));
+  file_metadata.is_symlink = entry.mode & FLAG_SYMLINK;
+
+  if (entry.mode & FLAG_HAS_PERMISSIONS) {
+    char permissions[16];
+    std::snprintf(permissions, sizeof(permissions), "%04o",
+                  entry.mode & MODE_PERMISSIONS);
+    file_metadata.permissions = permissions;
+  }
+
+  size_t digest_count = entry.chunk_count +
+                        (entry.mode & FLAG_HAS_CHECKSUM ? 1 : 0);
+  RecordCodec::Decoder digests(
+      digests_.data() + entry.first_digest * RecordCodec::DIGEST_SIZE,
+      digest_count * RecordCodec::DIGEST_SIZE);
+  if (entry.mode & FLAG_HAS_CHECKSUM) {
+    file_metadata.sha256_checksum = digests.GetDigest();
+  }
+  file_metadata.chunk_hashes.reserve(entry.chunk_count);
+  for (uint32_t i = 0; i < entry.chunk_count; i++) {
+    file_metadata.chunk_hashes.push_back(digests.GetDigest());
+  }
+
+  // A reassigned entry may keep an extra it no longer uses
+  if (entry.mode & FLAG_SYMLINK) {
+    file_metadata.symlink_target = extras_[entry.extra - 1].symlink_target;
+  }
+  if (entry.mode & FLAG_RENAMED) {
+    file_metadata.original_filename =
+        extras_[entry.extra - 1].original_filename;
+  } else {
+    file_metadata.original_filename = std::string(GetName(entry));
+  }
+  if (entry.mode & FLAG_SPARSE) {
+    file_metadata.holes = extras_[entry.extra - 1].holes;
+  }
+  if (entry.mode & FLAG_LINKED) {
+    file_metadata.link_group = extras_[entry.extra - 1].link_group;
+  }
+  return file_metadata;
+}
+
+void FileTable::Merge() const {
+  if (sorted_count_ == entries_.size()) return;
+
+  std::vector<uint32_t> tail;
+  tail.reserve(entries_.size() - sorted_count_);
+  for (size_t i = sorted_count_; i < entries_.size(); i++) {
+    if (!(entries_[i].mode & FLAG_DELETED)) {
+      tail.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  auto less = [this](uint32_t a, uint32_t b) {
+    const Entry& left = entries_[a];
+    const Entry& right = entries_[b];
+    return CompareJoined(directories_[left.directory], GetName(left),
+                         directories_[right.directory], GetName(right)) < 0;
+  };
+  std::sort(tail.begin(), tail.end(), less);
+
+  // Copy live entries in order into fresh arenas, which also drops the
+  // names and digests of erased and reassigned entries
+  std::vector<Entry> entries;
+  entries.reserve(live_count_);
+  std::string names;
+  names.reserve(names_.size());
+  std::vector<uint8_t> digests;
+  digests.reserve(digests_.size());
+  std::vector<Extra> extras;
+  auto append = [&](uint32_t index) {
+    Entry entry = entries_[index];
+    std::string_view name = GetName(entry);
+    entry.name_offset = names.size();
+    names.append(name);
+
+    size_t digest_bytes =
+        (entry.chunk_count + (entry.mode & FLAG_HAS_CHECKSUM ? 1 : 0)) *
+        RecordCodec::DIGEST_SIZE;
+    auto first =
+        digests_.begin() + entry.first_digest * RecordCodec::DIGEST_SIZE;
+    entry.first_digest = digests.size() / RecordCodec::DIGEST_SIZE;
+    digests.insert(digests.end(), first, first + digest_bytes);
+
+    if (entry.extra != 0) {
+      extras.push_back(std::move(extras_[entry.extra - 1]));
+      entry.extra = extras.size();
+    }
+    entries.push_back(entry);
+  };
+
+  size_t sorted = 0;
+  auto tail_it = tail.begin();
+  while (sorted < sorted_count_ || tail_it != tail.end()) {
+    if (sorted < sorted_count_ && (entries_[sorted].mode & FLAG_DELETED)) {
+      sorted++;
+    } else if (tail_it == tail.end() ||
+               (sorted < sorted_count_ &&
+                less(static_cast<uint32_t>(sorted), *tail_it))) {
+      append(static_cast<uint32_t>(sorted++));
+    } else {
+      append(*tail_it++);
+    }
+  }
+
+  entries_.swap(entries);
+  names_.swap(names);
+  digests_.swap(digests);
+  extras_.swap(extras);
+  sorted_count_ = entries_.size();
+  tail_index_.clear();
+  path_index_.clear();
+}
@@ -0,0 +1,64 @@
+#include "backup_restore/journal.hpp"
+
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "utils/error_util.h"
+#include "utils/setup.h"
+
+namespace Journal {
+
+fs::path GetPath(const std::string& kind, Repository* repo,
+                 const std::string& identity) {
+  std::string key = repo->GetRepositoryInfoString() + "\n" + identity;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(key.data()), key.size(), hash);
+
+  std::stringstream ss;
+  for (int i = 0; i < 8; i++) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << static_cast<int>(hash[i]);
+  }
+
+  return fs::path(Setup::GetAppDataPath()) / "journal" /
+         (kind + "_" + repo->GetName() + "_" + ss.str() + ".journal");
+}
+
+void WriteDurably(const fs::path& path, const std::string& data,
+                  bool truncate) {
+  fs::create_directories(path.parent_path());
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND);
+  int fd = open(path.c_str(), flags, 0600);
+  if (fd < 0) {
+    ErrorUtil::ThrowError("Cannot open journal " + path.string() + ": " +
+                          std::strerror(errno));
+  }
+
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) {
+      std::string error = std::strerror(errno);
+      close(fd);
+      ErrorUtil::ThrowError("Cannot write journal: " + error);
+    }
+    offset += written;
+  }
+
+  if (fsync(fd) < 0) {
+    std::string error = std::strerror(errno);
+    close(fd);
+    ErrorUtil::ThrowError("Cannot sync journal: " + error);
+  }
+  close(fd);
+}
+
+}  // namespace Journal
@@ -0,0 +1,491 @@
+#include "backup_restore/manifest.hpp"
+
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <set>
+#include <sstream>
+
+#include "backup_restore/record_codec.hpp"
+#include "backup_restore/snapshot.hpp"
+#include "utils/encryption_util.h"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+namespace fs = std::filesystem;
+
+static const std::string CATALOG_NAME = "catalog";
+static const std::string CATALOG_MAGIC = "RZCAT";
+static const uint8_t CATALOG_VERSION = 1;
+// Each appended block costs a key derivation to read, past this many the
+// writer folds them back into one
+static const size_t MAX_CATALOG_BLOCKS = 16;
+// JSON predecessor of the catalog, read once to convert it
+static const std::string LEGACY_MANIFEST_NAME = "manifest";
+// Held in the cache while a client updates the catalog
+static const std::string CATALOG_LOCK_NAME = "catalog.lock";
+
+static const uint8_t ENTRY_HAS_DIGEST = 1 << 0;
+
+static std::vector<uint8_t> ReadFileBytes(const fs::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not open file: " + path.string());
+  }
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+static std::string ToHex(const unsigned char* hash, size_t size) {
+  std::stringstream ss;
+  for (size_t i = 0; i < size; ++i) {
+    ss << std::hex << std::setw(2) << std::setfill('0')
+       << static_cast<int>(hash[i]);
+  }
+  return ss.str();
+}
+
+// Files shared between sessions are replaced atomically so a concurrent
+// reader never sees a partial object
+static fs::path TempPathFor(const fs::path& path) {
+  return path.string() + ".part." + std::to_string(getpid());
+}
+
+static void WriteFileBytes(const fs::path& path,
+                           const std::vector<uint8_t>& data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not write file: " + path.string());
+  }
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  file.close();
+  if (!file) {
+    ErrorUtil::ThrowError("Could not write file: " + path.string());
+  }
+}
+
+namespace {
+
+// Exclusive advisory lock on a file, held for as long as it lives
+class FileLock {
+ public:
+  explicit FileLock(const fs::path& path) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      ErrorUtil::ThrowError("Could not open lock file " + path.string() +
+                            ": " + std::strerror(errno));
+    }
+    while (flock(fd_, LOCK_EX) != 0) {
+      if (errno == EINTR) continue;
+      std::string error = std::strerror(errno);
+      close(fd_);
+      ErrorUtil::ThrowError("Could not lock " + path.string() + ": " + error);
+    }
+  }
+  ~FileLock() { close(fd_); }
+
+  FileLock(const FileLock&) = delete;
+  FileLock& operator=(const FileLock&) = delete;
+
+ private:
+  int fd_;
+};
+
+}  // namespace
+
+static std::vector<uint8_t> EncodeEntry(const ManifestEntry& entry) {
+  std::vector<uint8_t> out;
+  RecordCodec::PutString(out, entry.name);
+  out.push_back(static_cast<uint8_t>(entry.type));
+  RecordCodec::PutSigned(
+      out, std::chrono::system_clock::to_time_t(entry.timestamp));
+  RecordCodec::PutString(out, entry.previous_backup);
+  RecordCodec::PutString(out, entry.remarks);
+  RecordCodec::PutVarint(out, entry.file_count);
+  RecordCodec::PutVarint(out, entry.total_size);
+  RecordCodec::PutVarint(out, entry.new_bytes);
+  RecordCodec::PutVarint(out, entry.metadata_size);
+  out.push_back(entry.metadata_digest.empty() ? 0 : ENTRY_HAS_DIGEST);
+  if (!entry.metadata_digest.empty()) {
+    RecordCodec::PutDigest(out, entry.metadata_digest);
+  }
+  return out;
+}
+
+// Fields a later version adds after these are ignored
+static ManifestEntry DecodeEntry(RecordCodec::Decoder& decoder) {
+  ManifestEntry entry;
+  entry.name = decoder.GetString();
+  entry.type = static_cast<BackupType>(decoder.GetByte());
+  entry.timestamp = std::chrono::system_clock::from_time_t(
+      static_cast<time_t>(decoder.GetSigned()));
+  entry.previous_backup = decoder.GetString();
+  entry.remarks = decoder.GetString();
+  entry.file_count = decoder.GetVarint();
+  entry.total_size = decoder.GetVarint();
+  entry.new_bytes = decoder.GetVarint();
+  entry.metadata_size = decoder.GetVarint();
+  if (decoder.GetByte() & ENTRY_HAS_DIGEST) {
+    entry.metadata_digest = decoder.GetDigest();
+  }
+  return entry;
+}
+
+// Encrypt the entries as one block and append it to the catalog
+static void AppendBlock(std::vector<uint8_t>& catalog,
+                        const std::vector<ManifestEntry>& entries,
+                        const std::string& password) {
+  std::vector<uint8_t> records;
+  for (const auto& entry : entries) {
+    std::vector<uint8_t> record = EncodeEntry(entry);
+    RecordCodec::PutVarint(records, record.size());
+    records.insert(records.end(), record.begin(), record.end());
+  }
+
+  EncryptionUtil::MetadataEncryptor encryptor(password);
+  std::vector<uint8_t> block = encryptor.Update(records.data(), records.size());
+  std::vector<uint8_t> tail = encryptor.Final();
+  block.insert(block.end(), tail.begin(), tail.end());
+
+  RecordCodec::PutVarint(catalog, block.size());
+  catalog.insert(catalog.end(), block.begin(), block.end());
+}
+
+Manifest::Manifest(Repository* repo)
+    : repo_(repo), cache_dir_(repo->GetCachePath()) {}
+
+std::string Manifest::CalculateDigest(const fs::path& file_path) {
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not open file: " + file_path.string());
+  }
+
+  SHA256_CTX sha256;
+  SHA256_Init(&sha256);
+  char buffer[8192];
+  while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+    SHA256_Update(&sha256, buffer, file.gcount());
+  }
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, &sha256);
+  return ToHex(hash, SHA256_DIGEST_LENGTH);
+}
+
+void Manifest::Load() {
+  entries_.clear();
+  block_count_ = 0;
+  fs::create_directories(cache_dir_ / "backup");
+
+  fs::path catalog_path = cache_dir_ / CATALOG_NAME;
+  if (Download(CATALOG_NAME, catalog_path)) {
+    ReadCatalog(catalog_path);
+  } else if (ReadLegacyManifest()) {
+    // Converted once, later snapshots only append
+    Save();
+  } else {
+    Rebuild();
+    return;
+  }
+
+  PruneCache();
+}
+
+bool Manifest::Download(const std::string& name, const fs::path& local_path) {
+  fs::path download_path = TempPathFor(local_path);
+  fs::remove(download_path);
+
+  // Only a repository that predates the object lacks it, a failed fetch
+  // must not pass for that
+  bool fetched = false;
+  try {
+    fetched = repo_->DownloadFile(name, download_path.string());
+  } catch (const std::exception&) {
+    std::error_code ec;
+    fs::remove(download_path, ec);
+    throw;
+  }
+
+  if (!fetched) {
+    fs::remove(download_path);
+    return false;
+  }
+  if (!fs::exists(download_path)) {
+    ErrorUtil::ThrowError("Failed to download " + name);
+  }
+  fs::rename(download_path, local_path);
+  return true;
+}
+
+void Manifest::ReadCatalog(const fs::path& catalog_path) {
+  std::vector<uint8_t> catalog = ReadFileBytes(catalog_path);
+  size_t marker_size = CATALOG_MAGIC.size() + 1;
+  if (catalog.size() < marker_size ||
+      !std::equal(CATALOG_MAGIC.begin(), CATALOG_MAGIC.end(),
+                  catalog.begin())) {
+    ErrorUtil::ThrowError("Not a repository catalog: " +
+                          catalog_path.string());
+  }
+  if (catalog[CATALOG_MAGIC.size()] != CATALOG_VERSION) {
+    ErrorUtil::ThrowError(
+        "Unsupported repository catalog version: " +
+        std::to_string(static_cast<int>(catalog[CATALOG_MAGIC.size()])));
+  }
+
+  std::map<std::string, size_t> positions;
+  RecordCodec::Decoder blocks(catalog.data() + marker_size,
+                              catalog.size() - marker_size);
+  while (!blocks.AtEnd()) {
+    std::string block = blocks.GetString();
+    EncryptionUtil::MetadataDecryptor decryptor(repo_->GetPassword());
+    std::vector<uint8_t> records = decryptor.Update(
+        reinterpret_cast<const uint8_t*>(block.data()), block.size());
+    std::vector<uint8_t> tail = decryptor.Final();
+    records.insert(records.end(), tail.begin(), tail.end());
+
+    RecordCodec::Decoder decoder(records);
+    while (!decoder.AtEnd()) {
+      std::string record = decoder.GetString();
+      RecordCodec::Decoder fields(
+          reinterpret_cast<const uint8_t*>(record.data()), record.size());
+      ManifestEntry entry = DecodeEntry(fields);
+
+      // A later record of the same snapshot replaces the earlier one
+      auto [it, inserted] = positions.emplace(entry.name, entries_.size());
+      if (inserted) {
+        entries_.push_back(entry);
+      } else {
+        entries_[it->second] = entry;
+      }
+    }
+    block_count_++;
+  }
+}
+
+bool Manifest::ReadLegacyManifest() {
+  fs::path local_path = cache_dir_ / LEGACY_MANIFEST_NAME;
+  if (!Download(LEGACY_MANIFEST_NAME, local_path)) return false;
+
+  std::string json_string = EncryptionUtil::DecryptMetadata(
+      ReadFileBytes(local_path), repo_->GetPassword());
+  fs::remove(local_path);
+  if (json_string.empty()) {
+    ErrorUtil::ThrowError("Failed to decrypt repository manifest");
+  }
+
+  nlohmann::json manifest_json = nlohmann::json::parse(json_string);
+  for (const auto& entry_json : manifest_json["snapshots"]) {
+    ManifestEntry entry;
+    entry.name = entry_json["name"].get<std::string>();
+    entry.type = static_cast<BackupType>(entry_json["type"].get<int>());
+    entry.timestamp = std::chrono::system_clock::from_time_t(
+        entry_json["timestamp"].get<time_t>());
+    entry.previous_backup = entry_json.value("previous_backup", "");
+    entry.remarks = entry_json.value("remarks", "");
+    entry.file_count = entry_json.value("file_count", uint64_t(0));
+    entry.total_size = entry_json.value("total_size", uint64_t(0));
+    entry.metadata_size = entry_json.value("metadata_size", uint64_t(0));
+    entry.metadata_digest = entry_json.value("metadata_digest", "");
+    entries_.push_back(entry);
+  }
+  return true;
+}
+
+void Manifest::Add(const ManifestEntry& entry, const fs::path& metadata_file) {
+  // Reload first so snapshots written by other clients are kept, and keep
+  // clients of this machine from appending at the same time
+  fs::create_directories(cache_dir_);
+  FileLock lock(cache_dir_ / CATALOG_LOCK_NAME);
+  Load();
+  entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                [&entry](const ManifestEntry& e) {
+                                  return e.name == entry.name;
+                                }),
+                 entries_.end());
+  entries_.push_back(entry);
+  if (block_count_ + 1 < MAX_CATALOG_BLOCKS) {
+    Append(entry);
+  } else {
+    Save();
+  }
+
+  fs::path cached_path = cache_dir_ / "backup" / entry.name;
+  fs::path temp_path = TempPathFor(cached_path);
+  fs::copy_file(metadata_file, temp_path, fs::copy_options::overwrite_existing);
+  fs::rename(temp_path, cached_path);
+}
+
+std::vector<ManifestEntry> Manifest::GetEntries() const {
+  std::vector<ManifestEntry> entries = entries_;
+  std::sort(entries.begin(), entries.end(),
+            [](const ManifestEntry& a, const ManifestEntry& b) {
+              return a.name > b.name;
+            });
+  return entries;
+}
+
+std::optional<ManifestEntry> Manifest::Find(
+    const std::string& backup_name) const {
+  for (const auto& entry : entries_) {
+    if (entry.name == backup_name) return entry;
+  }
+  return std::nullopt;
+}
+
+fs::path Manifest::FetchMetadata(const std::string& backup_name) {
+  fs::path cached_path = cache_dir_ / "backup" / backup_name;
+  auto entry = Find(backup_name);
+  if (entry && IsCacheValid(*entry, cached_path)) {
+    return cached_path;
+  }
+
+  fs::path download_path = TempPathFor(cached_path);
+  fs::create_directories(cached_path.parent_path());
+  repo_->DownloadFile("backup/" + backup_name, download_path.string());
+  if (!fs::exists(download_path)) {
+    ErrorUtil::ThrowError("Backup metadata not found: " + backup_name);
+  }
+
+  if (entry && !IsCacheValid(*entry, download_path)) {
+    fs::remove(download_path);
+    ErrorUtil::ThrowError("Backup metadata does not match manifest: " +
+                          backup_name);
+  }
+  fs::rename(download_path, cached_path);
+  return cached_path;
+}
+
+bool Manifest::IsCacheValid(const ManifestEntry& entry,
+                            const fs::path& cached_path) const {
+  std::error_code ec;
+  auto size = fs::file_size(cached_path, ec);
+  if (ec) return false;
+
+  // Entries written before digests were recorded are checked by size only
+  if (entry.metadata_size != 0 && size != entry.metadata_size) return false;
+  if (entry.metadata_digest.empty()) return entry.metadata_size != 0;
+  return CalculateDigest(cached_path) == entry.metadata_digest;
+}
+
+void Manifest::PruneCache() {
+  std::set<std::string> names;
+  for (const auto& entry : entries_) {
+    names.insert(entry.name);
+  }
+
+  // Drop metadata of snapshots no longer in the repository and leftovers
+  // of interrupted downloads
+  std::error_code ec;
+  auto stale_before = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto& file : fs::directory_iterator(cache_dir_ / "backup", ec)) {
+    std::string name = file.path().filename().string();
+    if (name.find(".part.") != std::string::npos) {
+      if (file.last_write_time(ec) < stale_before) fs::remove(file.path(), ec);
+    } else if (!names.count(name)) {
+      fs::remove(file.path(), ec);
+    }
+  }
+}
+
+void Manifest::Rebuild() {
+  Logger::SystemLog("Indexing snapshots of " +
+                    repo_->GetRepositoryInfoString() + " into manifest");
+
+  // Start from an empty cache so snapshots deleted from the repository are
+  // not indexed again
+  fs::path backup_dir = cache_dir_ / "backup";
+  fs::remove_all(backup_dir);
+  fs::create_directories(backup_dir);
+  if (!repo_->DownloadDirectory("backup/", backup_dir.string())) {
+    ErrorUtil::ThrowError("Failed to load metadata");
+  }
+
+  entries_.clear();
+  for (const auto& file : fs::directory_iterator(backup_dir)) {
+    if (!file.is_regular_file()) continue;
+    // Leftovers of interrupted downloads or publishes
+    std::string name = file.path().filename().string();
+    if (name.find(".part.") != std::string::npos ||
+        name.find(".staged") != std::string::npos) {
+      continue;
+    }
+
+    std::string backup_name = name;
+    try {
+      SnapshotReader reader(file.path(), repo_->GetPassword());
+      const BackupMetadata& header = reader.GetHeader();
+
+      ManifestEntry entry;
+      entry.name = backup_name;
+      entry.type = header.type;
+      entry.timestamp = header.timestamp;
+      entry.previous_backup = header.previous_backup;
+      entry.remarks = header.remarks;
+      entry.metadata_size = file.file_size();
+      entry.metadata_digest = CalculateDigest(file.path());
+      if (reader.GetRoot()) {
+        // Tree snapshots carry their totals in the root record
+        entry.file_count = reader.GetRoot()->file_count;
+        entry.total_size = reader.GetRoot()->total_size;
+      } else {
+        reader.ReadFiles([&entry](const std::string&,
+                                  FileMetadata&& file_metadata) {
+          entry.file_count++;
+          entry.total_size += file_metadata.total_size;
+        });
+      }
+      entries_.push_back(entry);
+    } catch (const std::exception&) {
+      Logger::SystemLog("Skipping unreadable snapshot: " + backup_name,
+                        LogLevel::WARNING);
+    }
+  }
+
+  // A catalog published by another client meanwhile is kept, it may hold
+  // what the snapshots do not
+  fs::path catalog_path = cache_dir_ / CATALOG_NAME;
+  if (Download(CATALOG_NAME, catalog_path)) {
+    entries_.clear();
+    ReadCatalog(catalog_path);
+    return;
+  }
+  Save();
+}
+
+void Manifest::Save() {
+  std::vector<uint8_t> catalog(CATALOG_MAGIC.begin(), CATALOG_MAGIC.end());
+  catalog.push_back(CATALOG_VERSION);
+  block_count_ = 0;
+  if (!entries_.empty()) {
+    AppendBlock(catalog, entries_, repo_->GetPassword());
+    block_count_ = 1;
+  }
+  Publish(catalog);
+}
+
+void Manifest::Append(const ManifestEntry& entry) {
+  // Blocks already in the catalog are passed on byte for byte
+  std::vector<uint8_t> catalog = ReadFileBytes(cache_dir_ / CATALOG_NAME);
+  AppendBlock(catalog, {entry}, repo_->GetPassword());
+  block_count_++;
+  Publish(catalog);
+}
+
+void Manifest::Publish(const std::vector<uint8_t>& catalog) {
+  fs::path local_path = cache_dir_ / CATALOG_NAME;
+  fs::path temp_path = TempPathFor(local_path);
+  WriteFileBytes(temp_path, catalog);
+  fs::rename(temp_path, local_path);
+
+  repo_->UploadFile(local_path.string(), "");
+  repo_->Flush();
+}
@@ -0,0 +1,29 @@
+#include "backup_restore/mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils/error_util.h"
+
+MappedFile::MappedFile(const fs::path& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ErrorUtil::ThrowError("Could not open file: " + path.string());
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size_ = st.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      data_ = static_cast<const uint8_t*>(data);
+    }
+  }
+  close(fd);
+  if (!data_) {
+    ErrorUtil::ThrowError("Could not map file: " + path.string());
+  }
+}
+
+MappedFile::~MappedFile() { munmap(const_cast<uint8_t*>(data_), size_); }
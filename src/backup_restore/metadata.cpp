@@ -0,0 +1,61 @@
+#include "backup_restore/metadata.hpp"
+
+nlohmann::json FileMetadataToJson(const FileMetadata& file_metadata) {
+  nlohmann::json file_json;
+  file_json["original_filename"] = file_metadata.original_filename;
+  file_json["chunk_hashes"] = file_metadata.chunk_hashes;
+  file_json["total_size"] = file_metadata.total_size;
+  file_json["is_symlink"] = file_metadata.is_symlink;
+  file_json["permissions"] = file_metadata.permissions;
+  file_json["sha256_checksum"] = file_metadata.sha256_checksum;
+  if (file_metadata.is_symlink) {
+    file_json["symlink_target"] = file_metadata.symlink_target;
+  }
+  if (!file_metadata.holes.empty()) {
+    nlohmann::json holes = nlohmann::json::array();
+    for (const auto& hole : file_metadata.holes) {
+      holes.push_back({hole.offset, hole.length});
+    }
+    file_json["holes"] = holes;
+  }
+  if (!file_metadata.link_group.empty()) {
+    file_json["link_group"] = file_metadata.link_group;
+  }
+
+  // Convert file times to seconds since epoch
+  auto mtime_seconds = std::chrono::duration_cast<std::chrono::seconds>(
+                           file_metadata.mtime.time_since_epoch())
+                           .count();
+
+  file_json["mtime"] = mtime_seconds;
+  return file_json;
+}
+
+FileMetadata FileMetadataFromJson(const nlohmann::json& file_json) {
+  FileMetadata file_metadata;
+  file_metadata.original_filename = file_json["original_filename"];
+  file_metadata.chunk_hashes =
+      file_json["chunk_hashes"].get<std::vector<std::string>>();
+  file_metadata.total_size = file_json["total_size"].get<uint64_t>();
+  file_metadata.mtime = fs::file_time_type(
+      std::chrono::duration_cast<fs::file_time_type::duration>(
+          std::chrono::seconds(file_json["mtime"].get<time_t>())));
+
+  // Load symlink information (with backward compatibility)
+  file_metadata.is_symlink = file_json.value("is_symlink", false);
+  if (file_metadata.is_symlink) {
+    file_metadata.symlink_target = file_json["symlink_target"];
+  }
+
+  // Load new fields with backward compatibility
+  file_metadata.permissions = file_json.value("permissions", "");
+  file_metadata.sha256_checksum = file_json.value("sha256_checksum", "");
+  if (file_json.contains("holes")) {
+    for (const auto& hole : file_json["holes"]) {
+      file_metadata.holes.push_back(
+          {hole.at(0).get<uint64_t>(), hole.at(1).get<uint64_t>()});
+    }
+  }
+  file_metadata.link_group = file_json.value("link_group", "");
+  return file_metadata;
+}
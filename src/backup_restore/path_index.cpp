@@ -0,0 +1,383 @@
+#include "backup_restore/path_index.hpp"
+
+#include <fnmatch.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+
+#include "backup_restore/record_codec.hpp"
+#include "backup_restore/snapshot.hpp"
+#include "utils/encryption_util.h"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+namespace fs = std::filesystem;
+
+static const std::string SEGMENT_MAGIC = "RZHIST";
+static const uint8_t SEGMENT_VERSION = 1;
+static const uint8_t SEGMENT_COMPLETE = 1 << 0;
+static const size_t FOOTER_SIZE = 8;
+
+// Plaintext bytes per block, a lookup opens about one of them
+static const size_t BLOCK_SIZE = 64 * 1024;
+static const uint64_t MAX_BLOCK_SIZE = 1ULL << 30;
+
+static const uint8_t RECORD_FILE = 'F';
+static const uint8_t RECORD_REMOVED = 'X';
+static const uint8_t RECORD_HAS_CHECKSUM = 1 << 0;
+
+namespace {
+
+// Where a block lies in its segment and the first path it holds
+struct BlockInfo {
+  std::string first_path;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+}  // namespace
+
+static std::vector<uint8_t> SealBlock(const std::vector<uint8_t>& plain,
+                                      const std::string& password) {
+  std::vector<uint8_t> compressed(ZSTD_compressBound(plain.size()));
+  size_t compressed_size =
+      ZSTD_compress(compressed.data(), compressed.size(), plain.data(),
+                    plain.size(), ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError(compressed_size)) {
+    ErrorUtil::ThrowError("Failed to compress history block: " +
+                          std::string(ZSTD_getErrorName(compressed_size)));
+  }
+
+  EncryptionUtil::MetadataEncryptor encryptor(password);
+  std::vector<uint8_t> block =
+      encryptor.Update(compressed.data(), compressed_size);
+  std::vector<uint8_t> tail = encryptor.Final();
+  block.insert(block.end(), tail.begin(), tail.end());
+  return block;
+}
+
+static std::vector<uint8_t> OpenBlock(const std::vector<uint8_t>& block,
+                                      const std::string& password) {
+  EncryptionUtil::MetadataDecryptor decryptor(password);
+  std::vector<uint8_t> compressed =
+      decryptor.Update(block.data(), block.size());
+  std::vector<uint8_t> tail = decryptor.Final();
+  compressed.insert(compressed.end(), tail.begin(), tail.end());
+
+  unsigned long long size =
+      ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN ||
+      size > MAX_BLOCK_SIZE) {
+    ErrorUtil::ThrowError("Corrupt history block");
+  }
+  std::vector<uint8_t> plain(size);
+  size_t result = ZSTD_decompress(plain.data(), plain.size(),
+                                  compressed.data(), compressed.size());
+  if (ZSTD_isError(result) || result != size) {
+    ErrorUtil::ThrowError("Failed to decompress history block");
+  }
+  return plain;
+}
+
+static std::vector<uint8_t> ReadRange(std::ifstream& file, uint64_t offset,
+                                      uint64_t length) {
+  std::vector<uint8_t> data(length);
+  file.seekg(offset);
+  if (!file.read(reinterpret_cast<char*>(data.data()), length)) {
+    ErrorUtil::ThrowError("Truncated history segment");
+  }
+  return data;
+}
+
+// Part of the pattern before its first wildcard, every match starts with it
+static std::string GetLiteralPrefix(const std::string& pattern) {
+  return pattern.substr(0, pattern.find_first_of("*?["));
+}
+
+static bool Matches(const std::string& pattern, const std::string& path) {
+  if (pattern.find_first_of("*?[") != std::string::npos) {
+    return fnmatch(pattern.c_str(), path.c_str(), 0) == 0;
+  }
+  if (pattern.back() == '/') {
+    return path.compare(0, pattern.size(), pattern) == 0;
+  }
+  return path == pattern;
+}
+
+PathIndex::PathIndex(Repository* repo, const fs::path& cache_dir)
+    : repo_(repo), cache_dir_(cache_dir / "history") {
+  fs::create_directories(cache_dir_);
+}
+
+fs::path PathIndex::GetCachePath(const std::string& backup_name) const {
+  return cache_dir_ / (backup_name + ".idx");
+}
+
+void PathIndex::AddSnapshot(const std::string& backup_name, bool complete,
+                            SnapshotSpool& changes) {
+  fs::path segment_path = GetCachePath(backup_name);
+  fs::path temp_path =
+      segment_path.string() + ".part." + std::to_string(getpid());
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not write file: " + temp_path.string());
+  }
+  file.write(SEGMENT_MAGIC.data(), SEGMENT_MAGIC.size());
+  file.put(static_cast<char>(SEGMENT_VERSION));
+  file.put(static_cast<char>(complete ? SEGMENT_COMPLETE : 0));
+  uint64_t offset = SEGMENT_MAGIC.size() + 2;
+
+  std::vector<BlockInfo> blocks;
+  std::vector<uint8_t> plain;
+  auto flush_block = [&]() {
+    if (plain.empty()) return;
+    std::vector<uint8_t> sealed = SealBlock(plain, repo_->GetPassword());
+    file.write(reinterpret_cast<const char*>(sealed.data()), sealed.size());
+    blocks.back().offset = offset;
+    blocks.back().length = sealed.size();
+    offset += sealed.size();
+    plain.clear();
+  };
+
+  changes.Merge([&](const std::string& file_path,
+                    const FileMetadata* file_metadata) {
+    if (plain.empty()) {
+      blocks.push_back(BlockInfo{file_path, 0, 0});
+    }
+    RecordCodec::PutString(plain, file_path);
+    if (!file_metadata) {
+      plain.push_back(RECORD_REMOVED);
+    } else {
+      plain.push_back(RECORD_FILE);
+      RecordCodec::PutVarint(plain, file_metadata->total_size);
+      RecordCodec::PutSigned(
+          plain, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     file_metadata->mtime.time_since_epoch())
+                     .count());
+      bool has_checksum = !file_metadata->sha256_checksum.empty();
+      plain.push_back(has_checksum ? RECORD_HAS_CHECKSUM : 0);
+      if (has_checksum) {
+        RecordCodec::PutDigest(plain, file_metadata->sha256_checksum);
+      }
+    }
+    if (plain.size() >= BLOCK_SIZE) {
+      flush_block();
+    }
+  });
+  flush_block();
+
+  // The directory goes last so blocks can be written as they fill up
+  std::vector<uint8_t> directory;
+  RecordCodec::PutVarint(directory, blocks.size());
+  for (const auto& block : blocks) {
+    RecordCodec::PutString(directory, block.first_path);
+    RecordCodec::PutVarint(directory, block.offset);
+    RecordCodec::PutVarint(directory, block.length);
+  }
+  std::vector<uint8_t> sealed = SealBlock(directory, repo_->GetPassword());
+  file.write(reinterpret_cast<const char*>(sealed.data()), sealed.size());
+  for (size_t i = 0; i < FOOTER_SIZE; i++) {
+    file.put(static_cast<char>(offset >> (8 * i)));
+  }
+  file.close();
+  if (!file) {
+    fs::remove(temp_path);
+    ErrorUtil::ThrowError("Could not write file: " + temp_path.string());
+  }
+  fs::rename(temp_path, segment_path);
+
+  if (!repo_->UploadFile(segment_path.string(), "history/")) {
+    ErrorUtil::ThrowError("Failed to upload file history of " + backup_name);
+  }
+}
+
+bool PathIndex::FetchSegment(const std::string& backup_name) {
+  fs::path segment_path = GetCachePath(backup_name);
+  if (fs::exists(segment_path)) return true;
+
+  fs::path download_path =
+      segment_path.string() + ".part." + std::to_string(getpid());
+  bool fetched = false;
+  try {
+    fetched = repo_->DownloadFile("history/" + backup_name + ".idx",
+                                  download_path.string());
+  } catch (const std::exception&) {
+    fetched = false;  // Snapshot predates the index
+  }
+  if (!fetched || !fs::exists(download_path)) {
+    fs::remove(download_path);
+    return false;
+  }
+  fs::rename(download_path, segment_path);
+  return true;
+}
+
+void PathIndex::BuildSegment(Manifest& manifest, TreeStore* trees,
+                             const std::string& backup_name) {
+  Logger::TerminalLog("Indexing file history of backup " + backup_name);
+  SnapshotReader reader(manifest.FetchMetadata(backup_name),
+                        repo_->GetPassword(), trees);
+  fs::path spool_dir = cache_dir_ / (".spool." + std::to_string(getpid()));
+  {
+    SnapshotSpool files(spool_dir);
+    reader.ReadFiles(
+        [&files](const std::string& file_path, FileMetadata&& file_metadata) {
+          files.Add(file_path, file_metadata);
+        });
+    AddSnapshot(backup_name, true, files);
+  }
+  std::error_code ec;
+  fs::remove_all(spool_dir, ec);
+}
+
+PathIndex::Segment PathIndex::ReadSegment(const std::string& backup_name,
+                                          const std::string& pattern) {
+  fs::path segment_path = GetCachePath(backup_name);
+  std::ifstream file(segment_path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not open file: " + segment_path.string());
+  }
+  uint64_t size = file.tellg();
+  size_t header_size = SEGMENT_MAGIC.size() + 2;
+  if (size < header_size + FOOTER_SIZE) {
+    ErrorUtil::ThrowError("Corrupt history segment of " + backup_name);
+  }
+
+  std::vector<uint8_t> header = ReadRange(file, 0, header_size);
+  if (!std::equal(SEGMENT_MAGIC.begin(), SEGMENT_MAGIC.end(),
+                  header.begin())) {
+    ErrorUtil::ThrowError("Corrupt history segment of " + backup_name);
+  }
+  if (header[SEGMENT_MAGIC.size()] != SEGMENT_VERSION) {
+    ErrorUtil::ThrowError("Unsupported history segment version " +
+                          std::to_string(header[SEGMENT_MAGIC.size()]));
+  }
+  Segment segment;
+  segment.complete = header[SEGMENT_MAGIC.size() + 1] & SEGMENT_COMPLETE;
+
+  std::vector<uint8_t> footer = ReadRange(file, size - FOOTER_SIZE, FOOTER_SIZE);
+  uint64_t directory_offset = 0;
+  for (size_t i = 0; i < FOOTER_SIZE; i++) {
+    directory_offset |= static_cast<uint64_t>(footer[i]) << (8 * i);
+  }
+  if (directory_offset < header_size ||
+      directory_offset > size - FOOTER_SIZE) {
+    ErrorUtil::ThrowError("Corrupt history segment of " + backup_name);
+  }
+
+  std::vector<uint8_t> directory = OpenBlock(
+      ReadRange(file, directory_offset,
+                size - FOOTER_SIZE - directory_offset),
+      repo_->GetPassword());
+  RecordCodec::Decoder directory_decoder(directory);
+  std::vector<BlockInfo> blocks(directory_decoder.GetVarint());
+  for (auto& block : blocks) {
+    block.first_path = directory_decoder.GetString();
+    block.offset = directory_decoder.GetVarint();
+    block.length = directory_decoder.GetVarint();
+    if (block.offset + block.length > directory_offset) {
+      ErrorUtil::ThrowError("Corrupt history segment of " + backup_name);
+    }
+  }
+
+  // Matches lie from the block that would hold the literal prefix up to
+  // the first block starting past it
+  std::string prefix = GetLiteralPrefix(pattern);
+  auto first = std::upper_bound(
+      blocks.begin(), blocks.end(), prefix,
+      [](const std::string& path, const BlockInfo& block) {
+        return path < block.first_path;
+      });
+  if (first != blocks.begin()) --first;
+
+  for (auto block = first; block != blocks.end(); ++block) {
+    if (block != first &&
+        block->first_path.compare(0, prefix.size(), prefix) > 0) {
+      break;
+    }
+    std::vector<uint8_t> plain = OpenBlock(
+        ReadRange(file, block->offset, block->length), repo_->GetPassword());
+    RecordCodec::Decoder decoder(plain);
+    while (!decoder.AtEnd()) {
+      std::string file_path = decoder.GetString();
+      bool removed = decoder.GetByte() == RECORD_REMOVED;
+      FileVersion version;
+      if (!removed) {
+        version.size = decoder.GetVarint();
+        version.mtime = fs::file_time_type(
+            std::chrono::duration_cast<fs::file_time_type::duration>(
+                std::chrono::nanoseconds(decoder.GetSigned())));
+        if (decoder.GetByte() & RECORD_HAS_CHECKSUM) {
+          version.sha256_checksum = decoder.GetDigest();
+        }
+      }
+      if (!Matches(pattern, file_path)) continue;
+
+      version.path = file_path;
+      version.backup_name = backup_name;
+      if (removed) {
+        segment.files[file_path] = std::nullopt;
+      } else {
+        segment.files[file_path] = std::move(version);
+      }
+    }
+  }
+  return segment;
+}
+
+std::vector<FileVersion> PathIndex::Find(Manifest& manifest, TreeStore* trees,
+                                         const std::string& pattern) {
+  if (pattern.empty()) {
+    ErrorUtil::ThrowError("Empty file history pattern");
+  }
+
+  std::vector<ManifestEntry> entries = manifest.GetEntries();
+  std::map<std::string, std::string> previous_backups;
+  std::map<std::string, Segment> segments;
+  bool built = false;
+  for (const auto& entry : entries) {
+    if (!FetchSegment(entry.name)) {
+      BuildSegment(manifest, trees, entry.name);
+      built = true;
+    }
+    previous_backups[entry.name] = entry.previous_backup;
+    segments[entry.name] = ReadSegment(entry.name, pattern);
+  }
+  if (built) {
+    repo_->Flush();
+  }
+
+  std::set<std::string> paths;
+  for (const auto& [_, segment] : segments) {
+    for (const auto& [file_path, __] : segment.files) {
+      paths.insert(file_path);
+    }
+  }
+
+  // A segment that does not mention a path leaves it as the base snapshot
+  // had it, complete segments mention every file they hold
+  std::vector<FileVersion> versions;
+  for (const auto& file_path : paths) {
+    for (const auto& [backup_name, _] : segments) {
+      std::string name = backup_name;
+      for (size_t depth = 0; depth <= entries.size(); depth++) {
+        auto segment = segments.find(name);
+        if (segment == segments.end()) break;
+        auto file = segment->second.files.find(file_path);
+        if (file != segment->second.files.end()) {
+          if (file->second) {
+            versions.push_back(*file->second);
+            versions.back().backup_name = backup_name;
+          }
+          break;
+        }
+        if (segment->second.complete) break;
+        name = previous_backups[name];
+      }
+    }
+  }
+  return versions;
+}
@@ -0,0 +1,126 @@
+#include "backup_restore/prefetcher.hpp"
+
+#include <algorithm>
+
+ChunkPrefetcher::ChunkPrefetcher(ChunkLoader loader, size_t worker_count,
+                                 size_t window)
+    : loader_(std::move(loader)), window_(std::max<size_t>(window, 1)) {
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers_.emplace_back(&ChunkPrefetcher::WorkerLoop, this);
+  }
+}
+
+ChunkPrefetcher::~ChunkPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+uint64_t ChunkPrefetcher::Schedule(const std::vector<std::string>& hashes,
+                                   size_t first) {
+  uint64_t end;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = first; i < hashes.size(); ++i) {
+      // Fills have no stored object to load
+      if (Chunker::IsFillHash(hashes[i])) continue;
+      Slot slot;
+      slot.hash = hashes[i];
+      slots_.push_back(std::move(slot));
+    }
+    end = front_seq_ + slots_.size();
+  }
+  work_cv_.notify_all();
+  return end;
+}
+
+Chunk ChunkPrefetcher::Get(const std::string& hash) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (slots_.empty() || slots_.front().hash != hash) {
+    lock.unlock();
+    return loader_(hash);
+  }
+
+  if (!slots_.front().started) {
+    // No worker picked it up yet, load it here instead of waiting
+    PopFront();
+    lock.unlock();
+    work_cv_.notify_all();
+    return loader_(hash);
+  }
+
+  ready_cv_.wait(lock, [this] { return slots_.front().done; });
+  Chunk chunk = std::move(slots_.front().chunk);
+  std::exception_ptr error = slots_.front().error;
+  PopFront();
+  lock.unlock();
+  work_cv_.notify_all();
+
+  if (error) std::rethrow_exception(error);
+  return chunk;
+}
+
+void ChunkPrefetcher::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // In-flight loads see their sequence number fall behind and are dropped
+  front_seq_ += slots_.size();
+  slots_.clear();
+}
+
+void ChunkPrefetcher::SkipTo(uint64_t seq) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!slots_.empty() && front_seq_ < seq) {
+      PopFront();
+    }
+  }
+  work_cv_.notify_all();
+}
+
+void ChunkPrefetcher::PopFront() {
+  slots_.pop_front();
+  ++front_seq_;
+}
+
+void ChunkPrefetcher::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    size_t index = 0;
+    work_cv_.wait(lock, [this, &index] {
+      if (stopping_) return true;
+      size_t limit = std::min(window_, slots_.size());
+      for (index = 0; index < limit; ++index) {
+        if (!slots_[index].started) return true;
+      }
+      return false;
+    });
+    if (stopping_) return;
+
+    slots_[index].started = true;
+    uint64_t seq = front_seq_ + index;
+    std::string hash = slots_[index].hash;
+    lock.unlock();
+
+    Chunk chunk;
+    std::exception_ptr error;
+    try {
+      chunk = loader_(hash);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    if (seq >= front_seq_) {
+      Slot& slot = slots_[seq - front_seq_];
+      slot.chunk = std::move(chunk);
+      slot.error = error;
+      slot.done = true;
+      ready_cv_.notify_all();
+    }
+  }
+}
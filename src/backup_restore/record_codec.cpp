@@ -0,0 +1,199 @@
+#include "backup_restore/record_codec.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+#include "utils/error_util.h"
+
+namespace RecordCodec {
+
+static const uint8_t FLAG_SYMLINK = 1 << 0;
+static const uint8_t FLAG_PERMISSIONS = 1 << 1;
+static const uint8_t FLAG_CHECKSUM = 1 << 2;
+static const uint8_t FLAG_HOLES = 1 << 3;
+static const uint8_t FLAG_LINKED = 1 << 4;
+
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+void PutSigned(std::vector<uint8_t>& out, int64_t value) {
+  // Zigzag keeps small negative values short
+  PutVarint(out, (static_cast<uint64_t>(value) << 1) ^
+                     static_cast<uint64_t>(value >> 63));
+}
+
+void PutString(std::vector<uint8_t>& out, const std::string& value) {
+  PutVarint(out, value.size());
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+void PutDigest(std::vector<uint8_t>& out, const std::string& hex) {
+  if (hex.size() != DIGEST_SIZE * 2) {
+    ErrorUtil::ThrowError("Invalid SHA-256 digest: " + hex);
+  }
+  for (size_t i = 0; i < DIGEST_SIZE; i++) {
+    int high = HexValue(hex[2 * i]);
+    int low = HexValue(hex[2 * i + 1]);
+    if (high < 0 || low < 0) {
+      ErrorUtil::ThrowError("Invalid SHA-256 digest: " + hex);
+    }
+    out.push_back(static_cast<uint8_t>(high << 4 | low));
+  }
+}
+
+void PutFileMetadata(std::vector<uint8_t>& out,
+                     const FileMetadata& file_metadata) {
+  uint8_t flags = 0;
+  if (file_metadata.is_symlink) flags |= FLAG_SYMLINK;
+  if (!file_metadata.permissions.empty()) flags |= FLAG_PERMISSIONS;
+  if (!file_metadata.sha256_checksum.empty()) flags |= FLAG_CHECKSUM;
+  if (!file_metadata.holes.empty()) flags |= FLAG_HOLES;
+  if (!file_metadata.link_group.empty()) flags |= FLAG_LINKED;
+
+  PutString(out, file_metadata.original_filename);
+  PutVarint(out, file_metadata.total_size);
+  PutSigned(out, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     file_metadata.mtime.time_since_epoch())
+                     .count());
+  out.push_back(flags);
+  if (flags & FLAG_SYMLINK) {
+    PutString(out, file_metadata.symlink_target);
+  }
+  if (flags & FLAG_PERMISSIONS) {
+    PutVarint(out, std::stoul(file_metadata.permissions, nullptr, 8));
+  }
+  if (flags & FLAG_CHECKSUM) {
+    PutDigest(out, file_metadata.sha256_checksum);
+  }
+  if (flags & FLAG_HOLES) {
+    // Offsets as gaps from the end of the previous hole
+    PutVarint(out, file_metadata.holes.size());
+    uint64_t end = 0;
+    for (const auto& hole : file_metadata.holes) {
+      PutVarint(out, hole.offset - end);
+      PutVarint(out, hole.length);
+      end = hole.offset + hole.length;
+    }
+  }
+  if (flags & FLAG_LINKED) {
+    PutString(out, file_metadata.link_group);
+  }
+  PutVarint(out, file_metadata.chunk_hashes.size());
+  for (const auto& hash : file_metadata.chunk_hashes) {
+    PutDigest(out, hash);
+  }
+}
+
+uint8_t Decoder::GetByte() {
+  Require(1);
+  return data_[pos_++];
+}
+
+uint64_t Decoder::GetVarint() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = GetByte();
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  ErrorUtil::ThrowError("Corrupt metadata record: varint too long");
+  return 0;
+}
+
+int64_t Decoder::GetSigned() {
+  uint64_t value = GetVarint();
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+std::string Decoder::GetString() {
+  uint64_t length = GetVarint();
+  Require(length);
+  std::string value(reinterpret_cast<const char*>(data_ + pos_), length);
+  pos_ += length;
+  return value;
+}
+
+std::string Decoder::GetDigest() {
+  static const char* HEX = "0123456789abcdef";
+  Require(DIGEST_SIZE);
+  std::string hex(DIGEST_SIZE * 2, '0');
+  for (size_t i = 0; i < DIGEST_SIZE; i++) {
+    hex[2 * i] = HEX[data_[pos_ + i] >> 4];
+    hex[2 * i + 1] = HEX[data_[pos_ + i] & 0x0f];
+  }
+  pos_ += DIGEST_SIZE;
+  return hex;
+}
+
+FileMetadata Decoder::GetFileMetadata() {
+  FileMetadata file_metadata;
+  file_metadata.original_filename = GetString();
+  file_metadata.total_size = GetVarint();
+  file_metadata.mtime = fs::file_time_type(
+      std::chrono::duration_cast<fs::file_time_type::duration>(
+          std::chrono::nanoseconds(GetSigned())));
+
+  uint8_t flags = GetByte();
+  file_metadata.is_symlink = flags & FLAG_SYMLINK;
+  if (flags & FLAG_SYMLINK) {
+    file_metadata.symlink_target = GetString();
+  }
+  if (flags & FLAG_PERMISSIONS) {
+    char permissions[16];
+    std::snprintf(permissions, sizeof(permissions), "%04o",
+                  static_cast<unsigned>(GetVarint()));
+    file_metadata.permissions = permissions;
+  }
+  if (flags & FLAG_CHECKSUM) {
+    file_metadata.sha256_checksum = GetDigest();
+  }
+  if (flags & FLAG_HOLES) {
+    uint64_t hole_count = GetVarint();
+    // Each hole takes at least two bytes
+    if (hole_count > (size_ - pos_) / 2) {
+      ErrorUtil::ThrowError("Corrupt metadata record: unexpected end");
+    }
+    file_metadata.holes.reserve(hole_count);
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < hole_count; i++) {
+      FileExtent hole;
+      hole.offset = end + GetVarint();
+      hole.length = GetVarint();
+      end = hole.offset + hole.length;
+      file_metadata.holes.push_back(hole);
+    }
+  }
+  if (flags & FLAG_LINKED) {
+    file_metadata.link_group = GetString();
+  }
+  uint64_t chunk_count = GetVarint();
+  // Reject counts the record can't hold before reserving for them
+  if (chunk_count > (size_ - pos_) / DIGEST_SIZE) {
+    ErrorUtil::ThrowError("Corrupt metadata record: unexpected end");
+  }
+  file_metadata.chunk_hashes.reserve(chunk_count);
+  for (uint64_t i = 0; i < chunk_count; i++) {
+    file_metadata.chunk_hashes.push_back(GetDigest());
+  }
+  return file_metadata;
+}
+
+void Decoder::Require(uint64_t count) {
+  if (count > size_ - pos_) {
+    ErrorUtil::ThrowError("Corrupt metadata record: unexpected end");
+  }
+}
+
+}  // namespace RecordCodec
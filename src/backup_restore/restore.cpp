@@ -1,14 +1,19 @@
 #include "backup_restore/restore.hpp"
 
+#include <fcntl.h>
 #include <openssl/sha.h>
+#include <unistd.h>
 #include <zstd.h>
 
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <cstring>
+#include <deque>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <thread>
 
 #include "backup_restore/chunker.hpp"
 #include "backup_restore/progress.hpp"
@@ -16,21 +21,38 @@
 
 namespace fs = std::filesystem;
 
-Restore::Restore(Repository* repo) : repo_(repo) {
-  // Create a temporary working directory
-  temp_dir_ = fs::temp_directory_path() / ("restore_temp_" + repo->GetName());
-
+// Make restored files durable in the journal at least this often
+static const auto CHECKPOINT_INTERVAL = std::chrono::seconds(60);
+static const uint64_t CHECKPOINT_BYTES = 256ULL * 1024 * 1024;
+// Queue the chunks of at most this many files, or of files with at most
+// this many chunks, ahead of the one being restored
+static const size_t PREFETCH_AHEAD_FILES = 1024;
+static const size_t PREFETCH_AHEAD_CHUNKS = 4096;
+
+Restore::Restore(Repository* repo)
+    : repo_(repo),
+      // Create a temporary working directory
+      temp_dir_(fs::temp_directory_path() /
+                ("restore_temp_" + repo->GetName())),
+      manifest_(repo),
+      trees_(repo, manifest_.GetCacheDir()),
+      history_(repo, manifest_.GetCacheDir()),
+      chunk_cache_(ChunkCache::GetDefaultPath(),
+                   ChunkCache::GetConfiguredLimit()) {
   // Create necessary directories
   fs::create_directories(temp_dir_);
-  fs::create_directories(temp_dir_ / "backup");
   fs::create_directories(temp_dir_ / "chunks");
-  const fs::path prev_meta_path = temp_dir_ / "backup";
-  auto fetched_metadata =
-      repo_->DownloadDirectory("backup/", prev_meta_path.string());
-  if (!fetched_metadata) ErrorUtil::ThrowError("Failed to load metadata");
+  manifest_.Load();
+
+  prefetcher_ = std::make_unique<ChunkPrefetcher>(
+      [this](const std::string& hash) {
+        return DecompressChunk(LoadChunk(hash));
+      });
 }
 
 Restore::~Restore() {
+  // Stop background downloads before their target directory goes away
+  prefetcher_.reset();
   if (fs::exists(temp_dir_)) {
     fs::remove_all(temp_dir_);
   }
@@ -38,64 +60,14 @@ Restore::~Restore() {
 
 void Restore::LoadMetadata(const std::string backup_name_) {
   try {
-    fs::path metadata_path = temp_dir_ / "backup" / backup_name_;
-
-    if (!fs::exists(metadata_path)) {
-      ErrorUtil::ThrowError("Backup metadata not found: " +
-                            metadata_path.string());
-    }
-
-    std::ifstream metadata_file(metadata_path, std::ios::binary);
-    if (!metadata_file) {
-      ErrorUtil::ThrowError("Could not open metadata file: " +
-                            metadata_path.string());
-    }
-
-    // Read encrypted data
-    std::vector<uint8_t> encrypted_data(
-        (std::istreambuf_iterator<char>(metadata_file)),
-        std::istreambuf_iterator<char>());
-    metadata_file.close();
-
-    // Decrypt metadata using repository password
-    std::string json_string =
-        EncryptionUtil::DecryptMetadata(encrypted_data, repo_->GetPassword());
-    if (json_string.empty()) {
-      ErrorUtil::ThrowError("Failed to decrypt metadata: " + backup_name_);
-    }
-
-    nlohmann::json metadata_json = nlohmann::json::parse(json_string);
-
-    BackupType type = static_cast<BackupType>(metadata_json["type"].get<int>());
-    std::chrono::system_clock::time_point timestamp =
-        std::chrono::system_clock::from_time_t(
-            metadata_json["timestamp"].get<time_t>());
-    std::string previous_backup =
-        metadata_json["previous_backup"].get<std::string>();
-    std::map<std::string, FileMetadata> files;
-    for (const auto& [file_path, file_json] : metadata_json["files"].items()) {
-      FileMetadata file_metadata;
-      file_metadata.original_filename = file_json["original_filename"];
-      file_metadata.chunk_hashes =
-          file_json["chunk_hashes"].get<std::vector<std::string>>();
-      file_metadata.total_size = file_json["total_size"].get<uint64_t>();
-      file_metadata.mtime = fs::file_time_type(
-          std::chrono::duration_cast<fs::file_time_type::duration>(
-              std::chrono::seconds(file_json["mtime"].get<time_t>())));
-
-      // Load symlink information (with backward compatibility)
-      file_metadata.is_symlink = file_json.value("is_symlink", false);
-      if (file_metadata.is_symlink) {
-        file_metadata.symlink_target = file_json["symlink_target"];
-      }
-
-      // Load new fields with backward compatibility
-      file_metadata.permissions = file_json.value("permissions", "");
-      file_metadata.sha256_checksum = file_json.value("sha256_checksum", "");
-
-      files[file_path] = file_metadata;
-    }
-    metadata_ = new BackupMetadata(type, timestamp, previous_backup, files);
+    // Single file requests load the same snapshot once per file
+    if (session_ && session_->GetBackupName() == backup_name_) return;
+
+    session_.reset();
+    linked_outputs_.clear();
+    session_ = std::make_unique<RestoreSession>(manifest_, &trees_,
+                                                backup_name_,
+                                                repo_->GetPassword());
   } catch (const std::exception& e) {
     ErrorUtil::ThrowError("Failed to load metadata: " + std::string(e.what()));
     throw;
@@ -105,56 +77,143 @@ void Restore::LoadMetadata(const std::string backup_name_) {
 void Restore::RestoreFile(const std::filesystem::path& file_path,
                           const fs::path output_path_,
                           const std::string backup_name_) {
+  LoadMetadata(backup_name_);
+  auto file_metadata = session_->Find(file_path.string());
+  if (!file_metadata) {
+    ErrorUtil::ThrowError("File not found in backup: " + file_path.string());
+  }
+  RestoreEntry(file_path.string(), *file_metadata, output_path_);
+}
+
+void Restore::RestoreEntry(const std::string& file_path,
+                           const FileMetadata& file_metadata,
+                           const fs::path& output_path,
+                           const PrefetchPlan* plan) {
   try {
-    // Get file metadata
-    LoadMetadata(backup_name_);
-    auto file_metadata = FindFileMetadata(file_path.string());
-    if (!file_metadata) {
-      ErrorUtil::ThrowError("File not found in backup: " + file_path.string());
+    std::string filename = file_metadata.original_filename;
+    fs::path output_file = PrepareOutputPath(filename, file_path, output_path);
+
+    // Single file requests queue their own chunks
+    PrefetchPlan own_plan;
+    if (!plan) {
+      prefetcher_->Clear();
+      own_plan = PlanRestore(file_path, file_metadata, output_file, nullptr);
+      plan = &own_plan;
+    }
+
+    if (IsAlreadyRestored(file_path, file_metadata, output_file)) {
+      Logger::TerminalLog("Skipping restored file: " + output_file.string());
+      if (!file_metadata.link_group.empty()) {
+        linked_outputs_.emplace(
+            file_metadata.link_group,
+            std::make_pair(output_file, file_metadata.sha256_checksum));
+      }
+      successful_files_.push_back(output_file.string());
+      return;
     }
 
-    std::string filename = file_metadata->second.original_filename;
-    fs::path output_file = PrepareOutputPath(filename, file_path, output_path_);
+    // Link to the file of the group restored first if it holds the same
+    // content, writing a verified copy otherwise or if linking fails
+    if (!file_metadata.link_group.empty()) {
+      auto linked = linked_outputs_.find(file_metadata.link_group);
+      if (linked != linked_outputs_.end() &&
+          linked->second.second == file_metadata.sha256_checksum) {
+        const fs::path& target = linked->second.first;
+        std::error_code ec;
+        fs::remove(output_file, ec);
+        fs::create_hard_link(target, output_file, ec);
+        if (!ec) {
+          Logger::TerminalLog("Linking " + output_file.string() + " to " +
+                              target.string());
+          if (journal_) {
+            unsynced_files_.insert(output_file);
+            journal_->RecordFile(file_path, file_metadata.sha256_checksum);
+            if (IsCheckpointDue()) Checkpoint();
+          }
+          successful_files_.push_back(output_file.string());
+          return;
+        }
+        Logger::Log("Could not link " + output_file.string() + " to " +
+                        target.string() + ": " + ec.message(),
+                    LogLevel::WARNING);
+      }
+    }
 
     // Handle symlinks
-    if (file_metadata->second.is_symlink) {
+    if (file_metadata.is_symlink) {
       Logger::TerminalLog("Restoring symlink: " + output_file.string() +
-                          " -> " + file_metadata->second.symlink_target);
+                          " -> " + file_metadata.symlink_target);
+
+      // Left behind by the interrupted run before it was journaled
+      if (resuming_ && fs::is_symlink(output_file)) {
+        fs::remove(output_file);
+      }
 
       // Create the symlink
-      fs::create_symlink(file_metadata->second.symlink_target, output_file);
+      fs::create_symlink(file_metadata.symlink_target, output_file);
 
       // Restore file metadata (timestamps)
-      fs::last_write_time(output_file, file_metadata->second.mtime);
+      fs::last_write_time(output_file, file_metadata.mtime);
 
       // Restore file permissions if available
-      if (!file_metadata->second.permissions.empty()) {
-        SetFilePermissions(output_file, file_metadata->second.permissions);
+      if (!file_metadata.permissions.empty()) {
+        SetFilePermissions(output_file, file_metadata.permissions);
       }
 
       // For symlinks, we don't need to check integrity since they don't have
       // content checksums
-      successful_files_.push_back(file_path.string());
+      if (journal_) {
+        unsynced_files_.insert(output_file);
+        journal_->RecordFile(file_path, "");
+      }
+      successful_files_.push_back(file_path);
       return;
     }
 
-    ProgressBar progress(file_metadata->second.total_size,
-                         file_metadata->second.chunk_hashes.size(),
+    const auto& chunk_hashes = file_metadata.chunk_hashes;
+    ProgressBar progress(file_metadata.total_size, chunk_hashes.size(),
                          "Restore of " + filename);
 
+    // Continue after the chunks an interrupted run already wrote
+    RestoreProgress resume_from = plan->resume_from.value_or(RestoreProgress{});
+    if (plan->resume_from) {
+      current_file_hash_ = chunk_hashes.empty() ? "" : chunk_hashes[0];
+      current_chunk_ = resume_from.chunks;
+      processed_bytes_ = resume_from.bytes;
+      Logger::TerminalLog("Continuing " + output_file.string() + " at chunk " +
+                          std::to_string(resume_from.chunks));
+    }
+
+    // Periodically sync the written prefix so a resume can keep it
+    uint64_t reported_bytes = resume_from.bytes;
+    std::function<void(std::ofstream&, size_t)> chunk_written;
+    if (journal_) {
+      chunk_written = [&](std::ofstream& file, size_t bytes_written) {
+        uncheckpointed_bytes_ += bytes_written - reported_bytes;
+        reported_bytes = bytes_written;
+        if (IsCheckpointDue()) {
+          file.flush();
+          unsynced_files_.insert(output_file);
+          journal_->RecordProgress(file_path, {current_chunk_, bytes_written});
+          Checkpoint();
+        }
+      };
+    }
+
     // Use streaming chunk combining
     try {
       chunker_.StreamCombineChunks(
           [&]() -> Chunk {
             try {
-              return GetNextChunk(file_metadata->second, progress);
+              return GetNextChunk(file_metadata, progress);
             } catch (const std::exception& e) {
               ErrorUtil::ThrowError("Failed to get next chunk: " +
                                     std::string(e.what()));
               throw;
             }
           },
-          output_file, file_metadata->second.total_size);
+          output_file, file_metadata.total_size, resume_from.bytes,
+          chunk_written, file_metadata.holes);
 
       progress.Complete();
     } catch (const std::exception& e) {
@@ -163,34 +222,43 @@ void Restore::RestoreFile(const std::filesystem::path& file_path,
       processed_bytes_ = 0;
       current_file_hash_ = "";
       ErrorUtil::ThrowError("Failed to combine chunks for file: " +
-                            file_path.string() + " - " + e.what());
+                            file_path + " - " + e.what());
       throw;
     }
 
     // Restore file metadata
-    fs::last_write_time(output_file, file_metadata->second.mtime);
+    fs::last_write_time(output_file, file_metadata.mtime);
 
     // Restore file permissions if available
-    if (!file_metadata->second.permissions.empty()) {
-      SetFilePermissions(output_file, file_metadata->second.permissions);
+    if (!file_metadata.permissions.empty()) {
+      SetFilePermissions(output_file, file_metadata.permissions);
     }
 
     // Check file integrity
-    if (!CheckFileIntegrity(output_file,
-                            file_metadata->second.sha256_checksum)) {
+    if (!CheckFileIntegrity(output_file, file_metadata.sha256_checksum)) {
       Logger::Log("File integrity check failed for " + output_file.string(),
                   LogLevel::WARNING);
       integrity_failures_.push_back(output_file.string());
       return;
     }
+    if (journal_) {
+      unsynced_files_.insert(output_file);
+      journal_->RecordFile(file_path, file_metadata.sha256_checksum);
+      if (IsCheckpointDue()) Checkpoint();
+    }
+    if (!file_metadata.link_group.empty()) {
+      linked_outputs_.emplace(
+          file_metadata.link_group,
+          std::make_pair(output_file, file_metadata.sha256_checksum));
+    }
     successful_files_.push_back(output_file.string());
   } catch (const std::exception& e) {
     // Reset chunk tracking state on error
     current_chunk_ = 0;
     processed_bytes_ = 0;
     current_file_hash_ = "";
-    ErrorUtil::ThrowError("Failed to restore file: " + file_path.string() +
-                          " - " + e.what());
+    ErrorUtil::ThrowError("Failed to restore file: " + file_path + " - " +
+                          e.what());
     throw;
   }
 }
@@ -198,43 +266,55 @@ void Restore::RestoreFile(const std::filesystem::path& file_path,
 void Restore::VerifyFile(const std::filesystem::path& file_path,
                          const fs::path output_path_,
                          const std::string backup_name_) {
-  try {
-    // Get file metadata
-    LoadMetadata(backup_name_);
-    auto file_metadata = FindFileMetadata(file_path.string());
-    if (!file_metadata) {
-      ErrorUtil::ThrowError("File not found in backup: " + file_path.string());
-    }
+  LoadMetadata(backup_name_);
+  auto file_metadata = session_->Find(file_path.string());
+  if (!file_metadata) {
+    ErrorUtil::ThrowError("File not found in backup: " + file_path.string());
+  }
+  VerifyEntry(file_path.string(), *file_metadata, output_path_);
+}
 
-    std::string filename = file_metadata->second.original_filename;
-    fs::path output_file = PrepareOutputPath(filename, file_path, output_path_);
+void Restore::VerifyEntry(const std::string& file_path,
+                          const FileMetadata& file_metadata,
+                          const fs::path& output_path,
+                          const PrefetchPlan* plan) {
+  try {
+    std::string filename = file_metadata.original_filename;
+    fs::path output_file = PrepareOutputPath(filename, file_path, output_path);
 
     // Handle symlinks
-    if (file_metadata->second.is_symlink) {
+    if (file_metadata.is_symlink) {
       // No need to verify symlinks
       Logger::TerminalLog("Verifying symlink: " + output_file.string() +
-                          " -> " + file_metadata->second.symlink_target);
-      successful_files_.push_back(file_path.string());
+                          " -> " + file_metadata.symlink_target);
+      successful_files_.push_back(file_path);
       return;
     }
 
-    ProgressBar progress(file_metadata->second.total_size,
-                         file_metadata->second.chunk_hashes.size(),
+    ProgressBar progress(file_metadata.total_size,
+                         file_metadata.chunk_hashes.size(),
                          "Verifcation of " + filename);
 
+    // Single file requests queue their own chunks
+    if (!plan) {
+      prefetcher_->Clear();
+      PlanVerify(file_metadata);
+    }
+
     // Use streaming chunk combining
     try {
       chunker_.StreamCombineChunks(
           [&]() -> Chunk {
             try {
-              return GetNextChunk(file_metadata->second, progress);
+              return GetNextChunk(file_metadata, progress);
             } catch (const std::exception& e) {
               ErrorUtil::ThrowError("Failed to get next chunk: " +
                                     std::string(e.what()));
               throw;
             }
           },
-          output_file, file_metadata->second.total_size);
+          output_file, file_metadata.total_size, 0, nullptr,
+          file_metadata.holes);
 
       progress.Complete();
     } catch (const std::exception& e) {
@@ -243,65 +323,58 @@ void Restore::VerifyFile(const std::filesystem::path& file_path,
       processed_bytes_ = 0;
       current_file_hash_ = "";
       ErrorUtil::ThrowError("Failed to combine chunks for file: " +
-                            file_path.string() + " - " + e.what());
+                            file_path + " - " + e.what());
       throw;
     }
 
     // Check file integrity
-    if (!CheckFileIntegrity(output_file,
-                            file_metadata->second.sha256_checksum)) {
-      Logger::Log("File integrity check failed for " + file_path.string(),
+    if (!CheckFileIntegrity(output_file, file_metadata.sha256_checksum)) {
+      Logger::Log("File integrity check failed for " + file_path,
                   LogLevel::WARNING);
-      integrity_failures_.push_back(file_path.string());
+      integrity_failures_.push_back(file_path);
       return;
     }
 
     fs::remove(output_file);  // Remove file after verification
-    successful_files_.push_back(file_path.string());
+    successful_files_.push_back(file_path);
   } catch (const std::exception& e) {
     // Reset chunk tracking state on error
     current_chunk_ = 0;
     processed_bytes_ = 0;
     current_file_hash_ = "";
-    ErrorUtil::ThrowError("Failed to verify file: " + file_path.string() +
-                          " - " + e.what());
+    ErrorUtil::ThrowError("Failed to verify file: " + file_path + " - " +
+                          e.what());
     throw;
   }
 }
 
-std::optional<std::pair<std::string, FileMetadata>> Restore::FindFileMetadata(
-    const std::string& file_path) {
-  auto it = std::find_if(
-      (*metadata_)->files.begin(), (*metadata_)->files.end(),
-      [&file_path](const auto& pair) { return pair.first == file_path; });
-
-  if (it == (*metadata_)->files.end()) {
-    return std::nullopt;
-  }
-
-  return std::make_pair(it->first, it->second);
-}
-
-fs::path Restore::PrepareOutputPath(const std::string& filename,
-                                    const fs::path& original_path,
-                                    const fs::path output_path_) {
+fs::path Restore::GetOutputPath(const std::string& filename,
+                                const fs::path& original_path,
+                                const fs::path& output_path_) const {
   // Get the parent path from the original file path
   fs::path parent_path = fs::path(original_path).parent_path();
 
-  // Create the parent directories inside the output path
+  // The parent directories inside the output path
   fs::path output_parent = output_path_;
 
   // Modify parent path to remove beginning /
   std::string path = parent_path.string();
   output_parent.append(path.substr(1, path.size() - 1));
 
-  // Create parent path in output path
-  fs::create_directories(output_parent);
-
   // Create the final output path using the original filename
   return output_parent / filename;
 }
 
+fs::path Restore::PrepareOutputPath(const std::string& filename,
+                                    const fs::path& original_path,
+                                    const fs::path output_path_) {
+  fs::path output_file = GetOutputPath(filename, original_path, output_path_);
+
+  // Create parent path in output path
+  fs::create_directories(output_file.parent_path());
+  return output_file;
+}
+
 Chunk Restore::GetNextChunk(const FileMetadata& file_metadata,
                             ProgressBar& progress) {
   try {
@@ -321,10 +394,14 @@ Chunk Restore::GetNextChunk(const FileMetadata& file_metadata,
       return Chunk{};  // Return empty chunk to signal end
     }
 
-    // Load and decompress the next chunk
-    Chunk compressed_chunk =
-        LoadChunk(file_metadata.chunk_hashes[current_chunk_]);
-    Chunk decompressed_chunk = DecompressChunk(compressed_chunk);
+    // Take the next chunk from the prefetcher, fills are made up here
+    const std::string& hash = file_metadata.chunk_hashes[current_chunk_];
+    Chunk decompressed_chunk;
+    if (Chunker::IsFillHash(hash)) {
+      decompressed_chunk = Chunker::MakeFillChunk(hash);
+    } else {
+      decompressed_chunk = prefetcher_->Get(hash);
+    }
 
     // Update progress
     processed_bytes_ += decompressed_chunk.size;
@@ -343,7 +420,7 @@ Chunk Restore::GetNextChunk(const FileMetadata& file_metadata,
 }
 
 void Restore::RestoreAll(const fs::path output_path_,
-                         const std::string backup_name_) {
+                         const std::string backup_name_, bool resume) {
   try {
     // Ensure output path exists
     if (!fs::exists(output_path_)) fs::create_directories(output_path_);
@@ -359,16 +436,20 @@ void Restore::RestoreAll(const fs::path output_path_,
     current_file_hash_ = "";
 
     LoadMetadata(backup_name_);
+    OpenJournal(output_path_, backup_name_, resume);
 
-    for (const auto& [file_path, metadata] : (*metadata_)->files) {
+    ForEachPlanned(output_path_, false, {},
+                   [&](const std::string& file_path,
+                       const FileMetadata& metadata, const PrefetchPlan& plan) {
       try {
-        RestoreFile(file_path, output_path_, backup_name_);
+        RestoreEntry(file_path, metadata, output_path_, &plan);
       } catch (const std::exception& e) {
         Logger::Log("Failed to restore file: " + file_path + " - " + e.what(),
                     LogLevel::ERROR);
         failed_files_.push_back(file_path);
       }
-    }
+    });
+    CloseJournal();
     // Report any integrity failures
     auto result = ReportResults();
     if (result.second == 2) {
@@ -379,11 +460,121 @@ void Restore::RestoreAll(const fs::path output_path_,
       Logger::Log(result.first, LogLevel::INFO);
 
   } catch (const std::exception& e) {
+    // Keep what was restored so the next run can resume from here
+    if (journal_) {
+      try {
+        Checkpoint();
+      } catch (const std::exception& checkpoint_error) {
+        ErrorUtil::LogException(checkpoint_error,
+                                "Could not checkpoint restore progress");
+      }
+      journal_.reset();
+      resuming_ = false;
+    }
     ErrorUtil::ThrowError("Failed to restore all files: " +
                           std::string(e.what()));
   }
 }
 
+bool Restore::CanResume(const fs::path& output_path,
+                        const std::string& backup_name) {
+  return RestoreJournal(repo_, backup_name, output_path).Exists();
+}
+
+void Restore::OpenJournal(const fs::path& output_path,
+                          const std::string& backup_name, bool resume) {
+  journal_ = std::make_unique<RestoreJournal>(repo_, backup_name, output_path);
+  unsynced_files_.clear();
+  resuming_ = resume && journal_->Load();
+  if (resuming_) {
+    Logger::TerminalLog("Resuming interrupted restore into " +
+                        output_path.string());
+  } else {
+    if (resume) {
+      Logger::TerminalLog("No interrupted restore found, starting over",
+                          LogLevel::WARNING);
+    }
+    journal_->Begin();
+  }
+  last_checkpoint_ = std::chrono::steady_clock::now();
+  uncheckpointed_bytes_ = 0;
+}
+
+void Restore::CloseJournal() {
+  if (!journal_) return;
+  if (failed_files_.empty() && integrity_failures_.empty()) {
+    journal_->Remove();
+  } else {
+    // Let a resumed run retry only what is missing
+    Checkpoint();
+    Logger::TerminalLog(
+        "Restore incomplete, resume it to retry the remaining files",
+        LogLevel::WARNING);
+  }
+  journal_.reset();
+  resuming_ = false;
+}
+
+// Flush a restored file or directory to disk, skipping one that is gone
+static void SyncPath(const fs::path& path, bool is_directory) {
+  int fd = open(path.c_str(),
+                O_RDONLY | O_CLOEXEC | (is_directory ? O_DIRECTORY : 0));
+  if (fd < 0) return;
+  int result = fsync(fd);
+  int error = errno;
+  close(fd);
+  if (result != 0) {
+    ErrorUtil::ThrowError("Could not sync " + path.string() + ": " +
+                          std::strerror(error));
+  }
+}
+
+void Restore::Checkpoint() {
+  // Restored data must reach the disk before the journal vouches for it,
+  // the files themselves and the directory entries naming them
+  std::set<fs::path> directories;
+  for (const auto& path : unsynced_files_) {
+    std::error_code ec;
+    if (!fs::is_symlink(path, ec)) SyncPath(path, false);
+    directories.insert(path.parent_path());
+  }
+  for (const auto& directory : directories) {
+    SyncPath(directory, true);
+  }
+  unsynced_files_.clear();
+  journal_->Commit();
+  last_checkpoint_ = std::chrono::steady_clock::now();
+  uncheckpointed_bytes_ = 0;
+}
+
+bool Restore::IsCheckpointDue() const {
+  return std::chrono::steady_clock::now() - last_checkpoint_ >=
+             CHECKPOINT_INTERVAL ||
+         uncheckpointed_bytes_ >= CHECKPOINT_BYTES;
+}
+
+bool Restore::IsAlreadyRestored(const std::string& file_path,
+                                const FileMetadata& file_metadata,
+                                const fs::path& output_file) {
+  if (!resuming_) return false;
+  auto digest = journal_->GetFinishedDigest(file_path);
+  if (!digest || *digest != file_metadata.sha256_checksum) return false;
+
+  // The destination may have changed since it was journaled
+  std::error_code ec;
+  if (file_metadata.is_symlink) {
+    return fs::is_symlink(output_file, ec) &&
+           fs::read_symlink(output_file, ec).string() ==
+               file_metadata.symlink_target;
+  }
+  if (!fs::is_regular_file(output_file, ec) ||
+      fs::file_size(output_file, ec) != file_metadata.total_size || ec) {
+    return false;
+  }
+  // A file of the right size may still be torn or damaged
+  return CheckFileIntegrity(output_file, file_metadata.sha256_checksum);
+}
+
 void Restore::VerifyBackup(const std::string backup_name_) {
   try {
     const fs::path output_path_ = temp_dir_ / "files";
@@ -402,16 +593,42 @@ void Restore::VerifyBackup(const std::string backup_name_) {
 
     LoadMetadata(backup_name_);
 
-    for (const auto& [file_path, metadata] : (*metadata_)->files) {
+    // A subtree that verified cleanly for an earlier snapshot holds the
+    // same files and chunks, only the rest is checked again
+    std::set<std::string> skipped_files;
+    TreeDirectories directories;
+    session_->ForEachFile(
+        [&](const std::string& file_path, const FileMetadata&) {
+          if (trees_.IsVerified(directories, file_path)) {
+            skipped_files.insert(file_path);
+          }
+        },
+        "", &directories);
+    if (!skipped_files.empty()) {
+      Logger::TerminalLog("Skipping " + std::to_string(skipped_files.size()) +
+                          " files in subtrees verified earlier");
+    }
+
+    ForEachPlanned(output_path_, true, skipped_files,
+                   [&](const std::string& file_path,
+                       const FileMetadata& metadata, const PrefetchPlan& plan) {
+      if (skipped_files.count(file_path)) {
+        successful_files_.push_back(file_path);
+        return;
+      }
       try {
-        VerifyFile(file_path, output_path_, backup_name_);
+        VerifyEntry(file_path, metadata, output_path_, &plan);
 
       } catch (const std::exception& e) {
         Logger::Log("Failed to verify file: " + file_path + " - " + e.what(),
                     LogLevel::ERROR);
         failed_files_.push_back(file_path);
       }
+    });
+    if (failed_files_.empty() && integrity_failures_.empty()) {
+      trees_.MarkVerified(directories);
     }
+
     // Report any integrity failures
     auto result = ReportVerifyResults();
     if (result.second == 2) {
@@ -427,37 +644,147 @@ void Restore::VerifyBackup(const std::string backup_name_) {
   }
 }
 
+void Restore::ForEachPlanned(const fs::path& output_path, bool verifying,
+                             const std::set<std::string>& skipped_files,
+                             const PlannedVisitor& visitor) {
+  struct UpcomingFile {
+    std::string path;
+    FileMetadata metadata;
+    PrefetchPlan plan;
+  };
+  prefetcher_->Clear();
+  std::deque<UpcomingFile> upcoming;
+  size_t upcoming_chunks = 0;
+  // Files of a hard link group with the content of its first file are
+  // linked to it, not written
+  std::unordered_map<std::string, std::string> group_digests;
+
+  auto visit_next = [&]() {
+    UpcomingFile file = std::move(upcoming.front());
+    upcoming.pop_front();
+    upcoming_chunks -= file.plan.chunks;
+    visitor(file.path, file.metadata, file.plan);
+    // Drop what the file left unread, such as after a failure
+    prefetcher_->SkipTo(file.plan.end);
+  };
+
+  session_->ForEachFile([&](const std::string& file_path,
+                            const FileMetadata& metadata) {
+    UpcomingFile file{file_path, metadata, {}};
+    if (!skipped_files.count(file_path)) {
+      if (verifying) {
+        file.plan = PlanVerify(metadata);
+      } else {
+        fs::path output_file = GetOutputPath(metadata.original_filename,
+                                             file_path, output_path);
+        file.plan =
+            PlanRestore(file_path, metadata, output_file, &group_digests);
+      }
+    }
+    upcoming_chunks += file.plan.chunks;
+    upcoming.push_back(std::move(file));
+
+    while (upcoming.size() > PREFETCH_AHEAD_FILES ||
+           upcoming_chunks > PREFETCH_AHEAD_CHUNKS) {
+      visit_next();
+    }
+  });
+  while (!upcoming.empty()) {
+    visit_next();
+  }
+}
+
+Restore::PrefetchPlan Restore::PlanRestore(
+    const std::string& file_path, const FileMetadata& file_metadata,
+    const fs::path& output_file,
+    std::unordered_map<std::string, std::string>* group_digests) {
+  PrefetchPlan plan;
+  if (file_metadata.is_symlink) return plan;
+  if (group_digests && !file_metadata.link_group.empty()) {
+    auto group = group_digests->emplace(file_metadata.link_group,
+                                        file_metadata.sha256_checksum);
+    if (!group.second &&
+        group.first->second == file_metadata.sha256_checksum) {
+      return plan;
+    }
+  }
+
+  // Leave out what an interrupted restore already wrote, as long as the
+  // destination still holds it
+  const auto& chunk_hashes = file_metadata.chunk_hashes;
+  if (resuming_) {
+    if (journal_->GetFinishedDigest(file_path) ==
+        file_metadata.sha256_checksum) {
+      return plan;
+    }
+    auto journaled = journal_->GetProgress(file_path);
+    std::error_code ec;
+    if (journaled && journaled->chunks <= chunk_hashes.size() &&
+        fs::file_size(output_file, ec) >= journaled->bytes && !ec) {
+      plan.resume_from = *journaled;
+    }
+  }
+  size_t first_chunk = plan.resume_from ? plan.resume_from->chunks : 0;
+  plan.chunks = chunk_hashes.size() - first_chunk;
+  plan.end = prefetcher_->Schedule(chunk_hashes, first_chunk);
+  return plan;
+}
+
+Restore::PrefetchPlan Restore::PlanVerify(const FileMetadata& file_metadata) {
+  PrefetchPlan plan;
+  if (file_metadata.is_symlink) return plan;
+  plan.chunks = file_metadata.chunk_hashes.size();
+  plan.end = prefetcher_->Schedule(file_metadata.chunk_hashes);
+  return plan;
+}
+
 Chunk Restore::LoadChunk(const std::string& hash) {
   try {
-    // Use first two hex digits as subdirectory
+    Chunk chunk;
+    chunk.hash = hash;
+
+    // Serve the chunk from the local cache when possible
+    if (auto cached = chunk_cache_.Get(hash)) {
+      chunk.data = std::move(*cached);
+      chunk.size = chunk.data.size();
+      return chunk;
+    }
+
+    // Use first two hex digits as subdirectory. Prefetch workers may fetch
+    // the same chunk concurrently, so each downloads to its own file.
     std::string subdir = hash.substr(0, 2);
-    fs::path chunk_path = temp_dir_ / "chunks" / subdir / (hash + ".chunk");
-    if (!fs::exists(chunk_path.parent_path()))
-      fs::create_directories(chunk_path.parent_path());
-    if (!fs::exists(chunk_path)) {
-      // Try to download the chunk
-      repo_->DownloadFile("chunks/" + subdir + "/" + hash + ".chunk",
-                          chunk_path.string());
-
-      // Check if the download was successful
-      if (!fs::exists(chunk_path)) {
-        ErrorUtil::ThrowError("Failed to download chunk file: " + hash +
-                              " - file not found after download attempt");
-      }
+    std::stringstream download_name;
+    download_name << hash << ".part." << std::this_thread::get_id();
+    fs::path download_path = temp_dir_ / "chunks" / subdir / download_name.str();
+    if (!fs::exists(download_path.parent_path()))
+      fs::create_directories(download_path.parent_path());
+
+    // Try to download the chunk
+    repo_->DownloadFile("chunks/" + subdir + "/" + hash + ".chunk",
+                        download_path.string());
+
+    // Check if the download was successful
+    if (!fs::exists(download_path)) {
+      ErrorUtil::ThrowError("Failed to download chunk file: " + hash +
+                            " - file not found after download attempt");
     }
 
-    std::ifstream chunk_file(chunk_path, std::ios::binary);
+    std::ifstream chunk_file(download_path, std::ios::binary);
     if (!chunk_file) {
       ErrorUtil::ThrowError("Could not open chunk file: " +
-                            chunk_path.string());
+                            download_path.string());
     }
-
-    Chunk chunk;
-    chunk.hash = hash;
     chunk.data =
         std::vector<uint8_t>((std::istreambuf_iterator<char>(chunk_file)),
                              std::istreambuf_iterator<char>());
     chunk.size = chunk.data.size();
+    chunk_file.close();
+    fs::remove(download_path);
+
+    if (ChunkCache::CalculateDigest(chunk.data) != hash) {
+      ErrorUtil::ThrowError("Chunk content does not match its hash");
+    }
+    chunk_cache_.Put(hash, chunk.data);
 
     return chunk;
   } catch (const std::exception& e) {
@@ -502,10 +829,8 @@ Chunk Restore::DecompressChunk(const Chunk& compressed_chunk) {
 std::vector<std::string> Restore::ListBackups() {
   try {
     std::vector<std::string> backups;
-    for (const auto& entry : fs::directory_iterator(temp_dir_ / "backup")) {
-      if (entry.is_regular_file()) {
-        backups.push_back(entry.path().filename().string());
-      }
+    for (const auto& entry : manifest_.GetEntries()) {
+      backups.push_back(entry.name);
     }
     std::sort(backups.begin(), backups.end());
     return backups;
@@ -514,90 +839,25 @@ std::vector<std::string> Restore::ListBackups() {
   }
 }
 
+std::vector<FileVersion> Restore::FindFileHistory(const std::string& pattern) {
+  return history_.Find(manifest_, &trees_, pattern);
+}
+
 void Restore::CompareBackups(const std::string& backup1,
-                             const std::string& backup2) {
+                             const std::string& backup2, bool as_json) {
   // Load both backup metadata
-  fs::path metadata_path1 = temp_dir_ / "backup" / backup1;
-  fs::path metadata_path2 = temp_dir_ / "backup" / backup2;
-
-  if (!fs::exists(metadata_path1) || !fs::exists(metadata_path2)) {
+  if (!manifest_.Find(backup1) || !manifest_.Find(backup2)) {
     ErrorUtil::ThrowError("One or both backup metadata files not found");
   }
-
-  // Read and decrypt first backup metadata
-  std::ifstream metadata_file1(metadata_path1, std::ios::binary);
-  if (!metadata_file1) {
-    ErrorUtil::ThrowError("Could not open metadata file: " +
-                          metadata_path1.string());
-  }
-  std::vector<uint8_t> encrypted_data1(
-      (std::istreambuf_iterator<char>(metadata_file1)),
-      std::istreambuf_iterator<char>());
-  metadata_file1.close();
-
-  std::string json_string1 =
-      EncryptionUtil::DecryptMetadata(encrypted_data1, repo_->GetPassword());
-  if (json_string1.empty()) {
-    ErrorUtil::ThrowError("Failed to decrypt metadata: " + backup1);
-  }
-  nlohmann::json metadata_json1 = nlohmann::json::parse(json_string1);
-
-  // Read and decrypt second backup metadata
-  std::ifstream metadata_file2(metadata_path2, std::ios::binary);
-  if (!metadata_file2) {
-    ErrorUtil::ThrowError("Could not open metadata file: " +
-                          metadata_path2.string());
-  }
-  std::vector<uint8_t> encrypted_data2(
-      (std::istreambuf_iterator<char>(metadata_file2)),
-      std::istreambuf_iterator<char>());
-  metadata_file2.close();
-
-  std::string json_string2 =
-      EncryptionUtil::DecryptMetadata(encrypted_data2, repo_->GetPassword());
-  if (json_string2.empty()) {
-    ErrorUtil::ThrowError("Failed to decrypt metadata: " + backup2);
-  }
-  nlohmann::json metadata_json2 = nlohmann::json::parse(json_string2);
-
-  BackupMetadata metadata1, metadata2;
-  metadata1.type = static_cast<BackupType>(metadata_json1["type"].get<int>());
-  metadata2.type = static_cast<BackupType>(metadata_json2["type"].get<int>());
-
-  size_t changed_files = 0;
-  size_t unchanged_files = 0;
-  size_t added_files = 0;
-  size_t deleted_files = 0;
-
-  // Compare files
-  for (const auto& [file_path, file_metadata2] :
-       metadata_json2["files"].items()) {
-    auto it = metadata_json1["files"].find(file_path);
-    if (it == metadata_json1["files"].end()) {
-      added_files++;
-    } else if (file_metadata2["total_size"] != it.value()["total_size"] ||
-               file_metadata2["mtime"] != it.value()["mtime"]) {
-      changed_files++;
-    } else {
-      unchanged_files++;
-    }
+  SnapshotDiff diff = CompareSnapshots(manifest_.FetchMetadata(backup1),
+                                       manifest_.FetchMetadata(backup2),
+                                       repo_->GetPassword(), &trees_);
+
+  if (as_json) {
+    Logger::TerminalLog(SnapshotDiffToJson(backup1, backup2, diff).dump(2));
+  } else {
+    Logger::TerminalLog(FormatSnapshotDiff(backup1, backup2, diff));
   }
-
-  // Count deleted files
-  for (const auto& [file_path, _] : metadata_json1["files"].items()) {
-    if (metadata_json2["files"].find(file_path) ==
-        metadata_json2["files"].end()) {
-      deleted_files++;
-    }
-  }
-
-  std::ostringstream comparison;
-  comparison << "Backup Comparison (" << backup1 << " vs " << backup2 << "):"
-             << "\n - Changed files: " << changed_files
-             << "\n - Unchanged files: " << unchanged_files
-             << "\n - Added files: " << added_files
-             << "\n - Deleted files: " << deleted_files << std::endl;
-  Logger::TerminalLog(comparison.str());
 }
 
 void Restore::SetFilePermissions(const fs::path& file_path,
@@ -682,7 +942,7 @@ bool Restore::CheckFileIntegrity(const fs::path& file_path,
 std::pair<std::string, int> Restore::ReportResults() {
   int status = 0;  // 0 = OK, 1 = Integrity failures, 2 = Failed files
 
-  int total_files = (*metadata_)->files.size();
+  int total_files = session_->GetFileCount();
   int processed_files = successful_files_.size() + failed_files_.size() +
                         integrity_failures_.size();
   int restored_files = successful_files_.size() + integrity_failures_.size();
@@ -726,7 +986,7 @@ std::pair<std::string, int> Restore::ReportResults() {
 std::pair<std::string, int> Restore::ReportVerifyResults() {
   int status = 0;  // 0 = OK, 1 = Integrity failures, 2 = Failed files
 
-  int total_files = (*metadata_)->files.size();
+  int total_files = session_->GetFileCount();
   int processed_files = successful_files_.size() + failed_files_.size() +
                         integrity_failures_.size();
   int restored_files = successful_files_.size() + integrity_failures_.size();
@@ -0,0 +1,127 @@
+#include "backup_restore/restore_journal.hpp"
+
+#include <fstream>
+#include <nlohmann/json.hpp>
+
+#include "backup_restore/journal.hpp"
+#include "utils/logger.h"
+
+RestoreJournal::RestoreJournal(Repository* repo, const std::string& backup_name,
+                               const fs::path& output_path)
+    : journal_path_(Journal::GetPath(
+          "restore", repo,
+          backup_name + "\n" +
+              fs::absolute(output_path).lexically_normal().string())) {}
+
+bool RestoreJournal::Load() {
+  std::ifstream journal_file(journal_path_);
+  if (!journal_file) return false;
+
+  finished_.clear();
+  progress_.clear();
+  pending_.clear();
+
+  std::string line;
+  bool has_header = false;
+  while (std::getline(journal_file, line)) {
+    nlohmann::json record;
+    try {
+      record = nlohmann::json::parse(line);
+    } catch (const nlohmann::json::exception&) {
+      // Torn write of the last record before a crash
+      break;
+    }
+
+    std::string kind = record.value("kind", "");
+    if (kind == "begin") {
+      has_header = true;
+    } else if (!has_header) {
+      break;
+    } else if (kind == "file") {
+      std::string file_path = record["path"].get<std::string>();
+      finished_[file_path] = record["sha256"].get<std::string>();
+      progress_.erase(file_path);
+    } else if (kind == "progress") {
+      RestoreProgress progress;
+      progress.chunks = record["chunks"].get<size_t>();
+      progress.bytes = record["bytes"].get<uint64_t>();
+      progress_[record["path"].get<std::string>()] = progress;
+    }
+  }
+
+  if (!has_header) {
+    Logger::SystemLog("Ignoring unreadable restore journal: " +
+                          journal_path_.string(),
+                      LogLevel::WARNING);
+    return false;
+  }
+  return true;
+}
+
+void RestoreJournal::Begin() {
+  finished_.clear();
+  progress_.clear();
+  pending_.clear();
+
+  nlohmann::json header;
+  header["kind"] = "begin";
+  Journal::WriteDurably(journal_path_, header.dump() + "\n", true);
+}
+
+void RestoreJournal::RecordFile(const std::string& file_path,
+                                const std::string& sha256) {
+  finished_[file_path] = sha256;
+  progress_.erase(file_path);
+
+  nlohmann::json record;
+  record["kind"] = "file";
+  record["path"] = file_path;
+  record["sha256"] = sha256;
+  pending_.push_back(record.dump());
+}
+
+void RestoreJournal::RecordProgress(const std::string& file_path,
+                                    const RestoreProgress& progress) {
+  progress_[file_path] = progress;
+
+  nlohmann::json record;
+  record["kind"] = "progress";
+  record["path"] = file_path;
+  record["chunks"] = progress.chunks;
+  record["bytes"] = progress.bytes;
+  pending_.push_back(record.dump());
+}
+
+std::optional<std::string> RestoreJournal::GetFinishedDigest(
+    const std::string& file_path) const {
+  auto it = finished_.find(file_path);
+  if (it == finished_.end()) return std::nullopt;
+  return it->second;
+}
+
+std::optional<RestoreProgress> RestoreJournal::GetProgress(
+    const std::string& file_path) const {
+  auto it = progress_.find(file_path);
+  if (it == progress_.end()) return std::nullopt;
+  return it->second;
+}
+
+void RestoreJournal::Commit() {
+  if (pending_.empty()) return;
+
+  std::string data;
+  for (const auto& record : pending_) {
+    data += record;
+    data += '\n';
+  }
+  Journal::WriteDurably(journal_path_, data, false);
+  pending_.clear();
+}
+
+void RestoreJournal::Remove() {
+  std::error_code ec;
+  fs::remove(journal_path_, ec);
+  finished_.clear();
+  progress_.clear();
+  pending_.clear();
+}
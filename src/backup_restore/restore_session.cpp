@@ -0,0 +1,58 @@
+#include "backup_restore/restore_session.hpp"
+
+#include "backup_restore/snapshot.hpp"
+#include "utils/error_util.h"
+
+RestoreSession::RestoreSession(Manifest& manifest, TreeStore* trees,
+                               const std::string& backup_name,
+                               const std::string& password)
+    : backup_name_(backup_name), trees_(trees) {
+  if (!manifest.Find(backup_name)) {
+    ErrorUtil::ThrowError("Backup metadata not found: " + backup_name);
+  }
+  fs::path metadata_path = manifest.FetchMetadata(backup_name);
+  SnapshotReader reader(metadata_path, password, trees);
+  root_ = reader.GetRoot();
+  if (root_) return;
+
+  reader.ReadFiles(
+      [this](const std::string& file_path, FileMetadata&& file_metadata) {
+        files_.insert_or_assign(file_path, std::move(file_metadata));
+      });
+  files_.IndexPaths();
+}
+
+uint64_t RestoreSession::GetFileCount() const {
+  return root_ ? root_->file_count : files_.size();
+}
+
+std::optional<FileMetadata> RestoreSession::Find(
+    const std::string& file_path) {
+  if (root_) {
+    return trees_->FindFile(*root_, file_path);
+  }
+  auto it = files_.find(file_path);
+  if (it == files_.end()) return std::nullopt;
+  return it->second;
+}
+
+void RestoreSession::ForEachFile(
+    const std::function<void(const std::string&, const FileMetadata&)>&
+        visitor,
+    const std::string& directory_key, TreeDirectories* directories) {
+  if (root_) {
+    trees_->ReadFiles(
+        *root_,
+        [&visitor](const std::string& file_path, FileMetadata&& file_metadata) {
+          visitor(file_path, file_metadata);
+        },
+        directories, directory_key);
+    return;
+  }
+
+  for (auto it = files_.lower_bound(directory_key); it != files_.end(); ++it) {
+    std::string file_path = it.GetPath();
+    if (file_path.compare(0, directory_key.size(), directory_key) != 0) break;
+    visitor(file_path, it->second);
+  }
+}
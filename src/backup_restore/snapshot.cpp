@@ -0,0 +1,500 @@
+#include "backup_restore/snapshot.hpp"
+
+#include <unistd.h>
+
+#include <iomanip>
+#include <sstream>
+
+#include "backup_restore/record_codec.hpp"
+#include "backup_restore/snapshot_spool.hpp"
+#include "utils/config_manager.h"
+#include "utils/error_util.h"
+
+// Start of the decrypted stream, followed by the format version. Version 1
+// lists every file, version 2 refers to the root of a tree of directory
+// nodes instead.
+static const std::string FORMAT_MAGIC = "RZSNAP";
+static const uint8_t FORMAT_VERSION = 2;
+static const uint8_t OLDEST_FORMAT_VERSION = 1;
+
+static const uint8_t TAG_HEADER = 'H';
+static const uint8_t TAG_FILE = 'F';
+static const uint8_t TAG_ROOT = 'R';
+static const uint8_t TAG_END = 'E';
+
+static const size_t COMPRESS_BATCH_SIZE = 1024 * 1024;
+static const size_t READ_BLOCK_SIZE = 1024 * 1024;
+static const uint64_t MAX_RECORD_SIZE = 1ULL << 30;
+
+using RecordCodec::PutString;
+using RecordCodec::PutVarint;
+using RecordCodec::PutSigned;
+
+SnapshotWriter::SnapshotWriter(const fs::path& path,
+                               const std::string& password,
+                               SnapshotFormat format)
+    : file_(path, std::ios::binary | std::ios::trunc),
+      format_(format),
+      password_(password) {
+  if (!file_) {
+    ErrorUtil::ThrowError("Could not create metadata file: " + path.string());
+  }
+  if (format_ == SnapshotFormat::JSON) return;
+
+  encryptor_ = std::make_unique<EncryptionUtil::MetadataEncryptor>(password);
+  cctx_ = ZSTD_createCCtx();
+  if (!cctx_) {
+    ErrorUtil::ThrowError("Failed to create zstd context");
+  }
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+
+  std::vector<uint8_t> marker(FORMAT_MAGIC.begin(), FORMAT_MAGIC.end());
+  marker.push_back(FORMAT_VERSION);
+  Emit(marker.data(), marker.size());
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (cctx_) ZSTD_freeCCtx(cctx_);
+}
+
+SnapshotFormat SnapshotWriter::GetConfiguredFormat() {
+  ConfigManager config;
+  std::string format = config.Get<std::string>("snapshot_format", "binary");
+  return format == "json" ? SnapshotFormat::JSON : SnapshotFormat::BINARY;
+}
+
+void SnapshotWriter::WriteHeader(const BackupMetadata& metadata) {
+  auto timestamp = std::chrono::system_clock::to_time_t(metadata.timestamp);
+
+  if (format_ == SnapshotFormat::JSON) {
+    legacy_json_["type"] = static_cast<int>(metadata.type);
+    legacy_json_["timestamp"] = timestamp;
+    legacy_json_["previous_backup"] = metadata.previous_backup;
+    legacy_json_["remarks"] = metadata.remarks;
+    legacy_json_["files"] = nlohmann::json::object();
+    return;
+  }
+
+  std::vector<uint8_t> record;
+  record.push_back(static_cast<uint8_t>(metadata.type));
+  PutSigned(record, timestamp);
+  PutString(record, metadata.previous_backup);
+  PutString(record, metadata.remarks);
+
+  pending_.push_back(TAG_HEADER);
+  PutVarint(pending_, record.size());
+  pending_.insert(pending_.end(), record.begin(), record.end());
+}
+
+void SnapshotWriter::WriteFile(const std::string& file_path,
+                               const FileMetadata& file_metadata) {
+  file_count_++;
+  if (format_ == SnapshotFormat::JSON) {
+    legacy_json_["files"][file_path] = FileMetadataToJson(file_metadata);
+    return;
+  }
+
+  std::vector<uint8_t> record;
+  PutString(record, file_path);
+  RecordCodec::PutFileMetadata(record, file_metadata);
+
+  pending_.push_back(TAG_FILE);
+  PutVarint(pending_, record.size());
+  pending_.insert(pending_.end(), record.begin(), record.end());
+
+  if (pending_.size() >= COMPRESS_BATCH_SIZE) {
+    Compress(ZSTD_e_continue);
+  }
+}
+
+void SnapshotWriter::WriteRoot(const TreeRef& root) {
+  if (format_ == SnapshotFormat::JSON) {
+    ErrorUtil::ThrowError("JSON snapshots can't refer to a tree");
+  }
+  file_count_ = root.file_count;
+
+  std::vector<uint8_t> record;
+  RecordCodec::PutDigest(record, root.hash);
+  PutVarint(record, root.file_count);
+  PutVarint(record, root.total_size);
+
+  pending_.push_back(TAG_ROOT);
+  PutVarint(pending_, record.size());
+  pending_.insert(pending_.end(), record.begin(), record.end());
+}
+
+void SnapshotWriter::Finish() {
+  if (finished_) return;
+
+  if (format_ == SnapshotFormat::JSON) {
+    std::vector<uint8_t> encrypted_data =
+        EncryptionUtil::EncryptMetadata(legacy_json_.dump(4), password_);
+    if (encrypted_data.empty()) {
+      ErrorUtil::ThrowError("Failed to encrypt snapshot metadata");
+    }
+    file_.write(reinterpret_cast<const char*>(encrypted_data.data()),
+                encrypted_data.size());
+  } else {
+    // Trailer tells a complete snapshot from a truncated one
+    std::vector<uint8_t> record;
+    PutVarint(record, file_count_);
+    pending_.push_back(TAG_END);
+    PutVarint(pending_, record.size());
+    pending_.insert(pending_.end(), record.begin(), record.end());
+
+    Compress(ZSTD_e_end);
+    std::vector<uint8_t> tail = encryptor_->Final();
+    file_.write(reinterpret_cast<const char*>(tail.data()), tail.size());
+  }
+
+  file_.close();
+  if (!file_) {
+    ErrorUtil::ThrowError("Failed to write snapshot metadata");
+  }
+  finished_ = true;
+}
+
+void SnapshotWriter::Compress(ZSTD_EndDirective mode) {
+  std::vector<uint8_t> output(ZSTD_CStreamOutSize());
+  ZSTD_inBuffer input = {pending_.data(), pending_.size(), 0};
+
+  while (true) {
+    ZSTD_outBuffer out = {output.data(), output.size(), 0};
+    size_t remaining = ZSTD_compressStream2(cctx_, &out, &input, mode);
+    if (ZSTD_isError(remaining)) {
+      ErrorUtil::ThrowError("Failed to compress snapshot metadata: " +
+                            std::string(ZSTD_getErrorName(remaining)));
+    }
+    Emit(output.data(), out.pos);
+
+    bool done = mode == ZSTD_e_end ? remaining == 0
+                                   : input.pos == input.size;
+    if (done) break;
+  }
+  pending_.clear();
+}
+
+void SnapshotWriter::Emit(const uint8_t* data, size_t size) {
+  if (size == 0) return;
+  std::vector<uint8_t> encrypted = encryptor_->Update(data, size);
+  file_.write(reinterpret_cast<const char*>(encrypted.data()),
+              encrypted.size());
+}
+
+SnapshotReader::SnapshotReader(const fs::path& path,
+                               const std::string& password, TreeStore* trees)
+    : file_(path, std::ios::binary), decryptor_(password), trees_(trees) {
+  if (!file_) {
+    ErrorUtil::ThrowError("Could not open metadata file: " + path.string());
+  }
+
+  // The format marker is the start of the decrypted stream
+  size_t marker_size = FORMAT_MAGIC.size() + 1;
+  while (compressed_.size() < marker_size && ReadMore()) {
+  }
+
+  if (compressed_.size() < marker_size ||
+      !std::equal(FORMAT_MAGIC.begin(), FORMAT_MAGIC.end(),
+                  compressed_.begin())) {
+    // Older snapshots are a single JSON document
+    legacy_ = true;
+    while (ReadMore()) {
+    }
+    try {
+      legacy_json_ = nlohmann::json::parse(compressed_.begin(), compressed_.end());
+    } catch (const nlohmann::json::exception&) {
+      ErrorUtil::ThrowError("Failed to decrypt metadata: " +
+                            path.filename().string());
+    }
+    std::vector<uint8_t>().swap(compressed_);
+
+    header_.type = static_cast<BackupType>(legacy_json_["type"].get<int>());
+    header_.timestamp = std::chrono::system_clock::from_time_t(
+        legacy_json_["timestamp"].get<time_t>());
+    header_.previous_backup = legacy_json_.value("previous_backup", "");
+    header_.remarks = legacy_json_.value("remarks", "");
+    return;
+  }
+
+  uint8_t version = compressed_[FORMAT_MAGIC.size()];
+  if (version < OLDEST_FORMAT_VERSION || version > FORMAT_VERSION) {
+    ErrorUtil::ThrowError("Unsupported snapshot format version " +
+                          std::to_string(version) + ": " +
+                          path.filename().string());
+  }
+  compressed_offset_ = marker_size;
+
+  dctx_ = ZSTD_createDCtx();
+  if (!dctx_) {
+    ErrorUtil::ThrowError("Failed to create zstd context");
+  }
+
+  uint8_t tag;
+  std::vector<uint8_t> payload;
+  if (!ReadRecord(tag, payload) || tag != TAG_HEADER) {
+    ErrorUtil::ThrowError("Snapshot header missing: " +
+                          path.filename().string());
+  }
+  RecordCodec::Decoder decoder(payload);
+  header_.type = static_cast<BackupType>(decoder.GetByte());
+  header_.timestamp =
+      std::chrono::system_clock::from_time_t(decoder.GetSigned());
+  header_.previous_backup = decoder.GetString();
+  header_.remarks = decoder.GetString();
+
+  if (version >= 2) {
+    if (!ReadRecord(tag, payload) || tag != TAG_ROOT) {
+      ErrorUtil::ThrowError("Snapshot tree root missing: " +
+                            path.filename().string());
+    }
+    RecordCodec::Decoder root_decoder(payload);
+    TreeRef root;
+    root.hash = root_decoder.GetDigest();
+    root.file_count = root_decoder.GetVarint();
+    root.total_size = root_decoder.GetVarint();
+    root_ = root;
+  }
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (dctx_) ZSTD_freeDCtx(dctx_);
+}
+
+void SnapshotReader::ReadFiles(
+    const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+    TreeDirectories* directories) {
+  if (legacy_) {
+    for (const auto& [file_path, file_json] : legacy_json_["files"].items()) {
+      visitor(file_path, FileMetadataFromJson(file_json));
+    }
+    return;
+  }
+
+  uint64_t file_count = 0;
+  if (root_) {
+    if (!trees_) {
+      ErrorUtil::ThrowError("Snapshot files are in a tree, no store given");
+    }
+    trees_->ReadFiles(*root_, visitor, directories);
+    file_count = root_->file_count;
+  }
+
+  uint8_t tag;
+  std::vector<uint8_t> payload;
+  while (ReadRecord(tag, payload)) {
+    RecordCodec::Decoder decoder(payload);
+    if (tag == TAG_FILE) {
+      std::string file_path = decoder.GetString();
+      visitor(file_path, decoder.GetFileMetadata());
+      file_count++;
+    } else if (tag == TAG_END) {
+      if (decoder.GetVarint() != file_count) {
+        ErrorUtil::ThrowError("Snapshot file count does not match its trailer");
+      }
+      return;
+    }
+    // Records added by later versions are skipped
+  }
+  ErrorUtil::ThrowError("Snapshot metadata is truncated");
+}
+
+bool SnapshotReader::ReadRecord(uint8_t& tag, std::vector<uint8_t>& payload) {
+  if (!Fill(1)) return false;
+  tag = buffer_[offset_++];
+
+  uint64_t length = 0;
+  for (int shift = 0;; shift += 7) {
+    if (shift >= 64 || !Fill(1)) {
+      ErrorUtil::ThrowError("Snapshot metadata is truncated");
+    }
+    uint8_t byte = buffer_[offset_++];
+    length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) break;
+  }
+
+  if (length > MAX_RECORD_SIZE || !Fill(length)) {
+    ErrorUtil::ThrowError("Snapshot metadata is truncated");
+  }
+  payload.assign(buffer_.begin() + offset_, buffer_.begin() + offset_ + length);
+  offset_ += length;
+  return true;
+}
+
+bool SnapshotReader::Fill(size_t size) {
+  while (buffer_.size() - offset_ < size) {
+    // Drop consumed records once they make up half the buffer
+    if (offset_ > 0 && offset_ >= buffer_.size() / 2) {
+      buffer_.erase(buffer_.begin(), buffer_.begin() + offset_);
+      offset_ = 0;
+    }
+    if (!Pump()) return false;
+  }
+  return true;
+}
+
+bool SnapshotReader::Pump() {
+  std::vector<uint8_t> output(ZSTD_DStreamOutSize());
+  while (true) {
+    if (compressed_offset_ < compressed_.size() || flush_pending_) {
+      ZSTD_inBuffer input = {compressed_.data(), compressed_.size(),
+                             compressed_offset_};
+      ZSTD_outBuffer out = {output.data(), output.size(), 0};
+      size_t result = ZSTD_decompressStream(dctx_, &out, &input);
+      if (ZSTD_isError(result)) {
+        ErrorUtil::ThrowError("Failed to decompress snapshot metadata: " +
+                              std::string(ZSTD_getErrorName(result)));
+      }
+      compressed_offset_ = input.pos;
+      flush_pending_ = out.pos == out.size;
+
+      if (out.pos > 0) {
+        buffer_.insert(buffer_.end(), output.begin(), output.begin() + out.pos);
+        return true;
+      }
+      if (compressed_offset_ < compressed_.size()) continue;
+    }
+    if (!ReadMore()) return false;
+  }
+}
+
+bool SnapshotReader::ReadMore() {
+  if (input_done_) return false;
+
+  std::vector<char> block(READ_BLOCK_SIZE);
+  file_.read(block.data(), block.size());
+  std::streamsize count = file_.gcount();
+
+  std::vector<uint8_t> plaintext = decryptor_.Update(
+      reinterpret_cast<const uint8_t*>(block.data()), count);
+  if (file_.eof()) {
+    std::vector<uint8_t> tail = decryptor_.Final();
+    plaintext.insert(plaintext.end(), tail.begin(), tail.end());
+    input_done_ = true;
+  } else if (!file_) {
+    ErrorUtil::ThrowError("Failed to read snapshot metadata");
+  }
+
+  if (compressed_offset_ > 0) {
+    compressed_.erase(compressed_.begin(),
+                      compressed_.begin() + compressed_offset_);
+    compressed_offset_ = 0;
+  }
+  compressed_.insert(compressed_.end(), plaintext.begin(), plaintext.end());
+  return true;
+}
+
+BackupMetadata ReadSnapshot(const fs::path& path, const std::string& password,
+                            TreeStore* trees, TreeDirectories* directories) {
+  SnapshotReader reader(path, password, trees);
+  BackupMetadata metadata = reader.GetHeader();
+  reader.ReadFiles(
+      [&metadata](const std::string& file_path, FileMetadata&& file_metadata) {
+        metadata.files.insert_or_assign(file_path, file_metadata);
+      },
+      directories);
+  return metadata;
+}
+
+// Spool the files of a snapshot so they come back in path order
+static void SpoolSnapshot(const fs::path& path, const std::string& password,
+                          TreeStore* trees, SnapshotSpool& spool) {
+  SnapshotReader reader(path, password, trees);
+  reader.ReadFiles(
+      [&spool](const std::string& file_path, FileMetadata&& file_metadata) {
+        spool.Add(file_path, file_metadata);
+      });
+}
+
+SnapshotDiff CompareSnapshots(const fs::path& before, const fs::path& after,
+                              const std::string& password, TreeStore* trees) {
+  {
+    SnapshotReader old_reader(before, password, trees);
+    SnapshotReader new_reader(after, password, trees);
+    if (old_reader.GetRoot() && new_reader.GetRoot()) {
+      return trees->Diff(*old_reader.GetRoot(), *new_reader.GetRoot());
+    }
+  }
+
+  // Snapshots without a tree list their files in the order they were
+  // written, so both are sorted through spools and joined by path
+  fs::path spool_dir = fs::temp_directory_path() /
+                       ("snapshot_diff_" + std::to_string(getpid()));
+  SnapshotSpool old_files(spool_dir / "before");
+  SnapshotSpool new_files(spool_dir / "after");
+  SpoolSnapshot(before, password, trees, old_files);
+  SpoolSnapshot(after, password, trees, new_files);
+
+  SnapshotDiff diff;
+  {
+    SnapshotSpool::Reader old_it(old_files);
+    SnapshotSpool::Reader new_it(new_files);
+    while (old_it.Valid() || new_it.Valid()) {
+      if (!new_it.Valid() ||
+          (old_it.Valid() && old_it.GetPath() < new_it.GetPath())) {
+        diff.deleted_files++;
+        diff.deleted_bytes += old_it.GetFile()->total_size;
+        old_it.Next();
+      } else if (!old_it.Valid() || new_it.GetPath() < old_it.GetPath()) {
+        diff.added_files++;
+        diff.added_bytes += new_it.GetFile()->total_size;
+        new_it.Next();
+      } else {
+        CompareFiles(*old_it.GetFile(), *new_it.GetFile(), diff);
+        old_it.Next();
+        new_it.Next();
+      }
+    }
+  }
+
+  std::error_code ec;
+  fs::remove_all(spool_dir, ec);
+  return diff;
+}
+
+std::string FormatBytes(uint64_t bytes) {
+  static const char* UNITS[] = {"B", "KB", "MB", "GB", "TB", "PB"};
+  double value = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < sizeof(UNITS) / sizeof(UNITS[0])) {
+    value /= 1024;
+    unit++;
+  }
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << " "
+      << UNITS[unit];
+  return out.str();
+}
+
+std::string FormatSnapshotDiff(const std::string& before,
+                               const std::string& after,
+                               const SnapshotDiff& diff) {
+  std::ostringstream comparison;
+  comparison << "Backup Comparison (" << before << " vs " << after << "):"
+             << "\n - Changed files: " << diff.changed_files << " ("
+             << FormatBytes(diff.changed_bytes) << " changed)"
+             << "\n - Unchanged files: " << diff.unchanged_files
+             << "\n - Added files: " << diff.added_files << " ("
+             << FormatBytes(diff.added_bytes) << ")"
+             << "\n - Deleted files: " << diff.deleted_files << " ("
+             << FormatBytes(diff.deleted_bytes) << ")"
+             << "\n - Shared data: " << FormatBytes(diff.shared_bytes)
+             << std::endl;
+  return comparison.str();
+}
+
+nlohmann::json SnapshotDiffToJson(const std::string& before,
+                                  const std::string& after,
+                                  const SnapshotDiff& diff) {
+  nlohmann::json diff_json;
+  diff_json["before"] = before;
+  diff_json["after"] = after;
+  diff_json["changed_files"] = diff.changed_files;
+  diff_json["unchanged_files"] = diff.unchanged_files;
+  diff_json["added_files"] = diff.added_files;
+  diff_json["deleted_files"] = diff.deleted_files;
+  diff_json["changed_bytes"] = diff.changed_bytes;
+  diff_json["added_bytes"] = diff.added_bytes;
+  diff_json["deleted_bytes"] = diff.deleted_bytes;
+  diff_json["shared_bytes"] = diff.shared_bytes;
+  return diff_json;
+}
@@ -0,0 +1,198 @@
+#include "backup_restore/snapshot_spool.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+
+#include "backup_restore/record_codec.hpp"
+#include "utils/error_util.h"
+
+namespace fs = std::filesystem;
+
+static const uint8_t RECORD_FILE = 'F';
+static const uint8_t RECORD_REMOVED = 'X';
+
+// Rough bookkeeping cost of a buffered record besides its bytes
+static const uint64_t RECORD_OVERHEAD = sizeof(std::string) * 2 + 16;
+
+namespace {
+
+// Reads a run back one record at a time
+class RunReader {
+ public:
+  explicit RunReader(const fs::path& path)
+      : path_(path), file_(path, std::ios::binary) {
+    if (!file_) {
+      ErrorUtil::ThrowError("Could not open snapshot spool run: " +
+                            path.string());
+    }
+    Next();
+  }
+
+  bool Valid() const { return valid_; }
+  const std::string& GetPath() const { return path_in_run_; }
+  bool IsRemoved() const { return removed_; }
+  FileMetadata GetFile() const {
+    RecordCodec::Decoder decoder(payload_.data() + file_offset_,
+                                 payload_.size() - file_offset_);
+    return decoder.GetFileMetadata();
+  }
+
+  void Next() {
+    uint64_t length = 0;
+    for (int shift = 0;; shift += 7) {
+      int byte = file_.get();
+      if (byte == EOF) {
+        if (shift != 0) Corrupt();
+        valid_ = false;
+        return;
+      }
+      length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) break;
+      if (shift >= 63) Corrupt();
+    }
+
+    payload_.resize(length);
+    if (!file_.read(reinterpret_cast<char*>(payload_.data()), length)) {
+      Corrupt();
+    }
+    RecordCodec::Decoder decoder(payload_.data(), payload_.size());
+    path_in_run_ = decoder.GetString();
+    removed_ = decoder.GetByte() == RECORD_REMOVED;
+    file_offset_ = decoder.GetOffset();
+    valid_ = true;
+  }
+
+ private:
+  [[noreturn]] void Corrupt() {
+    ErrorUtil::ThrowError("Corrupt snapshot spool run: " + path_.string());
+  }
+
+  fs::path path_;
+  std::ifstream file_;
+  bool valid_ = false;
+  std::string path_in_run_;
+  bool removed_ = false;
+  std::vector<uint8_t> payload_;
+  size_t file_offset_ = 0;
+};
+
+}  // namespace
+
+SnapshotSpool::SnapshotSpool(const fs::path& dir, uint64_t max_buffer_bytes)
+    : dir_(dir), max_buffer_bytes_(max_buffer_bytes) {}
+
+SnapshotSpool::~SnapshotSpool() {
+  std::error_code ec;
+  for (const auto& run : runs_) {
+    fs::remove(run, ec);
+  }
+}
+
+void SnapshotSpool::Add(const std::string& file_path,
+                        const FileMetadata& file_metadata) {
+  Record record;
+  record.path = file_path;
+  RecordCodec::PutFileMetadata(record.file, file_metadata);
+  Push(std::move(record));
+}
+
+void SnapshotSpool::Remove(const std::string& file_path) {
+  Record record;
+  record.path = file_path;
+  record.removed = true;
+  Push(std::move(record));
+}
+
+void SnapshotSpool::Push(Record record) {
+  buffer_bytes_ += record.path.size() + record.file.size() + RECORD_OVERHEAD;
+  buffer_.push_back(std::move(record));
+  if (buffer_bytes_ >= max_buffer_bytes_) {
+    Spill();
+  }
+}
+
+void SnapshotSpool::Spill() {
+  if (buffer_.empty()) return;
+
+  // Stable, so the last record of a path stays last among its equals
+  std::stable_sort(
+      buffer_.begin(), buffer_.end(),
+      [](const Record& a, const Record& b) { return a.path < b.path; });
+
+  fs::create_directories(dir_);
+  fs::path run_path = dir_ / ("run_" + std::to_string(runs_.size()));
+  std::ofstream file(run_path, std::ios::binary | std::ios::trunc);
+  std::vector<uint8_t> payload;
+  std::vector<uint8_t> length;
+  for (size_t i = 0; i < buffer_.size(); i++) {
+    if (i + 1 < buffer_.size() && buffer_[i + 1].path == buffer_[i].path) {
+      continue;
+    }
+    const Record& record = buffer_[i];
+    payload.clear();
+    RecordCodec::PutString(payload, record.path);
+    payload.push_back(record.removed ? RECORD_REMOVED : RECORD_FILE);
+    payload.insert(payload.end(), record.file.begin(), record.file.end());
+
+    length.clear();
+    RecordCodec::PutVarint(length, payload.size());
+    file.write(reinterpret_cast<const char*>(length.data()), length.size());
+    file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+  }
+  file.close();
+  if (!file) {
+    ErrorUtil::ThrowError("Could not write snapshot spool run: " +
+                          run_path.string());
+  }
+
+  runs_.push_back(run_path);
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  buffer_bytes_ = 0;
+}
+
+struct SnapshotSpool::Reader::Runs {
+  std::vector<std::unique_ptr<RunReader>> readers;
+};
+
+SnapshotSpool::Reader::Reader(SnapshotSpool& spool)
+    : runs_(std::make_unique<Runs>()) {
+  spool.Spill();
+  for (const auto& run : spool.runs_) {
+    runs_->readers.push_back(std::make_unique<RunReader>(run));
+  }
+  Next();
+}
+
+SnapshotSpool::Reader::~Reader() = default;
+
+void SnapshotSpool::Reader::Next() {
+  // Runs are few, one per buffer spilled, so the smallest head is found by
+  // scanning them. Of equal paths the newest run wins.
+  RunReader* next = nullptr;
+  for (const auto& reader : runs_->readers) {
+    if (reader->Valid() && (!next || reader->GetPath() <= next->GetPath())) {
+      next = reader.get();
+    }
+  }
+  valid_ = next != nullptr;
+  if (!valid_) return;
+
+  path_ = next->GetPath();
+  removed_ = next->IsRemoved();
+  if (!removed_) file_ = next->GetFile();
+  for (const auto& reader : runs_->readers) {
+    if (reader->Valid() && reader->GetPath() == path_) {
+      reader->Next();
+    }
+  }
+}
+
+void SnapshotSpool::Merge(
+    const std::function<void(const std::string&, const FileMetadata*)>&
+        visitor) {
+  for (Reader reader(*this); reader.Valid(); reader.Next()) {
+    visitor(reader.GetPath(), reader.GetFile());
+  }
+}
@@ -0,0 +1,637 @@
+#include "backup_restore/tree.hpp"
+
+#include <unistd.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <string_view>
+#include <thread>
+
+#include "backup_restore/chunk_cache.hpp"
+#include "backup_restore/mapped_file.hpp"
+#include "backup_restore/record_codec.hpp"
+#include "utils/encryption_util.h"
+#include "utils/error_util.h"
+#include "utils/logger.h"
+
+namespace fs = std::filesystem;
+
+// Start of every encoded node, followed by the format version
+static const std::string NODE_MAGIC = "RZTREE";
+static const uint8_t NODE_VERSION = 1;
+
+static const uint8_t ENTRY_FILE = 'F';
+static const uint8_t ENTRY_DIRECTORY = 'D';
+
+static const uint64_t MAX_NODE_SIZE = 1ULL << 30;
+// Decoded nodes kept for lookups, enough for the directories around the
+// files of a walk
+static const size_t DECODED_NODE_LIMIT = 256;
+static const std::string VERIFIED_NAME = "verified_trees";
+// Differing subtrees to gather per worker before comparing in parallel, so
+// one large subtree does not leave the other workers idle
+static const size_t DIFF_TASKS_PER_WORKER = 4;
+
+static std::vector<uint8_t> ReadFileBytes(const fs::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    ErrorUtil::ThrowError("Could not open file: " + path.string());
+  }
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+static void WriteFileBytes(const fs::path& path,
+                           const std::vector<uint8_t>& data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  file.close();
+  if (!file) {
+    ErrorUtil::ThrowError("Could not write file: " + path.string());
+  }
+}
+
+// Decrypt and decompress a stored node, returning its encoding
+static std::vector<uint8_t> OpenNode(const uint8_t* object, size_t size,
+                                     const std::string& password) {
+  EncryptionUtil::MetadataDecryptor decryptor(password);
+  std::vector<uint8_t> compressed = decryptor.Update(object, size);
+  std::vector<uint8_t> tail = decryptor.Final();
+  compressed.insert(compressed.end(), tail.begin(), tail.end());
+
+  unsigned long long node_size =
+      ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+  if (node_size == ZSTD_CONTENTSIZE_ERROR ||
+      node_size == ZSTD_CONTENTSIZE_UNKNOWN || node_size > MAX_NODE_SIZE) {
+    ErrorUtil::ThrowError("Corrupt tree node");
+  }
+  std::vector<uint8_t> node(node_size);
+  size_t result = ZSTD_decompress(node.data(), node.size(), compressed.data(),
+                                  compressed.size());
+  if (ZSTD_isError(result) || result != node_size) {
+    ErrorUtil::ThrowError("Failed to decompress tree node");
+  }
+  return node;
+}
+
+static std::vector<TreeEntry> DecodeNode(const std::vector<uint8_t>& node) {
+  size_t marker_size = NODE_MAGIC.size() + 1;
+  if (node.size() < marker_size ||
+      !std::equal(NODE_MAGIC.begin(), NODE_MAGIC.end(), node.begin())) {
+    ErrorUtil::ThrowError("Corrupt tree node: bad marker");
+  }
+  if (node[NODE_MAGIC.size()] != NODE_VERSION) {
+    ErrorUtil::ThrowError("Unsupported tree node version " +
+                          std::to_string(node[NODE_MAGIC.size()]));
+  }
+
+  RecordCodec::Decoder decoder(node.data() + marker_size,
+                               node.size() - marker_size);
+  uint64_t count = decoder.GetVarint();
+  std::vector<TreeEntry> entries;
+  for (uint64_t i = 0; i < count; i++) {
+    TreeEntry entry;
+    uint8_t kind = decoder.GetByte();
+    entry.name = decoder.GetString();
+    if (kind == ENTRY_DIRECTORY) {
+      entry.is_directory = true;
+      entry.subtree.hash = decoder.GetDigest();
+      entry.subtree.file_count = decoder.GetVarint();
+      entry.subtree.total_size = decoder.GetVarint();
+    } else if (kind == ENTRY_FILE) {
+      entry.file = decoder.GetFileMetadata();
+    } else {
+      ErrorUtil::ThrowError("Corrupt tree node: unknown entry kind");
+    }
+    entries.push_back(std::move(entry));
+  }
+  return entries;
+}
+
+static uint64_t CountFiles(const TreeEntry& entry) {
+  return entry.is_directory ? entry.subtree.file_count : 1;
+}
+
+static uint64_t CountBytes(const TreeEntry& entry) {
+  return entry.is_directory ? entry.subtree.total_size : entry.file.total_size;
+}
+
+SnapshotDiff& SnapshotDiff::operator+=(const SnapshotDiff& other) {
+  changed_files += other.changed_files;
+  unchanged_files += other.unchanged_files;
+  added_files += other.added_files;
+  deleted_files += other.deleted_files;
+  added_bytes += other.added_bytes;
+  deleted_bytes += other.deleted_bytes;
+  changed_bytes += other.changed_bytes;
+  shared_bytes += other.shared_bytes;
+  return *this;
+}
+
+void CompareFiles(const FileMetadata& before, const FileMetadata& after,
+                  SnapshotDiff& diff) {
+  if (before.chunk_hashes == after.chunk_hashes &&
+      before.total_size == after.total_size &&
+      before.is_symlink == after.is_symlink &&
+      before.symlink_target == after.symlink_target &&
+      before.holes == after.holes) {
+    diff.unchanged_files++;
+    diff.shared_bytes += after.total_size;
+    return;
+  }
+  diff.changed_files++;
+
+  // Chunks of the new version the old one also had, each counted once
+  std::unordered_map<std::string_view, size_t> old_chunks;
+  for (const auto& hash : before.chunk_hashes) {
+    old_chunks[hash]++;
+  }
+  uint64_t shared_chunks = 0;
+  for (const auto& hash : after.chunk_hashes) {
+    auto it = old_chunks.find(hash);
+    if (it != old_chunks.end() && it->second > 0) {
+      it->second--;
+      shared_chunks++;
+    }
+  }
+
+  uint64_t chunk_count = after.chunk_hashes.size();
+  uint64_t shared_bytes =
+      chunk_count == 0
+          ? 0
+          : after.total_size / chunk_count * shared_chunks +
+                after.total_size % chunk_count * shared_chunks / chunk_count;
+  diff.shared_bytes += shared_bytes;
+  diff.changed_bytes += after.total_size - shared_bytes;
+}
+
+TreeStore::TreeStore(Repository* repo, const fs::path& cache_dir)
+    : repo_(repo),
+      cache_dir_(cache_dir / "trees"),
+      // Staged next to the cache so flushing a node is a rename
+      staging_dir_(cache_dir_ / (".part." + std::to_string(getpid()))) {
+  fs::create_directories(cache_dir_);
+
+  // Drop nodes of runs that ended before flushing them
+  std::error_code ec;
+  auto stale_before = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto& file : fs::directory_iterator(cache_dir_, ec)) {
+    if (file.path().filename().string().find(".part.") != std::string::npos &&
+        file.last_write_time(ec) < stale_before) {
+      fs::remove_all(file.path(), ec);
+    }
+  }
+}
+
+TreeStore::~TreeStore() {
+  std::error_code ec;
+  fs::remove_all(staging_dir_, ec);
+}
+
+std::string TreeStore::GetDirectoryKey(const std::string& file_path) {
+  size_t slash = file_path.rfind('/');
+  return slash == std::string::npos ? "" : file_path.substr(0, slash + 1);
+}
+
+std::string TreeStore::GetParentKey(const std::string& directory_key) {
+  if (directory_key.size() < 2) return "";
+  size_t slash = directory_key.rfind('/', directory_key.size() - 2);
+  return slash == std::string::npos ? "" : directory_key.substr(0, slash + 1);
+}
+
+fs::path TreeStore::GetCachePath(const std::string& hash) const {
+  return cache_dir_ / hash.substr(0, 2) / (hash + ".tree");
+}
+
+std::string TreeStore::Put(const std::vector<uint8_t>& node) {
+  std::string hash = ChunkCache::CalculateDigest(node);
+  // The cache may outlive the repository's copy of a node, only nodes this
+  // store uploaded are known to be there
+  if (pending_.count(hash) || stored_.count(hash)) return hash;
+
+  std::vector<uint8_t> compressed(ZSTD_compressBound(node.size()));
+  size_t compressed_size =
+      ZSTD_compress(compressed.data(), compressed.size(), node.data(),
+                    node.size(), ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError(compressed_size)) {
+    ErrorUtil::ThrowError("Failed to compress tree node: " +
+                          std::string(ZSTD_getErrorName(compressed_size)));
+  }
+
+  EncryptionUtil::MetadataEncryptor encryptor(repo_->GetPassword());
+  std::vector<uint8_t> object =
+      encryptor.Update(compressed.data(), compressed_size);
+  std::vector<uint8_t> tail = encryptor.Final();
+  object.insert(object.end(), tail.begin(), tail.end());
+
+  fs::create_directories(staging_dir_);
+  fs::path staged_path = staging_dir_ / (hash + ".tree");
+  WriteFileBytes(staged_path, object);
+  if (!repo_->UploadFile(staged_path.string(),
+                         "trees/" + hash.substr(0, 2) + "/")) {
+    fs::remove(staged_path);
+    ErrorUtil::ThrowError("Failed to upload tree node: " + hash);
+  }
+  pending_[hash] = staged_path;
+  return hash;
+}
+
+void TreeStore::Flush() {
+  repo_->Flush();
+
+  for (const auto& [hash, staged_path] : pending_) {
+    fs::path cached_path = GetCachePath(hash);
+    fs::create_directories(cached_path.parent_path());
+    fs::rename(staged_path, cached_path);
+    stored_.insert(hash);
+  }
+  pending_.clear();
+}
+
+std::vector<TreeEntry> TreeStore::Get(const std::string& hash) {
+  // Written by this run and not flushed yet
+  auto staged = pending_.find(hash);
+  if (staged != pending_.end()) {
+    MappedFile object(staged->second);
+    return DecodeNode(
+        OpenNode(object.data(), object.size(), repo_->GetPassword()));
+  }
+
+  fs::path cached_path = GetCachePath(hash);
+  if (fs::exists(cached_path)) {
+    try {
+      MappedFile object(cached_path);
+      std::vector<uint8_t> node =
+          OpenNode(object.data(), object.size(), repo_->GetPassword());
+      if (ChunkCache::CalculateDigest(node) == hash) {
+        return DecodeNode(node);
+      }
+    } catch (const std::exception& e) {
+      Logger::SystemLog("Dropping damaged cached tree node " + hash + ": " +
+                            e.what(),
+                        LogLevel::WARNING);
+    }
+    fs::remove(cached_path);
+  }
+
+  fs::create_directories(cached_path.parent_path());
+  // Diffs fetch nodes from several threads
+  fs::path download_path =
+      cached_path.string() + ".part." + std::to_string(getpid()) + "." +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  repo_->DownloadFile("trees/" + hash.substr(0, 2) + "/" + hash + ".tree",
+                      download_path.string());
+  if (!fs::exists(download_path)) {
+    ErrorUtil::ThrowError("Tree node not found in repository: " + hash);
+  }
+
+  std::vector<uint8_t> object = ReadFileBytes(download_path);
+  std::vector<uint8_t> node;
+  try {
+    node = OpenNode(object.data(), object.size(), repo_->GetPassword());
+  } catch (...) {
+    fs::remove(download_path);
+    throw;
+  }
+  if (ChunkCache::CalculateDigest(node) != hash) {
+    fs::remove(download_path);
+    ErrorUtil::ThrowError("Tree node does not match its hash: " + hash);
+  }
+  fs::rename(download_path, cached_path);
+  return DecodeNode(node);
+}
+
+void TreeStore::ReadFiles(
+    const TreeRef& root,
+    const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+    TreeDirectories* directories, const std::string& directory_key) {
+  // Descend to the directory through the nodes on its path only
+  TreeRef ref = root;
+  size_t start = 0;
+  while (start < directory_key.size()) {
+    size_t slash = directory_key.find('/', start);
+    if (slash == std::string::npos) {
+      ErrorUtil::ThrowError("Not a directory key: " + directory_key);
+    }
+    std::string name = directory_key.substr(start, slash - start);
+    std::shared_ptr<const std::vector<TreeEntry>> node = GetDecoded(ref.hash);
+    auto entry = std::lower_bound(
+        node->begin(), node->end(), name,
+        [](const TreeEntry& a, const std::string& b) { return a.name < b; });
+    if (entry == node->end() || entry->name != name || !entry->is_directory) {
+      return;
+    }
+    ref = entry->subtree;
+    start = slash + 1;
+  }
+  ReadDirectory(ref, directory_key, visitor, directories);
+}
+
+void TreeStore::ReadDirectory(
+    const TreeRef& ref, const std::string& key,
+    const std::function<void(const std::string&, FileMetadata&&)>& visitor,
+    TreeDirectories* directories) {
+  if (directories) (*directories)[key] = ref;
+
+  uint64_t file_count = 0;
+  for (auto& entry : Get(ref.hash)) {
+    file_count += CountFiles(entry);
+    if (entry.is_directory) {
+      ReadDirectory(entry.subtree, key + entry.name + "/", visitor,
+                    directories);
+    } else {
+      visitor(key + entry.name, std::move(entry.file));
+    }
+  }
+  if (file_count != ref.file_count) {
+    ErrorUtil::ThrowError("Tree node does not match its reference: " +
+                          ref.hash);
+  }
+}
+
+std::shared_ptr<const std::vector<TreeEntry>> TreeStore::GetDecoded(
+    const std::string& hash) {
+  auto cached = decoded_index_.find(hash);
+  if (cached != decoded_index_.end()) {
+    decoded_.splice(decoded_.begin(), decoded_, cached->second);
+    return cached->second->second;
+  }
+
+  auto node = std::make_shared<const std::vector<TreeEntry>>(Get(hash));
+  decoded_.emplace_front(hash, node);
+  decoded_index_[hash] = decoded_.begin();
+  if (decoded_.size() > DECODED_NODE_LIMIT) {
+    decoded_index_.erase(decoded_.back().first);
+    decoded_.pop_back();
+  }
+  return node;
+}
+
+std::optional<FileMetadata> TreeStore::FindFile(const TreeRef& root,
+                                                const std::string& file_path) {
+  std::shared_ptr<const std::vector<TreeEntry>> node = GetDecoded(root.hash);
+  size_t start = 0;
+  while (true) {
+    size_t slash = file_path.find('/', start);
+    std::string name = file_path.substr(
+        start, slash == std::string::npos ? slash : slash - start);
+
+    // Entries are sorted by name
+    auto entry = std::lower_bound(
+        node->begin(), node->end(), name,
+        [](const TreeEntry& a, const std::string& b) { return a.name < b; });
+    if (entry == node->end() || entry->name != name) {
+      return std::nullopt;
+    }
+    if (slash == std::string::npos) {
+      if (entry->is_directory) return std::nullopt;
+      return entry->file;
+    }
+    if (!entry->is_directory) {
+      return std::nullopt;
+    }
+    node = GetDecoded(entry->subtree.hash);
+    start = slash + 1;
+  }
+}
+
+SnapshotDiff TreeStore::Diff(const TreeRef& before, const TreeRef& after) {
+  size_t worker_count = std::max(1u, std::thread::hardware_concurrency());
+
+  SnapshotDiff diff;
+  std::vector<std::pair<TreeRef, TreeRef>> work = {{before, after}};
+  while (!work.empty() && work.size() < worker_count * DIFF_TASKS_PER_WORKER) {
+    std::vector<std::pair<TreeRef, TreeRef>> deeper;
+    for (const auto& [old_ref, new_ref] : work) {
+      DiffDirectory(old_ref, new_ref, diff, &deeper);
+    }
+    work = std::move(deeper);
+  }
+  if (work.empty()) return diff;
+
+  std::vector<SnapshotDiff> partial(std::min(worker_count, work.size()));
+  std::vector<std::exception_ptr> errors(partial.size());
+  std::atomic<size_t> next_task{0};
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < partial.size(); w++) {
+    workers.emplace_back([&, w] {
+      try {
+        for (size_t i = next_task++; i < work.size(); i = next_task++) {
+          DiffDirectory(work[i].first, work[i].second, partial[w], nullptr);
+        }
+      } catch (...) {
+        errors[w] = std::current_exception();
+        next_task = work.size();
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (const auto& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+  for (const auto& worker_diff : partial) {
+    diff += worker_diff;
+  }
+  return diff;
+}
+
+void TreeStore::DiffDirectory(
+    const TreeRef& before, const TreeRef& after, SnapshotDiff& diff,
+    std::vector<std::pair<TreeRef, TreeRef>>* deeper) {
+  if (before.hash == after.hash) {
+    diff.unchanged_files += after.file_count;
+    diff.shared_bytes += after.total_size;
+    return;
+  }
+
+  // Entries are sorted by name, so both nodes are walked in one pass
+  std::vector<TreeEntry> old_entries = Get(before.hash);
+  std::vector<TreeEntry> new_entries = Get(after.hash);
+  auto old_it = old_entries.begin();
+  auto new_it = new_entries.begin();
+  while (old_it != old_entries.end() || new_it != new_entries.end()) {
+    if (new_it == new_entries.end() ||
+        (old_it != old_entries.end() && old_it->name < new_it->name)) {
+      diff.deleted_files += CountFiles(*old_it);
+      diff.deleted_bytes += CountBytes(*old_it);
+      ++old_it;
+    } else if (old_it == old_entries.end() || new_it->name < old_it->name) {
+      diff.added_files += CountFiles(*new_it);
+      diff.added_bytes += CountBytes(*new_it);
+      ++new_it;
+    } else {
+      if (old_it->is_directory && new_it->is_directory) {
+        if (deeper && old_it->subtree.hash != new_it->subtree.hash) {
+          deeper->emplace_back(old_it->subtree, new_it->subtree);
+        } else {
+          DiffDirectory(old_it->subtree, new_it->subtree, diff, nullptr);
+        }
+      } else if (old_it->is_directory || new_it->is_directory) {
+        diff.deleted_files += CountFiles(*old_it);
+        diff.deleted_bytes += CountBytes(*old_it);
+        diff.added_files += CountFiles(*new_it);
+        diff.added_bytes += CountBytes(*new_it);
+      } else {
+        CompareFiles(old_it->file, new_it->file, diff);
+      }
+      ++old_it;
+      ++new_it;
+    }
+  }
+}
+
+void TreeStore::LoadVerified() {
+  if (verified_loaded_) return;
+  std::ifstream file(cache_dir_ / VERIFIED_NAME);
+  std::string hash;
+  while (file >> hash) {
+    verified_.insert(hash);
+  }
+  verified_loaded_ = true;
+}
+
+bool TreeStore::IsVerified(const TreeDirectories& directories,
+                           const std::string& file_path) {
+  LoadVerified();
+  std::string key = GetDirectoryKey(file_path);
+  while (true) {
+    auto it = directories.find(key);
+    if (it != directories.end() && verified_.count(it->second.hash)) {
+      return true;
+    }
+    if (key.empty()) return false;
+    key = GetParentKey(key);
+  }
+}
+
+void TreeStore::MarkVerified(const TreeDirectories& directories) {
+  LoadVerified();
+  std::ofstream file(cache_dir_ / VERIFIED_NAME, std::ios::app);
+  for (const auto& [_, ref] : directories) {
+    if (verified_.insert(ref.hash).second) {
+      file << ref.hash << "\n";
+    }
+  }
+}
+
+TreeRef TreeBuilder::Build(const std::optional<TreeRef>& base,
+                           SnapshotSpool& changes) {
+  // Nothing changed since the base snapshot
+  if (base && changes.IsEmpty()) {
+    return *base;
+  }
+
+  std::vector<OpenDirectory> open(1);
+  if (base) {
+    open.back().entries = ReadEntries(*base);
+  }
+
+  changes.Merge([&](const std::string& file_path,
+                    const FileMetadata* file_metadata) {
+    // In path order the changes below a directory form one contiguous run
+    std::string key = TreeStore::GetDirectoryKey(file_path);
+    while (key.compare(0, open.back().key.size(), open.back().key) != 0) {
+      CloseDirectory(open);
+    }
+    while (open.back().key != key) {
+      const std::string& parent = open.back().key;
+      OpenDirectory child;
+      child.key = key.substr(0, key.find('/', parent.size()) + 1);
+      auto existing = open.back().entries.find(child.key.substr(
+          parent.size(), child.key.size() - parent.size() - 1));
+      if (existing != open.back().entries.end() &&
+          existing->second.is_directory) {
+        child.entries = ReadEntries(existing->second.subtree);
+      }
+      open.push_back(std::move(child));
+    }
+
+    std::string name = file_path.substr(key.size());
+    if (!file_metadata) {
+      open.back().entries.erase(name);
+      return;
+    }
+    PendingEntry entry;
+    entry.total_size = file_metadata->total_size;
+    RecordCodec::PutFileMetadata(entry.file, *file_metadata);
+    open.back().entries.insert_or_assign(name, std::move(entry));
+  });
+
+  while (open.size() > 1) {
+    CloseDirectory(open);
+  }
+  return WriteDirectory(open.back());
+}
+
+std::map<std::string, TreeBuilder::PendingEntry> TreeBuilder::ReadEntries(
+    const TreeRef& ref) {
+  std::map<std::string, PendingEntry> entries;
+  for (auto& entry : store_->Get(ref.hash)) {
+    PendingEntry pending;
+    pending.is_directory = entry.is_directory;
+    if (entry.is_directory) {
+      pending.subtree = entry.subtree;
+    } else {
+      pending.total_size = entry.file.total_size;
+      RecordCodec::PutFileMetadata(pending.file, entry.file);
+    }
+    entries.emplace(std::move(entry.name), std::move(pending));
+  }
+  return entries;
+}
+
+void TreeBuilder::CloseDirectory(std::vector<OpenDirectory>& open) {
+  OpenDirectory directory = std::move(open.back());
+  open.pop_back();
+
+  std::string parent = TreeStore::GetParentKey(directory.key);
+  std::string name = directory.key.substr(
+      parent.size(), directory.key.size() - parent.size() - 1);
+  auto& entries = open.back().entries;
+  if (directory.entries.empty()) {
+    // Its last file was deleted, unless a file took the name meanwhile
+    auto existing = entries.find(name);
+    if (existing != entries.end() && existing->second.is_directory) {
+      entries.erase(existing);
+    }
+    return;
+  }
+
+  PendingEntry entry;
+  entry.is_directory = true;
+  entry.subtree = WriteDirectory(directory);
+  entries.insert_or_assign(name, std::move(entry));
+}
+
+TreeRef TreeBuilder::WriteDirectory(const OpenDirectory& directory) {
+  TreeRef ref;
+  std::vector<uint8_t> node(NODE_MAGIC.begin(), NODE_MAGIC.end());
+  node.push_back(NODE_VERSION);
+  RecordCodec::PutVarint(node, directory.entries.size());
+  for (const auto& [name, entry] : directory.entries) {
+    if (entry.is_directory) {
+      node.push_back(ENTRY_DIRECTORY);
+      RecordCodec::PutString(node, name);
+      RecordCodec::PutDigest(node, entry.subtree.hash);
+      RecordCodec::PutVarint(node, entry.subtree.file_count);
+      RecordCodec::PutVarint(node, entry.subtree.total_size);
+      ref.file_count += entry.subtree.file_count;
+      ref.total_size += entry.subtree.total_size;
+    } else {
+      node.push_back(ENTRY_FILE);
+      RecordCodec::PutString(node, name);
+      node.insert(node.end(), entry.file.begin(), entry.file.end());
+      ref.file_count++;
+      ref.total_size += entry.total_size;
+    }
+  }
+
+  ref.hash = store_->Put(node);
+  return ref;
+}
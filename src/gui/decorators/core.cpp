@@ -1,7 +1,6 @@
 #include "gui/decorators/core.h"
 
 #include <QWidget>
-#include <set>
 
 #include "gui/decorators/message_box.h"
 #include "gui/decorators/progress_box.h"
@@ -100,14 +99,14 @@ void RestoreGUI::RestoreAll(std::function<void(bool)> onFinishCallback,
             return false;
           }
 
-          if (!metadata_ || !(*metadata_)) {
+          if (!session_) {
             setFailureMessage("Metadata unavailable for backup.");
             Logger::SystemLog("GUI | Restore | Metadata pointer is null",
                               LogLevel::ERROR);
             return false;
           }
 
-          int total_files = (*metadata_)->files.size(), processed_files = 0;
+          int total_files = session_->GetFileCount(), processed_files = 0;
 
           if (total_files == 0) {
             setFailureMessage("No files to restore in the selected backup.");
@@ -121,10 +120,17 @@ void RestoreGUI::RestoreAll(std::function<void(bool)> onFinishCallback,
           failed_files_.clear();
           successful_files_.clear();
 
-          for (const auto& [file_path, metadata] : (*metadata_)->files) {
+          // Repeating an interrupted restore continues where it stopped
+          OpenJournal(output_path_, backup_name_,
+                      CanResume(output_path_, backup_name_));
+
+          ForEachPlanned(output_path_, false, {},
+                         [&](const std::string& file_path,
+                             const FileMetadata& metadata,
+                             const PrefetchPlan& plan) {
             try {
               setWaitMessage(QString::fromStdString("Restoring " + file_path));
-              RestoreFile(file_path, output_path_, backup_name_);
+              RestoreEntry(file_path, metadata, output_path_, &plan);
             } catch (const std::exception& e) {
               failed_files_.push_back(file_path);
               Logger::SystemLog(
@@ -135,7 +141,8 @@ void RestoreGUI::RestoreAll(std::function<void(bool)> onFinishCallback,
             processed_files++;
             setProgress(
                 static_cast<int>((processed_files * 100) / total_files));
-          }
+          });
+          CloseJournal();
 
           SetRestoreSummary();
 
@@ -234,14 +241,14 @@ void RestoreGUI::VerifyBackup(std::function<void(bool)> onFinishCallback,
             return false;
           }
 
-          if (!metadata_ || !(*metadata_)) {
+          if (!session_) {
             setFailureMessage("Metadata unavailable for backup.");
             Logger::SystemLog("GUI | Verify Backup | Metadata pointer is null",
                               LogLevel::ERROR);
             return false;
           }
 
-          int total_files = (*metadata_)->files.size(), processed_files = 0;
+          int total_files = session_->GetFileCount(), processed_files = 0;
 
           if (total_files == 0) {
             setFailureMessage("No files to verify in the selected backup.");
@@ -256,11 +263,14 @@ void RestoreGUI::VerifyBackup(std::function<void(bool)> onFinishCallback,
           failed_files_.clear();
           successful_files_.clear();
 
-          for (const auto& [file_path, metadata] : (*metadata_)->files) {
+          ForEachPlanned(output_path_, true, {},
+                         [&](const std::string& file_path,
+                             const FileMetadata& metadata,
+                             const PrefetchPlan& plan) {
             try {
               setWaitMessage(
                   QString::fromStdString("Verifying file: " + file_path));
-              VerifyFile(file_path, output_path_, backup_name_);
+              VerifyEntry(file_path, metadata, output_path_, &plan);
             } catch (const std::exception& e) {
               failed_files_.push_back(file_path);
               Logger::SystemLog(
@@ -271,7 +281,7 @@ void RestoreGUI::VerifyBackup(std::function<void(bool)> onFinishCallback,
             processed_files++;
             setProgress(
                 static_cast<int>((processed_files * 100) / total_files));
-          }
+          });
 
           SetRestoreSummary();
 
@@ -317,7 +327,7 @@ RestoreSummary RestoreGUI::GetRestoreSummary() { return summary_; }
 void RestoreGUI::SetRestoreSummary() {
   int status_code;  // 0 = OK, 1 = Integrity failures, 2 = Failed files
 
-  int total_files = (*metadata_)->files.size();
+  int total_files = session_->GetFileCount();
   int processed_files = successful_files_.size() + failed_files_.size() +
                         integrity_failures_.size();
   int restored_files = successful_files_.size() + integrity_failures_.size();
@@ -375,17 +385,19 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
              std::function<void(const QString&)> setSuccessMessage,
              std::function<void(const QString&)> setFailureMessage) -> bool {
         try {
+          // Continues a backup the command line left unfinished
+          BeginJournal();
           setWaitMessage("Scanning files...");
 
           // Collect all files to backup
-          std::vector<fs::path> files_to_backup;
-          std::set<std::string> current_files;
-
-          for (const auto& entry :
-               fs::recursive_directory_iterator(input_path_)) {
-            if (entry.is_regular_file() || fs::is_symlink(entry.path())) {
-              files_to_backup.push_back(entry.path());
-              current_files.insert(entry.path().string());
+          std::vector<ScannedFile> files_to_backup;
+          SnapshotSpool scanned(temp_dir_ / "scanned");
+          {
+            DirectoryScanner scanner(input_path_, filter_.get());
+            ScannedFile file;
+            while (scanner.Next(file)) {
+              scanned.Add(file.path, FileMetadata{});
+              files_to_backup.push_back(std::move(file));
             }
           }
 
@@ -394,31 +406,22 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
           size_t changed_files = 0;
           size_t unchanged_files = 0;
           size_t added_files = 0;
-          size_t deleted_files = 0;
 
           // Check deleted files
-          for (auto it = metadata_.files.begin();
-               it != metadata_.files.end();) {
-            if (!fs::exists(it->first)) {
-              deleted_files++;
-              it = metadata_.files.erase(it);
-            } else {
-              ++it;
-            }
-          }
+          size_t deleted_files = RemoveDeletedFiles(scanned);
 
           setWaitMessage("Preparing Backup...");
           success_files_.clear();
           failed_files_.clear();
 
-          for (const auto& file_path : files_to_backup) {
-            auto str_path = file_path.string();
-            auto it = metadata_.files.find(str_path);
+          for (const auto& file : files_to_backup) {
+            const std::string& str_path = file.path;
+            auto previous = FindPrevious(str_path);
 
-            if (it == metadata_.files.end()) {
+            if (!previous) {
               added_files++;
               try {
-                BackupFile(file_path);
+                BackupFile(file);
                 setWaitMessage("Backing up file: " +
                                QString::fromStdString(str_path));
                 success_files_.push_back(str_path);
@@ -428,10 +431,10 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
                     "GUI | Backup | Failed to backup file: " + str_path,
                     LogLevel::ERROR);
               }
-            } else if (CheckFileForChanges(file_path, it->second)) {
+            } else if (CheckFileForChanges(file, *previous)) {
               changed_files++;
               try {
-                BackupFile(file_path);
+                BackupFile(file);
                 setWaitMessage("Backing up file: " +
                                QString::fromStdString(str_path));
                 success_files_.push_back(str_path);
@@ -443,14 +446,16 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
               }
             } else {
               unchanged_files++;
+              file_states_.Record(file, *previous);
             }
+            CheckpointIfDue();
 
             processed++;
             setProgress(static_cast<int>((processed * 100) / total_files));
           }
 
           setWaitMessage("Saving metadata...");
-          SaveMetadata();
+          CompleteBackup();
 
           std::ostringstream out;
           out << "Backup Summary:\n"
@@ -467,6 +472,13 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
           Logger::SystemLog(
               "GUI | Cannot create backup: " + std::string(e.what()),
               LogLevel::ERROR);
+          // Keep what was uploaded so the next run can resume from here
+          try {
+            Checkpoint();
+          } catch (const std::exception& checkpoint_error) {
+            ErrorUtil::LogException(checkpoint_error,
+                                    "Could not checkpoint backup progress");
+          }
 
           setFailureMessage("Backup creation failed: " +
                             QString::fromStdString(e.what()));
@@ -484,40 +496,12 @@ void BackupGUI::BackupDirectory(std::function<void(bool)> onFinishCallback) {
 
 std::string BackupGUI::CompareBackups(std::string first_backup,
                                       std::string second_backup) {
-  BackupMetadata metadata1 = LoadPreviousMetadata(first_backup);
-  BackupMetadata metadata2 = LoadPreviousMetadata(second_backup);
-
-  size_t changed_files = 0;
-  size_t unchanged_files = 0;
-  size_t added_files = 0;
-  size_t deleted_files = 0;
-
-  // Compare files
-  for (const auto& [file_path, file_metadata2] : metadata2.files) {
-    auto it = metadata1.files.find(file_path);
-    if (it == metadata1.files.end()) {
-      added_files++;
-    } else if (file_metadata2.total_size != it->second.total_size ||
-               file_metadata2.mtime != it->second.mtime) {
-      changed_files++;
-    } else {
-      unchanged_files++;
-    }
-  }
-
-  // Count deleted files
-  for (const auto& [file_path, _] : metadata1.files) {
-    if (metadata2.files.find(file_path) == metadata2.files.end()) {
-      deleted_files++;
-    }
+  if (!manifest_.Find(first_backup) || !manifest_.Find(second_backup)) {
+    ErrorUtil::ThrowError("One or both backup metadata files not found");
   }
+  SnapshotDiff diff = CompareSnapshots(manifest_.FetchMetadata(first_backup),
+                                       manifest_.FetchMetadata(second_backup),
+                                       repo_->GetPassword(), &trees_);
 
-  std::ostringstream comparison;
-  comparison << "Backup Comparison (" << first_backup << " vs " << second_backup
-             << "):"
-             << "\n - Changed files: " << changed_files
-             << "\n - Unchanged files: " << unchanged_files
-             << "\n - Added files: " << added_files
-             << "\n - Deleted files: " << deleted_files << std::endl;
-  return comparison.str();
+  return FormatSnapshotDiff(first_backup, second_backup, diff);
 }
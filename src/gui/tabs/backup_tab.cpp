@@ -1,5 +1,6 @@
 #include "gui/tabs/backup_tab.h"
 
+#include <QLocale>
 #include <QModelIndexList>
 #include <QThread>
 #include <QTimer>
@@ -170,6 +171,13 @@ void BackupTab::fillListTable() {
 
     auto* nameItem = new QTableWidgetItem(QString::fromStdString(dtls.name));
     nameItem->setTextAlignment(Qt::AlignCenter);
+    QLocale locale;
+    qint64 total_size = static_cast<qint64>(dtls.total_size);
+    qint64 new_bytes = static_cast<qint64>(dtls.new_bytes);
+    nameItem->setToolTip(QString("%1 files, %2, %3 new")
+                             .arg(dtls.file_count)
+                             .arg(locale.formattedDataSize(total_size))
+                             .arg(locale.formattedDataSize(new_bytes)));
     ui->listTable->setItem(row, 0, nameItem);
 
     auto* typeItem = new QTableWidgetItem(QString::fromStdString(dtls.type));
@@ -684,17 +692,6 @@ void BackupTab::initBackup() {
 
 void BackupTab::listBackups() {
   try {
-    if (backup_ != nullptr) {
-      delete backup_;
-      backup_ = nullptr;
-    }
-    source_path_ = "/";
-    backup_type_ = BackupType::FULL;
-    remarks_ = "";
-
-    backup_ =
-        new BackupGUI(this, repository_, source_path_, backup_type_, remarks_);
-
     ProgressBoxDecorator::runProgressBoxIndeterminate(
         this,
         [&](std::function<void(const QString&)> setWaitMessage,
@@ -702,7 +699,8 @@ void BackupTab::listBackups() {
             std::function<void(const QString&)> setFailureMessage) -> bool {
           try {
             setWaitMessage("Fetching backups...");
-            backup_list_ = backup_->GetAllBackupDetails();
+            // The catalog alone is enough to list, no backup is prepared
+            backup_list_ = Backup::ListBackupDetails(repository_);
             fillListTable();
             fillCompareTable();
 
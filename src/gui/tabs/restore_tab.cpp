@@ -190,8 +190,7 @@ void RestoreTab::loadFileTables() {
 
   std::vector<BackupDetails> backupList;
   try {
-    Backup backup(repository_, ".");
-    backupList = backup.GetAllBackupDetails();
+    backupList = Backup::ListBackupDetails(repository_);
   }
 
   catch (const std::exception& e) {
@@ -1,16 +1,78 @@
 #include "repositories/local_repository.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <vector>
 
 #include "utils/error_util.h"
+#include "utils/rate_limiter.h"
 
 namespace fs = std::filesystem;
 
+// Staged uploads are published in groups so that one filesystem sync covers
+// many chunk files instead of paying one fsync per chunk
+static const size_t GROUP_COMMIT_MAX_FILES = 256;
+static const size_t GROUP_COMMIT_MAX_BYTES = 64 * 1024 * 1024;
+
+// Largest range moved per copy call, keeps throttling responsive
+static const size_t COPY_SLICE_BYTES = 8 * 1024 * 1024;
+
+// Copies with copy_file_range (server-side copy or reflink where the
+// filesystem supports it) and falls back to read/write across devices
+static void CopyFileContents(int src_fd, int dst_fd, const std::string& src) {
+  bool use_copy_range = true;
+  std::vector<char> buffer;
+
+  while (true) {
+    ssize_t n;
+    if (use_copy_range) {
+      n = copy_file_range(src_fd, nullptr, dst_fd, nullptr, COPY_SLICE_BYTES,
+                          0);
+      if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP)) {
+        use_copy_range = false;
+        buffer.resize(1 << 20);
+        continue;
+      }
+    } else {
+      n = read(src_fd, buffer.data(), buffer.size());
+      for (ssize_t off = 0; n > 0 && off < n;) {
+        ssize_t written = write(dst_fd, buffer.data() + off, n - off);
+        if (written < 0 && errno != EINTR) {
+          ErrorUtil::ThrowError("Write failed while copying " + src + ": " +
+                                std::strerror(errno));
+        }
+        if (written > 0) off += written;
+      }
+    }
+
+    if (n == 0) break;
+    if (n < 0 && errno != EINTR) {
+      ErrorUtil::ThrowError("Read failed while copying " + src + ": " +
+                            std::strerror(errno));
+    }
+    if (n > 0) RateLimiter::Instance().AcquireBytes(n);
+  }
+}
+
 LocalRepository::LocalRepository() {}
 
+LocalRepository::~LocalRepository() {
+  try {
+    Flush();
+  } catch (const std::exception& e) {
+    ErrorUtil::LogException(e, "Local repository flush failed");
+  }
+}
+
 LocalRepository::LocalRepository(const std::string& path,
                                  const std::string& name,
                                  const std::string& password,
@@ -26,10 +88,14 @@ bool LocalRepository::Exists() const { return LocalDirectoryExists(); }
 
 void LocalRepository::Initialize() {
   CreateLocalDirectory();
+  RemoveCache();
   WriteConfig();
 }
 
-void LocalRepository::Delete() { RemoveLocalDirectory(); }
+void LocalRepository::Delete() {
+  RemoveLocalDirectory();
+  RemoveCache();
+}
 
 void LocalRepository::WriteConfig() const {
   std::string config_path = GetFullPath() + "/config.json";
@@ -93,8 +159,7 @@ bool LocalRepository::UploadFile(const std::string& local_file,
       fs::create_directories(local_full_path);
     }
 
-    fs::path src_path(local_file), dest_path(local_full_path + filename);
-    fs::copy_file(src_path, dest_path, fs::copy_options::overwrite_existing);
+    StageFile(local_file, local_full_path + filename);
     return true;
 
   } catch (const std::exception& e) {
@@ -137,8 +202,7 @@ bool LocalRepository::UploadDirectory(const std::string& local_dir,
         fs::create_directories(target_path);
       } else if (fs::is_regular_file(entry.status())) {
         fs::create_directories(target_path.parent_path());
-        fs::copy_file(entry.path(), target_path,
-                      fs::copy_options::overwrite_existing);
+        StageFile(entry.path().string(), target_path.string());
       }
     }
 
@@ -157,8 +221,9 @@ bool LocalRepository::DownloadFile(const std::string& local_file,
 
   try {
     fs::path repo_fs_path(repo_full_path);
-    if (!fs::exists(repo_fs_path) || !fs::is_regular_file(repo_fs_path)) {
-      ErrorUtil::ThrowError("Source file not found: " + repo_full_path);
+    if (!fs::exists(repo_fs_path)) return false;
+    if (!fs::is_regular_file(repo_fs_path)) {
+      ErrorUtil::ThrowError("Source is not a file: " + repo_full_path);
     }
 
     std::string filename = repo_fs_path.filename().string();
@@ -176,8 +241,10 @@ bool LocalRepository::DownloadFile(const std::string& local_file,
     }
 
     fs::create_directories(fs::path(local_full_path).parent_path());
+    RateLimiter::Instance().AcquireOp();
     fs::copy_file(repo_fs_path, local_full_path,
                   fs::copy_options::overwrite_existing);
+    RateLimiter::Instance().AcquireBytes(fs::file_size(local_full_path));
     return true;
 
   } catch (...) {
@@ -220,8 +287,10 @@ bool LocalRepository::DownloadDirectory(const std::string& local_dir,
           copy_recursive(src_path, dst_path);
         } else if (fs::is_regular_file(src_path)) {
           fs::create_directories(dst_path.parent_path());
+          RateLimiter::Instance().AcquireOp();
           fs::copy_file(src_path, dst_path,
                         fs::copy_options::overwrite_existing);
+          RateLimiter::Instance().AcquireBytes(fs::file_size(dst_path));
         }
       }
     };
@@ -236,3 +305,137 @@ bool LocalRepository::DownloadDirectory(const std::string& local_dir,
   }
   return false;
 }
+
+void LocalRepository::Flush() const {
+  std::lock_guard<std::mutex> lock(staging_mutex_);
+  CommitStagedFiles();
+}
+
+void LocalRepository::StageFile(const std::string& source_file,
+                                const std::string& final_path) const {
+  RateLimiter::Instance().AcquireOp();
+  int src_fd = open(source_file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) {
+    ErrorUtil::ThrowError("Cannot open file for upload: " + source_file);
+  }
+
+  StagedFile staged;
+  staged.final_path = final_path;
+
+  // Unnamed file in the target directory: nothing is visible until linked
+  std::string target_dir = fs::path(final_path).parent_path().string();
+  staged.fd = open(target_dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+
+  if (staged.fd < 0) {
+    // Filesystems without O_TMPFILE get a named file in the staging area
+    std::string staging_dir = GetFullPath() + "/.staging";
+    fs::create_directories(staging_dir);
+    {
+      std::lock_guard<std::mutex> lock(staging_mutex_);
+      staged.temp_path = staging_dir + "/" + std::to_string(getpid()) + "." +
+                         std::to_string(staged_counter_++);
+    }
+    staged.fd = open(staged.temp_path.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (staged.fd < 0) {
+      close(src_fd);
+      ErrorUtil::ThrowError("Cannot create staging file: " + staged.temp_path);
+    }
+  }
+
+  struct stat st;
+  try {
+    if (fstat(src_fd, &st) < 0) {
+      ErrorUtil::ThrowError("Cannot stat file for upload: " + source_file);
+    }
+    CopyFileContents(src_fd, staged.fd, source_file);
+  } catch (...) {
+    close(src_fd);
+    close(staged.fd);
+    if (!staged.temp_path.empty()) unlink(staged.temp_path.c_str());
+    throw;
+  }
+
+  // Source was staged locally by us; keep it from evicting hot page cache
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(src_fd);
+
+  // Named files do not need their descriptor until publish
+  if (!staged.temp_path.empty()) {
+    close(staged.fd);
+    staged.fd = -1;
+  }
+
+  std::lock_guard<std::mutex> lock(staging_mutex_);
+  staged_files_.push_back(staged);
+  staged_bytes_ += st.st_size;
+
+  if (staged_files_.size() >= GROUP_COMMIT_MAX_FILES ||
+      staged_bytes_ >= GROUP_COMMIT_MAX_BYTES) {
+    CommitStagedFiles();
+  }
+}
+
+// Caller must hold staging_mutex_
+void LocalRepository::CommitStagedFiles() const {
+  if (staged_files_.empty()) return;
+
+  std::vector<StagedFile> batch;
+  batch.swap(staged_files_);
+  staged_bytes_ = 0;
+
+  int root_fd = open(GetFullPath().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  std::string error;
+  auto fail = [&error](const std::string& message) {
+    error = message + " (" + std::strerror(errno) + ")";
+  };
+
+  // A single sync makes the contents of the whole group durable before any
+  // of it becomes reachable under a final name
+  if (root_fd < 0 || syncfs(root_fd) < 0) {
+    fail("Cannot sync repository: " + GetFullPath());
+  }
+
+  for (auto& staged : batch) {
+    if (error.empty()) {
+      if (staged.fd >= 0) {
+        std::string proc_path = "/proc/self/fd/" + std::to_string(staged.fd);
+        if (linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD,
+                   staged.final_path.c_str(), AT_SYMLINK_FOLLOW) < 0) {
+          if (errno == EEXIST) {
+            // Replace an existing file atomically through a named link,
+            // unique to this process so concurrent writers keep theirs
+            std::string temp_path = staged.final_path + ".staged." +
+                                    std::to_string(getpid()) + "." +
+                                    std::to_string(staged_counter_++);
+            if (linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD,
+                       temp_path.c_str(), AT_SYMLINK_FOLLOW) < 0 ||
+                rename(temp_path.c_str(), staged.final_path.c_str()) < 0) {
+              fail("Cannot publish file: " + staged.final_path);
+              unlink(temp_path.c_str());
+            }
+          } else {
+            fail("Cannot publish file: " + staged.final_path);
+          }
+        }
+      } else if (rename(staged.temp_path.c_str(),
+                        staged.final_path.c_str()) < 0) {
+        fail("Cannot publish file: " + staged.final_path);
+      }
+    }
+
+    // Unpublished files are discarded so the repository never holds partials
+    if (staged.fd >= 0) close(staged.fd);
+    if (!error.empty() && !staged.temp_path.empty()) {
+      unlink(staged.temp_path.c_str());
+    }
+  }
+
+  // Second sync persists the new directory entries
+  if (error.empty() && syncfs(root_fd) < 0) {
+    fail("Cannot sync repository: " + GetFullPath());
+  }
+  if (root_fd >= 0) close(root_fd);
+
+  if (!error.empty()) ErrorUtil::ThrowError(error);
+}
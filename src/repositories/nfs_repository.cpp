@@ -4,10 +4,12 @@
 #include <nfsc/libnfs.h>
 #include <sys/stat.h>
 
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
 #include <nlohmann/json.hpp>
 
+#include "utils/rate_limiter.h"
 #include "utils/utils.h"
 
 namespace fs = std::filesystem;
@@ -58,6 +60,7 @@ bool NFSRepository::UploadFile(const std::string& local_file,
       nfs_umount(nfs);
       ErrorUtil::ThrowError("Cannot open local file: " + local_file);
     }
+    RateLimiter::Instance().AcquireOp();
     struct nfsfh* fh;
     if (nfs_creat(nfs, remote_file_path.c_str(), 0644, &fh) < 0) {
       std::string err = nfs_get_error(nfs);
@@ -77,6 +80,7 @@ bool NFSRepository::UploadFile(const std::string& local_file,
         ErrorUtil::ThrowError("Write failed: " + err);
       }
       offset += len;
+      RateLimiter::Instance().AcquireBytes(len);
     }
     nfs_close(nfs, fh);
     nfs_umount(nfs);
@@ -116,6 +120,7 @@ bool NFSRepository::UploadDirectory(const std::string& local_dir,
         std::string remote_file = remote_dir + "/" + file_name;
         std::ifstream infile(path, std::ios::binary);
         if (!infile) return;
+        RateLimiter::Instance().AcquireOp();
         struct nfsfh* fh;
         if (nfs_creat(nfs, remote_file.c_str(), 0644, &fh) < 0) {
           return;
@@ -129,6 +134,7 @@ bool NFSRepository::UploadDirectory(const std::string& local_dir,
             break;
           }
           offset += len;
+          RateLimiter::Instance().AcquireBytes(len);
         }
         nfs_close(nfs, fh);
       }
@@ -240,6 +246,7 @@ void NFSRepository::CreateNFSDirectory() const {
 
 void NFSRepository::Initialize() {
   CreateNFSDirectory();
+  RemoveCache();
   WriteConfig();
 }
 
@@ -284,6 +291,7 @@ void NFSRepository::RemoveNFSDirectory() const {
 }
 void NFSRepository::Delete() {
   RemoveNFSDirectory();
+  RemoveCache();
 }
 
 void NFSRepository::WriteConfig() const {
@@ -372,7 +380,14 @@ bool NFSRepository::DownloadFile(const std::string& remote_file,
     }
 
     struct nfsfh* fh;
-    if (nfs_open(nfs, remote_full_path.c_str(), O_RDONLY, &fh) < 0) {
+    RateLimiter::Instance().AcquireOp();
+    int result = nfs_open(nfs, remote_full_path.c_str(), O_RDONLY, &fh);
+    if (result == -ENOENT) {
+      nfs_umount(nfs);
+      nfs_destroy_context(nfs);
+      return false;
+    }
+    if (result < 0) {
       Logger::Log("Failed to open remote file: " + remote_full_path,
                   LogLevel::ERROR);
       nfs_umount(nfs);
@@ -392,6 +407,7 @@ bool NFSRepository::DownloadFile(const std::string& remote_file,
     ssize_t n;
     while ((n = nfs_read(nfs, fh, sizeof(buffer), buffer)) > 0) {
       output.write(buffer, n);
+      RateLimiter::Instance().AcquireBytes(n);
     }
 
     if (n < 0) {
@@ -459,6 +475,7 @@ bool NFSRepository::DownloadDirectory(const std::string& remote_dir,
             download_recursive(full_remote, full_local);
           } else if (S_ISREG(st.nfs_mode)) {
             struct nfsfh* fh;
+            RateLimiter::Instance().AcquireOp();
             if (nfs_open(nfs, full_remote.c_str(), O_RDONLY, &fh) < 0) {
               continue;
             }
@@ -473,6 +490,7 @@ bool NFSRepository::DownloadDirectory(const std::string& remote_dir,
             ssize_t n;
             while ((n = nfs_read(nfs, fh, sizeof(buffer), buffer)) > 0) {
               output.write(buffer, n);
+              RateLimiter::Instance().AcquireBytes(n);
             }
 
             nfs_close(nfs, fh);
@@ -12,6 +12,7 @@
 #include <stdexcept>
 
 #include "utils/error_util.h"
+#include "utils/rate_limiter.h"
 
 namespace fs = std::filesystem;
 
@@ -52,10 +53,14 @@ bool RemoteRepository::Exists() const { return RemoteDirectoryExists(); }
 
 void RemoteRepository::Initialize() {
   CreateRemoteDirectory();
+  RemoveCache();
   WriteConfig();
 }
 
-void RemoteRepository::Delete() { RemoveRemoteDirectory(); }
+void RemoteRepository::Delete() {
+  RemoveRemoteDirectory();
+  RemoveCache();
+}
 
 void RemoteRepository::WriteConfig() const {
   nlohmann::json config = {{"name", name_},
@@ -293,6 +298,7 @@ bool RemoteRepository::UploadFile(const std::string& local_file,
       ErrorUtil::ThrowError("SFTP initialization failed");
     }
 
+    RateLimiter::Instance().AcquireOp();
     sftp_file file = sftp_open(sftp, remote_full_path.c_str(),
                                O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (!file) {
@@ -312,6 +318,7 @@ bool RemoteRepository::UploadFile(const std::string& local_file,
         sftp_close(file);
         ErrorUtil::ThrowError("Failed to write to remote file");
       }
+      RateLimiter::Instance().AcquireBytes(input.gcount());
     }
 
     sftp_close(file);
@@ -395,6 +402,7 @@ bool RemoteRepository::UploadDirectory(const std::string& local_dir,
         int attempt = 0;
 
         while (attempt < max_retries) {
+          RateLimiter::Instance().AcquireOp();
           sftp_file file =
               sftp_open(sftp, remote_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                         S_IRUSR | S_IWUSR);
@@ -412,6 +420,7 @@ bool RemoteRepository::UploadDirectory(const std::string& local_dir,
               attempt++;
               break;
             }
+            RateLimiter::Instance().AcquireBytes(bytes);
           }
           sftp_close(file);
           break;
@@ -482,7 +491,14 @@ bool RemoteRepository::DownloadFile(const std::string& remote_file,
       ErrorUtil::ThrowError("SFTP initialization failed");
     }
 
+    RateLimiter::Instance().AcquireOp();
     sftp_file file = sftp_open(sftp, remote_full_path.c_str(), O_RDONLY, 0);
+    if (!file && sftp_get_error(sftp) == SSH_FX_NO_SUCH_FILE) {
+      sftp_free(sftp);
+      ssh_disconnect(session);
+      ssh_free(session);
+      return false;
+    }
     if (!file) {
       ErrorUtil::ThrowError("Unable to open remote file for reading: " +
                             remote_full_path);
@@ -499,6 +515,7 @@ bool RemoteRepository::DownloadFile(const std::string& remote_file,
     int nbytes;
     while ((nbytes = sftp_read(file, buffer, sizeof(buffer))) > 0) {
       output.write(buffer, nbytes);
+      RateLimiter::Instance().AcquireBytes(nbytes);
     }
 
     if (nbytes < 0) {
@@ -575,6 +592,7 @@ bool RemoteRepository::DownloadDirectory(const std::string& remote_dir,
         if (S_ISDIR(attr->permissions)) {
           download_recursive(full_remote, full_local);
         } else if (S_ISREG(attr->permissions)) {
+          RateLimiter::Instance().AcquireOp();
           sftp_file file = sftp_open(sftp, full_remote.c_str(), O_RDONLY, 0);
           if (!file) {
             sftp_attributes_free(attr);
@@ -592,6 +610,7 @@ bool RemoteRepository::DownloadDirectory(const std::string& remote_dir,
           int nbytes;
           while ((nbytes = sftp_read(file, buffer, sizeof(buffer))) > 0) {
             output.write(buffer, nbytes);
+            RateLimiter::Instance().AcquireBytes(nbytes);
           }
 
           sftp_close(file);
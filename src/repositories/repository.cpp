@@ -6,7 +6,9 @@
 #include <iomanip>
 #include <sstream>
 
+#include "utils/logger.h"
 #include "utils/repodata_manager.h"
+#include "utils/setup.h"
 #include "utils/validator.h"
 
 namespace fs = std::filesystem;
@@ -55,6 +57,33 @@ std::string Repository::GetHashedPassword(const std::string& password) {
   return oss.str();
 }
 
+std::string Repository::GetCachePath() const {
+  // Keyed by location and name, the same name may exist on several backends
+  std::string identity = GetRepositoryInfoString();
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(identity.data()),
+         identity.size(), hash);
+
+  std::ostringstream oss;
+  for (int i = 0; i < 8; ++i) {
+    oss << std::hex << std::setw(2) << std::setfill('0')
+        << static_cast<int>(hash[i]);
+  }
+  return (fs::path(Setup::GetAppDataPath()) / "cache" /
+          (name_ + "_" + oss.str()))
+      .string();
+}
+
+void Repository::RemoveCache() const {
+  std::error_code ec;
+  fs::remove_all(GetCachePath(), ec);
+  if (ec) {
+    Logger::SystemLog("Could not remove cache of " +
+                          GetRepositoryInfoString() + ": " + ec.message(),
+                      LogLevel::WARNING);
+  }
+}
+
 std::string Repository::GetResolvedPath(const std::string& path) {
   return (Validator::IsValidSftpPath(path) || Validator::IsValidNfsPath(path))
              ? path
@@ -1,5 +1,7 @@
 #include "schedulers/scheduler.h"
 #include <csignal>
+#include <iostream>
+#include <string>
 #include "utils/logger.h"
 
 
@@ -12,14 +14,28 @@ void signal_handler(int signum) {
   }
 }
 
-int main() {
-  Scheduler scheduler;
+int main(int argc, char* argv[]) {
+  bool track_changes = false;
+  for (int i = 1; i < argc; i++) {
+    std::string option(argv[i]);
+    if (option == "--track-changes") {
+      track_changes = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--track-changes]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Scheduler scheduler(track_changes);
 
   global_scheduler_ptr = &scheduler;
   std::signal(SIGTERM, signal_handler);
   std::signal(SIGINT, signal_handler);
 
   Logger::Log("Starting up scheduler server at Port 55055...");
+  if (track_changes) {
+    Logger::Log("Tracking changes of incremental sources");
+  }
   scheduler.Run();
   Logger::Log("Scheduler server terminated.");
 
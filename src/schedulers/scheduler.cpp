@@ -17,10 +17,16 @@
 #include "utils/logger.h"
 #include "utils/error_util.h"
 #include "utils/time_util.h"
+#include "utils/rate_limiter.h"
 #include "backup_restore/backup.hpp"
+#include "backup_restore/file_filter.hpp"
 #include "repositories/all.h"
 
-Scheduler::Scheduler(){
+// Largest request read from a client and how long it may take to send it
+static const size_t MAX_REQUEST_SIZE = 1 << 20;
+static const int REQUEST_TIMEOUT_SECONDS = 5;
+
+Scheduler::Scheduler(bool track_changes) : track_changes(track_changes){
     int port = 55055;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -67,6 +73,9 @@ std::string Scheduler::GenerateScheduleInfoString(std::string schedule_id){
     message += "-- Source: " + source + "\n";
     message += "-- Destination: " + repo->GetRepositoryInfoString() + "\n";
     message += "-- Remarks: " + remarks + "\n";
+    if (metaData.contains("filters") && !metaData["filters"].empty()){
+        message += "-- Filters: " + metaData["filters"].dump() + "\n";
+    }
     return message;
 }
 
@@ -84,6 +93,17 @@ std::string Scheduler::AddSchedule(nlohmann::json reqBody){
     std::string destination_type = reqBody["destination_type"];
 
     std::string remarks = reqBody["remarks"];
+    int time_budget = reqBody.value("time_budget", 0);
+    // Patterns, size bounds and age limit leaving files out of every run
+    nlohmann::json filters = reqBody.value("filters", nlohmann::json::object());
+    // Rejected now rather than on every run of the schedule
+    try {
+        FileFilter filter(source, filters);
+    } catch (const std::exception& e) {
+        nlohmann::json res;
+        res["error"] = std::string("Invalid filters: ") + e.what();
+        return res.dump();
+    }
     std::string schedule_string = reqBody["payload"];
     std::string schedule_id = GenerateScheduleId(conn_id);
     std::string schedule_name = GenerateScheduleName(schedule_id);
@@ -109,12 +129,23 @@ std::string Scheduler::AddSchedule(nlohmann::json reqBody){
         return "";
     }
     
+    // Watching the source from now on. Only incremental runs are based on
+    // the run before, full backups read every file anyway.
+    if (track_changes && static_cast<BackupType>(backup_type) == BackupType::INCREMENTAL){
+        auto change_journal = std::make_shared<ChangeJournal>(repo_data[schedule_id], source, schedule_id);
+        change_journal->Start();
+        std::lock_guard<std::mutex> lock(change_journals_mutex);
+        change_journals[schedule_id] = std::move(change_journal);
+    }
+    
     // Storing metadata
     nlohmann::json metaData;
     metaData["type"] = backup_type_string;
     metaData["schedule"] = schedule_string;
     metaData["source"] = source;
     metaData["remarks"] = remarks;
+    metaData["time_budget"] = time_budget;
+    metaData["filters"] = filters;
     
     schedules[schedule_id] = metaData.dump();
     conn_id = conn_id + 1;
@@ -125,6 +156,8 @@ std::string Scheduler::AddSchedule(nlohmann::json reqBody){
     taskContext["backup_type"] = backup_type;
     taskContext["remarks"] = remarks;
     taskContext["schedule_id"] = schedule_id;
+    taskContext["time_budget"] = time_budget;
+    taskContext["filters"] = filters;
     
     // Adding the scheduled function
     Logger::TerminalLog("Attempting creation of " + schedule_name + "...",LogLevel::INFO);
@@ -143,10 +176,26 @@ std::string Scheduler::AddSchedule(nlohmann::json reqBody){
         Logger::TerminalLog("Attempting scheduled backup of Schedule " + schedule_id_ + " at " + timestamp, LogLevel::INFO);
 
         bool success = false;
+        bool complete = true;
         try {
+            // Held until the backup is destroyed, even if the schedule is removed
+            std::shared_ptr<ChangeJournal> change_journal;
+            {
+                std::lock_guard<std::mutex> lock(change_journals_mutex);
+                auto journal_it = change_journals.find(schedule_id_);
+                if (journal_it != change_journals.end()){
+                    change_journal = journal_it->second;
+                }
+            }
             Backup backup(repo, taskContext["source"], taskContext["backup_type"], taskContext["remarks"]);
+            backup.SetTimeBudget(std::chrono::minutes(taskContext["time_budget"].get<int>()));
+            backup.SetFilter(taskContext["filters"]);
+            if (change_journal){
+                backup.SetChangeJournal(change_journal.get());
+            }
             backup.BackupDirectory();
             success = true;
+            complete = backup.IsComplete();
             
         } catch (const std::exception& e) {
             std::cerr << "Scheduler | Backup exception: " << e.what() << '\n';
@@ -157,7 +206,10 @@ std::string Scheduler::AddSchedule(nlohmann::json reqBody){
             Logger::TerminalLog("Scheduler | Scheduled backup " + schedule_id_ + " : Unknown exception caught", LogLevel::ERROR);
         }
         
-        if (success){
+        if (success && !complete){
+            Logger::TerminalLog("Scheduler | Scheduled backup " + schedule_id_ + " reached its time budget, resuming on next run" , LogLevel::INFO);
+        }
+        else if (success){
             Logger::TerminalLog("Scheduler | Backup success: " , LogLevel::INFO);
             Logger::TerminalLog(GenerateScheduleInfoString(schedule_id_), LogLevel::INFO);
         }
@@ -219,11 +271,31 @@ std::string Scheduler::RemoveSchedule(nlohmann::json reqBody){
     }
 
     cron.remove_schedule(name);
+    {
+        std::lock_guard<std::mutex> lock(change_journals_mutex);
+        change_journals.erase(schedule_id);
+    }
     schedules.erase(schedule_id);
 
     return schedule_id;
 }
 
+std::string Scheduler::UpdateThrottle(nlohmann::json reqBody){
+    nlohmann::json res;
+    try {
+        // Applies to backups already running as well as future ones
+        nlohmann::json settings = reqBody.value("payload", nlohmann::json::object());
+        if (!settings.empty()){
+            RateLimiter::Instance().Configure(settings);
+            Logger::TerminalLog("Throttle updated: " + settings.dump(), LogLevel::INFO);
+        }
+        res = RateLimiter::Instance().GetSettings();
+    } catch (const std::exception& e) {
+        res["error"] = std::string("Invalid throttle settings: ") + e.what();
+    }
+    return res.dump();
+}
+
 void Scheduler::RequestShutdown() { running = false; }
 
 void Scheduler::Run(){
@@ -298,10 +370,20 @@ void Scheduler::Run(){
             continue;
         }
         
-        // Reading client sent content
-        char buffer[4096] = {0};
-        
-        if (read(acceptor_fd, buffer, 4096) < 0){
+        // Reading client sent content, the client closes its end when done
+        struct timeval read_timeout;
+        read_timeout.tv_sec = REQUEST_TIMEOUT_SECONDS;
+        read_timeout.tv_usec = 0;
+        setsockopt(acceptor_fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
+
+        std::string request;
+        char buffer[4096];
+        ssize_t bytes_read = 0;
+        while ((bytes_read = read(acceptor_fd, buffer, sizeof(buffer))) > 0){
+            request.append(buffer, bytes_read);
+            if (request.size() > MAX_REQUEST_SIZE) break;
+        }
+        if (bytes_read < 0 || request.size() > MAX_REQUEST_SIZE){
             Logger::TerminalLog("Read failed" , LogLevel::WARNING);
             close(acceptor_fd);
             continue;
@@ -309,26 +391,41 @@ void Scheduler::Run(){
 
         std::string message; // Response sent back to client
 
-        nlohmann::json reqBody = nlohmann::json::parse(buffer);
-        if (reqBody["action"] == "exit"){
-            message = "Shutting down...!";
-        }
+        nlohmann::json reqBody;
+        try {
+            reqBody = nlohmann::json::parse(request);
 
-        else if (reqBody["action"] == "add"){
-            message = AddSchedule(reqBody);
-        }
+            if (reqBody["action"] == "exit"){
+                message = "Shutting down...!";
+            }
 
-        else if (reqBody["action"] == "view"){
-            message = ViewSchedules();
-        }
+            else if (reqBody["action"] == "add"){
+                message = AddSchedule(reqBody);
+            }
 
-        else if (reqBody["action"] == "remove"){
-            message = RemoveSchedule(reqBody);
-        }
+            else if (reqBody["action"] == "view"){
+                message = ViewSchedules();
+            }
 
-        else{
-            message = "Undefined request!";
-            Logger::TerminalLog("Undefined request made!" , LogLevel::WARNING);
+            else if (reqBody["action"] == "remove"){
+                message = RemoveSchedule(reqBody);
+            }
+
+            else if (reqBody["action"] == "throttle"){
+                message = UpdateThrottle(reqBody);
+            }
+
+            else{
+                message = "Undefined request!";
+                Logger::TerminalLog("Undefined request made!" , LogLevel::WARNING);
+            }
+        } catch (const std::exception& e) {
+            // A bad request must not take the server down
+            ErrorUtil::LogException(e, "Invalid request");
+            nlohmann::json res;
+            res["error"] = std::string("Invalid request: ") + e.what();
+            message = res.dump();
+            reqBody = nlohmann::json::object();
         }
 
         const char *c_message = message.c_str();
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -63,10 +64,49 @@ void SchedulerService::AddSchedule(){
         UserIO::DisplayMinTitle("Backup Type", false), menu);
     type = static_cast<BackupType>(choice);
     remarks = Prompter::PromptInput("Remarks for Backup (Optional)");
+
+    // Long backups stop at the budget and resume on the next run
+    auto is_number = [](const std::string& value) {
+        return !value.empty() &&
+               value.find_first_not_of("0123456789") == std::string::npos &&
+               value.size() < 7;
+    };
+    int time_budget = std::stoi(Prompter::PromptUntilValid(
+        is_number, "Time budget", "Time Budget per Run in Minutes (0 - Unlimited)"));
+
+    // Left out of every run, along with what .resilioz-ignore files list
+    nlohmann::json filters = nlohmann::json::object();
+    std::string patterns = Prompter::PromptInput(
+        "Exclude Patterns, Comma Separated (Ex. node_modules/, *.tmp) (Optional)");
+    std::vector<std::string> excludes;
+    size_t start = 0;
+    while (start <= patterns.size()){
+        size_t end = std::min(patterns.find(',', start), patterns.size());
+        std::string pattern = patterns.substr(start, end - start);
+        pattern.erase(0, pattern.find_first_not_of(' '));
+        pattern.erase(pattern.find_last_not_of(' ') + 1);
+        if (!pattern.empty()){
+            excludes.push_back(pattern);
+        }
+        start = end + 1;
+    }
+    if (!excludes.empty()){
+        filters["exclude"] = excludes;
+    }
+    int max_size = std::stoi(Prompter::PromptUntilValid(
+        is_number, "Size limit", "Largest File Size in MB (0 - Unlimited)"));
+    if (max_size > 0){
+        filters["max_size"] = static_cast<uint64_t>(max_size) * 1024 * 1024;
+    }
+    int max_age = std::stoi(Prompter::PromptUntilValid(
+        is_number, "Age limit", "Skip Files Unmodified for Days (0 - Never)"));
+    if (max_age > 0){
+        filters["max_age_days"] = max_age;
+    }
     
     std::string schedule_id = request_mgr->SendAddRequest(schedule, source,
         repo->GetName(), repo->GetPath(), repo->GetPassword(), "",
-        repo->GetType(), remarks, type);
+        repo->GetType(), remarks, type, time_budget, filters);
     Logger::Log("Schedule " + schedule_id + " created!");
 }
 
@@ -108,10 +148,33 @@ void SchedulerService::ViewSchedules(){
     }
 }
 
+void SchedulerService::ThrottleTransfers(){
+    UserIO::DisplayTitle("Throttling Scheduled Transfers");
+
+    nlohmann::json current = request_mgr->SendThrottleRequest(nlohmann::json::object());
+    Logger::TerminalLog("Active limits: " + current["active"].dump());
+
+    auto is_limit = [](const std::string& value) {
+        return !value.empty() &&
+               value.find_first_not_of("0123456789") == std::string::npos;
+    };
+
+    nlohmann::json settings;
+    settings["bytes_per_second"] = std::stoull(Prompter::PromptUntilValid(
+        is_limit, "Limit", "Bytes per Second (0 - Unlimited)"));
+    settings["ops_per_second"] = std::stoull(Prompter::PromptUntilValid(
+        is_limit, "Limit", "Operations per Second (0 - Unlimited)"));
+    settings["read_bytes_per_second"] = std::stoull(Prompter::PromptUntilValid(
+        is_limit, "Limit", "Source Read Bytes per Second (0 - Unlimited)"));
+
+    nlohmann::json updated = request_mgr->SendThrottleRequest(settings);
+    Logger::Log("Throttle updated, active limits: " + updated["active"].dump());
+}
+
 void SchedulerService::ShowMainMenu(){
     std::vector<std::string> main_menu = {
       "Go BACK...", "Create New Schedule", "List All Schedules",
-      "Delete Schedule"};
+      "Delete Schedule", "Throttle Transfers"};
     
     while (true) {
         int choice = UserIO::HandleMenuWithSelect(
@@ -131,6 +194,9 @@ void SchedulerService::ShowMainMenu(){
             case 3:
             RemoveSchedule();
             break;
+            case 4:
+            ThrottleTransfers();
+            break;
             default:
             Logger::TerminalLog("Menu Mismatch...", LogLevel::ERROR);
         }
@@ -162,7 +162,13 @@ void BackupSystem::CompareBackups() {
     int choice2 = UserIO::HandleMenuWithSelect(
         UserIO::DisplayMinTitle("Select Second Backup", false), menu);
     if (choice2 == 0) return;
-    backup.CompareBackups(backups[choice1 - 1], backups[choice2 - 1]);
+
+    int format = UserIO::HandleMenuWithSelect(
+        UserIO::DisplayMinTitle("Select Output Format", false),
+        {"Go BACK...", "Summary", "JSON"});
+    if (format == 0) return;
+    backup.CompareBackups(backups[choice1 - 1], backups[choice2 - 1],
+                          format == 2);
 
   } catch (...) {
     ErrorUtil::ThrowNested("Backup comparison failure");
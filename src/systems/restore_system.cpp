@@ -3,6 +3,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -26,7 +27,7 @@ void RestoreSystem::Run() {
   std::string title = UserIO::DisplayMaxTitle("RESTORE SYSTEM", false);
 
   std::vector<std::string> main_menu = {"Go BACK...", "Restore from Backup",
-                                        "Verify Backup"};
+                                        "Verify Backup", "Search File History"};
 
   while (true) {
     try {
@@ -46,6 +47,9 @@ void RestoreSystem::Run() {
         case 2:
           VerifyBackup();
           break;
+        case 3:
+          SearchFileHistory();
+          break;
         default:
           Logger::TerminalLog("Menu Mismatch...", LogLevel::ERROR);
       }
@@ -96,7 +100,16 @@ void RestoreSystem::RestoreFromBackup() {
     }
 
     fs::create_directories(restore_dir);
-    restore.RestoreAll(restore_dir.string(), backup_name);
+
+    // Offer to pick up where an interrupted restore left off
+    bool resume = false;
+    if (restore.CanResume(restore_dir, backup_name)) {
+      std::vector<std::string> resume_options = {"Resume", "Start over"};
+      resume = UserIO::HandleMenuWithSelect(
+                   UserIO::DisplayMinTitle("Interrupted Restore Found", false),
+                   resume_options) == 0;
+    }
+    restore.RestoreAll(restore_dir.string(), backup_name, resume);
 
   } catch (...) {
     ErrorUtil::ThrowNested("Restore operation failed");
@@ -132,6 +145,87 @@ void RestoreSystem::VerifyBackup() {
   }
 }
 
+void RestoreSystem::SearchFileHistory() {
+  try {
+    repository_ = repo_service_->SelectExistingRepository();
+    if (repository_ == nullptr) {
+      return;
+    }
+
+    Restore restore(repository_);
+    std::string pattern = Prompter::PromptInput(
+        "File Path, Directory ending in '/' or Glob (Ex. /etc/*.conf)");
+    std::vector<FileVersion> versions = restore.FindFileHistory(pattern);
+    if (versions.empty()) {
+      UserIO::DisplayMinTitle("No matching files found");
+      return;
+    }
+
+    // Files missing from the newest backup were deleted since
+    std::string latest_backup = restore.ListBackups().back();
+    std::set<std::string> current_files;
+    for (const auto& version : versions) {
+      if (version.backup_name == latest_backup) {
+        current_files.insert(version.path);
+      }
+    }
+
+    // Versions come ordered by path and then by backup
+    std::vector<std::string> menu = {"Go BACK..."};
+    int version_number = 0;
+    for (size_t i = 0; i < versions.size(); i++) {
+      const FileVersion& version = versions[i];
+      bool new_path = i == 0 || versions[i - 1].path != version.path;
+      if (new_path) {
+        version_number = 0;
+      }
+      if (new_path || versions[i - 1].size != version.size ||
+          versions[i - 1].mtime != version.mtime ||
+          versions[i - 1].sha256_checksum != version.sha256_checksum) {
+        version_number++;
+      }
+
+      std::string label = version.path + " @ " + version.backup_name +
+                          " | v" + std::to_string(version_number) + " | " +
+                          std::to_string(version.size) + " B";
+      if (!version.sha256_checksum.empty()) {
+        label += " | " + version.sha256_checksum.substr(0, 12);
+      }
+      if (!current_files.count(version.path)) {
+        label += " | deleted";
+      }
+      menu.push_back(label);
+    }
+
+    int choice = UserIO::HandleMenuWithSelect(
+        UserIO::DisplayMinTitle("Select File Version to Restore", false),
+        menu);
+    if (choice == 0) {
+      std::cout << " - Going Back...\n";
+      return;
+    }
+    const FileVersion& version = versions[choice - 1];
+
+    std::vector<std::string> location_options = {"Original location",
+                                                 "Custom location"};
+    int location_choice = UserIO::HandleMenuWithSelect(
+        UserIO::DisplayMinTitle("Select Restore Location", false),
+        location_options);
+
+    fs::path restore_dir = "/";
+    if (location_choice != 0) {
+      restore_dir = fs::path(
+          Prompter::PromptLocalPath("Path to Restore Destination"));
+    }
+    fs::create_directories(restore_dir);
+
+    restore.RestoreFile(version.path, restore_dir, version.backup_name);
+
+  } catch (...) {
+    ErrorUtil::ThrowNested("File history search failed");
+  }
+}
+
 void RestoreSystem::Log() {
   Logger::TerminalLog("Restore system is up and running... \n");
 }
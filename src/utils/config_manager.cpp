@@ -0,0 +1,77 @@
+#include "utils/config_manager.h"
+
+#include <filesystem>
+#include <fstream>
+
+#include "utils/error_util.h"
+#include "utils/setup.h"
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+ConfigManager::ConfigManager() {
+  try {
+    std::string base_dir = Setup::GetAppDataPath() + "/.data";
+    fs::create_directories(base_dir);
+    config_file_ = base_dir + "/config.json";
+    EnsureConfigFileExists();
+    Load();
+  } catch (...) {
+    ErrorUtil::ThrowNested("Failed to initialize application config");
+  }
+}
+
+void ConfigManager::EnsureConfigFileExists() {
+  try {
+    if (!fs::exists(config_file_)) {
+      std::ofstream ofs(config_file_);
+      if (!ofs) {
+        ErrorUtil::ThrowError("Unable to create config file");
+      }
+      ofs << json::object();
+      ofs.close();
+    }
+  } catch (...) {
+    ErrorUtil::ThrowNested("Could not ensure presence of config file");
+  }
+}
+
+bool ConfigManager::Load() {
+  try {
+    std::ifstream file(config_file_);
+    if (!file.is_open()) {
+      ErrorUtil::ThrowError("Could not read config file");
+    }
+
+    json j;
+    file >> j;
+    if (!j.is_object()) {
+      ErrorUtil::ThrowError("Config file is not a JSON object");
+    }
+    config_ = j;
+    return true;
+  } catch (...) {
+    ErrorUtil::ThrowNested("Failed to load application config");
+    return false;
+  }
+}
+
+bool ConfigManager::Save() {
+  try {
+    std::ofstream file(config_file_);
+    if (!file.is_open()) {
+      ErrorUtil::ThrowError("Unable to write to config file");
+    }
+
+    file << config_.dump(4);
+    file.close();
+    return true;
+  } catch (...) {
+    ErrorUtil::ThrowNested("Failed to save application config");
+    return false;
+  }
+}
+
+void ConfigManager::Set(const std::string& key, const json& value) {
+  config_[key] = value;
+}
@@ -6,6 +6,8 @@
 
 #include <algorithm>
 #include <iomanip>
+#include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <sstream>
 
@@ -205,6 +207,199 @@ std::string DecryptMetadata(const std::vector<uint8_t>& encrypted_data, const st
     }
 }
 
+// PBKDF2 is slow on purpose, and small metadata objects would spend most of
+// their time on it. Derived keys are kept per salt, and the stream classes
+// reuse one salt per password for the life of the process, with a fresh IV
+// for every object.
+static const size_t KEY_CACHE_LIMIT = 64;
+static std::mutex key_cache_mutex;
+static std::map<std::pair<std::string, std::vector<uint8_t>>, std::vector<uint8_t>> key_cache;
+static std::map<std::string, std::vector<uint8_t>> session_salts;
+
+static std::vector<uint8_t> DeriveKey(const std::string& password,
+                                      const uint8_t* salt) {
+    auto cache_key = std::make_pair(password, std::vector<uint8_t>(salt, salt + SALT_SIZE));
+    {
+        std::lock_guard<std::mutex> lock(key_cache_mutex);
+        auto it = key_cache.find(cache_key);
+        if (it != key_cache.end()) {
+            return it->second;
+        }
+    }
+
+    std::vector<uint8_t> key(32); // 256-bit key for AES-256
+    if (PKCS5_PBKDF2_HMAC(password.c_str(), password.length(),
+                          salt, SALT_SIZE,
+                          10000, // iterations
+                          EVP_sha256(),
+                          key.size(), key.data()) != 1) {
+        ErrorUtil::ThrowError("Failed to derive key from password");
+    }
+
+    std::lock_guard<std::mutex> lock(key_cache_mutex);
+    if (key_cache.size() >= KEY_CACHE_LIMIT) {
+        key_cache.clear();
+    }
+    key_cache[cache_key] = key;
+    return key;
+}
+
+static std::vector<uint8_t> GetSessionSalt(const std::string& password) {
+    std::lock_guard<std::mutex> lock(key_cache_mutex);
+    auto it = session_salts.find(password);
+    if (it != session_salts.end()) {
+        return it->second;
+    }
+
+    std::vector<uint8_t> salt(SALT_SIZE);
+    if (RAND_bytes(salt.data(), SALT_SIZE) != 1) {
+        ErrorUtil::ThrowError("Failed to generate random salt");
+    }
+    session_salts[password] = salt;
+    return salt;
+}
+
+MetadataEncryptor::MetadataEncryptor(const std::string& password) {
+    if (password.empty()) {
+        return;
+    }
+
+    std::vector<uint8_t> salt = GetSessionSalt(password);
+    std::vector<uint8_t> iv(IV_SIZE);
+    if (RAND_bytes(iv.data(), IV_SIZE) != 1) {
+        ErrorUtil::ThrowError("Failed to generate random IV");
+    }
+    std::vector<uint8_t> key = DeriveKey(password, salt.data());
+
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_ || EVP_EncryptInit_ex(ctx_, EVP_aes_256_cbc(), nullptr,
+                                    key.data(), iv.data()) != 1) {
+        ErrorUtil::ThrowError("Failed to initialize encryption");
+    }
+
+    header_.insert(header_.end(), ENCRYPTION_MAGIC.begin(), ENCRYPTION_MAGIC.end());
+    header_.insert(header_.end(), salt.begin(), salt.end());
+    header_.insert(header_.end(), iv.begin(), iv.end());
+}
+
+MetadataEncryptor::~MetadataEncryptor() {
+    if (ctx_) EVP_CIPHER_CTX_free(ctx_);
+}
+
+std::vector<uint8_t> MetadataEncryptor::Update(const uint8_t* data, size_t size) {
+    if (!ctx_) {
+        return std::vector<uint8_t>(data, data + size);
+    }
+
+    std::vector<uint8_t> output;
+    output.swap(header_);
+    size_t offset = output.size();
+    output.resize(offset + size + EVP_MAX_BLOCK_LENGTH);
+
+    int out_len = 0;
+    if (EVP_EncryptUpdate(ctx_, output.data() + offset, &out_len, data, size) != 1) {
+        ErrorUtil::ThrowError("Failed to encrypt data");
+    }
+    output.resize(offset + out_len);
+    return output;
+}
+
+std::vector<uint8_t> MetadataEncryptor::Final() {
+    if (!ctx_) {
+        return std::vector<uint8_t>();
+    }
+
+    std::vector<uint8_t> output;
+    output.swap(header_);
+    size_t offset = output.size();
+    output.resize(offset + EVP_MAX_BLOCK_LENGTH);
+
+    int final_len = 0;
+    if (EVP_EncryptFinal_ex(ctx_, output.data() + offset, &final_len) != 1) {
+        ErrorUtil::ThrowError("Failed to finalize encryption");
+    }
+    output.resize(offset + final_len);
+    return output;
+}
+
+MetadataDecryptor::MetadataDecryptor(const std::string& password)
+    : password_(password), passthrough_(password.empty()) {}
+
+MetadataDecryptor::~MetadataDecryptor() {
+    if (ctx_) EVP_CIPHER_CTX_free(ctx_);
+}
+
+std::vector<uint8_t> MetadataDecryptor::Update(const uint8_t* data, size_t size) {
+    if (passthrough_) {
+        return std::vector<uint8_t>(data, data + size);
+    }
+    if (ctx_) {
+        return Decrypt(data, size);
+    }
+
+    header_.insert(header_.end(), data, data + size);
+    size_t compared = std::min(header_.size(), MAGIC_SIZE);
+    if (!std::equal(header_.begin(), header_.begin() + compared,
+                    ENCRYPTION_MAGIC.begin())) {
+        // Not encrypted, hand everything held back to the caller
+        passthrough_ = true;
+        std::vector<uint8_t> output;
+        output.swap(header_);
+        return output;
+    }
+    if (header_.size() < MAGIC_SIZE + SALT_SIZE + IV_SIZE) {
+        return std::vector<uint8_t>();
+    }
+
+    const uint8_t* salt = header_.data() + MAGIC_SIZE;
+    const uint8_t* iv = salt + SALT_SIZE;
+    std::vector<uint8_t> key = DeriveKey(password_, salt);
+
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (!ctx_ || EVP_DecryptInit_ex(ctx_, EVP_aes_256_cbc(), nullptr,
+                                    key.data(), iv) != 1) {
+        ErrorUtil::ThrowError("Failed to initialize decryption");
+    }
+
+    std::vector<uint8_t> rest(header_.begin() + MAGIC_SIZE + SALT_SIZE + IV_SIZE,
+                              header_.end());
+    header_.clear();
+    return Decrypt(rest.data(), rest.size());
+}
+
+std::vector<uint8_t> MetadataDecryptor::Final() {
+    if (passthrough_) {
+        return std::vector<uint8_t>();
+    }
+    if (!ctx_) {
+        if (header_.size() < MAGIC_SIZE) {
+            // Too short to be encrypted
+            std::vector<uint8_t> output;
+            output.swap(header_);
+            return output;
+        }
+        ErrorUtil::ThrowError("Encrypted data too short");
+    }
+
+    std::vector<uint8_t> output(EVP_MAX_BLOCK_LENGTH);
+    int final_len = 0;
+    if (EVP_DecryptFinal_ex(ctx_, output.data(), &final_len) != 1) {
+        ErrorUtil::ThrowError("Failed to decrypt metadata, wrong password?");
+    }
+    output.resize(final_len);
+    return output;
+}
+
+std::vector<uint8_t> MetadataDecryptor::Decrypt(const uint8_t* data, size_t size) {
+    std::vector<uint8_t> output(size + EVP_MAX_BLOCK_LENGTH);
+    int out_len = 0;
+    if (EVP_DecryptUpdate(ctx_, output.data(), &out_len, data, size) != 1) {
+        ErrorUtil::ThrowError("Failed to decrypt data");
+    }
+    output.resize(out_len);
+    return output;
+}
+
 bool IsEncrypted(const std::vector<uint8_t>& data) {
     if (data.size() < MAGIC_SIZE) {
         return false;
@@ -0,0 +1,184 @@
+#include "utils/rate_limiter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+
+#include "utils/config_manager.h"
+#include "utils/error_util.h"
+
+using json = nlohmann::json;
+
+static int ParseMinuteOfDay(const std::string& time) {
+  int hours = -1, minutes = -1;
+  if (std::sscanf(time.c_str(), "%d:%d", &hours, &minutes) != 2 ||
+      hours < 0 || hours > 24 || minutes < 0 || minutes > 59 ||
+      hours * 60 + minutes > 24 * 60) {
+    ErrorUtil::ThrowError("Invalid time of day (expected HH:MM): " + time);
+  }
+  return hours * 60 + minutes;
+}
+
+static std::string FormatMinuteOfDay(int minute) {
+  char buffer[6];
+  std::snprintf(buffer, sizeof(buffer), "%02d:%02d", minute / 60, minute % 60);
+  return buffer;
+}
+
+RateLimiter& RateLimiter::Instance() {
+  static RateLimiter limiter;
+  return limiter;
+}
+
+RateLimiter::RateLimiter() {
+  try {
+    ConfigManager config;
+    Configure(config.Get<json>("throttle", json::object()));
+  } catch (const std::exception& e) {
+    ErrorUtil::LogException(e, "Transfer throttling disabled");
+  }
+}
+
+void RateLimiter::AcquireBytes(uint64_t bytes) {
+  if (bytes > 0) {
+    Acquire(byte_bucket_, bytes, &ThrottleProfile::bytes_per_second);
+  }
+}
+
+void RateLimiter::AcquireReadBytes(uint64_t bytes) {
+  if (bytes > 0) {
+    Acquire(read_bucket_, bytes, &ThrottleProfile::read_bytes_per_second);
+  }
+}
+
+void RateLimiter::AcquireOp() {
+  Acquire(op_bucket_, 1, &ThrottleProfile::ops_per_second);
+}
+
+void RateLimiter::SetLimits(uint64_t bytes_per_second, uint64_t ops_per_second,
+                            uint64_t read_bytes_per_second) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  limits_.bytes_per_second = bytes_per_second;
+  limits_.ops_per_second = ops_per_second;
+  limits_.read_bytes_per_second = read_bytes_per_second;
+}
+
+void RateLimiter::SetProfiles(const std::vector<ThrottleProfile>& profiles) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  profiles_ = profiles;
+}
+
+void RateLimiter::Configure(const json& settings) {
+  if (!settings.is_object()) {
+    ErrorUtil::ThrowError("Throttle settings must be a JSON object");
+  }
+
+  // Parse everything before applying so a bad request changes nothing
+  std::vector<ThrottleProfile> profiles;
+  if (settings.contains("profiles")) {
+    for (const auto& profile_json : settings["profiles"]) {
+      ThrottleProfile profile;
+      profile.start_minute =
+          ParseMinuteOfDay(profile_json.at("start").get<std::string>());
+      profile.end_minute =
+          ParseMinuteOfDay(profile_json.at("end").get<std::string>());
+      profile.bytes_per_second =
+          profile_json.value("bytes_per_second", uint64_t(0));
+      profile.ops_per_second = profile_json.value("ops_per_second", uint64_t(0));
+      profile.read_bytes_per_second =
+          profile_json.value("read_bytes_per_second", uint64_t(0));
+      profiles.push_back(profile);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  limits_.bytes_per_second =
+      settings.value("bytes_per_second", limits_.bytes_per_second);
+  limits_.ops_per_second =
+      settings.value("ops_per_second", limits_.ops_per_second);
+  limits_.read_bytes_per_second =
+      settings.value("read_bytes_per_second", limits_.read_bytes_per_second);
+  if (settings.contains("profiles")) {
+    profiles_ = profiles;
+  }
+}
+
+json RateLimiter::GetSettings() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  json settings;
+  settings["bytes_per_second"] = limits_.bytes_per_second;
+  settings["ops_per_second"] = limits_.ops_per_second;
+  settings["read_bytes_per_second"] = limits_.read_bytes_per_second;
+
+  json profiles = json::array();
+  for (const auto& profile : profiles_) {
+    profiles.push_back({{"start", FormatMinuteOfDay(profile.start_minute)},
+                        {"end", FormatMinuteOfDay(profile.end_minute)},
+                        {"bytes_per_second", profile.bytes_per_second},
+                        {"ops_per_second", profile.ops_per_second},
+                        {"read_bytes_per_second",
+                         profile.read_bytes_per_second}});
+  }
+  settings["profiles"] = profiles;
+
+  ThrottleProfile active = GetCurrentLimits();
+  settings["active"] = {
+      {"bytes_per_second", active.bytes_per_second},
+      {"ops_per_second", active.ops_per_second},
+      {"read_bytes_per_second", active.read_bytes_per_second}};
+  return settings;
+}
+
+void RateLimiter::Acquire(Bucket& bucket, uint64_t amount,
+                          uint64_t ThrottleProfile::*limit) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool charged = false;
+
+  while (true) {
+    double rate = static_cast<double>(GetCurrentLimits().*limit);
+
+    auto now = std::chrono::steady_clock::now();
+    if (rate == 0) {
+      bucket.tokens = 0;
+      bucket.last_refill = now;
+      return;
+    }
+
+    // Refill, allowing bursts of up to one second of traffic
+    double elapsed =
+        std::chrono::duration<double>(now - bucket.last_refill).count();
+    bucket.tokens = std::min(rate, bucket.tokens + elapsed * rate);
+    bucket.last_refill = now;
+
+    if (!charged) {
+      bucket.tokens -= static_cast<double>(amount);
+      charged = true;
+    }
+    if (bucket.tokens >= 0) return;
+
+    // Sleep in short steps so limit changes take effect promptly
+    double wait = std::min(-bucket.tokens / rate, 1.0);
+    lock.unlock();
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    lock.lock();
+  }
+}
+
+ThrottleProfile RateLimiter::GetCurrentLimits() {
+  if (profiles_.empty()) return limits_;
+
+  std::time_t now = std::time(nullptr);
+  std::tm local_time;
+  localtime_r(&now, &local_time);
+  int minute = local_time.tm_hour * 60 + local_time.tm_min;
+
+  for (const auto& profile : profiles_) {
+    bool active =
+        profile.start_minute <= profile.end_minute
+            ? minute >= profile.start_minute && minute < profile.end_minute
+            : minute >= profile.start_minute || minute < profile.end_minute;
+    if (active) return profile;
+  }
+  return limits_;
+}
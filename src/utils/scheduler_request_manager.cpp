@@ -1,6 +1,7 @@
 #include <iostream>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -35,7 +36,17 @@ std::string SchedulerRequestManager::SendRequest(const char *message){
         ErrorUtil::ThrowError("Connection to scheduler server failed!");
     }
 
-    send(client_fd, message, strlen(message), 0);
+    // The server reads the request until the end of the stream
+    size_t length = strlen(message);
+    for (size_t sent = 0; sent < length;){
+        ssize_t result = send(client_fd, message + sent, length - sent, 0);
+        if (result < 0){
+            close(client_fd);
+            ErrorUtil::ThrowError("Request to scheduler server not sent!");
+        }
+        sent += result;
+    }
+    shutdown(client_fd, SHUT_WR);
 
     // Fetch server response and display
     char server_msg[4096];
@@ -76,7 +87,8 @@ std::string SchedulerRequestManager::SendAddRequest(
             std::string schedule,std::string source,
             std::string destination_name,std::string destination_path,
             std::string destination_password,std::string destination_created_at,
-            RepositoryType destination_type,std::string remarks,BackupType type){
+            RepositoryType destination_type,std::string remarks,BackupType type,
+            int time_budget_minutes, const nlohmann::json& filters){
 
     nlohmann::json reqBody;
     reqBody["action"] = "add";
@@ -103,10 +115,17 @@ std::string SchedulerRequestManager::SendAddRequest(
 
     reqBody["type"] = type;
     reqBody["remarks"] = remarks;
+    reqBody["time_budget"] = time_budget_minutes;
+    reqBody["filters"] = filters;
     
     std::string schedule_id;
     schedule_id = SendRequest(reqBody.dump().c_str());
-    
+
+    // A rejected schedule comes back as an error object instead of its id
+    if (!schedule_id.empty() && schedule_id.front() == '{'){
+        nlohmann::json responseObj = nlohmann::json::parse(schedule_id);
+        ErrorUtil::ThrowError(responseObj.value("error", std::string("Schedule rejected")));
+    }
     return schedule_id;
 }
 
@@ -125,4 +144,17 @@ bool SchedulerRequestManager::SendDeleteRequest(std::string schedule_id){
     else{
         return false;
     }
-}
\ No newline at end of file
+}
+
+nlohmann::json SchedulerRequestManager::SendThrottleRequest(const nlohmann::json& settings){
+    nlohmann::json reqBody;
+    reqBody["action"] = "throttle";
+    reqBody["payload"] = settings;
+
+    std::string response = SendRequest(reqBody.dump().c_str());
+    nlohmann::json responseObj = nlohmann::json::parse(response);
+    if (responseObj.contains("error")){
+        ErrorUtil::ThrowError(responseObj["error"].get<std::string>());
+    }
+    return responseObj;
+}